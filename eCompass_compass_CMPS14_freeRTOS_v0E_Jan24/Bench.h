@@ -0,0 +1,239 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+/*
+ * Microbenchmarks for the heading hot path
+ *
+ * Only built when BENCHMARKS is defined (see the top of the sketch). The "bench" console
+ * command times each kernel below with the CPU cycle counter and prints a table, or JSON
+ * with "bench json" so results can be kept and compared between firmware releases.
+ *
+ * Each kernel is run BENCH_REPEATS times and the fastest run is reported, which keeps
+ * interrupts and the other tasks out of the figures as far as possible. The cost of the
+ * loop and the call through the table is measured with an empty kernel and subtracted.
+ *
+ * Allocations are counted by the global operator new in Memory.h, so allocs/op shows the
+ * std::string and other C++ heap use - plain malloc() calls (from sprintf for instance)
+ * are not included.
+ *
+ * Kernels that work through a buffer report their throughput in MB/s as well.
+ *
+ * The sea state kernels time one window of SeaState.h: the FFT alone, and the whole analysis.
+ * The SeaState task has SEA_BUDGET_PERCENT of a core over each hop, so sea_analyse is the
+ * figure to check against that - and against the slowest CPU clock in Power.h.
+ */
+
+#ifdef BENCHMARKS
+
+#include "NMEA.hpp"
+#include "Configuration.h"
+#include "NmeaInput.h"
+#include "Memory.h"
+#include "BuildProfile.h"
+#if FEATURE_SEA_STATE
+#include "SeaState.h"
+#endif
+
+#define BENCH_REPEATS 5
+
+volatile uint32_t benchSink = 0;     //results go here so the compiler can't drop the work
+
+//Throws away anything calcOffsets() prints
+class BenchNullPrint : public Print {
+  public:
+    size_t write(uint8_t c) { return 1; }
+    size_t write(const uint8_t *buffer, size_t size) { return size; }
+};
+
+//Gives the benchmark access to the checksum on its own
+class BenchNMEAmessage : public NMEAmessage {
+  public:
+    void checkSum() {
+      strcpy(msgString, "$HCHDM,123,M");
+      addCheckSum();
+    }
+};
+
+BenchNullPrint benchNullPrint;
+BenchNMEAmessage benchNmea;
+HDMmessage benchHdm;
+char benchBuff[128];
+#if FEATURE_FILE_EDITOR
+const char benchHtml[] =
+  "<!DOCTYPE html>\n<html><head><title>\"Compass\" & heading</title></head>\n"
+  "<body><script>if (a < b && c > d) update(\"hdg\");</script>\n"
+  "<p>Sensor &amp; boat heading, updated every second from the CMPS14.</p></body></html>\n";
+#endif
+
+//What a chartplotter with a GPS might send in a second
+const char benchSentences[] =
+  "$GPRMC,123519,A,5049.123,N,00117.456,W,5.2,231.4,180324,1.1,W*7C\r\n"
+  "$GPGGA,123519,5049.123,N,00117.456,W,1,08,0.9,12.4,M,47.0,M,,*60\r\n"
+  "$GPVTG,231.4,T,232.5,M,5.2,N,9.6,K*44\r\n"
+  "$GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1*39\r\n"
+  "$APHSC,229.0,T,230.1,M*59\r\n";
+NmeaReceiver benchReceiver;
+
+#if FEATURE_SEA_STATE
+//A window of swell and roll for the sea state kernels, and somewhere to work on it
+float benchSeaAccel[SEA_FFT_SIZE], benchSeaRoll[SEA_FFT_SIZE];
+float benchSeaRe[SEA_FFT_SIZE], benchSeaIm[SEA_FFT_SIZE];
+#endif
+
+void benchEmpty(int i) {}
+
+void benchCheckSum(int i) {
+  benchNmea.checkSum();
+}
+
+void benchHdmUpdate(int i) {
+  benchHdm.update(i % 360);
+}
+
+void benchCorrectHeading(int i) {
+  benchSink += correctHeading(i % 360);
+}
+
+void benchCalcOffsets(int i) {
+  calcOffsets(2, 93, 178, 268);
+}
+
+void benchFletcher16(int i) {
+  benchSink += Fletcher16((const uint8_t *)&configuration, sizeof(configuration));
+}
+
+#if FEATURE_FILE_EDITOR
+void benchHtmlEncode(int i) {
+  htmlEncode(benchHtml, sizeof(benchHtml) - 1, benchNullPrint);
+}
+#endif
+
+void benchGetHeadingJson(int i) {
+  sprintf(benchBuff,"{ \"result\":\"OK\",\"sensorHeading\":\"%03d\", \"boatHeading\":\"%03d\" }",sensorHeading,boatHeading);
+}
+
+//Feeds the sentences through a receive buffer as recv() would, in 64 byte reads
+void benchNmeaParse(int i) {
+  int room, length;
+  for (unsigned done = 0; done < sizeof(benchSentences) - 1; done += length) {
+    char *space = nmeaReceiveSpace(&benchReceiver, &room);
+    length = min(min(room, 64), (int)(sizeof(benchSentences) - 1 - done));
+    memcpy(space, benchSentences + done, length);
+    nmeaReceived(&benchReceiver, length, -1);
+  }
+}
+
+#if FEATURE_SEA_STATE
+//The transform on its own. The input is copied in first, or repeated transforms would overflow
+void benchSeaFft(int i) {
+  memcpy(benchSeaRe, benchSeaAccel, sizeof(benchSeaRe));
+  memcpy(benchSeaIm, benchSeaRoll, sizeof(benchSeaIm));
+  seaFft(benchSeaRe, benchSeaIm);
+}
+
+//Everything the SeaState task does with a window - Hann window, FFT and the statistics
+void benchSeaAnalyse(int i) {
+  SeaState result;
+  memcpy(benchSeaRe, benchSeaAccel, sizeof(benchSeaRe));
+  memcpy(benchSeaIm, benchSeaRoll, sizeof(benchSeaIm));
+  seaAnalyse(benchSeaRe, benchSeaIm, &result);
+  benchSink += result.valid;
+}
+#endif
+
+struct Benchmark {
+  const char *name;
+  void (*kernel)(int);
+  int iterations;
+  int bytes;          //processed per op, for the throughput
+};
+
+Benchmark benchmarks[] = {
+  { "nmea_checksum",    benchCheckSum,        1000 },
+  { "hdm_update",       benchHdmUpdate,       1000 },
+  { "correct_heading",  benchCorrectHeading,  10000 },
+  { "calc_offsets",     benchCalcOffsets,     20 },
+  { "fletcher16",       benchFletcher16,      1000 },
+#if FEATURE_FILE_EDITOR
+  { "html_encode",      benchHtmlEncode,      200 },
+#endif
+  { "get_heading_json", benchGetHeadingJson,  1000 },
+  { "nmea_parse",       benchNmeaParse,       200,   sizeof(benchSentences) - 1 },
+#if FEATURE_SEA_STATE
+  { "sea_fft",          benchSeaFft,          20,    2 * SEA_FFT_SIZE * sizeof(float) },
+  { "sea_analyse",      benchSeaAnalyse,      20,    2 * SEA_FFT_SIZE * sizeof(float) },
+#endif
+};
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+//Fastest of BENCH_REPEATS runs, in cycles per iteration. Also counts allocations per run
+float benchTime(void (*kernel)(int), int iterations, uint32_t *allocs) {
+  uint32_t best = UINT32_MAX;
+
+  for (int r = 0; r < BENCH_REPEATS; r++) {
+    uint32_t allocsBefore = heapAllocs;
+    uint32_t start = ESP.getCycleCount();
+    for (int i = 0; i < iterations; i++) kernel(i);
+    uint32_t cycles = ESP.getCycleCount() - start;
+    *allocs = heapAllocs - allocsBefore;
+    if (cycles < best) best = cycles;
+  }
+  return (float)best / iterations;
+}
+
+void runBenchmarks(Print &out, bool json) {
+  Print *savedOut = consoleOut;
+  TaskHandle_t savedTask = consoleTask;
+  uint32_t mhz = getCpuFrequencyMhz();
+  uint32_t allocs;
+  char buff[128];
+  int16_t savedCard[360];
+
+  //calcOffsets() overwrites the compass card, and reports as it goes - send that nowhere while timing it
+  memcpy(savedCard, compassCard, sizeof(savedCard));
+  consoleOut = &benchNullPrint;
+  consoleTask = xTaskGetCurrentTaskHandle();
+  //The parser benchmark mustn't move the real position or course
+  NmeaHandlers savedHandlers = nmeaHandlers;
+  nmeaHandlers = { NULL, NULL, NULL, NULL };
+  nmeaReceiverReset(&benchReceiver);
+#if FEATURE_SEA_STATE
+  //An 8 second swell and a 5 second roll, with some noise
+  for (int i = 0; i < SEA_FFT_SIZE; i++) {
+    float t = i / SEA_RATE_HZ;
+    benchSeaAccel[i] = 0.6f * sinf(2 * PI * t / 8) + random(-100, 101) / 1000.0f;
+    benchSeaRoll[i] = 5 * sinf(2 * PI * t / 5) + random(-100, 101) / 100.0f;
+  }
+#endif
+
+  float overhead = benchTime(benchEmpty, 1000, &allocs);
+
+  if (json) out.printf("{\"firmware\":\"%s\",\"cpu_mhz\":%u,\"results\":[", VERSION, mhz);
+  else {
+    out.printf("Firmware %s, CPU %u MHz\n", VERSION, mhz);
+    out.print("kernel               cycles/op     ns/op  allocs/op     MB/s\n");
+  }
+  for (unsigned b = 0; b < NUM_BENCHMARKS; b++) {
+    float cycles = benchTime(benchmarks[b].kernel, benchmarks[b].iterations, &allocs) - overhead;
+    float ns = cycles * 1000.0 / mhz;
+    float allocsPerOp = (float)allocs / benchmarks[b].iterations;
+    float mbPerS = benchmarks[b].bytes * 1000.0 / ns;    //bytes per ns is GB/s
+    if (json)
+      sprintf(buff, "%s{\"name\":\"%s\",\"iterations\":%d,\"cycles_per_op\":%.1f,\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,\"mb_per_s\":%.2f}",
+              b > 0 ? "," : "", benchmarks[b].name, benchmarks[b].iterations, cycles, ns, allocsPerOp, mbPerS);
+    else if (benchmarks[b].bytes > 0)
+      sprintf(buff, "%-18s %11.1f %9.1f %10.2f %8.2f\n", benchmarks[b].name, cycles, ns, allocsPerOp, mbPerS);
+    else
+      sprintf(buff, "%-18s %11.1f %9.1f %10.2f\n", benchmarks[b].name, cycles, ns, allocsPerOp);
+    out.print(buff);
+  }
+  if (json) out.print("]}\n");
+
+  memcpy(compassCard, savedCard, sizeof(savedCard));
+  consoleOut = savedOut;
+  consoleTask = savedTask;
+  nmeaHandlers = savedHandlers;
+}
+
+#endif //BENCHMARKS
+
+#endif
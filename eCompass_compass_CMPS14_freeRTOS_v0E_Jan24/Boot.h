@@ -0,0 +1,72 @@
+#ifndef _BOOT_H
+#define _BOOT_H
+/*
+ * Staged start up
+ *
+ * After a reset (or a brown out when the engine starts) the autopilot wants a heading back
+ * as soon as possible. setup() only does what the heading needs - serial, the I2C bus, the
+ * settings and the compass card - and starts the BOOT_FIRST tasks from the task table, the
+ * ones that read the CMPS14 and send the NMEA messages. Everything else - the CMPS14
+ * housekeeping, SPIFFS (which formats itself on first use), the OLED, WiFi and the servers -
+ * is done by a one-off Boot task on the network core, which then starts the BOOT_BACKGROUND
+ * tasks and deletes itself.
+ *
+ * Each phase is timed from reset with esp_timer, as are the first good heading and the first
+ * NMEA output. bootReport() prints the breakdown; it is logged to Serial once the Boot task is
+ * done and shown by the console "boot" command.
+ */
+
+#include <esp_timer.h>
+
+#define MAX_BOOT_PHASES 16
+#define BOOT_TARGET_US 300000     //first heading out within this of reset
+
+struct BootPhase {
+  const char *name;
+  int64_t startUs, endUs;         //since reset
+};
+
+BootPhase bootPhases[MAX_BOOT_PHASES];
+int numBootPhases = 0;
+portMUX_TYPE bootMux = portMUX_INITIALIZER_UNLOCKED;
+
+volatile int64_t bootFirstHeadingUs = 0;   //0 until it has happened
+volatile int64_t bootFirstOutputUs = 0;
+volatile int64_t bootCompleteUs = 0;
+
+//Record a phase that started at startUs and has just finished. Called from both cores
+void bootPhase(const char *name, int64_t startUs) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&bootMux);
+  if (numBootPhases < MAX_BOOT_PHASES) bootPhases[numBootPhases++] = { name, startUs, now };
+  portEXIT_CRITICAL(&bootMux);
+}
+
+//Called by the Heading and Output tasks - cheap enough to call every time
+inline void bootFirstHeading() {
+  if (bootFirstHeadingUs == 0) bootFirstHeadingUs = esp_timer_get_time();
+}
+
+inline void bootFirstOutput() {
+  if (bootFirstOutputUs == 0) bootFirstOutputUs = esp_timer_get_time();
+}
+
+void bootReport(Print &out) {
+  char buff[80];
+
+  out.print("Boot phase           start ms   took ms\n");
+  for (int i = 0; i < numBootPhases; i++) {
+    BootPhase *p = &bootPhases[i];
+    sprintf(buff, "%-20s %8.1f %9.1f\n", p->name, p->startUs / 1000.0, (p->endUs - p->startUs) / 1000.0);
+    out.print(buff);
+  }
+  if (bootFirstHeadingUs > 0) out.printf("First heading read   %8.1f\n", bootFirstHeadingUs / 1000.0);
+  else out.print("First heading read          -\n");
+  if (bootFirstOutputUs > 0)
+    out.printf("First heading out    %8.1f   %s\n", bootFirstOutputUs / 1000.0,
+               bootFirstOutputUs <= BOOT_TARGET_US ? "ok" : "over target");
+  else out.print("First heading out           -\n");
+  if (bootCompleteUs > 0) out.printf("Boot complete        %8.1f\n", bootCompleteUs / 1000.0);
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef _BUILD_PROFILE_H
+#define _BUILD_PROFILE_H
+/*
+ * Build profiles
+ *
+ * Not every unit needs everything the prototype has. BUILD_PROFILE (top of the sketch) picks
+ * one of the profiles below, and each profile switches the optional subsystems on or off:
+ *
+ *   feature                  prototype  headless  minimal NMEA
+ *   FEATURE_OLED                 x                               the display and its task
+ *   FEATURE_CONFIG_TELNET        x                               console sessions on CONFIG_PORT
+ *   FEATURE_FILE_EDITOR          x                               the demo upload and edit pages
+ *   FEATURE_SIGNALK              x          x                    Signal K deltas (SignalK.h)
+ *   FEATURE_SEA_STATE            x          x                    wave and roll periods, XDR
+ *   FEATURE_HISTORY              x          x                    the heading history
+ *
+ * Production units have no OLED and are set up through the web app, so "headless" leaves out
+ * the display, the deprecated telnet console (the serial console is always there) and the
+ * file editor. "minimal NMEA" is just the heading - NMEA over WiFi and wired, calibration in
+ * the web app and the metrics.
+ *
+ * A feature that is off is left out by the preprocessor - its code, its buffers, its task
+ * table entries and its libraries - so it costs nothing at all. Any one of them can be
+ * switched on or off on top of the profile by defining it as 1 or 0 before this is included.
+ *
+ * buildReport() ("build" on the console, and once after boot) gives the profile, the
+ * features and what the firmware takes: flash, static RAM, task stacks and the heap left.
+ * The flash and static RAM figures are also in /metrics, so the profiles can be compared.
+ */
+
+#include "Tasks.h"
+
+#define BUILD_PROTOTYPE 1
+#define BUILD_HEADLESS 2
+#define BUILD_MINIMAL_NMEA 3
+
+#ifndef BUILD_PROFILE
+#define BUILD_PROFILE BUILD_PROTOTYPE
+#endif
+
+#if BUILD_PROFILE == BUILD_PROTOTYPE
+#define BUILD_PROFILE_NAME "prototype"
+#elif BUILD_PROFILE == BUILD_HEADLESS
+#define BUILD_PROFILE_NAME "headless"
+#elif BUILD_PROFILE == BUILD_MINIMAL_NMEA
+#define BUILD_PROFILE_NAME "minimal-nmea"
+#else
+#error "BUILD_PROFILE must be BUILD_PROTOTYPE, BUILD_HEADLESS or BUILD_MINIMAL_NMEA"
+#endif
+
+#ifndef FEATURE_OLED
+#define FEATURE_OLED (BUILD_PROFILE == BUILD_PROTOTYPE)
+#endif
+#ifndef FEATURE_CONFIG_TELNET
+#define FEATURE_CONFIG_TELNET (BUILD_PROFILE == BUILD_PROTOTYPE)
+#endif
+#ifndef FEATURE_FILE_EDITOR
+#define FEATURE_FILE_EDITOR (BUILD_PROFILE == BUILD_PROTOTYPE)
+#endif
+#ifndef FEATURE_SIGNALK
+#define FEATURE_SIGNALK (BUILD_PROFILE != BUILD_MINIMAL_NMEA)
+#endif
+#ifndef FEATURE_SEA_STATE
+#define FEATURE_SEA_STATE (BUILD_PROFILE != BUILD_MINIMAL_NMEA)
+#endif
+#ifndef FEATURE_HISTORY
+#define FEATURE_HISTORY (BUILD_PROFILE != BUILD_MINIMAL_NMEA)
+#endif
+
+struct BuildFeature {
+  const char *name;
+  bool enabled;
+};
+
+const BuildFeature buildFeatures[] = {
+  { "oled",          FEATURE_OLED },
+  { "config telnet", FEATURE_CONFIG_TELNET },
+  { "file editor",   FEATURE_FILE_EDITOR },
+  { "signalk",       FEATURE_SIGNALK },
+  { "sea state",     FEATURE_SEA_STATE },
+  { "history",       FEATURE_HISTORY }
+};
+#define NUM_BUILD_FEATURES (sizeof(buildFeatures) / sizeof(buildFeatures[0]))
+
+//From the linker script - the initialised and zeroed globals in internal RAM
+extern "C" char _data_start, _data_end, _bss_start, _bss_end;
+
+struct BuildFootprint {
+  uint32_t flashBytes;        //the firmware image
+  uint32_t flashFreeBytes;    //left in the app partition
+  uint32_t dataBytes;         //initialised globals
+  uint32_t bssBytes;          //zeroed globals
+  uint32_t stackBytes;        //stacks of the tasks in the task table that are running
+  uint32_t tasks;
+  uint32_t heapBytes;         //the heap as a whole, and what is left of it
+  uint32_t heapFreeBytes;
+};
+
+void buildFootprint(BuildFootprint *f) {
+  f->flashBytes = ESP.getSketchSize();
+  f->flashFreeBytes = ESP.getFreeSketchSpace();
+  f->dataBytes = &_data_end - &_data_start;
+  f->bssBytes = &_bss_end - &_bss_start;
+  f->stackBytes = 0;
+  f->tasks = 0;
+  for (int i = 0; i < numTasks; i++) {
+    if (taskTable[i].handle == NULL) continue;
+    f->stackBytes += taskTable[i].stackSize;
+    f->tasks++;
+  }
+  f->heapBytes = ESP.getHeapSize();
+  f->heapFreeBytes = ESP.getFreeHeap();
+}
+
+void buildReport(Print &out) {
+  BuildFootprint f;
+
+  buildFootprint(&f);
+  out.printf("Build profile %s:", BUILD_PROFILE_NAME);
+  for (unsigned i = 0; i < NUM_BUILD_FEATURES; i++)
+    out.printf(" %s%s", buildFeatures[i].enabled ? "+" : "-", buildFeatures[i].name);
+  out.print("\n");
+  out.printf("Flash        %7u bytes, %u free\n", f.flashBytes, f.flashFreeBytes);
+  out.printf("Static RAM   %7u bytes (data %u, bss %u)\n", f.dataBytes + f.bssBytes, f.dataBytes, f.bssBytes);
+  out.printf("Task stacks  %7u bytes in %u tasks\n", f.stackBytes, f.tasks);
+  out.printf("Heap         %7u bytes, %u free\n", f.heapBytes, f.heapFreeBytes);
+}
+
+#endif
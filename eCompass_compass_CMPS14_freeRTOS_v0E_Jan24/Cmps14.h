@@ -21,6 +21,7 @@
 
 
 #include <Wire.h>
+#include "Trace.h"
 
 // Register Function
 // 0        Command register
@@ -66,6 +67,8 @@
   #define GYROY_Register 20
   #define GYROZ_Register 22
 
+  #define CALIBRATION_Register 0x1E
+
   #define ONE_BYTE   1
   #define TWO_BYTES  2
   #define FOUR_BYTES 4
@@ -73,63 +76,369 @@
 
 //---------------------------------
 
-  byte _byteHigh;
-  byte _byteLow;
-
   // Please note without clear documentation in the technical documenation
   // it is notoriously difficult to get the correct measurement units.
   // I've tried my best, and may revise these numbers.
 
-  int bearing;
-  int nReceived;
-  signed char pitch;
-  signed char roll;
-
-  float magnetX = 0;
-  float magnetY = 0;
-  float magnetZ = 0;
-
-  float accelX = 0;
-  float accelY = 0;
-  float accelZ = 0;
   // The acceleration along the X-axis, presented in mg 
   // See BNO080_Datasheet_v1.3 page 21
   float accelScale = 9.80592991914f/1000.f; // 1 m/s^2
   
-  float gyroX = 0;
-  float gyroY = 0;
-  float gyroZ = 0;
   // 16bit signed integer 32,768
   // Max 2000 degrees per second - page 6
   float gyroScale = 1.0f/16.f; // 1 Dps
 
-int16_t getBearing()
+  // Every transaction with the chip ends up as one of these, and so does every heading
+  // sample. Stale means the bus is down and we didn't even try. Out of range means the read
+  // worked but gave a bearing that can't be one - a bus reading all ones gives 6553 degrees
+  enum SampleStatus { SAMPLE_OK, SAMPLE_NACK, SAMPLE_SHORT_READ, SAMPLE_STALE, SAMPLE_OUT_OF_RANGE, NUM_SAMPLE_STATUS };
+  const char *sampleStatusNames[NUM_SAMPLE_STATUS] = { "ok", "nack", "short_read", "stale", "out_of_range" };
+
+  // The bearing register is in tenths of a degree, so anything from here up is garbage
+  #define CMPS_BEARING_LIMIT 3600
+
+  // Bus recovery. After CMPS_FAULT_THRESHOLD failures in a row a sensor is taken to be down:
+  // transactions fail straight away as stale, and service() clocks out its bus and
+  // re-initialises Wire and the chip, backing off exponentially while that doesn't work
+  #define CMPS_FAULT_THRESHOLD 3
+  #define CMPS_BACKOFF_MIN_MS 100
+  #define CMPS_BACKOFF_MAX_MS 30000
+
+// Up to three CMPS14s can be fitted, so one failing at sea doesn't leave the boat without a
+// heading (see Vote.h). The chips all answer at 0x60, so each extra one goes on the second
+// I2C bus, or behind an address translator (an LTC4316, say), or is given another address
+// with the chip's own address change sequence. CMPS_SENSORS says how many are fitted and
+// cmpsSensors[] below where they are. Sensor 0 is the main one: the fusion, the recorder and
+// the deviation learning work from it alone.
+
+#ifndef CMPS_SENSORS
+#define CMPS_SENSORS 1
+#endif
+#define CMPS_MAX_SENSORS 3
+
+#ifndef CMPS_BUS2_SDA
+#define CMPS_BUS2_SDA 25
+#endif
+#ifndef CMPS_BUS2_SCL
+#define CMPS_BUS2_SCL 26
+#endif
+
+// One task on a bus at a time. Recursive, so a multi-command sequence (see configureCMPS14())
+// can hold it across its transactions and nothing else gets in between
+struct CmpsBus {
+  TwoWire *wire;
+  int sda, scl;
+  SemaphoreHandle_t mutex;
+};
+
+class Cmps14;
+#ifdef SIMULATE_CMPS14
+#include "SimCmps14.h"
+#endif
+
+class Cmps14 {
+public:
+  const char *name;
+  uint8_t index;                   // in cmpsSensors[]
+  CmpsBus *bus;
+  uint8_t address;
+
+  SampleStatus status = SAMPLE_OK; // result of the last transaction
+  int16_t bearing = 0;             // degrees, the last good values
+  int8_t pitch = 0, roll = 0;
+  float gyroZ = 0;
+  uint8_t calibration = 0;
+
+  // I2C error counters - reported in the runtime metrics
+  uint32_t nackErrors = 0, shortReads = 0, staleReads = 0, outOfRange = 0;
+  uint32_t recoveryAttempts = 0, recoveries = 0;
+  volatile bool busDown = false;
+
+  // Time taken by the register reads
+  uint32_t reads = 0, readUsLast = 0, readUsMax = 0;
+  uint64_t readUsTotal = 0;
+
+  Cmps14(const char *name, uint8_t index, CmpsBus *bus, uint8_t address)
+    : name(name), index(index), bus(bus), address(address) {}
+
+  void begin()
+  {
+    if (bus->mutex != NULL) return;    // another sensor on the same bus has started it
+    bus->mutex = xSemaphoreCreateRecursiveMutex();
+#ifndef SIMULATE_CMPS14
+    bus->wire->begin(bus->sda, bus->scl);
+#endif
+  }
+
+  void lock()
+  {
+    TRACE_BEGIN(TRACE_I2C_WAIT);
+    if (bus->mutex != NULL) xSemaphoreTakeRecursive(bus->mutex, portMAX_DELAY);
+    TRACE_END(TRACE_I2C_WAIT);
+  }
+
+  // For background readers that would rather skip a reading than hold up the heading
+  bool tryLock()
+  {
+    return bus->mutex == NULL || xSemaphoreTakeRecursive(bus->mutex, 0) == pdTRUE;
+  }
+
+  void unlock()
+  {
+    if (bus->mutex != NULL) xSemaphoreGiveRecursive(bus->mutex);
+  }
+
+  // Read count consecutive registers starting at reg - call with the bus locked
+  bool transferRegisters(uint8_t reg, uint8_t *buf, uint8_t count)
+  {
+    TRACE_SCOPE(TRACE_I2C);
+    if (busDown) {
+      status = SAMPLE_STALE;
+      staleReads++;
+      return false;
+    }
+    uint32_t startUs = micros();
+#ifdef SIMULATE_CMPS14
+    SampleStatus result = simReadRegisters(index, reg, buf, count);
+#else
+    SampleStatus result = wireRead(reg, buf, count);
+#endif
+    readTime(micros() - startUs);
+    return this->result(result);
+  }
+
+  bool readRegisters(uint8_t reg, uint8_t *buf, uint8_t count)
+  {
+    lock();
+    bool ok = transferRegisters(reg, buf, count);
+    unlock();
+    return ok;
+  }
+
+  // Write a byte to the command register - call with the bus locked
+  bool transferCommand(uint8_t command)
+  {
+    TRACE_SCOPE(TRACE_I2C);
+    if (busDown) {
+      status = SAMPLE_STALE;
+      return false;
+    }
+#ifdef SIMULATE_CMPS14
+    return result(simWriteCommand(index, command));
+#else
+    bus->wire->beginTransmission(address);
+    bus->wire->write(byte(CONTROL_Register));
+    bus->wire->write(command);
+    if (bus->wire->endTransmission() != 0) return result(SAMPLE_NACK);
+    return result(SAMPLE_OK);
+#endif
+  }
+
+  bool writeCommand(uint8_t command)
+  {
+    lock();
+    bool ok = transferCommand(command);
+    unlock();
+    return ok;
+  }
+
+  // Called by the acquisition task before each sample. Does nothing unless the sensor is
+  // down and the backoff has run out
+  void service(void (*reinitialise)(Cmps14 *))
+  {
+    uint8_t version;
+
+    if (!busDown || (long)(millis() - retryAt) < 0) return;
+    lock();
+    recoveryAttempts++;
+    busClear();
+    consecutiveErrors = 0;
+    busDown = false;
+    if (readRegisters(CONTROL_Register, &version, ONE_BYTE)) {
+      if (reinitialise != NULL) reinitialise(this);
+      backoffMs = CMPS_BACKOFF_MIN_MS;
+      recoveries++;
+    } else {
+      // Still not answering - try again later, and leave it longer each time
+      retryAt = millis() + backoffMs;
+      backoffMs = min(backoffMs * 2, (unsigned long)CMPS_BACKOFF_MAX_MS);
+      busDown = true;
+    }
+    unlock();
+  }
+
+  // The last good bearing is returned if the read fails - check status
+  // Pitch and roll follow the bearing in the register file, so they come in the same read
+  int16_t getBearing()
+  {
+    uint8_t buf[FOUR_BYTES];
+
+    if (!readRegisters(BEARING_Register, buf, FOUR_BYTES)) return bearing;
+    if (!acceptBearing((buf[0]<<8) + buf[1])) return bearing;
+    pitch = (signed char)buf[PITCH_Register - BEARING_Register];
+    roll = (signed char)buf[ROLL_Register - BEARING_Register];
+    return bearing;
+  }
+
+  // Take a bearing register value read some other way (see recordAcquire()). One out of
+  // range fails like a bad read and the last good bearing is kept - call with the bus locked
+  bool acceptBearing(uint16_t tenths)
+  {
+    if (tenths >= CMPS_BEARING_LIMIT) return result(SAMPLE_OUT_OF_RANGE);
+    bearing = tenths / 10;
+    return true;
+  }
+
+  // Read the gyro Z axis (yaw rate), in degrees per second
+  float getGyroZ()
+  {
+    uint8_t buf[TWO_BYTES];
+
+    if (!readRegisters(GYROZ_Register, buf, TWO_BYTES)) return gyroZ;
+    gyroZ = (int16_t)((buf[0]<<8) | buf[1]) * gyroScale;
+    return gyroZ;
+  }
+
+  // The calibration register - the last good value if the read fails
+  uint8_t getCalibration()
+  {
+    uint8_t value;
+
+    if (readRegisters(CALIBRATION_Register, &value, ONE_BYTE)) calibration = value;
+    return calibration;
+  }
+
+private:
+  uint8_t consecutiveErrors = 0;
+  unsigned long retryAt = 0;
+  unsigned long backoffMs = CMPS_BACKOFF_MIN_MS;
+
+  // Count the result of a transaction and spot the sensor going down
+  bool result(SampleStatus result)
+  {
+    status = result;
+    if (result == SAMPLE_OK) {
+      consecutiveErrors = 0;
+      return true;
+    }
+    if (result == SAMPLE_NACK) nackErrors++;
+    else if (result == SAMPLE_SHORT_READ) shortReads++;
+    else if (result == SAMPLE_OUT_OF_RANGE) outOfRange++;
+    if (++consecutiveErrors >= CMPS_FAULT_THRESHOLD && !busDown) {
+      retryAt = millis();
+      busDown = true;
+    }
+    return false;
+  }
+
+  void readTime(uint32_t us)
+  {
+    reads++;
+    readUsLast = us;
+    readUsTotal += us;
+    if (us > readUsMax) readUsMax = us;
+  }
+
+#ifndef SIMULATE_CMPS14
+  SampleStatus wireRead(uint8_t reg, uint8_t *buf, uint8_t count)
+  {
+    // Tell register you want some data
+    bus->wire->beginTransmission(address);
+    bus->wire->write(reg);
+
+    // Return if we have a connection problem 
+    if (bus->wire->endTransmission() != 0) return SAMPLE_NACK;
+
+    // Something has gone wrong
+    if (bus->wire->requestFrom(address, count) != count) {
+      while (bus->wire->available()) bus->wire->read();
+      return SAMPLE_SHORT_READ;
+    }
+
+    for (int i = 0; i < count; i++) buf[i] = bus->wire->read();
+    return SAMPLE_OK;
+  }
+#endif
+
+  // A slave that was reset or glitched part way through a read can be left holding SDA low.
+  // Clock SCL until it lets go, then send a STOP, and start Wire again
+  void busClear()
+  {
+#ifdef SIMULATE_CMPS14
+    simBusClear(index);
+#else
+    // begin() goes back to the default clock - put back whatever was set before
+    uint32_t clock = bus->wire->getClock();
+    bus->wire->end();
+    pinMode(bus->sda, INPUT_PULLUP);
+    pinMode(bus->scl, OUTPUT_OPEN_DRAIN);
+    digitalWrite(bus->scl, HIGH);
+    for (int i = 0; i < 9 && digitalRead(bus->sda) == LOW; i++) {
+      digitalWrite(bus->scl, LOW);
+      delayMicroseconds(5);
+      digitalWrite(bus->scl, HIGH);
+      delayMicroseconds(5);
+    }
+    // STOP - SDA goes high while SCL is high
+    pinMode(bus->sda, OUTPUT_OPEN_DRAIN);
+    digitalWrite(bus->sda, LOW);
+    delayMicroseconds(5);
+    digitalWrite(bus->sda, HIGH);
+    delayMicroseconds(5);
+    bus->wire->begin(bus->sda, bus->scl);
+    bus->wire->setClock(clock);
+#endif
+  }
+};
+
+CmpsBus cmpsBuses[] = {
+  { &Wire,  SDA,           SCL },             // the standard pins, 21 and 22
+  { &Wire1, CMPS_BUS2_SDA, CMPS_BUS2_SCL }
+};
+
+// Anything else on a sensor bus (the OLED is on bus 0) must hold the bus lock while it
+// talks, or a bus recovery can end() the Wire and take the pins from under it.
+// The locks exist once cmpsBegin() has run
+void cmpsBusLock(int n)
 {
-  char buff[256];
-  // Begin communication with CMPS14
-  Wire.beginTransmission(CMPS14_I2C_ADDRESS);
+  if (cmpsBuses[n].mutex != NULL) xSemaphoreTakeRecursive(cmpsBuses[n].mutex, portMAX_DELAY);
+}
 
-  // Tell register you want some data
-  Wire.write(BEARING_Register);
+void cmpsBusUnlock(int n)
+{
+  if (cmpsBuses[n].mutex != NULL) xSemaphoreGiveRecursive(cmpsBuses[n].mutex);
+}
 
-  // End the transmission
-  int nackCatcher = Wire.endTransmission();
+// Only the first CMPS_SENSORS are used
+Cmps14 cmpsSensors[CMPS_MAX_SENSORS] = {
+  //     name      index  bus            address
+  Cmps14("main",   0,     &cmpsBuses[0], CMPS14_I2C_ADDRESS),
+  Cmps14("second", 1,     &cmpsBuses[1], CMPS14_I2C_ADDRESS),
+  Cmps14("third",  2,     &cmpsBuses[0], CMPS14_I2C_ADDRESS + 1)   // translated, or readdressed
+};
+const int cmpsCount = CMPS_SENSORS;
 
-  // Return if we have a connection problem 
-  if(nackCatcher != 0){return 0;}
-  
-  // Request 2 bytes from CMPS14
-  nReceived = Wire.requestFrom(CMPS14_I2C_ADDRESS , TWO_BYTES);
+int cmpsSelected = 0;      // the sensor the calibration and compass card commands work on
+void (*cmpsReinitialise)(Cmps14 *) = NULL;  // puts a chip back how the firmware wants it after a recovery
+
+inline Cmps14 *cmpsSelectedSensor()
+{
+  return &cmpsSensors[cmpsSelected];
+}
 
-  // Something has gone wrong
-  if (nReceived != TWO_BYTES) return 0;
+void cmpsBegin()
+{
+  for (int i = 0; i < cmpsCount; i++) cmpsSensors[i].begin();
+}
 
-  // Read the values
-  _byteHigh = Wire.read(); 
-  _byteLow = Wire.read();
+void cmpsService()
+{
+  for (int i = 0; i < cmpsCount; i++) cmpsSensors[i].service(cmpsReinitialise);
+}
 
-  // Calculate full bearing
-  bearing = ((_byteHigh<<8) + _byteLow) / 10;
-  return bearing;
+// Register level access to the main sensor, for the fusion and the recorder
+inline bool cmpsReadRegisters(uint8_t reg, uint8_t *buf, uint8_t count)
+{
+  return cmpsSensors[0].readRegisters(reg, buf, count);
 }
- #endif
+ #endif
\ No newline at end of file
@@ -1,108 +1,229 @@
 //
 //  Configuration.cpp
 //
-//  The configuration data for the device is held in EEPROM (or flash) and the
-//  code in this module is here to save and retrieve the configuration data.
+//  The configuration data for the device is held in flash and the code in this
+//  module is here to save and retrieve the configuration data.
+//
+//  The record is kept in the same Preferences (NVS) namespace as the compass card
+//  and is read and written in one go. Changes made at run time are coalesced -
+//  configurationChanged() just notes the time, and flushConfiguration() writes the
+//  record once things have been quiet for CONFIGURATION_WRITE_DELAY_MS.
+//
+//  Older records are migrated on read: a shorter record from an earlier schema
+//  keeps its fields and the new ones get their defaults. A record left in EEPROM
+//  by the original byte-by-byte store is picked up the same way.
+//
+//  Whatever is read is checked against the same rules as a change made at run time
+//  (see setConfigurationValue), and thrown away for the defaults if any field fails -
+//  a bad client count or port would otherwise only show up once it was used.
 //
 
 #include <HardwareSerial.h>
 #include <EEPROM.h>
+#include <Preferences.h>
 
 #include "Configuration.h"
 
-// The following method is used to calculate a 16 bit checksum for the data held 
+#define PREFERENCES_NAMESPACE "compass"
+#define PREFERENCES_KEY "config"
+
+struct Configuration configuration;
+volatile uint32_t configurationGeneration = 0;
+bool (*configurationPortReserved)(uint16_t port) = NULL;
+
+static Preferences configurationStore;
+static bool configurationDirty = false;
+static unsigned long configurationChangedAt = 0;
+
+// The following method is used to calculate a 16 bit checksum for the data held
 // in the configuration. The algorithm is details here:
 //
 // https://en.wikipedia.org/wiki/Fletcher%27s_checksum
+//
+// The sums are kept in 32 bits and only reduced modulo 255 once per block. 5802
+// bytes is the longest block for which sum2 cannot overflow.
 
-uint16_t Fletcher16( uint8_t *data, int count )
+uint16_t Fletcher16( const uint8_t *data, int count )
 {
-   uint16_t sum1 = 0;
-   uint16_t sum2 = 0;
-   int index;
+   uint32_t sum1 = 0;
+   uint32_t sum2 = 0;
 
-   for( index = 0; index < count; ++index )
+   while( count > 0 )
    {
-      sum1 = (sum1 + data[index]) % 255;
-      sum2 = (sum2 + sum1) % 255;
+      int block = count < 5802 ? count : 5802;
+      count -= block;
+      while( block-- > 0 )
+      {
+         sum1 += *data++;
+         sum2 += sum1;
+      }
+      sum1 %= 255;
+      sum2 %= 255;
    }
 
    return (sum2 << 8) | sum1;
 }
 
-void dumpConfiguration(struct Configuration *configuration)
+void defaultConfiguration(struct Configuration *configuration)
+{
+  memset(configuration, 0, sizeof(Configuration));
+  configuration->MajorVersion = CONFIGURATION_MAJOR_VERSION;
+  configuration->MinorVersion = CONFIGURATION_MINOR_VERSION;
+  strcpy(configuration->AccessPointSSID, "NavSource");
+  configuration->TCPPort = 23;
+  configuration->MaximumTCPClientCount = 4;
+  configuration->BlueToothEnabled = false;
+  strcpy(configuration->BlueToothDeviceName, "NavSource");
+  configuration->NMEABaudRate = 4800;
+}
+
+void dumpConfiguration(struct Configuration *configuration, Print &out)
 {
-  Serial.println("Configuration");
-  Serial.printf("   MajorVersion: ........... %d\n",configuration->MajorVersion);
-  Serial.printf("   MinorVersion: ........... %d\n",configuration->MinorVersion);
-  Serial.printf("   AccessPointSSID: ........ %s\n",configuration->AccessPointSSID);
-  Serial.printf("   AccessPointPassword: .... %s\n",configuration->AccessPointPassword);
-  Serial.printf("   TCPPort: ................ %d\n",configuration->TCPPort);
-  Serial.printf("   MaximumTCPClientCount: .. %d\n",configuration->MaximumTCPClientCount);
-  Serial.printf("   BlueToothEnabled: ....... %s\n",true == configuration->BlueToothEnabled ? "true" : "false");
-  Serial.printf("   BlueToothDeviceName: .... %s\n",configuration->BlueToothDeviceName);
-  Serial.printf("   NMEABaudRate: ........... %d\n",configuration->NMEABaudRate);
+  out.println("Configuration");
+  out.printf("   MajorVersion: ........... %d\n",configuration->MajorVersion);
+  out.printf("   MinorVersion: ........... %d\n",configuration->MinorVersion);
+  out.printf("   AccessPointSSID: ........ %s\n",configuration->AccessPointSSID);
+  out.printf("   AccessPointPassword: .... %s\n",configuration->AccessPointPassword);
+  out.printf("   TCPPort: ................ %d\n",configuration->TCPPort);
+  out.printf("   MaximumTCPClientCount: .. %d\n",configuration->MaximumTCPClientCount);
+  out.printf("   BlueToothEnabled: ....... %s\n",true == configuration->BlueToothEnabled ? "true" : "false");
+  out.printf("   BlueToothDeviceName: .... %s\n",configuration->BlueToothDeviceName);
+  out.printf("   NMEABaudRate: ........... %d\n",configuration->NMEABaudRate);
 }
 
 //
-// This method is called to read the configuration information from the EEPROM
+// The rules for each field. Used for changes and for whatever is read from flash
 //
-bool readConfiguration(struct Configuration *configuration)
+static bool validSSID(const char *value)
 {
-  // Activate EEPROM access
-  
-  EEPROM.begin(EEPROM_SIZE);
+  size_t length = strnlen(value, ACCESS_POINT_SSID_SIZE + 1);
+  return length > 0 && length <= ACCESS_POINT_SSID_SIZE;
+}
 
-  // We read from the EEPROM byte by byte, Allocate a structure to read
-  // into and locate the start of it.
+static bool validPassword(const char *value)
+{
+  // Empty for an open network, otherwise WPA2 needs at least 8 characters
+  size_t length = strnlen(value, ACCESS_POINT_PASSWORD_SIZE + 1);
+  return length <= ACCESS_POINT_PASSWORD_SIZE && (length == 0 || length >= 8);
+}
 
-  struct EEPROM_DATA eepromData;
-  char *q = (char *)&eepromData;
+static bool validPort(long port)
+{
+  // Not one the other listeners already have - begin() would fail after the next reboot
+  if (port < 1 || port > 65535) return false;
+  return configurationPortReserved == NULL || !configurationPortReserved(port);
+}
+
+static bool validClients(long clients)
+{
+  return clients >= 1 && clients <= MAX_TCP_CLIENTS;
+}
 
-  // Read all the data from the EEPROM, this will include the checksum
-  
-  for(int i = 0; i < sizeof(EEPROM_DATA); i++)
-    *q++ = EEPROM.read(i);
+static bool validBaud(long baud)
+{
+  return baud == 4800 || baud == 9600 || baud == 19200 || baud == 38400 || baud == 57600 || baud == 115200;
+}
 
-  // End the EEPROM access
-  
-  EEPROM.end();
+bool validConfiguration(const struct Configuration *configuration)
+{
+  return validSSID(configuration->AccessPointSSID) &&
+         validPassword(configuration->AccessPointPassword) &&
+         validPort(configuration->TCPPort) &&
+         validClients(configuration->MaximumTCPClientCount) &&
+         strnlen(configuration->BlueToothDeviceName, BLUETOOTH_DEVICE_NAME_SIZE + 1) <= BLUETOOTH_DEVICE_NAME_SIZE &&
+         validBaud(configuration->NMEABaudRate);
+}
 
-  // Either way, if the checksum is correct or not we will copy over the
-  // configuration information read back.
+//
+// Bring a record written by an older version of the firmware up to date.
+// Fields are only ever appended, so whatever the old record holds is kept
+// and anything after it takes the default value.
+//
+static void migrateConfiguration(struct Configuration *configuration, const uint8_t *record, uint16_t size)
+{
+  Serial.printf("migrateConfiguration, from %d bytes to %d bytes\n", size, sizeof(Configuration));
 
-  memcpy(configuration,&eepromData.Configuration,sizeof(Configuration));
+  defaultConfiguration(configuration);
+  memcpy(configuration, record, size < sizeof(Configuration) ? size : sizeof(Configuration));
+  configuration->MajorVersion = CONFIGURATION_MAJOR_VERSION;
+  configuration->MinorVersion = CONFIGURATION_MINOR_VERSION;
+}
+
+//
+// Check a stored record. The configuration is followed by its size and checksum,
+// wherever the record came from.
+//
+static bool validRecord(const uint8_t *record, size_t length, uint16_t *size)
+{
+  uint16_t checkSum;
 
-  // Display the stored size of checksum
+  if (length < 2 * sizeof(uint16_t)) return false;
+  memcpy(size, record + length - 2 * sizeof(uint16_t), sizeof(uint16_t));
+  memcpy(&checkSum, record + length - sizeof(uint16_t), sizeof(uint16_t));
 
   Serial.print("readConfiguration, Size = ");
-  Serial.println(eepromData.Size);  
+  Serial.println(*size);
   Serial.print("readConfiguration, CheckSum = ");
-  Serial.println(eepromData.CheckSum);    
-  
-  // We can now check the checksum
-  
-  uint16_t checkSum = Fletcher16((uint8_t *)&eepromData.Configuration,sizeof(Configuration));
+  Serial.println(checkSum);
 
-  Serial.print("readConfiguration, expected CheckSum = ");
-  Serial.println(checkSum);  
-
-  // Return the a Bool to indicate if all is OK?
-  
-  return (sizeof(Configuration) == eepromData.Size) && (checkSum == eepromData.CheckSum);
+  if (*size > length - 2 * sizeof(uint16_t)) return false;
+  return Fletcher16(record, *size) == checkSum;
 }
 
 //
-// This method is called to write the configuration information to the EEPROM
+// This method is called to read the configuration information from flash
 //
-void writeConfiguration(struct Configuration *configuration)
+bool readConfiguration(struct Configuration *configuration)
 {
-  // Activate EEPROM access
-  
+  uint8_t record[EEPROM_SIZE];
+  uint16_t size;
+
+  // Read the whole record in one go
+
+  size_t length = configurationStore.getBytes(PREFERENCES_KEY, record, sizeof(record));
+
+  if (length > 0 && validRecord(record, length, &size))
+  {
+    if (size == sizeof(Configuration) && record[0] == CONFIGURATION_MAJOR_VERSION && record[1] == CONFIGURATION_MINOR_VERSION)
+      memcpy(configuration, record, sizeof(Configuration));
+    else
+      migrateConfiguration(configuration, record, size);
+    if (validConfiguration(configuration))
+      return true;
+    Serial.println("readConfiguration, stored configuration is out of range");
+    return false;
+  }
+
+  // Nothing in flash - is there a record left behind by the old EEPROM store?
+  // The old records are the original Configuration fields followed by size and checksum.
+
   EEPROM.begin(EEPROM_SIZE);
+  EEPROM.readBytes(0, record, sizeof(EEPROM_DATA));
+  EEPROM.end();
 
-  // We read need to allocate an EEPROM_DATA object, populate it with the
-  // configuration information passed in, and update size and the checksum.
+  if (validRecord(record, sizeof(EEPROM_DATA), &size))
+  {
+    Serial.println("readConfiguration, found old EEPROM configuration");
+    migrateConfiguration(configuration, record, size);
+    if (!validConfiguration(configuration))
+    {
+      Serial.println("readConfiguration, old EEPROM configuration is out of range");
+      return false;
+    }
+    writeConfiguration(configuration);
+    return true;
+  }
+
+  return false;
+}
+
+//
+// This method is called to write the configuration information to flash
+//
+void writeConfiguration(struct Configuration *configuration)
+{
+  // Populate an EEPROM_DATA object with the configuration information passed in,
+  // and update size and the checksum.
 
   struct EEPROM_DATA eepromData;
   memcpy(&eepromData.Configuration,configuration,sizeof(Configuration));
@@ -111,18 +232,83 @@ void writeConfiguration(struct Configuration *configuration)
 
   Serial.print("writeConfiguration, checksum = ");
   Serial.println(eepromData.CheckSum);
-  
-  // We write the data out byte by byte so we need a character pointer to
-  // the start of the data.
-  
-  char *p = (char *)&eepromData;
-
-  // Write out the data
-  
-  for(int i = 0; i < sizeof(EEPROM_DATA); i++)
-    EEPROM.write(i,*p++);
-
-  // End the EEPROM access
-  
-  EEPROM.end();
+
+  // Write out the data in one go
+
+  configurationStore.putBytes(PREFERENCES_KEY, &eepromData, sizeof(EEPROM_DATA));
+  configurationDirty = false;
+}
+
+//
+// Load the live configuration at start up, falling back to the defaults
+//
+bool beginConfiguration()
+{
+  configurationStore.begin(PREFERENCES_NAMESPACE, false);
+  if (readConfiguration(&configuration))
+    return true;
+
+  Serial.println("No usable configuration found in flash, using defaults");
+  defaultConfiguration(&configuration);
+  return false;
+}
+
+//
+// The live configuration has been changed - schedule a write
+//
+void configurationChanged()
+{
+  configurationDirty = true;
+  configurationChangedAt = millis();
+  configurationGeneration++;
+}
+
+//
+// Write the live configuration if it has changed and things have settled down.
+// Called regularly; force writes any pending change straight away.
+//
+void flushConfiguration(bool force)
+{
+  if (!configurationDirty) return;
+  if (!force && millis() - configurationChangedAt < CONFIGURATION_WRITE_DELAY_MS) return;
+  writeConfiguration(&configuration);
+}
+
+//
+// Change one setting of the live configuration, by name.
+// Returns false if the name is unknown or the value is not acceptable.
+//
+bool setConfigurationValue(const char *name, const char *value)
+{
+  long number = atol(value);
+
+  if (strcmp(name, "ssid") == 0)
+  {
+    if (!validSSID(value)) return false;
+    strcpy(configuration.AccessPointSSID, value);
+  }
+  else if (strcmp(name, "password") == 0)
+  {
+    if (!validPassword(value)) return false;
+    strcpy(configuration.AccessPointPassword, value);
+  }
+  else if (strcmp(name, "port") == 0)
+  {
+    if (!validPort(number)) return false;
+    configuration.TCPPort = number;
+  }
+  else if (strcmp(name, "clients") == 0)
+  {
+    if (!validClients(number)) return false;
+    configuration.MaximumTCPClientCount = number;
+  }
+  else if (strcmp(name, "baud") == 0)
+  {
+    if (!validBaud(number)) return false;
+    configuration.NMEABaudRate = number;
+  }
+  else return false;
+
+  configurationChanged();
+  return true;
 }
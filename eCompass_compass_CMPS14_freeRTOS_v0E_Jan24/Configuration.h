@@ -4,6 +4,11 @@
 //  See Configuration.cpp for details.
 //
 
+#ifndef _CONFIGURATION_H
+#define _CONFIGURATION_H
+
+#include <Print.h>
+
 #define EEPROM_SIZE 512
 
 #define ACCESS_POINT_SSID_SIZE 32
@@ -11,7 +16,23 @@
 
 #define BLUETOOTH_DEVICE_NAME_SIZE 31
 
+// Schema version of the Configuration structure. Bump the minor version when fields
+// are appended, the major version if existing fields change meaning or layout.
+
+#define CONFIGURATION_MAJOR_VERSION 2
+#define CONFIGURATION_MINOR_VERSION 0
+
+// Changes are written to flash this long after the last change, so a burst of
+// settings only costs one flash write.
+
+#define CONFIGURATION_WRITE_DELAY_MS 5000
+
+// Upper limit on MaximumTCPClientCount - size of the NMEA client array
+
+#define MAX_TCP_CLIENTS 8
+
 // The configuration structure holds the basic configuration data.
+// New fields must only ever be added at the end - see migrateConfiguration().
 
 struct Configuration
 {
@@ -19,12 +40,12 @@ struct Configuration
   uint8_t MinorVersion;
 
   // WiFi Related Data
-  
+
   char AccessPointSSID[ACCESS_POINT_SSID_SIZE + 1];
   char AccessPointPassword[ACCESS_POINT_PASSWORD_SIZE + 1];
 
   // TCP Client related data
-  
+
   uint16_t TCPPort;
   uint8_t MaximumTCPClientCount;
 
@@ -39,7 +60,8 @@ struct Configuration
 };
 
 // The EPPROM_DATA structure wraps the configuration structure and adds a checksum
-// to it. The checkum will be validated on reads and updated on writes.
+// to it. The checkum will be validated on reads and updated on writes. It is the
+// layout used by the original EEPROM based store, and is still used in flash.
 
 struct EEPROM_DATA
 {
@@ -48,8 +70,31 @@ struct EEPROM_DATA
   uint16_t CheckSum;
 };
 
+// The live configuration. Everything that is configurable reads its values from here.
+
+extern struct Configuration configuration;
+
+// Incremented every time the live configuration changes, so the code that applies the
+// settings can tell when it has something to do.
+
+extern volatile uint32_t configurationGeneration;
+
+// Set by the sketch to tell us which ports its other listeners use, so the NMEA port
+// can't be moved onto one of them. NULL if there are none.
+
+extern bool (*configurationPortReserved)(uint16_t port);
+
 // The following methods are used to manipulate the configuration information
 
 bool readConfiguration(struct Configuration *configuration);
 void writeConfiguration(struct Configuration *configuration);
-void dumpConfiguration(struct Configuration *configuration);
+void dumpConfiguration(struct Configuration *configuration, Print &out);
+void defaultConfiguration(struct Configuration *configuration);
+bool beginConfiguration();
+bool setConfigurationValue(const char *name, const char *value);
+bool validConfiguration(const struct Configuration *configuration);
+void configurationChanged();
+void flushConfiguration(bool force);
+uint16_t Fletcher16(const uint8_t *data, int count);
+
+#endif
@@ -0,0 +1,534 @@
+#ifndef _CONSOLE_H
+#define _CONSOLE_H
+/*
+ * Configuration console
+ *
+ * Line oriented command interpreter for the serial port and telnet sessions on the
+ * config port (only the serial port in builds without FEATURE_CONFIG_TELNET, see
+ * BuildProfile.h). Nothing in here ever waits for input - the Network task calls
+ * consoleService() when a session's socket is readable and consoleTick() every time
+ * round its select() loop. Each session is a small state machine, so the long running
+ * commands (the calibration countdowns and the four point compass swing) just change
+ * the session state and return. Several sessions can be open at once.
+ *
+ * Commands take arguments, e.g. "cal mag 60" or "card set 2 93 178 268".
+ * The old single key commands still work as abbreviations.
+ */
+
+#include <WiFi.h>
+#include <lwip/sockets.h>
+#include "BuildProfile.h"
+
+#if FEATURE_CONFIG_TELNET
+#define MAX_CONSOLE_SESSIONS 3     //Session 0 is always the serial port
+#else
+#define MAX_CONSOLE_SESSIONS 1
+#endif
+#define CONSOLE_LINE_LENGTH 80
+
+enum ConsoleState {
+  CONSOLE_CLOSED,
+  CONSOLE_COMMAND,     //waiting for a command line
+  CONSOLE_COUNTDOWN,   //CMPS14 calibration running, counting down
+  CONSOLE_SWING        //compass swing, waiting for Enter on each cardinal
+};
+
+struct ConsoleSession {
+  ConsoleState state;
+#if FEATURE_CONFIG_TELNET
+  WiFiClient client;   //unused for the serial session
+#endif
+  Print *out;
+  char line[CONSOLE_LINE_LENGTH + 1];
+  int lineLength;
+  bool lastWasCR;              //the LF of a CR LF can come in the next read
+  unsigned countdown;          //seconds left
+  unsigned long nextTick;      //millis() of the next countdown tick
+  int swingStep;               //0-3 = N, E, S, W
+  int swingReadings[4];
+};
+
+ConsoleSession consoleSessions[MAX_CONSOLE_SESSIONS];
+
+const char *cardinalNames[4] = { "North", "East", "South", "West" };
+
+void consolePrompt(ConsoleSession *s) {
+  s->out->print("->? ");
+}
+
+void consoleHelp(ConsoleSession *s) {
+  Print *out = s->out;
+  out->print("\n");
+  out->print("Enter command;\n");
+  out->print(" help (h, ?)                 print this menu\n");
+  out->print(" cal (c)                     show current calibration levels\n");
+  out->print(" cal gyro [secs] (g)         calibrate the gyroscope\n");
+  out->print(" cal accel [secs] (a)        calibrate accelerometer\n");
+  out->print(" cal mag [secs] (m)          calibrate magnetometer\n");
+  out->print(" cal save (s)                save current CMPS calibration\n");
+  out->print(" cal erase (e)               erase the saved CMPS calibration\n");
+  out->print(" cal autosave on|off (p, x)  enable/disable periodic auto-save\n");
+  out->print(" card swing (b)              generate a boat compass card by swinging the boat\n");
+  out->print(" card set <N> <E> <S> <W>    generate a compass card from sensor readings\n");
+  out->print(" card show (d)               display the compass card\n");
+  out->print(" card zero (z)               zero (erase) the compass card\n");
+  out->print(" card save (n)               save compass card to ESP32 Non-volatile memory\n");
+  out->print(" heading                     show sensor and boat heading\n");
+  out->print(" sensors                     show the health of each CMPS14 and how they vote\n");
+  out->print(" sensor <n>                  calibrate and swing CMPS14 n (0 is the main one)\n");
+  out->print(" config                      show the configuration\n");
+  out->print(" config set <name> <value>   change ssid, password, port, clients or baud\n");
+  out->print(" config save                 write the configuration to flash now\n");
+  out->print(" config defaults             go back to the default configuration\n");
+  out->print(" position [<lat> <lon>]       show or set the position used for variation\n");
+  out->print(" deviation [status]          show the compass card learnt from GPS course\n");
+  out->print(" deviation apply|reset       make the learnt card the compass card, or start again\n");
+  out->print(" fusion [status]             show the heading source and fusion figures\n");
+  out->print(" fusion on|off               use our own sensor fusion or the CMPS14 bearing\n");
+  out->print(" fusion cal start|stop|save  hard/soft iron calibration for the fusion\n");
+  out->print(" record start|stop|status     record the raw sensor registers to SPIFFS\n");
+  out->print(" record erase                delete the recording\n");
+  out->print(" replay [speed]              replay the recording, speed x real time (0 = flat out)\n");
+  out->print(" replay status               show the result of the last replay\n");
+#if FEATURE_HISTORY
+  out->print(" history                     show how much heading history is held\n");
+#endif
+  out->print(" profiles                    show the NMEA output profiles and their clients\n");
+  out->print(" pipeline                    show the time in each stage and the queue depths\n");
+#if FEATURE_SEA_STATE
+  out->print(" seastate                    show the wave and roll periods and heights\n");
+#endif
+  out->print(" boot                        show how long each start up phase took\n");
+  out->print(" build                       show the build profile and its flash and RAM footprint\n");
+#ifdef SIMULATE_CMPS14
+  out->print(" sim fault <type> [n] [s]    inject faults into sensor s: off, nack, short, stuck, dead,\n");
+  out->print("                             frozen, offset or garbage - n is percent, or degrees for offset\n");
+#endif
+#ifdef BENCHMARKS
+  out->print(" bench [json]                time the heading hot path kernels\n");
+#endif
+  out->print(" stats (t)                   show runtime stats\n");
+  out->print(" reboot (r)                  reboot the system\n");
+  out->print(" quit (q)                    close this session\n");
+}
+
+void consoleClose(ConsoleSession *s) {
+  if (s == &consoleSessions[0]) {   //The serial port can't be closed, just go back to the prompt
+    s->state = CONSOLE_COMMAND;
+    return;
+  }
+#if FEATURE_CONFIG_TELNET
+  s->client.stop();
+  s->state = CONSOLE_CLOSED;
+  Serial.println("Config client disconnected.");
+#endif
+}
+
+//Start one of the CMPS14 calibration modes and count down while the user moves the sensor
+void consoleStartCalibration(ConsoleSession *s, byte mode, unsigned secs) {
+  configureCMPS14(mode);
+  if (secs == 0) {
+    CalibrationQuality();
+    return;
+  }
+  s->countdown = secs;
+  s->nextTick = millis();
+  s->state = CONSOLE_COUNTDOWN;
+}
+
+void consoleSwingPrompt(ConsoleSession *s) {
+  char buff[128];
+  sprintf(buff, "Steer the boat due %s. Hit enter when the boat compass reads %03d degrees. ('abort' to stop)\n",
+          cardinalNames[s->swingStep], s->swingStep * 90);
+  s->out->print(buff);
+}
+
+//Next line of input during a compass swing
+void consoleSwingLine(ConsoleSession *s, char *line) {
+  char buff[128];
+  if (strcmp(line, "abort") == 0) {
+    s->out->print("Compass swing abandoned\n");
+    s->state = CONSOLE_COMMAND;
+    return;
+  }
+  Cmps14 *sensor = cmpsSelectedSensor();
+  sensor->lock();   //so its status is the result of our read
+  s->swingReadings[s->swingStep] = sensor->getBearing();
+  SampleStatus status = sensor->status;
+  sensor->unlock();
+  if (status != SAMPLE_OK) {
+    sprintf(buff, "No reading from the CMPS14 (%s) - try again\n", sampleStatusNames[status]);
+    s->out->print(buff);
+    consoleSwingPrompt(s);
+    return;
+  }
+  sprintf(buff, "CMPS reading for %s is %03d degrees\n\n", cardinalNames[s->swingStep], s->swingReadings[s->swingStep]);
+  s->out->print(buff);
+  if (++s->swingStep < 4) {
+    consoleSwingPrompt(s);
+    return;
+  }
+  //now calculate the mapping for every possible degree
+  calcOffsets(s->swingReadings[0], s->swingReadings[1], s->swingReadings[2], s->swingReadings[3]);
+  s->state = CONSOLE_COMMAND;
+}
+
+//Parse the optional countdown argument, or use the default
+unsigned consoleSeconds(char *arg, unsigned defaultSecs) {
+  return arg != NULL ? atoi(arg) : defaultSecs;
+}
+
+void consoleCalCommand(ConsoleSession *s, char *sub, char *arg) {
+  if (sub == NULL) {
+    CalibrationQuality();
+  } else if (strcmp(sub, "gyro") == 0) {
+    s->out->print("Gyro... Keep the CMPS14 stationary\n");
+    consoleStartCalibration(s, B10000100, consoleSeconds(arg, 20));
+  } else if (strcmp(sub, "accel") == 0) {
+    s->out->print("Accelerometer...\nRotate in differnt 90 degrees and keep steady for a while\n");
+    consoleStartCalibration(s, B10000010, consoleSeconds(arg, 40));
+  } else if (strcmp(sub, "mag") == 0) {
+    s->out->print("Magnetometer...\nRotate the CMPS14 randomly around for 40 seconds\n");
+    consoleStartCalibration(s, B10000001, consoleSeconds(arg, 40));
+  } else if (strcmp(sub, "autosave") == 0 && arg != NULL && strcmp(arg, "on") == 0) {
+    s->out->print("Enable periodic automatic save of calibration data\n");
+    consoleStartCalibration(s, B10010000, 0);
+  } else if (strcmp(sub, "autosave") == 0 && arg != NULL && strcmp(arg, "off") == 0) {
+    s->out->print("Stop auto calibration\n");
+    consoleStartCalibration(s, B10000000, 0);
+  } else if (strcmp(sub, "save") == 0) {
+    saveCMPSCalibration();
+    s->out->print("Calibration profile saved\n");
+  } else if (strcmp(sub, "erase") == 0) {
+    eraseCMPSCalibration();
+    s->out->print("Saved calibration erased, factory defaults apply\n");
+  } else {
+    s->out->print("Usage: cal [gyro|accel|mag [secs] | save | erase | autosave on|off]\n");
+  }
+}
+
+void consoleConfigCommand(ConsoleSession *s, char *sub, char **args) {
+  if (sub == NULL || strcmp(sub, "show") == 0) {
+    dumpConfiguration(&configuration, *s->out);
+  } else if (strcmp(sub, "set") == 0 && args[0] && args[1]) {
+    if (setConfigurationValue(args[0], args[1])) s->out->print("OK\n");
+    else s->out->print("Invalid setting\n");
+  } else if (strcmp(sub, "save") == 0) {
+    flushConfiguration(true);
+  } else if (strcmp(sub, "defaults") == 0) {
+    defaultConfiguration(&configuration);
+    configurationChanged();
+  } else {
+    s->out->print("Usage: config [show | set <name> <value> | save | defaults]\n");
+  }
+}
+
+void consoleCardCommand(ConsoleSession *s, char *sub, char **args) {
+  if (sub != NULL && strcmp(sub, "swing") == 0) {
+    s->swingStep = 0;
+    s->state = CONSOLE_SWING;
+    consoleSwingPrompt(s);
+  } else if (sub != NULL && strcmp(sub, "set") == 0 && args[0] && args[1] && args[2] && args[3]) {
+    calcOffsets(atoi(args[0]), atoi(args[1]), atoi(args[2]), atoi(args[3]));
+  } else if (sub != NULL && strcmp(sub, "show") == 0) {
+    displayCompassCard();
+  } else if (sub != NULL && strcmp(sub, "zero") == 0) {
+    resetCompassCard();
+  } else if (sub != NULL && strcmp(sub, "save") == 0) {
+    saveCompassCard();
+  } else {
+    s->out->print("Usage: card swing | set <N> <E> <S> <W> | show | zero | save\n");
+  }
+}
+
+void consolePositionCommand(ConsoleSession *s, char **args) {
+  char buff[128];
+  float variation;
+
+  if (args[0] != NULL && args[1] != NULL) {
+    float lat = atof(args[0]), lon = atof(args[1]);
+    if (lat < -90 || lat > 90 || lon < -180 || lon > 180) {
+      s->out->print("Usage: position <lat> <lon> - decimal degrees, south and west negative\n");
+      return;
+    }
+    setPosition(lat, lon);
+  }
+  if (!currentVariation(&variation)) {
+    if (!position.valid) s->out->print("Position not known\n");
+    else {
+      sprintf(buff, "Date %.2f is outside the magnetic model, %.0f to %.0f\n", currentYear(), WMM_EPOCH, WMM_EPOCH + WMM_LIFE_YEARS);
+      s->out->print(buff);
+    }
+    return;
+  }
+  sprintf(buff, "Position %.5f %.5f, date %.2f, variation %.1f%c, true heading %03d\n", position.lat, position.lon,
+          currentYear(), fabs(variation), variation < 0 ? 'W' : 'E', MOD360(boatHeading + (int)lroundf(variation)));
+  s->out->print(buff);
+}
+
+void consoleDeviationCommand(ConsoleSession *s, char *sub) {
+  char buff[64];
+
+  if (sub == NULL || strcmp(sub, "status") == 0) {
+    deviationStatus(*s->out);
+  } else if (strcmp(sub, "apply") == 0) {
+    sprintf(buff, "%d degrees of the compass card updated\n", deviationApply());
+    s->out->print(buff);
+  } else if (strcmp(sub, "reset") == 0) {
+    deviationReset();
+  } else {
+    s->out->print("Usage: deviation [status] | apply | reset\n");
+  }
+}
+
+#ifdef SIMULATE_CMPS14
+void consoleSimCommand(ConsoleSession *s, char *sub, char *type, char *value, char *sensor) {
+  int n = sensor != NULL ? atoi(sensor) : 0;
+  if (sub != NULL && strcmp(sub, "fault") == 0 && type != NULL && n >= 0 && n < cmpsCount) {
+    for (int i = 0; i < NUM_SIM_FAULTS; i++) {
+      if (strcmp(type, simFaultNames[i]) != 0) continue;
+      simSetFault(n, (SimFault)i, value != NULL ? atoi(value) : (i == SIM_FAULT_OFFSET ? 30 : 100));
+      return;
+    }
+  }
+  s->out->print("Usage: sim fault off|nack|short|stuck|dead|frozen|offset|garbage [percent|degrees] [sensor]\n");
+}
+#endif
+
+void consoleSensorCommand(ConsoleSession *s, char *arg) {
+  char buff[64];
+  int n = arg != NULL ? atoi(arg) : -1;
+  if (arg == NULL || n < 0 || n >= cmpsCount) {
+    sprintf(buff, "Usage: sensor <0 to %d>\n", cmpsCount - 1);
+    s->out->print(buff);
+    return;
+  }
+  cmpsSelected = n;
+  sprintf(buff, "cal and card commands now work on the %s CMPS14\n", cmpsSensors[n].name);
+  s->out->print(buff);
+}
+
+void consoleFusionCommand(ConsoleSession *s, char *sub, char *arg) {
+  if (sub == NULL || strcmp(sub, "status") == 0) {
+    fusionStatus(*s->out);
+  } else if (strcmp(sub, "on") == 0) {
+    setHeadingSource(SOURCE_FUSION);
+  } else if (strcmp(sub, "off") == 0) {
+    setHeadingSource(SOURCE_CMPS14);
+  } else if (strcmp(sub, "cal") == 0 && arg != NULL && strcmp(arg, "start") == 0) {
+    magCalibrationStart();
+    s->out->print("Turn the unit slowly through every orientation, then 'fusion cal stop'\n");
+  } else if (strcmp(sub, "cal") == 0 && arg != NULL && strcmp(arg, "stop") == 0) {
+    if (magCalibrationStop()) magCalibrationShow(*s->out);
+    else s->out->print("Not enough movement - calibration unchanged\n");
+  } else if (strcmp(sub, "cal") == 0 && arg != NULL && strcmp(arg, "save") == 0) {
+    magCalibrationSave();
+  } else {
+    s->out->print("Usage: fusion [status | on | off | cal start|stop|save]\n");
+  }
+}
+
+void consoleRecordCommand(ConsoleSession *s, char *sub) {
+  if (sub != NULL && strcmp(sub, "start") == 0) {
+    if (recordStart()) s->out->print("Recording to " RECORD_FILE "\n");
+    else s->out->print("Can't open " RECORD_FILE "\n");
+  } else if (sub != NULL && strcmp(sub, "stop") == 0) {
+    recordStop();
+  } else if (sub != NULL && strcmp(sub, "erase") == 0) {
+    if (recording) s->out->print("Stop the recording first\n");
+    else recordErase();
+  } else if (sub == NULL || strcmp(sub, "status") == 0) {
+    recordStatus(*s->out);
+  } else {
+    s->out->print("Usage: record start | stop | status | erase\n");
+  }
+}
+
+void consoleReplayCommand(ConsoleSession *s, char *arg) {
+  if (arg != NULL && strcmp(arg, "status") == 0) {
+    replayStatus(*s->out);
+  } else if (replayStart(arg != NULL ? atoi(arg) : 0)) {
+    s->out->print("Replaying " RECORD_FILE " - 'replay status' for the result\n");
+  } else {
+    s->out->print("Can't replay - no recording, a recording in progress or a replay already running\n");
+  }
+}
+
+//Expand the old single key commands into their long form
+void consoleAbbreviation(char **argv, int *argc) {
+  static char *expansions[][3] = {
+    {(char *)"h", (char *)"help", NULL},      {(char *)"?", (char *)"help", NULL},
+    {(char *)"c", (char *)"cal", NULL},       {(char *)"g", (char *)"cal", (char *)"gyro"},
+    {(char *)"a", (char *)"cal", (char *)"accel"}, {(char *)"m", (char *)"cal", (char *)"mag"},
+    {(char *)"s", (char *)"cal", (char *)"save"},  {(char *)"e", (char *)"cal", (char *)"erase"},
+    {(char *)"p", (char *)"cal", (char *)"autosave"}, {(char *)"x", (char *)"cal", (char *)"autosave"},
+    {(char *)"b", (char *)"card", (char *)"swing"}, {(char *)"d", (char *)"card", (char *)"show"},
+    {(char *)"z", (char *)"card", (char *)"zero"},  {(char *)"n", (char *)"card", (char *)"save"},
+    {(char *)"t", (char *)"stats", NULL},     {(char *)"r", (char *)"reboot", NULL},
+    {(char *)"q", (char *)"quit", NULL}
+  };
+  if (*argc != 1 || strlen(argv[0]) != 1) return;
+  for (unsigned i = 0; i < sizeof(expansions) / sizeof(expansions[0]); i++) {
+    if (strcmp(argv[0], expansions[i][0]) != 0) continue;
+    argv[0] = expansions[i][1];
+    if (expansions[i][2] != NULL) {
+      argv[(*argc)++] = expansions[i][2];
+      if (strcmp(expansions[i][0], "p") == 0) argv[(*argc)++] = (char *)"on";
+      if (strcmp(expansions[i][0], "x") == 0) argv[(*argc)++] = (char *)"off";
+    }
+    return;
+  }
+}
+
+#define CONSOLE_MAX_ARGS 8
+
+void consoleCommand(ConsoleSession *s, char *line) {
+  char *argv[CONSOLE_MAX_ARGS + 1];
+  int argc = 0;
+  char *save;
+  char buff[128];
+
+  for (char *tok = strtok_r(line, " \t", &save); tok != NULL && argc < CONSOLE_MAX_ARGS - 2; tok = strtok_r(NULL, " \t", &save))
+    argv[argc++] = tok;
+  if (argc == 0) return;
+  consoleAbbreviation(argv, &argc);
+  for (int i = argc; i <= CONSOLE_MAX_ARGS; i++) argv[i] = NULL;
+
+  if (strcmp(argv[0], "help") == 0) consoleHelp(s);
+  else if (strcmp(argv[0], "cal") == 0) consoleCalCommand(s, argv[1], argv[2]);
+  else if (strcmp(argv[0], "card") == 0) consoleCardCommand(s, argv[1], &argv[2]);
+  else if (strcmp(argv[0], "config") == 0) consoleConfigCommand(s, argv[1], &argv[2]);
+  else if (strcmp(argv[0], "position") == 0) consolePositionCommand(s, &argv[1]);
+  else if (strcmp(argv[0], "deviation") == 0) consoleDeviationCommand(s, argv[1]);
+  else if (strcmp(argv[0], "fusion") == 0) consoleFusionCommand(s, argv[1], argv[2]);
+  else if (strcmp(argv[0], "record") == 0) consoleRecordCommand(s, argv[1]);
+  else if (strcmp(argv[0], "replay") == 0) consoleReplayCommand(s, argv[1]);
+  else if (strcmp(argv[0], "stats") == 0) printStats();
+  else if (strcmp(argv[0], "boot") == 0) bootReport(*s->out);
+  else if (strcmp(argv[0], "build") == 0) buildReport(*s->out);
+#if FEATURE_HISTORY
+  else if (strcmp(argv[0], "history") == 0) historyStatus(*s->out);
+#endif
+  else if (strcmp(argv[0], "profiles") == 0) nmeaProfilesStatus(*s->out);
+  else if (strcmp(argv[0], "pipeline") == 0) pipelineStatus(*s->out);
+#if FEATURE_SEA_STATE
+  else if (strcmp(argv[0], "seastate") == 0) seaStateStatus(*s->out);
+#endif
+  else if (strcmp(argv[0], "sensors") == 0) sensorsStatus(*s->out);
+  else if (strcmp(argv[0], "sensor") == 0) consoleSensorCommand(s, argv[1]);
+#ifdef SIMULATE_CMPS14
+  else if (strcmp(argv[0], "sim") == 0) consoleSimCommand(s, argv[1], argv[2], argv[3], argv[4]);
+#endif
+#ifdef BENCHMARKS
+  else if (strcmp(argv[0], "bench") == 0) runBenchmarks(*s->out, argv[1] != NULL && strcmp(argv[1], "json") == 0);
+#endif
+  else if (strcmp(argv[0], "heading") == 0) {
+    sprintf(buff, "Sensor: %03d deg. Boat: %03d deg.\n", sensorHeading, boatHeading);
+    s->out->print(buff);
+  }
+  else if (strcmp(argv[0], "reboot") == 0) ESP.restart();
+  else if (strcmp(argv[0], "quit") == 0) consoleClose(s);
+  else s->out->print("Unknown command - 'help' for the list\n");
+}
+
+//A complete line of input has arrived
+void consoleLine(ConsoleSession *s) {
+  s->line[s->lineLength] = '\0';
+  s->lineLength = 0;
+  userActivity();
+
+  //Command output goes back to this session
+  consoleOut = s->out;
+  consoleTask = xTaskGetCurrentTaskHandle();
+  switch (s->state) {
+    case CONSOLE_COMMAND:   consoleCommand(s, s->line); break;
+    case CONSOLE_SWING:     consoleSwingLine(s, s->line); break;
+    case CONSOLE_COUNTDOWN: s->out->print("Busy - wait for the calibration to finish\n"); break;
+    default: break;
+  }
+  consoleOut = NULL;
+  if (s->state == CONSOLE_COMMAND) consolePrompt(s);
+}
+
+//Feed received characters into the session's line buffer
+void consoleInput(ConsoleSession *s, const char *data, int length) {
+  for (int i = 0; i < length && s->state != CONSOLE_CLOSED; i++) {
+    char c = data[i];
+    bool afterCR = s->lastWasCR;
+    s->lastWasCR = c == '\r';
+    if (c == '\r' || c == '\n') {
+      //Treat CR LF as a single end of line, however the reads split it
+      if (c == '\n' && afterCR) continue;
+      consoleLine(s);
+    } else if ((c == '\b' || c == 0x7f) && s->lineLength > 0) {
+      s->lineLength--;
+    } else if (c >= ' ' && c < 0x7f && s->lineLength < CONSOLE_LINE_LENGTH) {
+      //Anything else, including telnet option negotiation, is ignored
+      s->line[s->lineLength++] = c;
+    }
+  }
+}
+
+#if FEATURE_CONFIG_TELNET
+//New telnet connection on the config port
+void consoleOpen(WiFiClient newClient) {
+  for (int i = 1; i < MAX_CONSOLE_SESSIONS; i++) {
+    ConsoleSession *s = &consoleSessions[i];
+    if (s->state != CONSOLE_CLOSED) continue;
+    s->client = newClient;
+    s->out = &s->client;
+    s->lineLength = 0;
+    s->lastWasCR = false;
+    s->state = CONSOLE_COMMAND;
+    Serial.println("Config Client detected.");
+    consoleHelp(s);
+    consolePrompt(s);
+    return;
+  }
+  newClient.print("Too many config sessions\n");
+  newClient.stop();
+}
+
+//Socket of session i is readable
+void consoleService(int i) {
+  ConsoleSession *s = &consoleSessions[i];
+  char buff[64];
+  int n = recv(s->client.fd(), buff, sizeof(buff), MSG_DONTWAIT);
+  if (n > 0) consoleInput(s, buff, n);
+  else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) consoleClose(s);
+}
+#endif
+
+//Called every time round the Network task loop - serial input and countdown timers
+void consoleTick() {
+  char buff[64];
+  int n = 0;
+  while (Serial.available() > 0 && n < (int)sizeof(buff)) buff[n++] = Serial.read();
+  if (n > 0) consoleInput(&consoleSessions[0], buff, n);
+
+  for (int i = 0; i < MAX_CONSOLE_SESSIONS; i++) {
+    ConsoleSession *s = &consoleSessions[i];
+    if (s->state != CONSOLE_COUNTDOWN || (long)(millis() - s->nextTick) < 0) continue;
+    consoleOut = s->out;
+    consoleTask = xTaskGetCurrentTaskHandle();
+    if (s->countdown > 0) {
+      s->out->print(s->countdown--);
+      s->out->print(" ");
+      s->nextTick += 1000;
+    } else {
+      s->out->print("OK\n");
+      CalibrationQuality();
+      s->state = CONSOLE_COMMAND;
+      consolePrompt(s);
+    }
+    consoleOut = NULL;
+  }
+}
+
+void consoleSetup() {
+  consoleSessions[0].out = &Serial;
+  consoleSessions[0].state = CONSOLE_COMMAND;
+  for (int i = 1; i < MAX_CONSOLE_SESSIONS; i++) consoleSessions[i].state = CONSOLE_CLOSED;
+}
+
+#endif
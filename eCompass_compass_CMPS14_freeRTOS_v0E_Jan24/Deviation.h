@@ -0,0 +1,206 @@
+#ifndef _DEVIATION_H
+#define _DEVIATION_H
+/*
+ * Deviation learning from GPS course over ground
+ *
+ * The compass card from a four point swing goes stale as things get moved around the boat.
+ * While we are motoring or sailing in a straight line the course over ground from the GPS,
+ * less the variation, is what the boat compass should read - so each new COG fix gives us a
+ * measurement of the card offset (sensor heading less magnetic heading) at the heading we
+ * are on.
+ *
+ * The Heading task feeds every sample in here and we keep the mean sensor heading and the
+ * peak turn rate since the last fix. A fix only counts when the boat has been on a steady
+ * leg for DEV_LEG_SETTLE_MS - fast enough for the COG to mean something, not turning, and
+ * the COG itself steady, which keeps out most of the effect of tide and leeway changing.
+ *
+ * Offsets are kept per DEV_SECTOR_DEG sector of sensor heading as a running mean and
+ * variance, O(1) per fix in a fixed table. Once a sector has DEV_MAX_WEIGHT fixes older ones
+ * are progressively forgotten, so the estimate follows a slowly changing boat. A proposed
+ * card is interpolated between sector centres and shown with its 95% confidence interval;
+ * it only replaces the compass card when somebody approves it with deviationApply().
+ */
+
+#include "Wmm.h"
+
+#define DEV_SECTOR_DEG 10
+#define DEV_SECTORS (360 / DEV_SECTOR_DEG)
+#define DEV_MIN_SOG 2.5           //knots - below this COG is mostly noise
+#define DEV_MAX_RATE_DPS 2.0      //peak turn rate allowed between fixes
+#define DEV_MAX_COG_CHANGE 4.0    //degrees between fixes
+#define DEV_LEG_SETTLE_MS 20000   //steady this long before fixes are used
+#define DEV_MIN_SAMPLES 10        //before a sector contributes to the proposed card
+#define DEV_MAX_WEIGHT 500        //fixes a sector remembers in full
+#define DEV_GATE_DEG 20.0         //outlier gate around the sector mean
+#define DEV_MIN_FIX_MS 500        //RMC and VTG in the same second count once
+
+struct DeviationSector {
+  uint32_t count;
+  float mean;                     //offset, degrees -180..180
+  float variance;
+};
+
+DeviationSector deviationSectors[DEV_SECTORS];
+
+enum DeviationCount { DEV_ACCEPTED, DEV_SLOW, DEV_TURNING, DEV_UNSTEADY, DEV_SETTLING, DEV_NO_VARIATION,
+                      DEV_OUTLIER, NUM_DEV_COUNTS };
+const char *deviationCountNames[NUM_DEV_COUNTS] = { "accepted", "slow", "turning", "unsteady", "settling",
+                                                    "no_variation", "outlier" };
+uint32_t deviationCounts[NUM_DEV_COUNTS];
+
+//Heading statistics since the last fix, written by the Heading task
+portMUX_TYPE deviationMux = portMUX_INITIALIZER_UNLOCKED;
+float devSinSum = 0, devCosSum = 0, devPeakRate = 0;
+unsigned devSamples = 0;
+
+//The current leg
+unsigned long devLegStart = 0, devLastFixAt = 0;
+float devLastCog = NAN;
+
+inline float wrap180(float degrees) {
+  degrees = fmodf(degrees, 360);
+  if (degrees > 180) degrees -= 360;
+  else if (degrees <= -180) degrees += 360;
+  return degrees;
+}
+
+//Called by the Heading task for every sample
+void deviationSample(int heading, float yawRate) {
+  float rad = heading * DEG_TO_RAD;
+  portENTER_CRITICAL(&deviationMux);
+  devSinSum += sin(rad);
+  devCosSum += cos(rad);
+  devSamples++;
+  if (fabs(yawRate) > devPeakRate) devPeakRate = fabs(yawRate);
+  portEXIT_CRITICAL(&deviationMux);
+}
+
+//Running mean and variance. Plain Welford until the sector is full, then exponentially weighted
+void deviationUpdate(DeviationSector *sector, float offset) {
+  if (sector->count < DEV_MAX_WEIGHT) sector->count++;
+  float alpha = 1.0 / sector->count;
+  float diff = wrap180(offset - sector->mean);
+  float increment = alpha * diff;
+  sector->mean = wrap180(sector->mean + increment);
+  sector->variance = (1 - alpha) * (sector->variance + diff * increment);
+}
+
+//A new course over ground (true) from the GPS. Called by the NMEA input handlers
+void deviationFix(float cog, float sog) {
+  float s, c, rate, variation;
+  unsigned n;
+  DeviationCount result = DEV_ACCEPTED;
+  unsigned long now = millis();
+
+  if (now - devLastFixAt < DEV_MIN_FIX_MS) return;
+  devLastFixAt = now;
+  portENTER_CRITICAL(&deviationMux);
+  s = devSinSum; c = devCosSum; n = devSamples; rate = devPeakRate;
+  devSinSum = devCosSum = devPeakRate = 0;
+  devSamples = 0;
+  portEXIT_CRITICAL(&deviationMux);
+
+  bool cogSteady = !isnan(devLastCog) && fabs(wrap180(cog - devLastCog)) <= DEV_MAX_COG_CHANGE;
+  devLastCog = cog;
+
+  if (sog < DEV_MIN_SOG) result = DEV_SLOW;
+  else if (n == 0 || rate > DEV_MAX_RATE_DPS) result = DEV_TURNING;
+  else if (!cogSteady) result = DEV_UNSTEADY;
+  if (result != DEV_ACCEPTED) {
+    devLegStart = now;
+    deviationCounts[result]++;
+    return;
+  }
+  if (now - devLegStart < DEV_LEG_SETTLE_MS) result = DEV_SETTLING;
+  else if (!currentVariation(&variation)) result = DEV_NO_VARIATION;
+  if (result != DEV_ACCEPTED) {
+    deviationCounts[result]++;
+    return;
+  }
+
+  float sensor = atan2(s, c) * RAD_TO_DEG;
+  if (sensor < 0) sensor += 360;
+  float offset = wrap180(sensor - (cog - variation));
+  DeviationSector *sector = &deviationSectors[(int)sensor / DEV_SECTOR_DEG % DEV_SECTORS];
+
+  //Tide setting across the leg, a wave of leeway or a GPS glitch
+  if (sector->count >= DEV_MIN_SAMPLES &&
+      fabs(wrap180(offset - sector->mean)) > fmaxf(DEV_GATE_DEG, 3 * sqrtf(sector->variance))) {
+    deviationCounts[DEV_OUTLIER]++;
+    return;
+  }
+  deviationUpdate(sector, offset);
+  deviationCounts[DEV_ACCEPTED]++;
+}
+
+//95% confidence interval half width of a sector mean, degrees
+float deviationConfidence(const DeviationSector *sector) {
+  return 1.96 * sqrt(sector->variance / sector->count);
+}
+
+//Proposed card offset for a sensor heading, interpolated between the two nearest sector
+//centres that have enough fixes. False if neither has, in which case the card is left alone
+bool deviationProposed(int heading, float *offset, float *confidence) {
+  float place = (heading - DEV_SECTOR_DEG / 2.0) / DEV_SECTOR_DEG;
+  int below = (int)floor(place);
+  float fraction = place - below;
+  const DeviationSector *a = &deviationSectors[(below + DEV_SECTORS) % DEV_SECTORS];
+  const DeviationSector *b = &deviationSectors[(below + 1) % DEV_SECTORS];
+  bool haveA = a->count >= DEV_MIN_SAMPLES, haveB = b->count >= DEV_MIN_SAMPLES;
+
+  if (haveA && haveB) {
+    *offset = wrap180(a->mean + fraction * wrap180(b->mean - a->mean));
+    *confidence = fmaxf(deviationConfidence(a), deviationConfidence(b));
+  } else if (haveA || haveB) {
+    const DeviationSector *only = haveA ? a : b;
+    *offset = only->mean;
+    *confidence = deviationConfidence(only);
+  } else return false;
+  return true;
+}
+
+//Replace the main sensor's compass card with the proposal, where there is one - the deviation
+//is only learnt from the main sensor, whichever one the card commands are working on.
+//Returns degrees changed
+int deviationApply() {
+  float offset, confidence;
+  int changed = 0;
+
+  for (int i = 0; i < 360; i++) {
+    if (!deviationProposed(i, &offset, &confidence)) continue;
+    compassCard[i] = MOD360((int)lroundf(offset));
+    changed++;
+  }
+  if (changed > 0) saveCompassCard(0);
+  return changed;
+}
+
+void deviationReset() {
+  memset(deviationSectors, 0, sizeof(deviationSectors));
+  memset(deviationCounts, 0, sizeof(deviationCounts));
+  devLastCog = NAN;
+  devLegStart = millis();
+}
+
+//Per sector table of the current card against the proposal
+void deviationStatus(Print &out) {
+  char buff[96];
+  float offset, confidence;
+
+  out.print("Sector  fixes   card  proposed    95% CI\n");
+  for (int i = 0; i < DEV_SECTORS; i++) {
+    DeviationSector *sector = &deviationSectors[i];
+    int centre = i * DEV_SECTOR_DEG + DEV_SECTOR_DEG / 2;
+    float card = wrap180(compassCard[centre]);
+    if (deviationProposed(centre, &offset, &confidence))
+      sprintf(buff, "%03d   %6u %6.1f %9.1f %9.1f\n", i * DEV_SECTOR_DEG, sector->count, card, offset, confidence);
+    else
+      sprintf(buff, "%03d   %6u %6.1f         -         -\n", i * DEV_SECTOR_DEG, sector->count, card);
+    out.print(buff);
+  }
+  out.print("Fixes:");
+  for (int i = 0; i < NUM_DEV_COUNTS; i++) out.printf(" %s %u", deviationCountNames[i], deviationCounts[i]);
+  out.print("\n");
+}
+
+#endif
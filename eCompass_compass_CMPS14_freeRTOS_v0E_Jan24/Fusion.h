@@ -0,0 +1,288 @@
+#ifndef _FUSION_H
+#define _FUSION_H
+/*
+ * Our own sensor fusion
+ *
+ * An alternative to the bearing worked out inside the CMPS14. The Fusion task burst reads
+ * the raw magnetometer, accelerometer and gyro registers (6-23) at 100Hz and runs a
+ * Mahony filter (complementary filter on a quaternion, with integral feedback for the
+ * gyro bias), which gives a tilt compensated heading. Mahony rather than Madgwick because
+ * it needs fewer operations per update on the ESP32's single precision FPU - and no
+ * divisions other than the normalisations.
+ *
+ * The magnetometer is corrected with our own hard iron offsets and soft iron scale
+ * factors. These come from "fusion cal": rotate the unit through every orientation and
+ * the minimum and maximum of each axis give the centre and radii of the (assumed axis
+ * aligned) ellipsoid.
+ *
+ * headingSource selects at run time which heading the Heading task uses. While the chip's
+ * bearing is in use the Fusion task sleeps. If the burst reads keep failing (FUSION_MAX_ERRORS
+ * in a row) the filter is reset and has to settle again, and a heading that hasn't been
+ * updated for FUSION_STALE_MS isn't used either - the Heading task falls back to the chip's
+ * bearing rather than sending out a frozen one. The cycles taken by each update are counted
+ * and reported as a share of the 10ms budget.
+ */
+
+#include <Preferences.h>
+#include "Tasks.h"
+
+#define FUSION_PERIOD_MS 10
+#define FUSION_KP 2.0f         //proportional gain - how hard the accel/mag pull the gyro
+#define FUSION_KI 0.005f       //integral gain - gyro bias estimation
+#define FUSION_SETTLE_UPDATES 100   //updates after a reset before the heading is used
+#define FUSION_MAX_ERRORS 5         //read errors in a row before the filter is reset
+#define FUSION_STALE_MS 50          //a heading older than this is not used
+
+#define FUSION_RAW_START MAGNETX_Register
+#define FUSION_RAW_BYTES (GYROZ_Register + 2 - MAGNETX_Register)
+
+enum HeadingSource { SOURCE_CMPS14, SOURCE_FUSION };
+const char *headingSourceNames[] = { "cmps14", "fusion" };
+
+struct MagCalibration {
+  float offset[3];             //hard iron, raw counts
+  float scale[3];              //soft iron, per axis
+};
+
+extern Preferences settings;
+
+volatile HeadingSource headingSource = SOURCE_CMPS14;
+volatile float fusionHeading = 0;      //degrees, 0-360
+volatile bool fusionValid = false;
+volatile uint32_t fusionUpdatedMs = 0; //millis() of the last good update
+float fusionQ[4] = { 1, 0, 0, 0 };     //orientation quaternion
+float fusionBias[3] = { 0, 0, 0 };     //integral feedback
+unsigned fusionSettle = 0;             //updates since the last reset
+MagCalibration magCalibration = { { 0, 0, 0 }, { 1, 1, 1 } };
+
+//Hard/soft iron calibration in progress
+bool magCalibrating = false;
+float magMin[3], magMax[3];
+
+//Cycle budget
+uint32_t fusionUpdates = 0, fusionErrors = 0;
+unsigned fusionErrorRun = 0;           //read errors in a row
+uint32_t fusionCyclesLast = 0, fusionCyclesMax = 0;
+uint64_t fusionCyclesTotal = 0;
+
+inline float fusionInvSqrt(float x) {
+  return 1.0f / sqrtf(x);
+}
+
+//One Mahony update. Gyro in rad/s, accel and mag in any units, dt in seconds
+void mahonyUpdate(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz, float dt) {
+  float *q = fusionQ;
+  float q0q0 = q[0] * q[0], q0q1 = q[0] * q[1], q0q2 = q[0] * q[2], q0q3 = q[0] * q[3];
+  float q1q1 = q[1] * q[1], q1q2 = q[1] * q[2], q1q3 = q[1] * q[3];
+  float q2q2 = q[2] * q[2], q2q3 = q[2] * q[3], q3q3 = q[3] * q[3];
+  float norm;
+
+  //Only correct the gyro when the accelerometer and magnetometer readings are usable
+  if (ax * ax + ay * ay + az * az > 0 && mx * mx + my * my + mz * mz > 0) {
+    norm = fusionInvSqrt(ax * ax + ay * ay + az * az);
+    ax *= norm; ay *= norm; az *= norm;
+    norm = fusionInvSqrt(mx * mx + my * my + mz * mz);
+    mx *= norm; my *= norm; mz *= norm;
+
+    //Earth's magnetic field, rotated into the earth frame and flattened onto north/down
+    float hx = 2.0f * (mx * (0.5f - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2));
+    float hy = 2.0f * (mx * (q1q2 + q0q3) + my * (0.5f - q1q1 - q3q3) + mz * (q2q3 - q0q1));
+    float bx = sqrtf(hx * hx + hy * hy);
+    float bz = 2.0f * (mx * (q1q3 - q0q2) + my * (q2q3 + q0q1) + mz * (0.5f - q1q1 - q2q2));
+
+    //Where gravity and the field should be according to the current orientation
+    float vx = q1q3 - q0q2;
+    float vy = q0q1 + q2q3;
+    float vz = q0q0 - 0.5f + q3q3;
+    float wx = bx * (0.5f - q2q2 - q3q3) + bz * (q1q3 - q0q2);
+    float wy = bx * (q1q2 - q0q3) + bz * (q0q1 + q2q3);
+    float wz = bx * (q0q2 + q1q3) + bz * (0.5f - q1q1 - q2q2);
+
+    //Error is the cross product between measured and expected directions
+    float ex = (ay * vz - az * vy) + (my * wz - mz * wy);
+    float ey = (az * vx - ax * vz) + (mz * wx - mx * wz);
+    float ez = (ax * vy - ay * vx) + (mx * wy - my * wx);
+
+    fusionBias[0] += FUSION_KI * ex * dt;
+    fusionBias[1] += FUSION_KI * ey * dt;
+    fusionBias[2] += FUSION_KI * ez * dt;
+    gx += FUSION_KP * ex + fusionBias[0];
+    gy += FUSION_KP * ey + fusionBias[1];
+    gz += FUSION_KP * ez + fusionBias[2];
+  }
+
+  //Integrate the rate of change of the quaternion
+  gx *= 0.5f * dt; gy *= 0.5f * dt; gz *= 0.5f * dt;
+  float qa = q[0], qb = q[1], qc = q[2];
+  q[0] += -qb * gx - qc * gy - q[3] * gz;
+  q[1] += qa * gx + qc * gz - q[3] * gy;
+  q[2] += qa * gy - qb * gz + q[3] * gx;
+  q[3] += qa * gz + qb * gy - qc * gx;
+  norm = fusionInvSqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+  q[0] *= norm; q[1] *= norm; q[2] *= norm; q[3] *= norm;
+}
+
+//Heading (yaw) from the quaternion, degrees 0-360
+float fusionYaw() {
+  float *q = fusionQ;
+  float yaw = atan2f(2.0f * (q[1] * q[2] + q[0] * q[3]), q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]) * RAD_TO_DEG;
+  return yaw < 0 ? yaw + 360.0f : yaw;
+}
+
+//Start the filter at the orientation given by one accelerometer and magnetometer reading,
+//rather than waiting for it to swing round from level and north
+void fusionInit(float ax, float ay, float az, float mx, float my, float mz) {
+  float roll = atan2f(ay, az);
+  float pitch = atan2f(-ax, sqrtf(ay * ay + az * az));
+
+  //Level the magnetometer reading, then the heading is the angle of what is left
+  float my1 = my * cosf(roll) - mz * sinf(roll);
+  float mz1 = my * sinf(roll) + mz * cosf(roll);
+  float mx2 = mx * cosf(pitch) + mz1 * sinf(pitch);
+  float yaw = atan2f(-my1, mx2);
+
+  float cr = cosf(roll / 2), sr = sinf(roll / 2);
+  float cp = cosf(pitch / 2), sp = sinf(pitch / 2);
+  float cy = cosf(yaw / 2), sy = sinf(yaw / 2);
+  fusionQ[0] = cr * cp * cy + sr * sp * sy;
+  fusionQ[1] = sr * cp * cy - cr * sp * sy;
+  fusionQ[2] = cr * sp * cy + sr * cp * sy;
+  fusionQ[3] = cr * cp * sy - sr * sp * cy;
+}
+
+void fusionReset() {
+  fusionQ[0] = 1; fusionQ[1] = fusionQ[2] = fusionQ[3] = 0;
+  fusionBias[0] = fusionBias[1] = fusionBias[2] = 0;
+  fusionSettle = 0;
+  fusionValid = false;
+}
+
+/*
+ * Hard and soft iron calibration
+ */
+
+void magCalibrationStart() {
+  TaskConfig *task = findTask("Fusion");
+
+  for (int i = 0; i < 3; i++) {
+    magMin[i] = 32767;
+    magMax[i] = -32768;
+  }
+  magCalibrating = true;
+  if (task != NULL && headingSource != SOURCE_FUSION) xTaskNotifyGive(task->handle);
+}
+
+//Work out the correction from the extremes seen. Returns false if the unit wasn't turned enough
+bool magCalibrationStop() {
+  float radius[3], average = 0;
+
+  magCalibrating = false;
+  for (int i = 0; i < 3; i++) {
+    radius[i] = (magMax[i] - magMin[i]) / 2;
+    if (radius[i] <= 0) return false;
+    average += radius[i] / 3;
+  }
+  for (int i = 0; i < 3; i++) {
+    magCalibration.offset[i] = (magMax[i] + magMin[i]) / 2;
+    magCalibration.scale[i] = average / radius[i];
+  }
+  fusionReset();
+  return true;
+}
+
+void magCalibrationSave() {
+  settings.putBytes("magCal", &magCalibration, sizeof(magCalibration));
+}
+
+void magCalibrationLoad() {
+  if (settings.isKey("magCal"))
+    settings.getBytes("magCal", &magCalibration, sizeof(magCalibration));
+}
+
+void magCalibrationShow(Print &out) {
+  out.printf("Hard iron offsets: %.1f %.1f %.1f\n", magCalibration.offset[0], magCalibration.offset[1], magCalibration.offset[2]);
+  out.printf("Soft iron scales: %.3f %.3f %.3f\n", magCalibration.scale[0], magCalibration.scale[1], magCalibration.scale[2]);
+}
+
+/*
+ * Source selection and the Fusion task
+ */
+
+void setHeadingSource(HeadingSource source) {
+  TaskConfig *task = findTask("Fusion");
+
+  if (source == headingSource) return;
+  if (source == SOURCE_FUSION) fusionReset();
+  headingSource = source;
+  if (source == SOURCE_FUSION && task != NULL) xTaskNotifyGive(task->handle);
+}
+
+void fusion(void *pvParameters) {
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+  uint8_t buf[FUSION_RAW_BYTES];
+  float raw[9];
+
+  for (;;) {
+    //Sleep until our heading is wanted
+    if (headingSource != SOURCE_FUSION && !magCalibrating) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      xLastWakeTime = xTaskGetTickCount();
+    }
+
+    uint32_t start = ESP.getCycleCount();
+    if (cmpsReadRegisters(FUSION_RAW_START, buf, FUSION_RAW_BYTES)) {
+      for (int i = 0; i < 9; i++) raw[i] = (int16_t)((buf[2 * i] << 8) | buf[2 * i + 1]);
+      if (magCalibrating) {
+        for (int i = 0; i < 3; i++) {
+          if (raw[i] < magMin[i]) magMin[i] = raw[i];
+          if (raw[i] > magMax[i]) magMax[i] = raw[i];
+        }
+      }
+      for (int i = 0; i < 3; i++) raw[i] = (raw[i] - magCalibration.offset[i]) * magCalibration.scale[i];
+
+      if (fusionSettle == 0) fusionInit(raw[3], raw[4], raw[5], raw[0], raw[1], raw[2]);
+      const float gyroRad = gyroScale * DEG_TO_RAD;
+      mahonyUpdate(raw[6] * gyroRad, raw[7] * gyroRad, raw[8] * gyroRad, raw[3], raw[4], raw[5],
+                   raw[0], raw[1], raw[2], FUSION_PERIOD_MS / 1000.0f);
+      fusionHeading = fusionYaw();
+      fusionUpdatedMs = millis();
+      fusionErrorRun = 0;
+      if (fusionSettle < FUSION_SETTLE_UPDATES) fusionSettle++;
+      else fusionValid = true;
+    } else {
+      fusionErrors++;
+      if (++fusionErrorRun >= FUSION_MAX_ERRORS && fusionSettle > 0) fusionReset();
+    }
+
+    fusionCyclesLast = ESP.getCycleCount() - start;
+    if (fusionCyclesLast > fusionCyclesMax) fusionCyclesMax = fusionCyclesLast;
+    fusionCyclesTotal += fusionCyclesLast;
+    fusionUpdates++;
+
+    waitForNextPeriod(pvParameters, &xLastWakeTime);
+  }
+}
+
+//The fusion heading is settled and up to date. Called by the Heading task for every sample
+inline bool fusionUsable() {
+  uint32_t updated = fusionUpdatedMs;   //before millis(), or an update in between would look stale
+  return fusionValid && millis() - updated <= FUSION_STALE_MS;
+}
+
+//Average share of the update period used by one update (including the I2C read)
+float fusionBudgetPercent() {
+  if (fusionUpdates == 0) return 0;
+  float cyclesPerPeriod = getCpuFrequencyMhz() * 1000.0f * FUSION_PERIOD_MS;
+  return 100.0f * fusionCyclesTotal / fusionUpdates / cyclesPerPeriod;
+}
+
+void fusionStatus(Print &out) {
+  out.printf("Heading source: %s\n", headingSourceNames[headingSource]);
+  out.printf("Fusion heading: %.1f (%s)\n", fusionHeading, fusionValid ? "valid" : "settling");
+  out.printf("Updates: %u, read errors: %u\n", fusionUpdates, fusionErrors);
+  out.printf("Cycles per update: last %u, max %u, %.2f%% of the %dms budget\n",
+             fusionCyclesLast, fusionCyclesMax, fusionBudgetPercent(), FUSION_PERIOD_MS);
+  magCalibrationShow(out);
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _HEADING_H
+#define _HEADING_H
+/*
+ * The latest heading sample
+ *
+ * The Heading task publishes every sample here as one snapshot, so the tasks on the network
+ * core (Signal K, the history) never see the heading from one sample with the rate of turn
+ * from the next. Copying it in or out is a few words under a spinlock. The heading, rate and
+ * attitude are those of the last good sample; status says whether the latest one was good.
+ */
+
+#include "Cmps14.h"
+
+struct HeadingSnapshot {
+  uint32_t sequence;             //incremented by every sample
+  SampleStatus status;
+  uint16_t heading;              //boat heading, degrees magnetic
+  float rateOfTurn;              //degrees per second, positive to starboard
+  int8_t pitch, roll;            //degrees
+  uint8_t calibration;           //CMPS14 calibration register
+  uint32_t sampledUs;            //micros() of the last good sample
+};
+
+HeadingSnapshot headingShared;
+portMUX_TYPE headingMux = portMUX_INITIALIZER_UNLOCKED;
+
+void headingPublish(const HeadingSnapshot *s) {
+  portENTER_CRITICAL(&headingMux);
+  uint32_t sequence = headingShared.sequence + 1;
+  headingShared = *s;
+  headingShared.sequence = sequence;
+  portEXIT_CRITICAL(&headingMux);
+}
+
+void headingLatest(HeadingSnapshot *s) {
+  portENTER_CRITICAL(&headingMux);
+  *s = headingShared;
+  portEXIT_CRITICAL(&headingMux);
+}
+
+#endif
@@ -0,0 +1,449 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+/*
+ * Heading history
+ *
+ * Once a second the History task adds a sample - boat heading, rate of turn, pitch, roll and
+ * the four CMPS14 calibration levels - to two stores in RAM, so the web app can show a trend
+ * and we can look back at what happened during an incident.
+ *
+ * The 1Hz samples go into a ring of HISTORY_BLOCKS blocks. Like the recorder (Recorder.h) a
+ * block starts with one sample in full and the rest are differences from the sample before,
+ * here behind a tag byte with one bit per field that changed, each change a zigzag varint.
+ * A sample the same as the one before costs nothing more than a run count. Samples are a
+ * second apart, so only the block start carries a time - a gap starts a new block. The
+ * oldest block is dropped whole when the ring is full.
+ *
+ * How far back the 1Hz samples go depends on the boat. In harbour (heading moving a degree
+ * now and then) a day of samples takes about 22KB and fits. At sea every field changes every
+ * second, a sample is about 4 bytes and the ring holds an hour and a half. That is short of
+ * the 24 hours at 1Hz we set out to keep, and no lossless code gets there: at sea the deltas
+ * carry about 11 bits of information a second (roll alone is over 4), over 100KB a day. Even
+ * with pitch and roll cut to 5 degree steps it is over 50KB. So 24 hours is covered by the
+ * 2 minute buckets below, and the 1Hz detail by however much the ring holds; historyStatus()
+ * says how many hours that is at the moment.
+ *
+ * Alongside, each sample is added to HISTORY_LEVELS rings of min/mean/max buckets (10s for an
+ * hour, 2 minutes and 30 minutes for a day) so that a query never has to look at more than a
+ * few hundred buckets whatever window it covers. The heading is circular: its mean is the
+ * vector mean, its min and max are the extremes anticlockwise and clockwise of that, so they
+ * can read e.g. min 355 max 005.
+ *
+ * historyJson() answers a query from the coarsest store whose buckets are no wider than the
+ * requested step and that still goes back far enough. Only steps under 10 seconds are served
+ * from the 1Hz samples. Times are seconds since boot.
+ */
+
+#include "Recorder.h"      //putVarint(), getVarint(), zigzag()
+
+enum HistoryField { HIST_HEADING, HIST_RATE, HIST_PITCH, HIST_ROLL,
+                    HIST_CAL_SYSTEM, HIST_CAL_GYRO, HIST_CAL_ACCEL, HIST_CAL_MAG, HISTORY_FIELDS };
+const char * const historyFieldNames[HISTORY_FIELDS] = { "heading", "rate", "pitch", "roll",
+                                                         "calSystem", "calGyro", "calAccel", "calMag" };
+
+struct HistorySample {
+  uint32_t t;                        //seconds since boot
+  int16_t field[HISTORY_FIELDS];     //degrees, tenths of a degree per second for the rate, levels 0-3
+};
+
+//The CMPS14 calibration register, two bits per sensor
+void historyCalibration(HistorySample *s, uint8_t calibration) {
+  for (int i = 0; i < 4; i++) s->field[HIST_CAL_SYSTEM + i] = (calibration >> (6 - 2 * i)) & 3;
+}
+
+/*
+ * 1Hz samples
+ */
+
+#define HISTORY_BLOCK_SIZE 256
+#define HISTORY_BLOCKS 96
+#define HISTORY_BLOCK_DATA (HISTORY_BLOCK_SIZE - 8 - 2 * HISTORY_FIELDS)
+#define HISTORY_MAX_SAMPLE_BYTES (1 + 3 * HISTORY_FIELDS)   //tag and worst case varints
+#define HISTORY_RUN 0                                        //tag of a run of unchanged samples
+
+struct HistoryBlock {
+  uint32_t start;                    //time of the first sample
+  uint16_t samples;                  //0 if the block is unused
+  uint16_t length;                   //bytes of data used
+  int16_t first[HISTORY_FIELDS];
+  uint8_t data[HISTORY_BLOCK_DATA];
+};
+
+HistoryBlock historyBlocks[HISTORY_BLOCKS];
+int historyHead = 0;                 //block being filled
+bool historyWrapped = false;         //every block has been used
+HistorySample historyLast;           //last sample added
+int historyRunAt = -1;               //offset of the run count in the head block, while in a run
+
+//Heading differences take the short way round
+inline int16_t historyDelta(int field, int16_t from, int16_t to) {
+  int16_t delta = to - from;
+  if (field == HIST_HEADING) {
+    if (delta > 180) delta -= 360;
+    else if (delta <= -180) delta += 360;
+  }
+  return delta;
+}
+
+void historyAppend(const HistorySample *s) {
+  HistoryBlock *b = &historyBlocks[historyHead];
+  uint8_t mask = 0;
+
+  if (b->samples == 0 || s->t != b->start + b->samples || b->length + HISTORY_MAX_SAMPLE_BYTES > HISTORY_BLOCK_DATA) {
+    if (b->samples > 0) {
+      historyHead = (historyHead + 1) % HISTORY_BLOCKS;
+      if (historyHead == 0) historyWrapped = true;
+      b = &historyBlocks[historyHead];
+    }
+    b->start = s->t;
+    b->samples = 1;
+    b->length = 0;
+    memcpy(b->first, s->field, sizeof(b->first));
+    historyLast = *s;
+    historyRunAt = -1;
+    return;
+  }
+
+  uint8_t *p = b->data + b->length;
+  for (int i = 0; i < HISTORY_FIELDS; i++)
+    if (s->field[i] != historyLast.field[i]) mask |= 1 << i;
+  if (mask == 0) {
+    if (historyRunAt >= 0 && b->data[historyRunAt] < 255) b->data[historyRunAt]++;
+    else {
+      *p++ = HISTORY_RUN;
+      historyRunAt = p - b->data;
+      *p++ = 1;
+    }
+  } else {
+    *p++ = mask;
+    for (int i = 0; i < HISTORY_FIELDS; i++)
+      if (mask & (1 << i)) p = putVarint(p, zigzag(historyDelta(i, historyLast.field[i], s->field[i])));
+    historyRunAt = -1;
+  }
+  b->length = p - b->data;
+  b->samples++;
+  historyLast = *s;
+}
+
+//Reads the samples in a block back in order
+struct HistoryReader {
+  const HistoryBlock *block;
+  const uint8_t *p, *end;
+  HistorySample sample;
+  uint16_t read;
+  uint8_t run;                       //unchanged samples still to come
+};
+
+void historyReaderStart(HistoryReader *r, const HistoryBlock *b) {
+  r->block = b;
+  r->p = b->data;
+  r->end = b->data + b->length;
+  r->read = 0;
+  r->run = 0;
+}
+
+bool historyNext(HistoryReader *r) {
+  const HistoryBlock *b = r->block;
+  uint32_t value;
+
+  if (r->read == b->samples) return false;
+  if (r->read == 0) {
+    r->sample.t = b->start;
+    memcpy(r->sample.field, b->first, sizeof(b->first));
+  } else if (r->run > 0) {
+    r->sample.t++;
+    r->run--;
+  } else {
+    if (r->p >= r->end) return false;
+    uint8_t mask = *r->p++;
+    r->sample.t++;
+    if (mask == HISTORY_RUN) {
+      if (r->p >= r->end || *r->p == 0) return false;
+      r->run = *r->p++ - 1;
+    }
+    for (int i = 0; i < HISTORY_FIELDS; i++) {
+      if (!(mask & (1 << i))) continue;
+      if ((r->p = getVarint(r->p, r->end, &value)) == NULL) return false;
+      int16_t v = r->sample.field[i] + unzigzag(value);
+      r->sample.field[i] = i == HIST_HEADING ? MOD360(v) : v;
+    }
+  }
+  r->read++;
+  return true;
+}
+
+/*
+ * Aggregates
+ */
+
+//Running min/mean/max of the fields. The heading min and max are kept as offsets from the
+//first heading added, so a bucket that crosses north still comes out right
+struct HistoryTotal {
+  uint32_t count;
+  int16_t min[HISTORY_FIELDS], max[HISTORY_FIELDS];
+  float sum[HISTORY_FIELDS];
+  float headingSin, headingCos;
+  int16_t headingRef;
+};
+
+void historyTotalAdd(HistoryTotal *t, uint32_t count, const int16_t *min, const int16_t *mean, const int16_t *max) {
+  if (count == 0) return;
+  if (t->count == 0) {
+    memset(t, 0, sizeof(*t));
+    t->headingRef = mean[HIST_HEADING];
+    for (int i = 0; i < HISTORY_FIELDS; i++) {
+      t->min[i] = INT16_MAX;
+      t->max[i] = INT16_MIN;
+    }
+  }
+  for (int i = 0; i < HISTORY_FIELDS; i++) {
+    int16_t lo = min[i], hi = max[i];
+    if (i == HIST_HEADING) {
+      lo = historyDelta(i, t->headingRef, lo);
+      hi = historyDelta(i, t->headingRef, hi);
+      t->headingSin += count * sinf(mean[i] * DEG_TO_RAD);
+      t->headingCos += count * cosf(mean[i] * DEG_TO_RAD);
+    } else t->sum[i] += (float)count * mean[i];
+    if (lo < t->min[i]) t->min[i] = lo;
+    if (hi > t->max[i]) t->max[i] = hi;
+  }
+  t->count += count;
+}
+
+inline void historyTotalSample(HistoryTotal *t, const HistorySample *s) {
+  historyTotalAdd(t, 1, s->field, s->field, s->field);
+}
+
+void historyTotalResult(const HistoryTotal *t, int16_t *min, int16_t *mean, int16_t *max) {
+  for (int i = 0; i < HISTORY_FIELDS; i++) {
+    if (i == HIST_HEADING) {
+      min[i] = MOD360(t->headingRef + t->min[i]);
+      max[i] = MOD360(t->headingRef + t->max[i]);
+      mean[i] = MOD360((int)lroundf(atan2f(t->headingSin, t->headingCos) * RAD_TO_DEG));
+    } else {
+      min[i] = t->min[i];
+      max[i] = t->max[i];
+      mean[i] = lroundf(t->sum[i] / t->count);
+    }
+  }
+}
+
+//A closed bucket, packed - 24 bytes
+struct HistoryBucket {
+  uint16_t count;                    //0 if there were no samples
+  int16_t heading[3];                //min, mean, max
+  int16_t rate[3];
+  int8_t pitch[3], roll[3];
+  uint8_t calibration[3];            //the four levels packed like the CMPS14 register
+};
+
+void historyBucketPack(HistoryBucket *b, const HistoryTotal *t) {
+  int16_t v[3][HISTORY_FIELDS];
+
+  historyTotalResult(t, v[0], v[1], v[2]);
+  b->count = t->count;
+  for (int j = 0; j < 3; j++) {
+    b->heading[j] = v[j][HIST_HEADING];
+    b->rate[j] = v[j][HIST_RATE];
+    b->pitch[j] = constrain(v[j][HIST_PITCH], -128, 127);
+    b->roll[j] = constrain(v[j][HIST_ROLL], -128, 127);
+    b->calibration[j] = 0;
+    for (int i = 0; i < 4; i++) b->calibration[j] |= (v[j][HIST_CAL_SYSTEM + i] & 3) << (6 - 2 * i);
+  }
+}
+
+void historyBucketUnpack(const HistoryBucket *b, int16_t v[3][HISTORY_FIELDS]) {
+  for (int j = 0; j < 3; j++) {
+    v[j][HIST_HEADING] = b->heading[j];
+    v[j][HIST_RATE] = b->rate[j];
+    v[j][HIST_PITCH] = b->pitch[j];
+    v[j][HIST_ROLL] = b->roll[j];
+    for (int i = 0; i < 4; i++) v[j][HIST_CAL_SYSTEM + i] = (b->calibration[j] >> (6 - 2 * i)) & 3;
+  }
+}
+
+#define HISTORY_LEVELS 3
+
+struct HistoryLevel {
+  uint16_t width;                    //seconds per bucket
+  uint16_t buckets;
+  HistoryBucket *bucket;
+  uint32_t open;                     //index (time / width) of the bucket being filled
+  HistoryTotal total;                //what has gone into it so far
+};
+
+HistoryBucket historyBuckets10s[360], historyBuckets2m[720], historyBuckets30m[48];
+HistoryLevel historyLevels[HISTORY_LEVELS] = {
+  { 10,   360, historyBuckets10s },   //an hour
+  { 120,  720, historyBuckets2m },    //a day
+  { 1800, 48,  historyBuckets30m }    //a day, for the long views
+};
+
+void historyLevelAdd(HistoryLevel *l, const HistorySample *s) {
+  uint32_t index = s->t / l->width;
+
+  if (l->total.count > 0 && index != l->open) {
+    historyBucketPack(&l->bucket[l->open % l->buckets], &l->total);
+    //Buckets skipped over - the heading was bad - are empty
+    for (uint32_t i = l->open + 1; i < index && i <= l->open + l->buckets; i++) l->bucket[i % l->buckets].count = 0;
+    l->total.count = 0;
+  }
+  if (l->total.count == 0) l->open = index;
+  historyTotalSample(&l->total, s);
+}
+
+/*
+ * Store and query
+ */
+
+#define HISTORY_MAX_POINTS 500       //buckets in one answer
+
+SemaphoreHandle_t historyLock = NULL;
+uint32_t historySamples = 0;
+
+void historyBegin() {
+  historyLock = xSemaphoreCreateMutex();
+}
+
+//Called by the History task once a second
+void historyAdd(const HistorySample *s) {
+  xSemaphoreTake(historyLock, portMAX_DELAY);
+  historyAppend(s);
+  for (int i = 0; i < HISTORY_LEVELS; i++) historyLevelAdd(&historyLevels[i], s);
+  historySamples++;
+  xSemaphoreGive(historyLock);
+}
+
+//Oldest time a store can answer for - source -1 is the 1Hz samples
+uint32_t historyOldest(int source) {
+  if (source < 0) return historyWrapped ? historyBlocks[(historyHead + 1) % HISTORY_BLOCKS].start : 0;
+  const HistoryLevel *l = &historyLevels[source];
+  return l->open >= l->buckets ? (l->open - l->buckets + 1) * l->width : 0;
+}
+
+//Builds the answer a bucket at a time
+struct HistoryQuery {
+  uint32_t from, step;
+  int32_t current;                   //answer bucket being added to, -1 before the first
+  HistoryTotal total;
+  int points;
+  Print *out;
+};
+
+void historyEmit(HistoryQuery *q) {
+  int16_t v[3][HISTORY_FIELDS];
+  char buff[32];
+
+  if (q->current < 0 || q->total.count == 0) return;
+  historyTotalResult(&q->total, v[0], v[1], v[2]);
+  q->out->printf("%s{\"t\":%u,\"n\":%u", q->points++ > 0 ? "," : "", q->from + q->current * q->step, q->total.count);
+  for (int j = 0; j < 3; j++) {
+    q->out->print(j == 0 ? ",\"min\":[" : j == 1 ? "],\"mean\":[" : "],\"max\":[");
+    for (int i = 0; i < HISTORY_FIELDS; i++) {
+      if (i == HIST_RATE) sprintf(buff, "%s%.1f", i > 0 ? "," : "", v[j][i] / 10.0);
+      else sprintf(buff, "%s%d", i > 0 ? "," : "", v[j][i]);
+      q->out->print(buff);
+    }
+  }
+  q->out->print("]}");
+  q->total.count = 0;
+}
+
+//Add count samples summarised by min/mean/max, starting at time t
+void historyQueryAdd(HistoryQuery *q, uint32_t t, uint32_t count, const int16_t *min, const int16_t *mean, const int16_t *max) {
+  int32_t k = (t - q->from) / q->step;
+  if (k != q->current) {
+    historyEmit(q);
+    q->current = k;
+  }
+  historyTotalAdd(&q->total, count, min, mean, max);
+}
+
+//Summarise [from, to) in buckets of about step seconds, as JSON
+void historyJson(uint32_t from, uint32_t to, uint32_t step, Print &out) {
+  HistoryQuery q;
+  int source = -1;
+  char buff[96];
+
+  if (step < 1) step = 1;
+  if (to <= from) to = from + 1;
+  if ((to - from) / step > HISTORY_MAX_POINTS) step = (to - from + HISTORY_MAX_POINTS - 1) / HISTORY_MAX_POINTS;
+
+  xSemaphoreTake(historyLock, portMAX_DELAY);
+  //The coarsest store with buckets no wider than step that goes back far enough
+  for (int l = 0; l < HISTORY_LEVELS; l++)
+    if (historyLevels[l].width <= step || historyOldest(source) > from) source = l;
+  if (source >= 0) {
+    uint32_t width = historyLevels[source].width;
+    step = (step + width - 1) / width * width;
+    from = from / width * width;
+  }
+
+  q.from = from;
+  q.step = step;
+  q.current = -1;
+  q.total.count = 0;
+  q.points = 0;
+  q.out = &out;
+  sprintf(buff, "{ \"result\":\"OK\",\"now\":%u,\"from\":%u,\"step\":%u,\"fields\":[", historyLast.t, from, step);
+  out.print(buff);
+  for (int i = 0; i < HISTORY_FIELDS; i++) out.printf("%s\"%s\"", i > 0 ? "," : "", historyFieldNames[i]);
+  out.print("],\"buckets\":[");
+
+  if (source < 0) {
+    HistoryReader r;
+    int first = historyWrapped ? (historyHead + 1) % HISTORY_BLOCKS : 0;
+    for (int n = 0; n < HISTORY_BLOCKS; n++) {
+      const HistoryBlock *b = &historyBlocks[(first + n) % HISTORY_BLOCKS];
+      if (b->samples == 0 || b->start + b->samples <= from || b->start >= to) continue;
+      historyReaderStart(&r, b);
+      while (historyNext(&r))
+        if (r.sample.t >= from && r.sample.t < to)
+          historyQueryAdd(&q, r.sample.t, 1, r.sample.field, r.sample.field, r.sample.field);
+    }
+  } else {
+    HistoryLevel *l = &historyLevels[source];
+    int16_t v[3][HISTORY_FIELDS];
+    uint32_t i = max(from / l->width, historyOldest(source) / l->width);
+    for (; i * l->width < to && i <= l->open; i++) {
+      if (i == l->open) {
+        if (l->total.count == 0) continue;
+        historyTotalResult(&l->total, v[0], v[1], v[2]);
+        historyQueryAdd(&q, i * l->width, l->total.count, v[0], v[1], v[2]);
+      } else {
+        const HistoryBucket *b = &l->bucket[i % l->buckets];
+        if (b->count == 0) continue;
+        historyBucketUnpack(b, v);
+        historyQueryAdd(&q, i * l->width, b->count, v[0], v[1], v[2]);
+      }
+    }
+  }
+  historyEmit(&q);
+  xSemaphoreGive(historyLock);
+  out.print("] }\n");
+}
+
+//Memory used and how far back each store goes
+void historyStatus(Print &out) {
+  uint32_t bytes = 0, samples = 0;
+
+  xSemaphoreTake(historyLock, portMAX_DELAY);
+  for (int i = 0; i < HISTORY_BLOCKS; i++) {
+    bytes += historyBlocks[i].samples > 0 ? HISTORY_BLOCK_SIZE - HISTORY_BLOCK_DATA + historyBlocks[i].length : 0;
+    samples += historyBlocks[i].samples;
+  }
+  out.printf("1Hz samples: %u in %u bytes (%.2f bytes each), back to %us, ring %u bytes\n", samples, bytes,
+             samples > 0 ? (float)bytes / samples : 0.0, historyOldest(-1), (unsigned)sizeof(historyBlocks));
+  //At the current rate, how long a full ring lasts
+  if (samples > 0)
+    out.printf("1Hz ring holds %.1f hours at this rate\n", sizeof(historyBlocks) * (float)samples / bytes / 3600);
+  for (int i = 0; i < HISTORY_LEVELS; i++) {
+    HistoryLevel *l = &historyLevels[i];
+    out.printf("%us buckets: %u, %u bytes, back to %us\n", l->width, l->buckets, l->buckets * (unsigned)sizeof(HistoryBucket),
+               historyOldest(i));
+  }
+  out.printf("Now %us, %u samples since boot\n", historyLast.t, historySamples);
+  xSemaphoreGive(historyLock);
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef _JSON_WRITER_H
+#define _JSON_WRITER_H
+/*
+ * Streaming JSON writer
+ *
+ * Writes into a buffer the caller owns - usually a static one - so building a message costs
+ * no allocation and no String or std::string. Members and elements are written in order and
+ * the commas between them are put in automatically. A value encoded earlier can be dropped
+ * in whole with jsonFragment(), which is how the same value goes to several clients while
+ * only being encoded once. If the buffer fills the writer stops and sets overflow, and the
+ * caller should throw the message away rather than send half of it.
+ */
+
+#define JSON_MAX_DEPTH 8
+
+struct JsonWriter {
+  char *buf;
+  size_t size, length;
+  bool overflow;
+  uint8_t depth;
+  bool first[JSON_MAX_DEPTH];      //nothing written yet at this level
+  bool afterKey;                   //the next value belongs to a key, so no comma
+};
+
+void jsonBegin(JsonWriter *w, char *buf, size_t size) {
+  w->buf = buf;
+  w->size = size;
+  w->length = 0;
+  w->overflow = false;
+  w->depth = 0;
+  w->afterKey = false;
+}
+
+void jsonRaw(JsonWriter *w, const char *s, size_t n) {
+  if (w->overflow || w->length + n >= w->size) {
+    w->overflow = true;
+    return;
+  }
+  memcpy(w->buf + w->length, s, n);
+  w->length += n;
+  w->buf[w->length] = '\0';
+}
+
+//Comma before every value but the first at each level
+void jsonSeparator(JsonWriter *w) {
+  if (w->afterKey) {
+    w->afterKey = false;
+    return;
+  }
+  if (w->depth == 0) return;
+  if (!w->first[w->depth - 1]) jsonRaw(w, ",", 1);
+  w->first[w->depth - 1] = false;
+}
+
+void jsonOpen(JsonWriter *w, char bracket) {
+  jsonSeparator(w);
+  jsonRaw(w, &bracket, 1);
+  if (w->depth == JSON_MAX_DEPTH) {
+    w->overflow = true;
+    return;
+  }
+  w->first[w->depth++] = true;
+}
+
+void jsonClose(JsonWriter *w, char bracket) {
+  if (w->depth > 0) w->depth--;
+  jsonRaw(w, &bracket, 1);
+}
+
+inline void jsonObject(JsonWriter *w) { jsonOpen(w, '{'); }
+inline void jsonEndObject(JsonWriter *w) { jsonClose(w, '}'); }
+inline void jsonArray(JsonWriter *w) { jsonOpen(w, '['); }
+inline void jsonEndArray(JsonWriter *w) { jsonClose(w, ']'); }
+
+void jsonQuoted(JsonWriter *w, const char *s) {
+  jsonRaw(w, "\"", 1);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') jsonRaw(w, "\\", 1);
+    if ((uint8_t)*s >= ' ') jsonRaw(w, s, 1);
+  }
+  jsonRaw(w, "\"", 1);
+}
+
+void jsonKey(JsonWriter *w, const char *key) {
+  jsonSeparator(w);
+  jsonQuoted(w, key);
+  jsonRaw(w, ":", 1);
+  w->afterKey = true;
+}
+
+void jsonString(JsonWriter *w, const char *s) {
+  jsonSeparator(w);
+  jsonQuoted(w, s);
+}
+
+void jsonNumber(JsonWriter *w, float value, int decimals) {
+  char buff[24];
+  jsonSeparator(w);
+  if (isnan(value) || isinf(value)) jsonRaw(w, "null", 4);
+  else jsonRaw(w, buff, snprintf(buff, sizeof(buff), "%.*f", decimals, value));
+}
+
+void jsonInt(JsonWriter *w, long value) {
+  char buff[16];
+  jsonSeparator(w);
+  jsonRaw(w, buff, snprintf(buff, sizeof(buff), "%ld", value));
+}
+
+//A value encoded beforehand by another writer
+void jsonFragment(JsonWriter *w, const char *json, size_t n) {
+  jsonSeparator(w);
+  jsonRaw(w, json, n);
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef _MEMORY_H
+#define _MEMORY_H
+/*
+ * Memory plan
+ *
+ * Everything our own code needs is sized at compile time: NMEA clients come from a fixed
+ * pool (telnetClientPool) as do the console sessions, each client slot has its own NMEA
+ * receive buffer, and the http handlers share one scratch arena (httpScratch) instead of
+ * putting buffers on the stack or the heap. Constant tables are const so they stay in
+ * flash with the string literals.
+ *
+ * The heap is still used while booting (task stacks, the http server's nodes) and by the
+ * WiFi, lwIP and http server libraries - accepting a connection allocates inside WiFiClient
+ * for instance - but not by the sensor and output path once we are running.
+ *
+ * Define HEAP_CHECK (top of the sketch) to check that. C++ allocations (new, std::string,
+ * String) are counted, and once the unit has been up for HEAP_CHECK_ARM_MS one made by the
+ * acquisition or output tasks stops the firmware, so the panic backtrace shows where it
+ * came from. C allocations (malloc, calloc, strdup, and the libraries underneath) are
+ * caught the same way through the IDF heap hooks, which need a core built with
+ * CONFIG_HEAP_USE_HOOKS - without it only C++ allocations are seen, and the build says so.
+ *
+ * The heap block counts and fragmentation go into the metrics either way.
+ */
+
+#include <esp_heap_caps.h>
+#include "Tasks.h"
+
+#define HEAP_CHECK_ARM_MS 30000   //long enough for the tasks to have settled
+#define HEAP_SETTLE_MS 30000      //when the block count baseline is taken
+
+//Tasks that must not allocate once running
+const char * const heapCheckTasks[] = { "updateHDG", "Heading", "Encode", "Output", "Fusion", "SeaSample", "SeaState" };
+#define HEAP_CHECK_TASKS (sizeof(heapCheckTasks) / sizeof(heapCheckTasks[0]))
+
+volatile uint32_t heapAllocs = 0;      //C++ allocations since boot, when counting
+
+#if defined(HEAP_CHECK) || defined(BENCHMARKS)
+
+#ifdef HEAP_CHECK
+TaskHandle_t heapCheckHandles[HEAP_CHECK_TASKS];
+volatile bool heapCheckArmed = false;
+
+//Called for every allocation - nothing in here may allocate
+void heapCheckAllocation(size_t size) {
+  if (!heapCheckArmed) {
+    if (millis() < HEAP_CHECK_ARM_MS) return;
+    for (unsigned i = 0; i < HEAP_CHECK_TASKS; i++) {
+      TaskConfig *t = findTask(heapCheckTasks[i]);
+      heapCheckHandles[i] = t != NULL ? t->handle : NULL;
+    }
+    heapCheckArmed = true;
+  }
+  TaskHandle_t current = xTaskGetCurrentTaskHandle();
+  for (unsigned i = 0; i < HEAP_CHECK_TASKS; i++) {
+    if (current != heapCheckHandles[i]) continue;
+    ets_printf("HEAP_CHECK: task %s allocated %u bytes\n", heapCheckTasks[i], (unsigned)size);
+    abort();
+  }
+}
+
+#if CONFIG_HEAP_USE_HOOKS
+//Called by the IDF allocator for every heap_caps allocation, malloc() included
+extern "C" void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps) {
+  heapCheckAllocation(size);
+}
+#else
+#warning HEAP_CHECK only sees C++ allocations - malloc() needs a core built with CONFIG_HEAP_USE_HOOKS
+#endif
+#endif
+
+void *operator new(size_t size) {
+  heapAllocs++;
+#ifdef HEAP_CHECK
+  heapCheckAllocation(size);
+#endif
+  void *p = malloc(size);
+  if (p == NULL) abort();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept {
+  free(p);
+}
+
+#endif //HEAP_CHECK || BENCHMARKS
+
+//Heap fragmentation for the metrics. The allocated block count is compared with a
+//baseline taken once the unit has settled - if it keeps growing something is leaking
+struct HeapStats {
+  uint32_t freeBytes;
+  uint32_t largestFreeBlock;
+  uint32_t allocatedBlocks;
+  uint32_t freeBlocks;
+  float fragmentation;             //0 = all the free memory in one block
+  int32_t blockGrowth;             //allocated blocks since the baseline
+};
+
+uint32_t heapBaselineBlocks = 0;
+
+void heapStats(HeapStats *stats) {
+  multi_heap_info_t info;
+
+  heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+  stats->freeBytes = info.total_free_bytes;
+  stats->largestFreeBlock = info.largest_free_block;
+  stats->allocatedBlocks = info.allocated_blocks;
+  stats->freeBlocks = info.free_blocks;
+  stats->fragmentation = info.total_free_bytes > 0 ? 1.0 - (float)info.largest_free_block / info.total_free_bytes : 0;
+  if (heapBaselineBlocks == 0 && millis() > HEAP_SETTLE_MS) heapBaselineBlocks = info.allocated_blocks;
+  stats->blockGrowth = heapBaselineBlocks > 0 ? (int32_t)(info.allocated_blocks - heapBaselineBlocks) : 0;
+}
+
+#endif
@@ -0,0 +1,456 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+/*
+ * Runtime metrics
+ *
+ * Everything we need to size the task stacks and spot regressions in the field.
+ * writeMetrics() prints the lot in Prometheus text format to any Print object, so the
+ * same output is served by the http /metrics node and by the telnet "stats" command.
+ *
+ * The load figures show how the unit copes with several chartplotters and a busy web
+ * app: for each NMEA client the throughput, messages dropped because it is not reading
+ * its socket, and the longest gap between messages it was sent; the spread of the gaps
+ * between standard NMEA batches (as a multiple of the output period); the latency from a
+ * heading being read from the CMPS14 to it going out on the network; the time each stage
+ * of the pipeline takes and how deep its queue gets; and the time taken to serve the polled
+ * web app requests. Subsystems left out of the build (see BuildProfile.h) have no metrics,
+ * and the build profile and its flash and RAM footprint are given first.
+ */
+
+#include "BuildProfile.h"
+#include "Tasks.h"
+#include "Power.h"
+#include "Fusion.h"
+#include "Wmm.h"
+#include "NmeaInput.h"
+#include "Memory.h"
+#include "Boot.h"
+#include "NmeaSerial.h"
+#include "NmeaProfiles.h"
+#if FEATURE_SIGNALK
+#include "SignalK.h"
+#endif
+#include "Pipeline.h"
+#if FEATURE_SEA_STATE
+#include "SeaState.h"
+#endif
+
+//I2C error counters and the bus state live with the CMPS14 driver, one set for each sensor
+#include "Cmps14.h"
+#include "Vote.h"
+
+//NMEA output counters - updated by the Network and Output tasks
+uint32_t nmeaClientCount = 0;
+uint32_t nmeaBytesSent = 0;
+
+struct NmeaClientStats {
+  uint32_t connectedAt;    //millis()
+  uint32_t bytesSent;
+  uint32_t messagesSent;
+  uint32_t drops;          //socket buffer full, message not sent
+  uint32_t partials;       //only part of a message went, the rest was held for the next send
+  uint32_t lastSentAt;
+  uint32_t maxGapMs;
+};
+
+NmeaClientStats nmeaClientStats[MAX_TCP_CLIENTS];
+
+//Histogram bucket upper limits - the last bucket is everything above
+#define GAP_BUCKETS 6
+const float gapBucketLimits[GAP_BUCKETS - 1] = { 0.9, 1.1, 1.5, 2.0, 4.0 };   //multiples of the Output period
+#define LATENCY_BUCKETS 6
+const uint32_t latencyBucketUs[LATENCY_BUCKETS - 1] = { 1000, 5000, 20000, 50000, 100000 };
+
+uint32_t outputGaps[GAP_BUCKETS];
+float outputGapSum = 0;
+uint32_t latencies[LATENCY_BUCKETS];
+uint64_t latencySumUs = 0;
+uint32_t latencyMaxUs = 0;
+volatile uint32_t headingSampledUs = 0;   //micros() when the last good heading was read
+uint32_t sampleStatusCounts[NUM_SAMPLE_STATUS];   //updateHeading() samples by status
+
+enum HttpEndpoint { HTTP_GET_HEADING, HTTP_GET_CAL_STATUS, NUM_HTTP_ENDPOINTS };
+
+struct HttpEndpointStats {
+  const char *path;
+  uint32_t requests;
+  uint64_t totalUs;
+  uint32_t maxUs;
+};
+
+HttpEndpointStats httpStats[NUM_HTTP_ENDPOINTS] = { { "/getHeading" }, { "/getCalStatus" } };
+
+void nmeaClientStatsReset(int i) {
+  memset(&nmeaClientStats[i], 0, sizeof(NmeaClientStats));
+  nmeaClientStats[i].connectedAt = nmeaClientStats[i].lastSentAt = millis();
+}
+
+//Output task - a standard profile batch, gapMs after the last one
+void outputGapSample(uint32_t gapMs, uint32_t periodMs) {
+  float ratio = (float)gapMs / periodMs;
+  int b = 0;
+  while (b < GAP_BUCKETS - 1 && ratio > gapBucketLimits[b]) b++;
+  outputGaps[b]++;
+  outputGapSum += ratio;
+}
+
+//Output task - the heading it is about to send was read latencyUs ago
+void latencySample(uint32_t latencyUs) {
+  int b = 0;
+  while (b < LATENCY_BUCKETS - 1 && latencyUs > latencyBucketUs[b]) b++;
+  latencies[b]++;
+  latencySumUs += latencyUs;
+  if (latencyUs > latencyMaxUs) latencyMaxUs = latencyUs;
+}
+
+//Called at the end of a timed web request, with micros() from the start
+void httpRequestDone(HttpEndpoint endpoint, uint32_t startUs) {
+  uint32_t us = micros() - startUs;
+  httpStats[endpoint].requests++;
+  httpStats[endpoint].totalUs += us;
+  if (us > httpStats[endpoint].maxUs) httpStats[endpoint].maxUs = us;
+}
+
+void writeMetrics(Print &out) {
+  BuildFootprint build;
+  buildFootprint(&build);
+  out.println("# HELP ecompass_build_info Build profile the firmware was compiled with");
+  out.println("# TYPE ecompass_build_info gauge");
+  out.printf("ecompass_build_info{profile=\"%s\",version=\"%s\"} 1\n", BUILD_PROFILE_NAME, VERSION);
+  out.println("# TYPE ecompass_build_feature gauge");
+  for (unsigned i = 0; i < NUM_BUILD_FEATURES; i++)
+    out.printf("ecompass_build_feature{feature=\"%s\"} %d\n", buildFeatures[i].name, buildFeatures[i].enabled ? 1 : 0);
+  out.println("# HELP ecompass_build_flash_bytes Size of the firmware image");
+  out.println("# TYPE ecompass_build_flash_bytes gauge");
+  out.printf("ecompass_build_flash_bytes %u\n", build.flashBytes);
+  out.println("# HELP ecompass_build_static_ram_bytes Globals in internal RAM, initialised and zeroed");
+  out.println("# TYPE ecompass_build_static_ram_bytes gauge");
+  out.printf("ecompass_build_static_ram_bytes{section=\"data\"} %u\n", build.dataBytes);
+  out.printf("ecompass_build_static_ram_bytes{section=\"bss\"} %u\n", build.bssBytes);
+  out.println("# HELP ecompass_build_task_stack_bytes Stacks of the running tasks from the task table");
+  out.println("# TYPE ecompass_build_task_stack_bytes gauge");
+  out.printf("ecompass_build_task_stack_bytes %u\n", build.stackBytes);
+
+  out.println("# HELP ecompass_task_cpu_percent CPU used by each task over the last second, percent of one core");
+  out.println("# TYPE ecompass_task_cpu_percent gauge");
+  for (int i = 0; i < numTaskSamples; i++)
+    out.printf("ecompass_task_cpu_percent{task=\"%s\"} %.2f\n", taskSamples[i].name, taskSamples[i].cpuPercent);
+
+  out.println("# HELP ecompass_task_stack_free_bytes Lowest amount of free stack seen for each task");
+  out.println("# TYPE ecompass_task_stack_free_bytes gauge");
+  for (int i = 0; i < numTaskSamples; i++)
+    out.printf("ecompass_task_stack_free_bytes{task=\"%s\"} %u\n", taskSamples[i].name, taskSamples[i].stackFree);
+
+  out.println("# HELP ecompass_task_stack_size_bytes Configured stack size of our own tasks");
+  out.println("# TYPE ecompass_task_stack_size_bytes gauge");
+  for (int i = 0; i < numTasks; i++)
+    out.printf("ecompass_task_stack_size_bytes{task=\"%s\"} %u\n", taskTable[i].name, taskTable[i].stackSize);
+
+  out.println("# HELP ecompass_task_overruns_total Periods where a periodic task missed its deadline");
+  out.println("# TYPE ecompass_task_overruns_total counter");
+  for (int i = 0; i < numTasks; i++) {
+    if (taskTable[i].periodMs > 0)
+      out.printf("ecompass_task_overruns_total{task=\"%s\"} %u\n", taskTable[i].name, taskTable[i].overruns);
+  }
+  //A gauge of its own, as the power mode changes some periods (see Power.h)
+  out.println("# HELP ecompass_task_period_ms Current period of each periodic task");
+  out.println("# TYPE ecompass_task_period_ms gauge");
+  for (int i = 0; i < numTasks; i++) {
+    if (taskTable[i].periodMs > 0)
+      out.printf("ecompass_task_period_ms{task=\"%s\"} %u\n", taskTable[i].name, taskTable[i].periodMs);
+  }
+
+  out.println("# HELP ecompass_core_idle_percent Idle time of each core over the last second");
+  out.println("# TYPE ecompass_core_idle_percent gauge");
+  out.printf("ecompass_core_idle_percent{core=\"0\"} %.2f\n", coreIdlePercent[0]);
+  out.printf("ecompass_core_idle_percent{core=\"1\"} %.2f\n", coreIdlePercent[1]);
+
+  HeapStats heap;
+  heapStats(&heap);
+  out.println("# TYPE ecompass_heap_free_bytes gauge");
+  out.printf("ecompass_heap_free_bytes %u\n", heap.freeBytes);
+  out.println("# TYPE ecompass_heap_min_free_bytes gauge");
+  out.printf("ecompass_heap_min_free_bytes %u\n", ESP.getMinFreeHeap());
+  out.println("# TYPE ecompass_heap_largest_free_block_bytes gauge");
+  out.printf("ecompass_heap_largest_free_block_bytes %u\n", heap.largestFreeBlock);
+  out.println("# TYPE ecompass_heap_blocks gauge");
+  out.printf("ecompass_heap_blocks{state=\"allocated\"} %u\n", heap.allocatedBlocks);
+  out.printf("ecompass_heap_blocks{state=\"free\"} %u\n", heap.freeBlocks);
+  out.println("# HELP ecompass_heap_fragmentation_ratio 1 - largest free block / free bytes");
+  out.println("# TYPE ecompass_heap_fragmentation_ratio gauge");
+  out.printf("ecompass_heap_fragmentation_ratio %.3f\n", heap.fragmentation);
+  out.println("# HELP ecompass_heap_block_growth Allocated blocks gained since the unit settled - steady growth is a leak");
+  out.println("# TYPE ecompass_heap_block_growth gauge");
+  out.printf("ecompass_heap_block_growth %d\n", heap.blockGrowth);
+
+  out.println("# HELP ecompass_i2c_errors_total Failed transactions with each CMPS14");
+  out.println("# TYPE ecompass_i2c_errors_total counter");
+  for (int i = 0; i < cmpsCount; i++) {
+    Cmps14 *c = &cmpsSensors[i];
+    out.printf("ecompass_i2c_errors_total{sensor=\"%s\",type=\"nack\"} %u\n", c->name, c->nackErrors);
+    out.printf("ecompass_i2c_errors_total{sensor=\"%s\",type=\"short_read\"} %u\n", c->name, c->shortReads);
+    out.printf("ecompass_i2c_errors_total{sensor=\"%s\",type=\"stale\"} %u\n", c->name, c->staleReads);
+    out.printf("ecompass_i2c_errors_total{sensor=\"%s\",type=\"out_of_range\"} %u\n", c->name, c->outOfRange);
+  }
+  out.println("# HELP ecompass_i2c_bus_down 1 while the sensor is being recovered");
+  out.println("# TYPE ecompass_i2c_bus_down gauge");
+  for (int i = 0; i < cmpsCount; i++)
+    out.printf("ecompass_i2c_bus_down{sensor=\"%s\"} %d\n", cmpsSensors[i].name, cmpsSensors[i].busDown ? 1 : 0);
+  out.println("# TYPE ecompass_i2c_recoveries_total counter");
+  for (int i = 0; i < cmpsCount; i++) {
+    Cmps14 *c = &cmpsSensors[i];
+    out.printf("ecompass_i2c_recoveries_total{sensor=\"%s\",result=\"attempted\"} %u\n", c->name, c->recoveryAttempts);
+    out.printf("ecompass_i2c_recoveries_total{sensor=\"%s\",result=\"recovered\"} %u\n", c->name, c->recoveries);
+  }
+  out.println("# HELP ecompass_i2c_read_seconds Time taken by the register reads of each CMPS14");
+  out.println("# TYPE ecompass_i2c_read_seconds summary");
+  for (int i = 0; i < cmpsCount; i++) {
+    Cmps14 *c = &cmpsSensors[i];
+    out.printf("ecompass_i2c_read_seconds_count{sensor=\"%s\"} %u\n", c->name, c->reads);
+    out.printf("ecompass_i2c_read_seconds_sum{sensor=\"%s\"} %.6f\n", c->name, c->readUsTotal / 1e6);
+  }
+  out.println("# TYPE ecompass_i2c_read_max_seconds gauge");
+  for (int i = 0; i < cmpsCount; i++)
+    out.printf("ecompass_i2c_read_max_seconds{sensor=\"%s\"} %.6f\n", cmpsSensors[i].name, cmpsSensors[i].readUsMax / 1e6);
+  out.println("# HELP ecompass_sensor_votes_total Samples each sensor answered and was used, or was outvoted, or didn't answer");
+  out.println("# TYPE ecompass_sensor_votes_total counter");
+  for (int i = 0; i < cmpsCount; i++) {
+    SensorHealth *h = &sensorHealth[i];
+    out.printf("ecompass_sensor_votes_total{sensor=\"%s\",result=\"used\"} %u\n", cmpsSensors[i].name, h->used);
+    out.printf("ecompass_sensor_votes_total{sensor=\"%s\",result=\"outvoted\"} %u\n", cmpsSensors[i].name, h->outvoted);
+    out.printf("ecompass_sensor_votes_total{sensor=\"%s\",result=\"missing\"} %u\n", cmpsSensors[i].name, h->missing);
+  }
+  out.println("# HELP ecompass_sensor_deviation_degrees How far each sensor was from the voted heading on its last sample");
+  out.println("# TYPE ecompass_sensor_deviation_degrees gauge");
+  for (int i = 0; i < cmpsCount; i++)
+    out.printf("ecompass_sensor_deviation_degrees{sensor=\"%s\"} %.1f\n", cmpsSensors[i].name, sensorHealth[i].deviation);
+  out.println("# HELP ecompass_sensor_disagreements_total Samples where the sensors that answered didn't agree");
+  out.println("# TYPE ecompass_sensor_disagreements_total counter");
+  out.printf("ecompass_sensor_disagreements_total %u\n", voteDisagreements);
+  out.println("# TYPE ecompass_sensor_disagree gauge");
+  out.printf("ecompass_sensor_disagree %d\n", voteDisagree ? 1 : 0);
+  out.println("# HELP ecompass_heading_samples_total Heading samples by status - only ok samples are sent as valid headings");
+  out.println("# TYPE ecompass_heading_samples_total counter");
+  for (int i = 0; i < NUM_SAMPLE_STATUS; i++)
+    out.printf("ecompass_heading_samples_total{status=\"%s\"} %u\n", sampleStatusNames[i], sampleStatusCounts[i]);
+  out.println("# HELP ecompass_boot_seconds Time from reset to each start up milestone");
+  out.println("# TYPE ecompass_boot_seconds gauge");
+  out.printf("ecompass_boot_seconds{milestone=\"first_heading\"} %.3f\n", bootFirstHeadingUs / 1e6);
+  out.printf("ecompass_boot_seconds{milestone=\"first_output\"} %.3f\n", bootFirstOutputUs / 1e6);
+  out.printf("ecompass_boot_seconds{milestone=\"complete\"} %.3f\n", bootCompleteUs / 1e6);
+
+  out.println("# TYPE ecompass_nmea_clients gauge");
+  out.printf("ecompass_nmea_clients %u\n", nmeaClientCount);
+  out.println("# TYPE ecompass_nmea_bytes_sent_total counter");
+  out.printf("ecompass_nmea_bytes_sent_total %u\n", nmeaBytesSent);
+  out.println("# HELP ecompass_nmea_sentences_encoded_total NMEA sentences encoded - once a tick however many profiles and clients share them");
+  out.println("# TYPE ecompass_nmea_sentences_encoded_total counter");
+  out.printf("ecompass_nmea_sentences_encoded_total %u\n", nmeaSentencesEncoded);
+  out.println("# TYPE ecompass_nmea_profile_clients gauge");
+  for (int i = 0; i < MAX_NMEA_PROFILES; i++)
+    if (nmeaProfiles[i].sentences != 0)
+      out.printf("ecompass_nmea_profile_clients{profile=\"%s\"} %u\n", nmeaProfiles[i].name, nmeaProfiles[i].clients);
+  out.println("# TYPE ecompass_nmea_profile_bytes_sent_total counter");
+  for (int i = 0; i < MAX_NMEA_PROFILES; i++)
+    if (nmeaProfiles[i].sentences != 0)
+      out.printf("ecompass_nmea_profile_bytes_sent_total{profile=\"%s\"} %u\n", nmeaProfiles[i].name, nmeaProfiles[i].bytesSent);
+  out.println("# TYPE ecompass_nmea_profile_messages_total counter");
+  for (int i = 0; i < MAX_NMEA_PROFILES; i++) {
+    NmeaProfile *p = &nmeaProfiles[i];
+    if (p->sentences == 0) continue;
+    out.printf("ecompass_nmea_profile_messages_total{profile=\"%s\",result=\"sent\"} %u\n", p->name, p->messagesSent);
+    out.printf("ecompass_nmea_profile_messages_total{profile=\"%s\",result=\"dropped\"} %u\n", p->name, p->drops);
+  }
+  out.println("# HELP ecompass_nmea_serial_sentences_total Sentences on the wired NMEA output - dropped when the baud rate can't keep up");
+  out.println("# TYPE ecompass_nmea_serial_sentences_total counter");
+  out.printf("ecompass_nmea_serial_sentences_total{result=\"sent\"} %u\n", nmeaSerialSentences);
+  out.printf("ecompass_nmea_serial_sentences_total{result=\"dropped\"} %u\n", nmeaSerialDropped);
+  out.println("# TYPE ecompass_nmea_serial_bytes_sent_total counter");
+  out.printf("ecompass_nmea_serial_bytes_sent_total %u\n", nmeaSerialBytes);
+  out.println("# HELP ecompass_nmea_serial_batches_skipped_total Output batches not sent on the UART to keep within its baud rate");
+  out.println("# TYPE ecompass_nmea_serial_batches_skipped_total counter");
+  out.printf("ecompass_nmea_serial_batches_skipped_total %u\n", nmeaSerialSkipped);
+
+#if FEATURE_SIGNALK
+  out.println("# TYPE ecompass_signalk_clients gauge");
+  out.printf("ecompass_signalk_clients %d\n", signalKClientCount);
+  out.println("# HELP ecompass_signalk_deltas_total Signal K deltas - dropped when a client's socket was full");
+  out.println("# TYPE ecompass_signalk_deltas_total counter");
+  out.printf("ecompass_signalk_deltas_total{result=\"sent\"} %u\n", signalKDeltas);
+  out.printf("ecompass_signalk_deltas_total{result=\"dropped\"} %u\n", signalKDrops);
+  out.println("# TYPE ecompass_signalk_bytes_sent_total counter");
+  out.printf("ecompass_signalk_bytes_sent_total %u\n", signalKBytes);
+#endif
+
+  //By slot, so the series stay bounded. A new client in a slot starts its counters from zero,
+  //which shows as a counter reset, and its connected time starts again
+  out.println("# HELP ecompass_nmea_client_connected_seconds How long the NMEA client in each slot has been connected");
+  out.println("# TYPE ecompass_nmea_client_connected_seconds gauge");
+  for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+    NmeaClientStats *c = &nmeaClientStats[i];
+    if (c->connectedAt == 0) continue;
+    out.printf("ecompass_nmea_client_connected_seconds{client=\"%d\"} %.1f\n", i, (millis() - c->connectedAt) / 1000.0);
+  }
+  out.println("# HELP ecompass_nmea_client_throughput_bytes_per_second Average rate each NMEA client has been sent data since it connected");
+  out.println("# TYPE ecompass_nmea_client_throughput_bytes_per_second gauge");
+  for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+    NmeaClientStats *c = &nmeaClientStats[i];
+    if (c->connectedAt == 0) continue;
+    uint32_t connectedMs = millis() - c->connectedAt;
+    out.printf("ecompass_nmea_client_throughput_bytes_per_second{client=\"%d\"} %.1f\n",
+               i, connectedMs > 0 ? c->bytesSent * 1000.0 / connectedMs : 0.0);
+  }
+  out.println("# TYPE ecompass_nmea_client_messages_total counter");
+  for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+    NmeaClientStats *c = &nmeaClientStats[i];
+    if (c->connectedAt == 0) continue;
+    out.printf("ecompass_nmea_client_messages_total{client=\"%d\",result=\"sent\"} %u\n", i, c->messagesSent);
+    out.printf("ecompass_nmea_client_messages_total{client=\"%d\",result=\"dropped\"} %u\n", i, c->drops);
+    out.printf("ecompass_nmea_client_messages_total{client=\"%d\",result=\"partial\"} %u\n", i, c->partials);
+  }
+  out.println("# HELP ecompass_nmea_client_max_gap_ms Longest time each NMEA client has gone without a message");
+  out.println("# TYPE ecompass_nmea_client_max_gap_ms gauge");
+  for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+    NmeaClientStats *c = &nmeaClientStats[i];
+    if (c->connectedAt == 0) continue;
+    out.printf("ecompass_nmea_client_max_gap_ms{client=\"%d\"} %u\n", i, c->maxGapMs);
+  }
+
+  out.println("# HELP ecompass_nmea_received_total Sentences received from NMEA clients, by type or reason for rejection");
+  out.println("# TYPE ecompass_nmea_received_total counter");
+  for (int i = 0; i < NUM_NMEA_RX_COUNTS; i++)
+    out.printf("ecompass_nmea_received_total{sentence=\"%s\"} %u\n", nmeaRxCountNames[i], nmeaRxCounts[i]);
+  out.println("# TYPE ecompass_nmea_bytes_received_total counter");
+  out.printf("ecompass_nmea_bytes_received_total %u\n", nmeaRxBytes);
+
+  uint32_t count = 0;
+  out.println("# HELP ecompass_output_gap_ratio Time between standard NMEA batches as a multiple of the output period");
+  out.println("# TYPE ecompass_output_gap_ratio histogram");
+  for (int b = 0; b < GAP_BUCKETS; b++) {
+    count += outputGaps[b];
+    if (b < GAP_BUCKETS - 1) out.printf("ecompass_output_gap_ratio_bucket{le=\"%.1f\"} %u\n", gapBucketLimits[b], count);
+    else out.printf("ecompass_output_gap_ratio_bucket{le=\"+Inf\"} %u\n", count);
+  }
+  out.printf("ecompass_output_gap_ratio_sum %.1f\n", outputGapSum);
+  out.printf("ecompass_output_gap_ratio_count %u\n", count);
+
+  count = 0;
+  out.println("# HELP ecompass_heading_latency_seconds Time from reading the CMPS14 to sending the heading to the NMEA clients");
+  out.println("# TYPE ecompass_heading_latency_seconds histogram");
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    count += latencies[b];
+    if (b < LATENCY_BUCKETS - 1) out.printf("ecompass_heading_latency_seconds_bucket{le=\"%.3f\"} %u\n", latencyBucketUs[b] / 1e6, count);
+    else out.printf("ecompass_heading_latency_seconds_bucket{le=\"+Inf\"} %u\n", count);
+  }
+  out.printf("ecompass_heading_latency_seconds_sum %.3f\n", latencySumUs / 1e6);
+  out.printf("ecompass_heading_latency_seconds_count %u\n", count);
+  out.println("# TYPE ecompass_heading_latency_max_seconds gauge");
+  out.printf("ecompass_heading_latency_max_seconds %.3f\n", latencyMaxUs / 1e6);
+
+  out.println("# HELP ecompass_pipeline_stage_samples_total Samples through each stage of the pipeline");
+  out.println("# TYPE ecompass_pipeline_stage_samples_total counter");
+  for (int i = 0; i < NUM_PIPE_STAGES; i++)
+    out.printf("ecompass_pipeline_stage_samples_total{stage=\"%s\"} %u\n", pipeStageNames[i], pipeStages[i].items);
+  out.println("# TYPE ecompass_pipeline_stage_seconds_total counter");
+  for (int i = 0; i < NUM_PIPE_STAGES; i++)
+    out.printf("ecompass_pipeline_stage_seconds_total{stage=\"%s\"} %.6f\n", pipeStageNames[i], pipeStages[i].totalUs / 1e6);
+  out.println("# TYPE ecompass_pipeline_stage_max_seconds gauge");
+  for (int i = 0; i < NUM_PIPE_STAGES; i++)
+    out.printf("ecompass_pipeline_stage_max_seconds{stage=\"%s\"} %.6f\n", pipeStageNames[i], pipeStages[i].maxUs / 1e6);
+  out.println("# HELP ecompass_pipeline_queue_depth Samples waiting for each stage, now and the most seen");
+  out.println("# TYPE ecompass_pipeline_queue_depth gauge");
+  for (int q = 0; q < NUM_PIPE_QUEUES; q++) {
+    out.printf("ecompass_pipeline_queue_depth{queue=\"%s\",stat=\"now\"} %u\n", pipeQueueNames[q],
+               (unsigned)uxQueueMessagesWaiting(pipeQueues[q].queue));
+    out.printf("ecompass_pipeline_queue_depth{queue=\"%s\",stat=\"max\"} %u\n", pipeQueueNames[q], pipeQueues[q].maxDepth);
+  }
+  out.println("# TYPE ecompass_pipeline_queue_drops_total counter");
+  for (int q = 0; q < NUM_PIPE_QUEUES; q++)
+    out.printf("ecompass_pipeline_queue_drops_total{queue=\"%s\"} %u\n", pipeQueueNames[q], pipeQueues[q].drops);
+  out.println("# HELP ecompass_pipeline_pool_free_min Fewest free buffers seen in each pool");
+  out.println("# TYPE ecompass_pipeline_pool_free_min gauge");
+  out.printf("ecompass_pipeline_pool_free_min{pool=\"samples\"} %u\n", pipeSamplesMinFree);
+  out.printf("ecompass_pipeline_pool_free_min{pool=\"sentences\"} %u\n", pipeSentencesMinFree);
+  out.println("# TYPE ecompass_pipeline_pool_empty_total counter");
+  out.printf("ecompass_pipeline_pool_empty_total %u\n", pipePoolEmpty);
+
+  out.println("# HELP ecompass_http_requests_total Polled web app requests served");
+  out.println("# TYPE ecompass_http_requests_total counter");
+  for (int i = 0; i < NUM_HTTP_ENDPOINTS; i++)
+    out.printf("ecompass_http_requests_total{path=\"%s\"} %u\n", httpStats[i].path, httpStats[i].requests);
+  out.println("# TYPE ecompass_http_request_seconds_total counter");
+  for (int i = 0; i < NUM_HTTP_ENDPOINTS; i++)
+    out.printf("ecompass_http_request_seconds_total{path=\"%s\"} %.3f\n", httpStats[i].path, httpStats[i].totalUs / 1e6);
+  out.println("# TYPE ecompass_http_request_max_seconds gauge");
+  for (int i = 0; i < NUM_HTTP_ENDPOINTS; i++)
+    out.printf("ecompass_http_request_max_seconds{path=\"%s\"} %.3f\n", httpStats[i].path, httpStats[i].maxUs / 1e6);
+
+  out.println("# HELP ecompass_wmm_evaluations_total Magnetic model evaluations, one per grid cell visited");
+  out.println("# TYPE ecompass_wmm_evaluations_total counter");
+  out.printf("ecompass_wmm_evaluations_total %u\n", wmmEvaluations);
+  out.println("# TYPE ecompass_wmm_cache_hits_total counter");
+  out.printf("ecompass_wmm_cache_hits_total %u\n", wmmCacheHits);
+
+  out.println("# TYPE ecompass_heading_source gauge");
+  out.printf("ecompass_heading_source{source=\"%s\"} %d\n", headingSourceNames[headingSource], headingSource);
+  out.println("# TYPE ecompass_fusion_updates_total counter");
+  out.printf("ecompass_fusion_updates_total %u\n", fusionUpdates);
+  out.println("# HELP ecompass_fusion_read_errors_total Fusion burst reads of the raw registers that failed");
+  out.println("# TYPE ecompass_fusion_read_errors_total counter");
+  out.printf("ecompass_fusion_read_errors_total %u\n", fusionErrors);
+  out.println("# HELP ecompass_fusion_update_cycles CPU cycles taken by one fusion update, including the I2C read");
+  out.println("# TYPE ecompass_fusion_update_cycles gauge");
+  out.printf("ecompass_fusion_update_cycles{stat=\"last\"} %u\n", fusionCyclesLast);
+  out.printf("ecompass_fusion_update_cycles{stat=\"max\"} %u\n", fusionCyclesMax);
+  out.println("# HELP ecompass_fusion_budget_percent Average share of the fusion period used by an update");
+  out.println("# TYPE ecompass_fusion_budget_percent gauge");
+  out.printf("ecompass_fusion_budget_percent %.2f\n", fusionBudgetPercent());
+
+#if FEATURE_SEA_STATE
+  SeaState sea = seaStateGet();
+  if (sea.valid) {
+    out.println("# HELP ecompass_sea_period_seconds Peak wave and roll periods");
+    out.println("# TYPE ecompass_sea_period_seconds gauge");
+    out.printf("ecompass_sea_period_seconds{motion=\"wave\"} %.1f\n", sea.wavePeriodS);
+    out.printf("ecompass_sea_period_seconds{motion=\"wave_zero_crossing\"} %.1f\n", sea.zeroCrossingPeriodS);
+    out.printf("ecompass_sea_period_seconds{motion=\"roll\"} %.1f\n", sea.rollPeriodS);
+    out.println("# HELP ecompass_sea_heave_meters Significant heave, crest to trough");
+    out.println("# TYPE ecompass_sea_heave_meters gauge");
+    out.printf("ecompass_sea_heave_meters %.2f\n", sea.heaveM);
+    out.println("# HELP ecompass_sea_roll_degrees Significant roll amplitude");
+    out.println("# TYPE ecompass_sea_roll_degrees gauge");
+    out.printf("ecompass_sea_roll_degrees %.1f\n", sea.rollDeg);
+  }
+  out.println("# HELP ecompass_sea_windows_total Sea state windows by what became of them");
+  out.println("# TYPE ecompass_sea_windows_total counter");
+  out.printf("ecompass_sea_windows_total{result=\"analysed\"} %u\n", seaAnalyses);
+  out.printf("ecompass_sea_windows_total{result=\"gappy\"} %u\n", seaGappy);
+  out.printf("ecompass_sea_windows_total{result=\"over_budget\"} %u\n", seaOverBudget);
+  out.println("# TYPE ecompass_sea_readings_total counter");
+  out.printf("ecompass_sea_readings_total{result=\"ok\"} %u\n", seaReads - seaBusBusy - seaReadErrors);
+  out.printf("ecompass_sea_readings_total{result=\"bus_busy\"} %u\n", seaBusBusy);
+  out.printf("ecompass_sea_readings_total{result=\"error\"} %u\n", seaReadErrors);
+  out.println("# HELP ecompass_sea_budget_percent Average share of a core taken by the sea state analysis");
+  out.println("# TYPE ecompass_sea_budget_percent gauge");
+  out.printf("ecompass_sea_budget_percent %.3f\n", seaBudgetPercent());
+#endif
+
+  out.println("# HELP ecompass_power_mode_seconds_total Time spent in each power mode");
+  out.println("# TYPE ecompass_power_mode_seconds_total counter");
+  for (int i = 0; i < NUM_POWER_MODES; i++)
+    out.printf("ecompass_power_mode_seconds_total{mode=\"%s\"} %.1f\n", powerProfiles[i].name, powerModeMs[i] / 1000.0);
+  out.println("# TYPE ecompass_power_mode gauge");
+  out.printf("ecompass_power_mode{mode=\"%s\"} %d\n", powerProfiles[powerMode].name, powerMode);
+  out.println("# HELP ecompass_current_estimate_ma Estimated supply current right now");
+  out.println("# TYPE ecompass_current_estimate_ma gauge");
+  out.printf("ecompass_current_estimate_ma %.1f\n", estimatedCurrentMa());
+  out.println("# HELP ecompass_energy_estimate_mah_total Estimated charge used since boot");
+  out.println("# TYPE ecompass_energy_estimate_mah_total counter");
+  out.printf("ecompass_energy_estimate_mah_total %.2f\n", energyUsedMah);
+#if FEATURE_OLED
+  out.println("# TYPE ecompass_oled_on gauge");
+  out.printf("ecompass_oled_on %d\n", oledOn ? 1 : 0);
+#endif
+}
+
+#endif
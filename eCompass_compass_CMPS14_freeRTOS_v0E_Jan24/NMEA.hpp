@@ -1,3 +1,5 @@
+#ifndef _NMEA_HPP
+#define _NMEA_HPP
 
 #define MAXLEN 255
 /*
@@ -46,6 +48,97 @@ class HDMmessage : public NMEAmessage {
     }
 };
 
+/*
+ * "HDG" message - Heading, Deviation and Variation
+ * $--HDG,x.x,x.x,a,x.x,a*hh
+ * The compass card has already taken out the deviation, so that field is left empty,
+ * as is the variation until we know where we are
+ */
+
+class HDGmessage : public NMEAmessage {
+  public:
+    HDGmessage(short heading=0, float variation=0) {
+      update(heading, variation);
+    }
+    void update(short heading, float variation, bool haveVariation = true) {
+      if (haveVariation) sprintf(msgString,"$%sHDG,%03d,,,%.1f,%c",sourceID, heading, fabs(variation), variation < 0 ? 'W' : 'E');
+      else sprintf(msgString,"$%sHDG,%03d,,,,",sourceID, heading);
+      addCheckSum();
+    }
+    //No trustworthy heading - the heading field is left void
+    void invalid(float variation, bool haveVariation) {
+      if (haveVariation) sprintf(msgString,"$%sHDG,,,,%.1f,%c",sourceID, fabs(variation), variation < 0 ? 'W' : 'E');
+      else sprintf(msgString,"$%sHDG,,,,,",sourceID);
+      addCheckSum();
+    }
+};
+
+/*
+ * "HDT" message - True Heading
+ * $--HDT,x.x,T*hh
+ */
+
+class HDTmessage : public NMEAmessage {
+  public:
+    HDTmessage(short heading=0) {
+      update(heading);
+    }
+    void update(short heading) {
+      sprintf(msgString,"$%sHDT,%03d,T",sourceID, heading);
+      addCheckSum();
+    }
+};
+
+/*
+ * "ROT" message - Rate of Turn
+ * $--ROT,x.x,A*hh
+ * Degrees per minute, negative when the bow turns to port. V in the status field if it can't be trusted
+ */
+
+class ROTmessage : public NMEAmessage {
+  public:
+    ROTmessage(float degreesPerSecond=0) {
+      update(degreesPerSecond);
+    }
+    void update(float degreesPerSecond) {
+      sprintf(msgString,"$%sROT,%.1f,A",sourceID, degreesPerSecond * 60);
+      addCheckSum();
+    }
+    void invalid() {
+      sprintf(msgString,"$%sROT,,V",sourceID);
+      addCheckSum();
+    }
+};
+
+/*
+ * "XDR" message - Transducer measurements, here the sea state (see SeaState.h)
+ * $--XDR,G,x.x,,WAVEPER,D,x.xx,M,HEAVE,G,x.x,,ROLLPER,A,x.x,D,ROLL*hh
+ * Periods in seconds, significant heave in metres and significant roll in degrees
+ */
+
+class XDRmessage : public NMEAmessage {
+  public:
+    void update(float wavePeriod, float heave, float rollPeriod, float roll) {
+      sprintf(msgString,"$%sXDR,G,%.1f,,WAVEPER,D,%.2f,M,HEAVE,G,%.1f,,ROLLPER,A,%.1f,D,ROLL",
+              sourceID, wavePeriod, heave, rollPeriod, roll);
+      addCheckSum();
+    }
+};
+
+/*
+ * "PEASP" message - our own proprietary sentence, the output profile a client is getting
+ * $PEASP,name,sentences,rate*hh  e.g. $PEASP,autopilot,HDG+ROT,10.0*hh
+ * Clients send the same sentence to choose a profile (see NmeaProfiles.h)
+ */
+
+class PEASPmessage : public NMEAmessage {
+  public:
+    void update(const char *name, const char *sentences, float rateHz) {
+      sprintf(msgString,"$PEASP,%s,%s,%.1f",name, sentences, rateHz);
+      addCheckSum();
+    }
+};
+
 class HSCmessage : public NMEAmessage {
   public:
     HSCmessage(short targetHeading=0) {
@@ -57,3 +150,5 @@ class HSCmessage : public NMEAmessage {
       addCheckSum();
     }
 };
+
+#endif
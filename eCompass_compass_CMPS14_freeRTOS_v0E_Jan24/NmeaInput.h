@@ -0,0 +1,291 @@
+#ifndef _NMEA_INPUT_H
+#define _NMEA_INPUT_H
+/*
+ * NMEA 0183 input
+ *
+ * Chartplotters and GPS receivers connected to the NMEA port can send us sentences. Each
+ * client has an NmeaReceiver: the Network task recv()s straight into its buffer and the
+ * complete lines are tokenised where they lie - fields are pointer/length pairs into the
+ * receive buffer and numbers are parsed from there, nothing is copied. Only the partial
+ * sentence at the end of a read is moved to the front of the buffer for next time.
+ *
+ * Sentences must have a valid checksum. RMC, GGA, VTG and HSC are decoded into typed
+ * structures and passed to the handlers in nmeaHandlers, as is our own $PEASP profile
+ * request (see NmeaProfiles.h); anything else is counted and ignored. A line longer than
+ * the buffer is thrown away up to the next line end.
+ */
+
+#define NMEA_RX_BUFFER 128       //a sentence is at most 82 characters
+#define NMEA_MAX_FIELDS 24
+
+struct NmeaField {
+  const char *p;
+  uint8_t length;
+};
+
+struct NmeaSentence {
+  const char *talker;            //2 characters
+  const char *type;              //3 characters
+  NmeaField field[NMEA_MAX_FIELDS];   //field[0] is the first after the address
+  int fields;
+};
+
+struct NmeaReceiver {
+  char buf[NMEA_RX_BUFFER];
+  int length;
+  bool discarding;               //skipping the rest of an over long line
+};
+
+//Decoded sentences. Fields the sender left empty are NAN
+struct NmeaRMC {
+  bool valid;                    //status A
+  float lat, lon;                //degrees, north and east positive
+  float sog, cog;                //knots, degrees true
+  int year, month, day;          //0 if there was no date
+  float variation;               //degrees, east positive
+};
+
+struct NmeaGGA {
+  int quality;                   //0 = no fix
+  float lat, lon;
+  int satellites;
+  float hdop, altitude;
+};
+
+struct NmeaVTG {
+  float cogTrue, cogMagnetic;
+  float sog;                     //knots
+};
+
+struct NmeaHSC {
+  float headingTrue, headingMagnetic;   //heading to steer
+};
+
+struct NmeaHandlers {
+  void (*rmc)(const NmeaRMC *, int client);
+  void (*gga)(const NmeaGGA *, int client);
+  void (*vtg)(const NmeaVTG *, int client);
+  void (*hsc)(const NmeaHSC *, int client);
+  void (*profile)(const NmeaSentence *, int client);
+};
+
+enum NmeaRxCount { NMEA_RX_RMC, NMEA_RX_GGA, NMEA_RX_VTG, NMEA_RX_HSC, NMEA_RX_PROFILE, NMEA_RX_OTHER,
+                   NMEA_RX_BAD_CHECKSUM, NMEA_RX_MALFORMED, NMEA_RX_OVERLONG, NUM_NMEA_RX_COUNTS };
+const char *nmeaRxCountNames[NUM_NMEA_RX_COUNTS] = { "rmc", "gga", "vtg", "hsc", "profile", "other",
+                                                     "bad_checksum", "malformed", "overlong" };
+uint32_t nmeaRxCounts[NUM_NMEA_RX_COUNTS];
+uint32_t nmeaRxBytes = 0;
+
+NmeaHandlers nmeaHandlers = { NULL, NULL, NULL, NULL, NULL };
+
+//What the handlers in the sketch have picked up from the boat's instruments
+struct Navigation {
+  bool cogValid;
+  float cog, sog;                //degrees true, knots
+  unsigned long cogAt;           //millis() when last heard
+  bool steerValid;
+  float headingToSteer;          //degrees magnetic, from an HSC sentence
+  unsigned long steerAt;
+};
+
+Navigation navigation = { false, 0, 0, 0, false, 0, 0 };
+
+/*
+ * Field parsing - straight from the receive buffer
+ */
+
+inline int nmeaHexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+//Decimal number, NAN if the field is empty or not a number
+float nmeaFloat(const NmeaField &f) {
+  const char *p = f.p, *end = f.p + f.length;
+  bool negative = false, digits = false;
+  float value = 0, scale = 1;
+
+  if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+  for (; p < end && *p >= '0' && *p <= '9'; p++, digits = true) value = value * 10 + (*p - '0');
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits = true) {
+      scale /= 10;
+      value += (*p - '0') * scale;
+    }
+  }
+  if (!digits || p != end) return NAN;
+  return negative ? -value : value;
+}
+
+//-1 if the field is empty or not a number, or too big for an int
+int nmeaInt(const NmeaField &f) {
+  float value = nmeaFloat(f);
+  return isnan(value) || fabsf(value) > 1e9f ? -1 : (int)value;
+}
+
+//ddmm.mmmm or dddmm.mmmm plus a hemisphere field, to signed degrees. NAN if it isn't a
+//place on the earth
+float nmeaLatLon(const NmeaField &value, const NmeaField &hemisphere) {
+  float v = nmeaFloat(value);
+  if (isnan(v) || v < 0 || hemisphere.length != 1) return NAN;
+  char h = hemisphere.p[0];
+  float limit = h == 'N' || h == 'S' ? 90 : h == 'E' || h == 'W' ? 180 : -1;
+  float degrees = floorf(v / 100), minutes = v - degrees * 100;
+  float result = degrees + minutes / 60;
+  if (minutes >= 60 || result > limit) return NAN;
+  return h == 'S' || h == 'W' ? -result : result;
+}
+
+inline bool nmeaIs(const NmeaField &f, char c) {
+  return f.length == 1 && f.p[0] == c;
+}
+
+/*
+ * Tokeniser
+ */
+
+//Split one sentence, from the '$' to just before the line end, and check its checksum
+bool nmeaTokenize(const char *s, int length, NmeaSentence *out) {
+  const char *end = s + length, *p;
+  uint8_t checkSum = 0;
+
+  //$ttsss, then the fields, then *hh
+  if (length < 9 || (s[0] != '$' && s[0] != '!')) {
+    nmeaRxCounts[NMEA_RX_MALFORMED]++;
+    return false;
+  }
+  for (p = s + 1; p < end && *p != '*'; p++) checkSum ^= *p;
+  if (end - p != 3 || nmeaHexDigit(p[1]) < 0 || nmeaHexDigit(p[2]) < 0 ||
+      (nmeaHexDigit(p[1]) << 4 | nmeaHexDigit(p[2])) != checkSum) {
+    nmeaRxCounts[NMEA_RX_BAD_CHECKSUM]++;
+    return false;
+  }
+  end = p;    //the '*'
+
+  out->talker = s + 1;
+  out->type = s + 3;
+  out->fields = 0;
+  if (s[6] != ',') {
+    nmeaRxCounts[NMEA_RX_MALFORMED]++;
+    return false;
+  }
+  for (p = s + 7; out->fields < NMEA_MAX_FIELDS; ) {
+    const char *comma = (const char *)memchr(p, ',', end - p);
+    const char *fieldEnd = comma != NULL ? comma : end;
+    out->field[out->fields].p = p;
+    out->field[out->fields].length = fieldEnd - p;
+    out->fields++;
+    if (comma == NULL) break;
+    p = comma + 1;
+  }
+  //Missing trailing fields read as empty
+  for (int i = out->fields; i < NMEA_MAX_FIELDS; i++) {
+    out->field[i].p = end;
+    out->field[i].length = 0;
+  }
+  return true;
+}
+
+/*
+ * Sentence decoders
+ */
+
+void nmeaDispatch(const NmeaSentence *s, int client) {
+  const NmeaField *f = s->field;
+
+  if (memcmp(s->type, "RMC", 3) == 0) {
+    //hhmmss.ss,A,llll.ll,a,yyyyy.yy,a,x.x,x.x,ddmmyy,x.x,a
+    NmeaRMC rmc;
+    rmc.valid = nmeaIs(f[1], 'A');
+    rmc.lat = nmeaLatLon(f[2], f[3]);
+    rmc.lon = nmeaLatLon(f[4], f[5]);
+    rmc.sog = nmeaFloat(f[6]);
+    rmc.cog = nmeaFloat(f[7]);
+    int date = f[8].length == 6 ? nmeaInt(f[8]) : -1;
+    rmc.day = date > 0 ? date / 10000 : 0;
+    rmc.month = date > 0 ? date / 100 % 100 : 0;
+    rmc.year = date > 0 ? 2000 + date % 100 : 0;
+    rmc.variation = nmeaFloat(f[9]);
+    if (nmeaIs(f[10], 'W')) rmc.variation = -rmc.variation;
+    nmeaRxCounts[NMEA_RX_RMC]++;
+    if (nmeaHandlers.rmc) nmeaHandlers.rmc(&rmc, client);
+  } else if (memcmp(s->type, "GGA", 3) == 0) {
+    //hhmmss.ss,llll.ll,a,yyyyy.yy,a,x,xx,x.x,x.x,M,...
+    NmeaGGA gga;
+    gga.lat = nmeaLatLon(f[1], f[2]);
+    gga.lon = nmeaLatLon(f[3], f[4]);
+    gga.quality = nmeaInt(f[5]);
+    gga.satellites = nmeaInt(f[6]);
+    gga.hdop = nmeaFloat(f[7]);
+    gga.altitude = nmeaFloat(f[8]);
+    nmeaRxCounts[NMEA_RX_GGA]++;
+    if (nmeaHandlers.gga) nmeaHandlers.gga(&gga, client);
+  } else if (memcmp(s->type, "VTG", 3) == 0) {
+    //x.x,T,x.x,M,x.x,N,x.x,K
+    NmeaVTG vtg;
+    vtg.cogTrue = nmeaFloat(f[0]);
+    vtg.cogMagnetic = nmeaFloat(f[2]);
+    vtg.sog = nmeaFloat(f[4]);
+    nmeaRxCounts[NMEA_RX_VTG]++;
+    if (nmeaHandlers.vtg) nmeaHandlers.vtg(&vtg, client);
+  } else if (memcmp(s->type, "HSC", 3) == 0) {
+    //x.x,T,x.x,M
+    NmeaHSC hsc;
+    hsc.headingTrue = nmeaFloat(f[0]);
+    hsc.headingMagnetic = nmeaFloat(f[2]);
+    nmeaRxCounts[NMEA_RX_HSC]++;
+    if (nmeaHandlers.hsc) nmeaHandlers.hsc(&hsc, client);
+  } else if (memcmp(s->talker, "PEASP", 5) == 0) {
+    //name, or sentences and rate
+    nmeaRxCounts[NMEA_RX_PROFILE]++;
+    if (nmeaHandlers.profile) nmeaHandlers.profile(s, client);
+  } else nmeaRxCounts[NMEA_RX_OTHER]++;
+}
+
+/*
+ * Receive buffer
+ */
+
+void nmeaReceiverReset(NmeaReceiver *rx) {
+  rx->length = 0;
+  rx->discarding = false;
+}
+
+//Where the next recv() should put its data, and how much room there is
+inline char *nmeaReceiveSpace(NmeaReceiver *rx, int *room) {
+  *room = NMEA_RX_BUFFER - rx->length;
+  return rx->buf + rx->length;
+}
+
+//count bytes have been received into the space - handle any complete sentences
+void nmeaReceived(NmeaReceiver *rx, int count, int client) {
+  NmeaSentence sentence;
+  char *line = rx->buf, *end = rx->buf + rx->length + count, *nl;
+
+  nmeaRxBytes += count;
+  while ((nl = (char *)memchr(line, '\n', end - line)) != NULL) {
+    if (!rx->discarding) {
+      char *start = (char *)memchr(line, '$', nl - line);   //skip any noise before the start
+      if (start == NULL) start = (char *)memchr(line, '!', nl - line);
+      if (start != NULL) {
+        int length = nl - start;
+        if (length > 0 && start[length - 1] == '\r') length--;
+        if (nmeaTokenize(start, length, &sentence)) nmeaDispatch(&sentence, client);
+      }
+    }
+    rx->discarding = false;
+    line = nl + 1;
+  }
+
+  //Keep the partial line for next time, unless it has filled the buffer
+  rx->length = end - line;
+  if (rx->length == NMEA_RX_BUFFER) {
+    nmeaRxCounts[NMEA_RX_OVERLONG]++;
+    rx->discarding = true;
+    rx->length = 0;
+  } else if (line != rx->buf && rx->length > 0) memmove(rx->buf, line, rx->length);
+}
+
+#endif
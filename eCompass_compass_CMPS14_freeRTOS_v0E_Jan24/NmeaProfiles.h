@@ -0,0 +1,221 @@
+#ifndef _NMEA_PROFILES_H
+#define _NMEA_PROFILES_H
+/*
+ * NMEA output profiles
+ *
+ * Not every NMEA client wants the same thing - the autopilot wants HDG and ROT ten times a
+ * second, a cabin repeater is happy with HDM once a second. Each client on the NMEA port is
+ * given a profile: a set of sentences and a rate. Which one depends on how it connected:
+ * the configured NMEA port gives "standard", and the built in profiles with a port of their
+ * own have a listener there. A client can change profile at any time by sending
+ *   $PEASP,<name>*hh                   e.g. $PEASP,repeater*hh
+ *   $PEASP,<sentences>,<rate Hz>*hh    e.g. $PEASP,HDG+ROT,20*hh or $PEASP,HDM+XDR,1*hh
+ *   $PEASP,*hh                         just ask which profile we are on
+ * and gets a $PEASP sentence back describing the profile it is now on. Clients asking for
+ * the same sentences at the same rate share a profile; up to NMEA_CUSTOM_PROFILES sets that
+ * match none of the built in ones are made up on demand and recycled once nobody uses them.
+ *
+ * Output is driven by the samples (see Pipeline.h). For each sample the Encode task asks
+ * nmeaProfilesDue() which profiles are due and which sentences they need between them, and
+ * encodes each of those sentences once. The Output task then has nmeaProfilesBuild() put each
+ * due profile's batch together from them, and sends the batch to all of the profile's clients.
+ * A profile is due on the first sample within half a sample period of its time coming round
+ * (the standard profile follows the output period the power manager sets), so a profile
+ * can't go faster than the samples. Rates are rounded to multiples of
+ * NMEA_PROFILE_MIN_PERIOD, so nothing asks for more than 20 Hz - the sample rate in active mode.
+ *
+ * The profile table and the client assignments are shared between the Network, Encode and
+ * Output tasks and are only touched with telnetClientsLock held.
+ */
+
+#include "BuildProfile.h"
+#include "Configuration.h"
+#include "NMEA.hpp"
+#include "NmeaInput.h"
+#include "SocketServer.h"
+
+//XDR is the sea state (see SeaState.h) - none of the built in profiles has it, a client asks.
+//Without the sea state in the build it isn't a sentence we know, so asking for it is refused
+#if FEATURE_SEA_STATE
+enum NmeaSentenceId { SENTENCE_HDM, SENTENCE_HDG, SENTENCE_HDT, SENTENCE_ROT, SENTENCE_XDR, NUM_SENTENCES };
+const char * const nmeaSentenceNames[NUM_SENTENCES] = { "HDM", "HDG", "HDT", "ROT", "XDR" };
+#else
+enum NmeaSentenceId { SENTENCE_HDM, SENTENCE_HDG, SENTENCE_HDT, SENTENCE_ROT, NUM_SENTENCES };
+const char * const nmeaSentenceNames[NUM_SENTENCES] = { "HDM", "HDG", "HDT", "ROT" };
+#endif
+#define SENTENCE(id) (1 << (id))
+
+#define NMEA_BUILTIN_PROFILES 3
+#define NMEA_CUSTOM_PROFILES 3
+#define MAX_NMEA_PROFILES (NMEA_BUILTIN_PROFILES + NMEA_CUSTOM_PROFILES)
+#define NMEA_PROFILE_MIN_PERIOD 50      //ms
+#define NMEA_PROFILE_MAX_PERIOD 60000
+#define NMEA_MAX_SENTENCE 84            //82 characters and CR LF
+#define NO_PROFILE 0xFF
+
+struct NmeaProfile {
+  char name[12];
+  uint8_t sentences;           //SENTENCE() bits
+  uint16_t periodMs;           //0 to follow the output period from the power manager
+  uint16_t port;               //its own listener, 0 for none
+  //Run time, under telnetClientsLock
+  uint8_t clients;
+  uint32_t nextAt;             //ms, when the next batch is due
+  char line[NUM_SENTENCES * NMEA_MAX_SENTENCE + 1];
+  int length;                  //of this sample's batch, 0 if it isn't due
+  int batchBytes;              //size of the last batch
+  //Statistics
+  uint32_t batches;            //samples it was due on
+  uint32_t messagesSent, bytesSent, drops;
+};
+
+//Custom profiles are filled in by nmeaProfileRequest()
+NmeaProfile nmeaProfiles[MAX_NMEA_PROFILES] = {
+  // name         sentences                                                              period  port
+  { "standard",  SENTENCE(SENTENCE_HDM) | SENTENCE(SENTENCE_HDG) | SENTENCE(SENTENCE_HDT), 0,      0 },
+  { "autopilot", SENTENCE(SENTENCE_HDG) | SENTENCE(SENTENCE_ROT),                         100,    10110 },
+  { "repeater",  SENTENCE(SENTENCE_HDM),                                                  1000,   10111 }
+};
+
+SocketServer nmeaProfileServers[NMEA_BUILTIN_PROFILES] = { SocketServer(0), SocketServer(0), SocketServer(0) };
+uint8_t nmeaClientProfile[MAX_TCP_CLIENTS];
+uint32_t nmeaSentencesEncoded = 0;
+uint32_t nmeaOutputPeriodMs = 200;     //the standard profile's period, from the power manager
+
+//Open the listeners of the profiles that have their own port
+void nmeaProfilesBegin() {
+  for (int i = 0; i < MAX_TCP_CLIENTS; i++) nmeaClientProfile[i] = NO_PROFILE;
+  for (int p = 0; p < NMEA_BUILTIN_PROFILES; p++)
+    if (nmeaProfiles[p].port != 0 && !nmeaProfileServers[p].restart(nmeaProfiles[p].port))
+      Serial.printf("Failed to open NMEA port %u\n", nmeaProfiles[p].port);
+}
+
+void nmeaProfileAttach(int client, int profile) {
+  if (nmeaClientProfile[client] != NO_PROFILE) nmeaProfiles[nmeaClientProfile[client]].clients--;
+  nmeaClientProfile[client] = profile;
+  nmeaProfiles[profile].clients++;
+}
+
+void nmeaProfileDetach(int client) {
+  if (nmeaClientProfile[client] != NO_PROFILE) nmeaProfiles[nmeaClientProfile[client]].clients--;
+  nmeaClientProfile[client] = NO_PROFILE;
+}
+
+//e.g. "HDG+ROT"
+char *nmeaSentenceList(uint8_t sentences, char *buff) {
+  char *p = buff;
+  *p = '\0';
+  for (int s = 0; s < NUM_SENTENCES; s++)
+    if (sentences & SENTENCE(s)) p += sprintf(p, "%s%s", p == buff ? "" : "+", nmeaSentenceNames[s]);
+  return buff;
+}
+
+inline uint32_t nmeaProfilePeriod(const NmeaProfile *p) {
+  return p->periodMs != 0 ? p->periodMs : nmeaOutputPeriodMs;
+}
+
+//The profile a $PEASP sentence asks for, or -1 if it makes no sense or there is no room.
+//The client's current profile if it gives neither name nor sentences
+int nmeaProfileRequest(const NmeaSentence *s, int client) {
+  const NmeaField &request = s->field[0];
+  uint8_t sentences = 0;
+
+  if (request.length == 0) return nmeaClientProfile[client];
+  for (int p = 0; p < MAX_NMEA_PROFILES; p++)
+    if (nmeaProfiles[p].sentences != 0 && strlen(nmeaProfiles[p].name) == request.length &&
+        strncasecmp(nmeaProfiles[p].name, request.p, request.length) == 0) return p;
+
+  //HDM+HDG+... in any order
+  for (const char *q = request.p, *end = request.p + request.length; q < end; q += 4) {
+    int id;
+    for (id = 0; id < NUM_SENTENCES && (end - q < 3 || strncasecmp(q, nmeaSentenceNames[id], 3) != 0); id++);
+    if (id == NUM_SENTENCES || (q + 3 < end && q[3] != '+')) return -1;
+    sentences |= SENTENCE(id);
+  }
+  float rate = nmeaFloat(s->field[1]);
+  if (isnan(rate) || rate <= 0) rate = 1;
+  uint32_t period = lroundf(1000 / rate / NMEA_PROFILE_MIN_PERIOD) * NMEA_PROFILE_MIN_PERIOD;
+  period = constrain(period, NMEA_PROFILE_MIN_PERIOD, NMEA_PROFILE_MAX_PERIOD);
+
+  int unused = -1;
+  for (int p = 0; p < MAX_NMEA_PROFILES; p++) {
+    NmeaProfile *profile = &nmeaProfiles[p];
+    if (profile->sentences == sentences && profile->periodMs == period) return p;
+    if (p >= NMEA_BUILTIN_PROFILES && profile->clients == 0 && unused < 0) unused = p;
+  }
+  if (unused < 0) return -1;
+  NmeaProfile *profile = &nmeaProfiles[unused];
+  memset(profile, 0, sizeof(NmeaProfile));
+  sprintf(profile->name, "custom%d", unused - NMEA_BUILTIN_PROFILES + 1);
+  profile->sentences = sentences;
+  profile->periodMs = period;
+  return unused;
+}
+
+//The reply to a $PEASP request - the client's profile as a $PEASP sentence
+void nmeaProfileDescribe(int profile, PEASPmessage *reply) {
+  char list[NUM_SENTENCES * 4];
+  NmeaProfile *p = &nmeaProfiles[profile];
+  reply->update(p->name, nmeaSentenceList(p->sentences, list), 1000.0 / nmeaProfilePeriod(p));
+}
+
+//A sample taken at nowMs. Sets a bit in *due for each profile that is due - anything within
+//slackMs of its time - and returns the sentences they need between them. The standard profile
+//is always served, for the wired output
+uint8_t nmeaProfilesDue(uint32_t nowMs, uint32_t slackMs, uint8_t *due) {
+  uint8_t wanted = 0;
+
+  *due = 0;
+  for (int i = 0; i < MAX_NMEA_PROFILES; i++) {
+    NmeaProfile *p = &nmeaProfiles[i];
+    if (p->clients == 0 && i != 0) continue;
+    uint32_t period = nmeaProfilePeriod(p);
+    if ((int32_t)(nowMs + slackMs - p->nextAt) < 0) continue;
+    p->nextAt += period;
+    if ((int32_t)(nowMs - p->nextAt) >= 0) p->nextAt = nowMs + period;   //new, or we fell behind
+    *due |= 1 << i;
+    p->batches++;
+    wanted |= p->sentences;
+  }
+  return wanted;
+}
+
+//Put the batch of each profile in due together from one sample's sentences, NULL for one
+//that isn't going out this time (a bad heading holds back HDM and HDT, for instance)
+void nmeaProfilesBuild(const char * const sentence[NUM_SENTENCES], uint8_t due) {
+  int length[NUM_SENTENCES];
+
+  for (int s = 0; s < NUM_SENTENCES; s++) {
+    length[s] = sentence[s] != NULL ? strlen(sentence[s]) : 0;
+    if (length[s] > NMEA_MAX_SENTENCE - 2) length[s] = 0;
+  }
+  for (int i = 0; i < MAX_NMEA_PROFILES; i++) {
+    NmeaProfile *p = &nmeaProfiles[i];
+    p->length = 0;
+    if (!(due & 1 << i)) continue;
+    for (int s = 0; s < NUM_SENTENCES; s++) {
+      if (!(p->sentences & SENTENCE(s)) || length[s] == 0) continue;
+      memcpy(p->line + p->length, sentence[s], length[s]);
+      p->length += length[s];
+      p->line[p->length++] = '\r';
+      p->line[p->length++] = '\n';
+    }
+    p->batchBytes = p->length;
+  }
+}
+
+void nmeaProfilesStatus(Print &out) {
+  char list[NUM_SENTENCES * 4];
+
+  out.print("Profile    Sentences        Rate   Port  Clients  Batch B  Sent kB  Dropped\n");
+  for (int i = 0; i < MAX_NMEA_PROFILES; i++) {
+    NmeaProfile *p = &nmeaProfiles[i];
+    if (p->sentences == 0) continue;
+    out.printf("%-10s %-15s %5.1fHz %5u %8u %8d %8.1f %8u\n", p->name, nmeaSentenceList(p->sentences, list),
+               1000.0 / nmeaProfilePeriod(p), i == 0 ? configuration.TCPPort : p->port,
+               p->clients, p->batchBytes, p->bytesSent / 1024.0, p->drops);
+  }
+  out.printf("Sentences encoded: %u\n", nmeaSentencesEncoded);
+}
+
+#endif
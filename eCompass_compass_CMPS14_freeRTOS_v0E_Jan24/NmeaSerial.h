@@ -0,0 +1,91 @@
+#ifndef _NMEA_SERIAL_H
+#define _NMEA_SERIAL_H
+/*
+ * Wired NMEA 0183 output
+ *
+ * Older autopilots want the heading on a wire at 4800 (or 38400) baud rather than over WiFi.
+ * The Output task hands every batch of sentences it sends to the telnet clients to
+ * nmeaSerialSend() as well, and they go out of UART2 at configuration.NMEABaudRate.
+ *
+ * The Output task must never wait for the UART. The UART driver is given a TX ring of
+ * NMEA_SERIAL_TX_BUFFER bytes which its interrupt handler feeds into the hardware FIFO, so a
+ * write only copies into the ring. A heading that sits in the ring is getting old though, so
+ * only as much as the UART sends in NMEA_SERIAL_MAX_DELAY_MS is allowed to queue. Before
+ * writing a sentence we check there is room for all of it; if there isn't - the baud rate
+ * can't keep up with the output rate - the sentence is dropped and counted rather than sent
+ * in part, so the listener never sees a broken sentence. At 4800 baud about 480 characters a
+ * second go out, a little over fifteen sentences.
+ *
+ * The Output task runs every 100ms when the boat is moving, and the standard batch (HDM, HDG
+ * and HDT) is about 65 characters - more than the 48 a 4800 baud line carries in that time.
+ * So the UART has its own rate, worked out from the baud rate: a batch is only sent once the
+ * line has had time to send the last one NMEA_SERIAL_LOAD_PERCENT times over, and the batches
+ * in between are skipped (and counted). At 4800 baud that is about three batches a second; at
+ * 38400 and above every batch goes.
+ */
+
+#include <HardwareSerial.h>
+
+#define NMEA_SERIAL Serial2
+#ifndef NMEA_SERIAL_TX_PIN
+#define NMEA_SERIAL_TX_PIN 17
+#endif
+#ifndef NMEA_SERIAL_RX_PIN
+#define NMEA_SERIAL_RX_PIN 16
+#endif
+#define NMEA_SERIAL_TX_BUFFER 512     //about a second at 4800 baud
+#define NMEA_SERIAL_MAX_DELAY_MS 250  //longest a sentence may wait in the ring
+#define NMEA_SERIAL_LOAD_PERCENT 50   //share of the line the heading output may use
+
+uint32_t nmeaSerialBaud = 4800;
+uint32_t nmeaSerialLimit = 0;         //bytes allowed to queue at the current baud rate
+uint32_t nmeaSerialLastMs = 0;        //millis() when the last batch was queued
+uint32_t nmeaSerialSkipped = 0;       //batches left out to keep within the baud rate
+uint32_t nmeaSerialSentences = 0;
+uint32_t nmeaSerialBytes = 0;
+uint32_t nmeaSerialDropped = 0;       //sentences that would have waited too long
+
+//10 bits a character with the start and stop bits
+void nmeaSerialSetLimit(uint32_t baud) {
+  nmeaSerialBaud = baud;
+  nmeaSerialLimit = min((uint32_t)NMEA_SERIAL_TX_BUFFER, baud / 10 * NMEA_SERIAL_MAX_DELAY_MS / 1000);
+}
+
+void nmeaSerialBegin(uint32_t baud) {
+  nmeaSerialSetLimit(baud);
+  NMEA_SERIAL.setTxBufferSize(NMEA_SERIAL_TX_BUFFER);   //must be before begin()
+  NMEA_SERIAL.begin(baud, SERIAL_8N1, NMEA_SERIAL_RX_PIN, NMEA_SERIAL_TX_PIN);
+}
+
+void nmeaSerialBaudRate(uint32_t baud) {
+  NMEA_SERIAL.updateBaudRate(baud);
+  nmeaSerialSetLimit(baud);
+}
+
+//Queue a batch of CR LF terminated sentences, unless the line is still busy with the last
+//one. Never blocks
+void nmeaSerialSend(const char *line, int length) {
+  const char *end = line + length, *nl;
+  uint32_t now = millis();
+
+  if (now - nmeaSerialLastMs < (uint32_t)length * 10 * 1000 * 100 / (nmeaSerialBaud * NMEA_SERIAL_LOAD_PERCENT)) {
+    nmeaSerialSkipped++;
+    return;
+  }
+  nmeaSerialLastMs = now;
+
+  for (; line < end; line = nl + 1) {
+    if ((nl = (const char *)memchr(line, '\n', end - line)) == NULL) nl = end - 1;
+    int n = nl + 1 - line;
+    //What is free less the part of the ring we keep empty
+    if (NMEA_SERIAL.availableForWrite() - (int)(NMEA_SERIAL_TX_BUFFER - nmeaSerialLimit) < n) {
+      nmeaSerialDropped++;
+      continue;
+    }
+    NMEA_SERIAL.write((const uint8_t *)line, n);
+    nmeaSerialSentences++;
+    nmeaSerialBytes += n;
+  }
+}
+
+#endif
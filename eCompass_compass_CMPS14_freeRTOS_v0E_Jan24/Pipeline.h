@@ -0,0 +1,232 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+/*
+ * Sensor to output pipeline
+ *
+ * A heading goes from the CMPS14 to the NMEA clients through five stages:
+ *
+ *   acquire    updateHDG task   reads the CMPS14s, every sample period (see Power.h)
+ *   correct    Heading task     picks the heading source (chip or fusion), applies the compass
+ *                               cards and votes between the sensors (see Vote.h)
+ *   filter     Heading task     damps the heading and publishes it to the rest of the unit
+ *   encode     Encode task      works out which NMEA profiles are due and encodes their sentences
+ *   fan out    Output task      puts each profile's batch together and sends it, wired and WiFi
+ *
+ * Only acquire runs on a clock. The other tasks block on their input queue and run as soon
+ * as they are fed, so the heading goes out straight after it is read, rather than waiting for
+ * an Output tick that beats against the sample period. Correct and filter are a few
+ * microseconds of arithmetic and share a task. Sending to the clients is the slow part, so fan
+ * out has a task of its own at a lower priority, and the next sample can be encoded while the
+ * last one is still being sent.
+ *
+ * Nothing is copied from stage to stage. A sample is a buffer from a fixed pool, and the
+ * queues carry pointers to it. Encode attaches a buffer of sentences from a second pool, and
+ * fan out gives both back when it is done. A stage never waits for the next one. If a queue
+ * is full, or a pool is empty, the sample is dropped and counted. The queue depths and the time
+ * spent in each stage are kept for tuning - "pipeline" on the console, and /metrics.
+ */
+
+#include "BuildProfile.h"
+#include "Cmps14.h"
+#include "NMEA.hpp"
+#include "NmeaProfiles.h"
+#include "Trace.h"
+
+#ifndef PIPE_SAMPLES
+#define PIPE_SAMPLES 8            //samples in flight - one or two in normal running
+#endif
+#ifndef PIPE_BATCHES
+#define PIPE_BATCHES 4            //sets of encoded sentences in flight
+#endif
+#define PIPE_QUEUE_DEPTH 4
+#ifndef HEADING_DAMPING_MS
+#define HEADING_DAMPING_MS 0      //time constant of the filter stage, 0 to pass the heading straight through
+#endif
+
+enum PipeStageId { STAGE_ACQUIRE, STAGE_CORRECT, STAGE_FILTER, STAGE_ENCODE, STAGE_FANOUT, NUM_PIPE_STAGES };
+const char * const pipeStageNames[NUM_PIPE_STAGES] = { "acquire", "correct", "filter", "encode", "fanout" };
+
+//The queues between the tasks, by the stage they feed
+enum PipeQueueId { QUEUE_CORRECT, QUEUE_ENCODE, QUEUE_FANOUT, NUM_PIPE_QUEUES };
+const char * const pipeQueueNames[NUM_PIPE_QUEUES] = { "correct", "encode", "fanout" };
+
+//The sentences encoded from one sample. Each buffer has message objects of its own, so one
+//batch can be encoded while the one before it is still going out
+struct PipeSentences {
+  HDMmessage hdm;
+  HDGmessage hdg;
+  HDTmessage hdt;
+  ROTmessage rot;
+#if FEATURE_SEA_STATE
+  XDRmessage xdr;
+#endif
+  const char *sentence[NUM_SENTENCES];   //into the messages above, NULL if not going out
+};
+
+struct PipeSample {
+  //Acquire
+  SampleStatus status;           //SAMPLE_OK if any of the sensors answered
+  SampleStatus sensorStatus[CMPS_MAX_SENSORS];
+  int16_t sensorBearing[CMPS_MAX_SENSORS];   //degrees, as each sensor read it
+  uint32_t tickMs;               //wake time of the acquire period - the profiles are timed by this
+  uint32_t sampledUs;            //micros() when it was read
+  int16_t sensorHeading;         //degrees, of the main sensor
+  float yawRate;                 //degrees per second, positive to starboard
+  int8_t pitch, roll;            //degrees, of the last good sample
+  uint8_t calibration;
+  bool recorded;                 //the raw registers went to the recorder (see Recorder.h)
+  //Correct and filter
+  uint16_t heading;              //boat heading, of the last good sample
+  //Encode
+  uint8_t due;                   //a bit for each NMEA profile this sample goes to
+  PipeSentences *sentences;
+};
+
+struct PipeStageStats {
+  uint32_t items;
+  uint64_t totalUs;
+  uint32_t maxUs;
+};
+
+struct PipeQueueStats {
+  QueueHandle_t queue;
+  uint32_t maxDepth;             //deepest it has been
+  uint32_t drops;                //it was full, so the sample was thrown away
+};
+
+PipeSample pipeSamples[PIPE_SAMPLES];
+PipeSentences pipeSentences[PIPE_BATCHES];
+QueueHandle_t pipeFreeSamples, pipeFreeSentences;     //the pools - pointers to the free buffers
+PipeQueueStats pipeQueues[NUM_PIPE_QUEUES];
+PipeStageStats pipeStages[NUM_PIPE_STAGES];
+uint32_t pipeSamplesMinFree = PIPE_SAMPLES, pipeSentencesMinFree = PIPE_BATCHES;
+uint32_t pipePoolEmpty = 0;      //a stage wanted a buffer and there was none
+
+//Called once by setup(), before the acquisition tasks start
+void pipelineBegin() {
+  pipeFreeSamples = xQueueCreate(PIPE_SAMPLES, sizeof(PipeSample *));
+  for (int i = 0; i < PIPE_SAMPLES; i++) {
+    PipeSample *s = &pipeSamples[i];
+    xQueueSend(pipeFreeSamples, &s, 0);
+  }
+  pipeFreeSentences = xQueueCreate(PIPE_BATCHES, sizeof(PipeSentences *));
+  for (int i = 0; i < PIPE_BATCHES; i++) {
+    PipeSentences *b = &pipeSentences[i];
+    xQueueSend(pipeFreeSentences, &b, 0);
+  }
+  for (int q = 0; q < NUM_PIPE_QUEUES; q++)
+    pipeQueues[q].queue = xQueueCreate(PIPE_QUEUE_DEPTH, sizeof(PipeSample *));
+}
+
+//The pool slot of a sample, for anything kept alongside it
+inline int pipeSampleIndex(const PipeSample *s) {
+  return s - pipeSamples;
+}
+
+//A free sample, or NULL if they are all in use
+PipeSample *pipeSampleGet() {
+  PipeSample *s;
+  if (xQueueReceive(pipeFreeSamples, &s, 0) != pdTRUE) {
+    pipePoolEmpty++;
+    return NULL;
+  }
+  uint32_t free = uxQueueMessagesWaiting(pipeFreeSamples);
+  if (free < pipeSamplesMinFree) pipeSamplesMinFree = free;
+  s->recorded = false;
+  s->due = 0;
+  s->sentences = NULL;
+  return s;
+}
+
+//Attach a free set of sentences to a sample. False if there is none
+bool pipeSentencesGet(PipeSample *s) {
+  PipeSentences *b;
+  if (xQueueReceive(pipeFreeSentences, &b, 0) != pdTRUE) {
+    pipePoolEmpty++;
+    return false;
+  }
+  uint32_t free = uxQueueMessagesWaiting(pipeFreeSentences);
+  if (free < pipeSentencesMinFree) pipeSentencesMinFree = free;
+  for (int i = 0; i < NUM_SENTENCES; i++) b->sentence[i] = NULL;
+  s->sentences = b;
+  return true;
+}
+
+//Give a sample, and its sentences if it has any, back to the pools
+void pipeSampleFree(PipeSample *s) {
+  if (s->sentences != NULL) xQueueSend(pipeFreeSentences, &s->sentences, 0);
+  s->sentences = NULL;
+  xQueueSend(pipeFreeSamples, &s, 0);
+}
+
+//Hand a sample on to the next stage. Never waits - if that stage is so far behind that its
+//queue is full the sample is dropped
+void pipeSend(PipeQueueId q, PipeSample *s) {
+  PipeQueueStats *stats = &pipeQueues[q];
+  if (xQueueSend(stats->queue, &s, 0) != pdTRUE) {
+    stats->drops++;
+    pipeSampleFree(s);
+    return;
+  }
+  uint32_t depth = uxQueueMessagesWaiting(stats->queue);
+  if (depth > stats->maxDepth) stats->maxDepth = depth;
+}
+
+//Wait up to wait ticks for the next sample from queue q. NULL if none came
+PipeSample *pipeReceive(PipeQueueId q, TickType_t wait) {
+  PipeSample *s;
+  TRACE_END(TRACE_RUN);
+  BaseType_t got = xQueueReceive(pipeQueues[q].queue, &s, wait);
+  TRACE_BEGIN(TRACE_RUN);
+  return got == pdTRUE ? s : NULL;
+}
+
+//Filter stage - damp the heading with a time constant of HEADING_DAMPING_MS. A heading
+//that swings across north is damped the short way round. The state is the caller's, so a
+//replay (see Recorder.h) filters its own heading and leaves the live one alone
+struct HeadingFilter {
+  float damped = -1;             //-1 to start from the next heading
+};
+
+int filterHeading(HeadingFilter *f, int heading, uint32_t periodMs) {
+#if HEADING_DAMPING_MS > 0
+  if (f->damped < 0) f->damped = heading;
+  float diff = heading - f->damped;
+  if (diff > 180) diff -= 360;
+  else if (diff < -180) diff += 360;
+  f->damped += diff * periodMs / (HEADING_DAMPING_MS + periodMs);
+  if (f->damped < 0) f->damped += 360;
+  else if (f->damped >= 360) f->damped -= 360;
+  return (int)(f->damped + 0.5) % 360;
+#else
+  return heading;
+#endif
+}
+
+//A stage is done with a sample it started on at startUs (micros())
+void pipeStageDone(PipeStageId stage, uint32_t startUs) {
+  PipeStageStats *stats = &pipeStages[stage];
+  uint32_t us = micros() - startUs;
+  stats->items++;
+  stats->totalUs += us;
+  if (us > stats->maxUs) stats->maxUs = us;
+}
+
+void pipelineStatus(Print &out) {
+  out.print("Stage      Samples   Mean us   Max us\n");
+  for (int i = 0; i < NUM_PIPE_STAGES; i++) {
+    PipeStageStats *s = &pipeStages[i];
+    out.printf("%-8s %9u %9.1f %8u\n", pipeStageNames[i], s->items,
+               s->items > 0 ? (double)s->totalUs / s->items : 0.0, s->maxUs);
+  }
+  out.print("Queue      Depth   Max  Dropped\n");
+  for (int q = 0; q < NUM_PIPE_QUEUES; q++) {
+    PipeQueueStats *s = &pipeQueues[q];
+    out.printf("%-8s %7u %5u %8u\n", pipeQueueNames[q], (unsigned)uxQueueMessagesWaiting(s->queue), s->maxDepth, s->drops);
+  }
+  out.printf("Samples free %u of %d (lowest %u), sentences free %u of %d (lowest %u), pool empty %u\n",
+             (unsigned)uxQueueMessagesWaiting(pipeFreeSamples), PIPE_SAMPLES, pipeSamplesMinFree,
+             (unsigned)uxQueueMessagesWaiting(pipeFreeSentences), PIPE_BATCHES, pipeSentencesMinFree, pipePoolEmpty);
+}
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef _POWER_H
+#define _POWER_H
+/*
+ * Adaptive power mode
+ *
+ * The unit runs off the house batteries, so there is no point sampling at full rate
+ * while the boat is lying at anchor. The Heading task feeds every sample (heading and
+ * gyro yaw rate) in here, and once a second the Power task looks at the peak turn rate
+ * and the spread of the headings and picks one of the profiles below. Stepping up to a
+ * busier profile is immediate, stepping down only happens after CALM_TIME_MS of calm.
+ *
+ * Each profile sets the sample and output periods of the acquisition tasks and the CPU
+ * clock. Automatic light sleep and tickless idle are not possible while the soft-AP is
+ * up (the radio has to stay awake to serve the clients), so lowering the clock is the
+ * saving we can actually make between samples.
+ *
+ * The OLED is switched off after OLED_TIMEOUT_MS without anybody pressing the BOOT
+ * button or using the config console, and its task sleeps until woken again. Builds
+ * without the OLED (see BuildProfile.h) leave all of that out.
+ *
+ * Time in each mode and an estimate of the current drawn are kept so different
+ * profiles can be compared.
+ */
+
+#include "BuildProfile.h"
+#if FEATURE_OLED
+#include <Adafruit_SH110X.h>
+#endif
+#include "Tasks.h"
+
+enum PowerMode { POWER_ANCHOR, POWER_CRUISE, POWER_ACTIVE, NUM_POWER_MODES };
+
+struct PowerProfile {
+  const char *name;
+  uint32_t samplePeriodMs;   //updateHDG task period
+  uint32_t outputPeriodMs;   //standard NMEA profile period
+  uint32_t cpuMHz;
+  float currentMa;           //estimated supply current in this mode with the OLED off
+};
+
+//Ceiling (anchor) to floor (active) periods. Cruise is the original 10Hz / 5Hz
+PowerProfile powerProfiles[NUM_POWER_MODES] = {
+  // name      sample  output  MHz  mA
+  { "anchor",  500,    1000,   80,  95  },
+  { "cruise",  100,    200,    160, 110 },
+  { "active",  50,     100,    240, 130 }
+};
+
+#define OLED_CURRENT_MA 12
+
+#define RATE_ACTIVE_DPS 6.0    //peak yaw rate that puts us into active mode
+#define RATE_CALM_DPS 1.0      //below this (and a steady heading) we are at anchor
+#define SPREAD_ACTIVE_DEG 10.0 //standard deviation of heading over the last second
+#define SPREAD_CALM_DEG 2.0
+#define CALM_TIME_MS 60000     //how long things must be calm before stepping down a mode
+
+#define OLED_TIMEOUT_MS 300000 //display off after 5 minutes of nobody using it
+#define OLED_WAKE_PIN 0        //BOOT button on the ESP32 devkit
+
+#if FEATURE_OLED
+extern Adafruit_SH1106G display;
+#endif
+extern uint32_t nmeaOutputPeriodMs;    //see NmeaProfiles.h
+
+PowerMode powerMode = POWER_CRUISE;
+uint32_t powerModeMs[NUM_POWER_MODES] = {0, 0, 0};
+float energyUsedMah = 0;
+#if FEATURE_OLED
+volatile bool oledOn = true;
+#endif
+volatile unsigned long lastUserActivity = 0;
+
+//Sample statistics for the current one second window, written by the Heading task
+portMUX_TYPE powerStatsMux = portMUX_INITIALIZER_UNLOCKED;
+float headingSinSum = 0, headingCosSum = 0, peakYawRate = 0;
+unsigned headingSamples = 0;
+
+//Called by the Heading task for every sample
+void powerSample(int heading, float yawRate) {
+  float rad = heading * DEG_TO_RAD;
+  portENTER_CRITICAL(&powerStatsMux);
+  headingSinSum += sin(rad);
+  headingCosSum += cos(rad);
+  headingSamples++;
+  if (fabs(yawRate) > peakYawRate) peakYawRate = fabs(yawRate);
+  portEXIT_CRITICAL(&powerStatsMux);
+}
+
+//Somebody is using the unit - keep (or switch) the display on
+void userActivity() {
+  lastUserActivity = millis();
+}
+
+#if FEATURE_OLED
+void IRAM_ATTR oledWakeISR() {
+  lastUserActivity = millis();
+}
+#endif
+
+float estimatedCurrentMa() {
+#if FEATURE_OLED
+  return powerProfiles[powerMode].currentMa + (oledOn ? OLED_CURRENT_MA : 0);
+#else
+  return powerProfiles[powerMode].currentMa;
+#endif
+}
+
+void setPowerMode(PowerMode mode) {
+  TaskConfig *t;
+  powerMode = mode;
+  if ((t = findTask("updateHDG")) != NULL) t->periodMs = powerProfiles[mode].samplePeriodMs;
+  nmeaOutputPeriodMs = powerProfiles[mode].outputPeriodMs;
+  setCpuFrequencyMhz(powerProfiles[mode].cpuMHz);
+  TRACE_SYNC();     //the cycle counters now run at the new rate
+  Serial.printf("Power mode %s\n", powerProfiles[mode].name);
+}
+
+#if FEATURE_OLED
+//Called by displayHeadings() before every update. Blocks while the display is off
+void oledWait() {
+  if (oledOn) return;
+  cmpsBusLock(0);
+  display.oled_command(SH110X_DISPLAYOFF);
+  cmpsBusUnlock(0);
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  cmpsBusLock(0);
+  display.oled_command(SH110X_DISPLAYON);
+  cmpsBusUnlock(0);
+}
+#endif
+
+void powerSetup() {
+#if FEATURE_OLED
+  pinMode(OLED_WAKE_PIN, INPUT_PULLUP);
+  attachInterrupt(OLED_WAKE_PIN, oledWakeISR, FALLING);
+#endif
+  lastUserActivity = millis();
+  setPowerMode(POWER_CRUISE);
+}
+
+//Once a second - choose the power mode, gate the OLED and update the counters
+void managePower(void * pvParameters) {
+  TickType_t xLastWakeTime = xTaskGetTickCount(); //Runs every periodMs from the task table
+  unsigned long lastRun = millis(), calmSince = millis();
+  float s, c, rate, spread;
+  unsigned n;
+
+  for (;;) {
+    waitForNextPeriod(pvParameters, &xLastWakeTime);
+    TRACE_SYNC();     //keeps the tracepoint timestamps within a second of a sync
+
+    unsigned long now = millis();
+    powerModeMs[powerMode] += now - lastRun;
+    energyUsedMah += estimatedCurrentMa() * (now - lastRun) / 3600000.0;
+    lastRun = now;
+
+    portENTER_CRITICAL(&powerStatsMux);
+    s = headingSinSum; c = headingCosSum; n = headingSamples; rate = peakYawRate;
+    headingSinSum = headingCosSum = peakYawRate = 0;
+    headingSamples = 0;
+    portEXIT_CRITICAL(&powerStatsMux);
+
+    if (n > 0) {
+      //Circular standard deviation of the headings, in degrees
+      float r = sqrt(s * s + c * c) / n;
+      spread = r >= 1.0 ? 0 : sqrt(-2.0 * log(r)) * RAD_TO_DEG;
+
+      PowerMode wanted = POWER_CRUISE;
+      if (rate > RATE_ACTIVE_DPS || spread > SPREAD_ACTIVE_DEG) wanted = POWER_ACTIVE;
+      else if (rate < RATE_CALM_DPS && spread < SPREAD_CALM_DEG) wanted = POWER_ANCHOR;
+
+      if (wanted > powerMode) {
+        setPowerMode(wanted);
+        calmSince = now;
+      } else if (wanted == powerMode) {
+        calmSince = now;
+      } else if (now - calmSince > CALM_TIME_MS) {
+        setPowerMode((PowerMode)(powerMode - 1));
+        calmSince = now;
+      }
+    }
+
+#if FEATURE_OLED
+    //Display gating
+    TaskConfig *oled = findTask("updateOLED");
+    if (oledOn && now - lastUserActivity > OLED_TIMEOUT_MS) {
+      oledOn = false;
+    } else if (!oledOn && now - lastUserActivity <= OLED_TIMEOUT_MS) {
+      oledOn = true;
+      if (oled != NULL) xTaskNotifyGive(oled->handle);
+    }
+#endif
+  }
+}
+
+#endif
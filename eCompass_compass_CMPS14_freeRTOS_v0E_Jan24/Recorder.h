@@ -0,0 +1,427 @@
+#ifndef _RECORDER_H
+#define _RECORDER_H
+/*
+ * Raw sensor recorder and replay
+ *
+ * While recording, updateHeading() reads the whole CMPS14 register block (bearing,
+ * pitch/roll, magnetometer, accelerometer, gyro) in one burst each sample and passes it
+ * here together with the calibration byte and the boat heading it worked out. The
+ * samples are packed into RECORD_BLOCK_SIZE byte blocks and the Recorder task appends
+ * each full block to RECORD_FILE on SPIFFS.
+ *
+ * Block layout (all multi-byte values little endian)
+ *   magic (1)  sample count (1)  payload length (2)  payload  Fletcher16 of payload (2)
+ *
+ * The first sample in a block is stored as-is, the rest as differences from the sample
+ * before, with the time and every field written as a zigzag varint - a slowly changing
+ * heading costs about one byte per field, so a sample is typically 15-20 bytes and an
+ * hour at 10Hz is well under 1MB. Each block stands alone, so a damaged block only loses
+ * its own samples. A new recording is added to the end of the file, until it is erased.
+ *
+ * A replay reads a recording back through the same compass card correction, filter and
+ * NMEA encoding as the live heading, as fast as possible or at a multiple of real time, and
+ * writes what it produced to REPLAY_FILE. The boat heading from the recording is kept in
+ * each sample, so the replay counts the samples where this firmware disagrees with the
+ * one that made the recording, and the digest of the output lines makes it easy to tell
+ * whether two firmware versions produce identical output. Both files are under /public
+ * so they can be downloaded from the web server. Each recording in the file is timed from
+ * the boot it was made in, so the replay takes a step back in time, or a gap longer than any
+ * sample period, as the start of the next recording and joins it on to the end of the last.
+ */
+
+#include <SPIFFS.h>
+#include "Configuration.h"
+#include "Tasks.h"
+#include "NMEA.hpp"
+#include "Pipeline.h"
+
+#define RECORD_FILE "/public/record.bin"
+#define REPLAY_FILE "/public/replay.csv"
+
+#define RECORD_BLOCK_SIZE 512
+#define RECORD_BLOCK_MAGIC 0xB7
+#define RECORD_HEADER_SIZE 4
+#define RECORD_TRAILER_SIZE 2
+#define RECORD_PAYLOAD_SIZE (RECORD_BLOCK_SIZE - RECORD_HEADER_SIZE - RECORD_TRAILER_SIZE)
+#define RECORD_SPIFFS_RESERVE (8 * RECORD_BLOCK_SIZE) //stop recording when SPIFFS gets this full
+#define REPLAY_MAX_GAP_MS 5000                        //longer between samples is another recording
+
+//Fields of a sample, in the order they are encoded
+enum RawField {
+  RAW_BEARING,                                  //tenths of a degree
+  RAW_PITCH, RAW_ROLL,                          //degrees
+  RAW_MAGX, RAW_MAGY, RAW_MAGZ,
+  RAW_ACCELX, RAW_ACCELY, RAW_ACCELZ,
+  RAW_GYROX, RAW_GYROY, RAW_GYROZ,
+  RAW_CALIBRATION,
+  RAW_BOAT_HEADING,                             //what the recording firmware made of the main sensor
+  RAW_FIELDS
+};
+
+#define RAW_BURST_START BEARING_Register
+#define RAW_BURST_BYTES (GYROZ_Register + 2 - BEARING_Register)
+#define RECORD_MAX_SAMPLE_BYTES (5 + 3 * RAW_FIELDS) //worst case varint lengths
+
+struct RawSample {
+  uint32_t ms;
+  int16_t field[RAW_FIELDS];
+};
+
+struct RecordBlock {
+  uint8_t data[RECORD_BLOCK_SIZE];
+  uint16_t length;          //payload bytes used
+  uint8_t samples;
+  RawSample last;           //for the deltas
+};
+
+struct ReplayResult {
+  bool running;
+  uint32_t samples;
+  uint32_t mismatches;      //boat heading differs from the recording
+  uint32_t badBlocks;
+  uint32_t digest;          //FNV-1a of the output lines
+  uint32_t elapsedMs;
+  uint32_t recordedMs;      //span of the recordings, end to end
+  uint32_t recordings;
+};
+
+volatile bool recording = false;
+volatile bool recordStopping = false;
+uint32_t recordedSamples = 0, recordedBlocks = 0, recordDroppedBlocks = 0;
+
+RecordBlock recordBlocks[2];
+int recordFilling = 0;
+volatile int recordReady = -1;    //block waiting to be written, if any
+File recordFile;
+portMUX_TYPE recordMux = portMUX_INITIALIZER_UNLOCKED;
+
+ReplayResult replayResult;
+uint32_t replaySpeed = 0;
+TaskHandle_t replayTask = NULL;
+
+/*
+ * Encoding
+ */
+
+uint8_t *putVarint(uint8_t *p, uint32_t value) {
+  while (value >= 0x80) {
+    *p++ = value | 0x80;
+    value >>= 7;
+  }
+  *p++ = value;
+  return p;
+}
+
+const uint8_t *getVarint(const uint8_t *p, const uint8_t *end, uint32_t *value) {
+  uint32_t result = 0;
+  for (int shift = 0; p < end && shift < 35; shift += 7) {
+    uint8_t b = *p++;
+    result |= (uint32_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) {
+      *value = result;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+inline uint32_t zigzag(int32_t n) { return ((uint32_t)n << 1) ^ (uint32_t)(n >> 31); }
+inline int32_t unzigzag(uint32_t n) { return (int32_t)(n >> 1) ^ -(int32_t)(n & 1); }
+
+void recordBlockReset(RecordBlock *b) {
+  b->length = 0;
+  b->samples = 0;
+  memset(&b->last, 0, sizeof(b->last));
+}
+
+//Append a sample to a block. Returns false if it would not fit
+bool recordBlockAdd(RecordBlock *b, const RawSample *s) {
+  if (b->length + RECORD_MAX_SAMPLE_BYTES > RECORD_PAYLOAD_SIZE || b->samples == 255) return false;
+  uint8_t *p = b->data + RECORD_HEADER_SIZE + b->length;
+  p = putVarint(p, s->ms - b->last.ms);
+  for (int i = 0; i < RAW_FIELDS; i++)
+    p = putVarint(p, zigzag(s->field[i] - b->last.field[i]));
+  b->length = p - (b->data + RECORD_HEADER_SIZE);
+  b->samples++;
+  b->last = *s;
+  return true;
+}
+
+//Fill in the header and checksum. Returns the number of bytes to write
+int recordBlockClose(RecordBlock *b) {
+  uint8_t *payload = b->data + RECORD_HEADER_SIZE;
+  uint16_t checkSum = Fletcher16(payload, b->length);
+  b->data[0] = RECORD_BLOCK_MAGIC;
+  b->data[1] = b->samples;
+  b->data[2] = b->length & 0xFF;
+  b->data[3] = b->length >> 8;
+  payload[b->length] = checkSum & 0xFF;
+  payload[b->length + 1] = checkSum >> 8;
+  return RECORD_HEADER_SIZE + b->length + RECORD_TRAILER_SIZE;
+}
+
+//Decode one block's payload. Calls handler for each sample and returns the sample count,
+//or -1 if the payload is inconsistent
+int recordBlockDecode(const uint8_t *payload, int length, int count, void (*handler)(const RawSample *, void *), void *context) {
+  const uint8_t *p = payload, *end = payload + length;
+  RawSample s;
+  uint32_t value;
+
+  memset(&s, 0, sizeof(s));
+  for (int n = 0; n < count; n++) {
+    if ((p = getVarint(p, end, &value)) == NULL) return -1;
+    s.ms += value;
+    for (int i = 0; i < RAW_FIELDS; i++) {
+      if ((p = getVarint(p, end, &value)) == NULL) return -1;
+      s.field[i] += unzigzag(value);
+    }
+    handler(&s, context);
+  }
+  return p == end ? count : -1;
+}
+
+/*
+ * Recording - the acquisition side
+ */
+
+//Read all the raw registers in one go. Called by updateHeading() while recording
+bool recordAcquire(RawSample *s) {
+  uint8_t buf[RAW_BURST_BYTES];
+
+  if (!cmpsReadRegisters(RAW_BURST_START, buf, RAW_BURST_BYTES)) return false;
+  s->ms = millis();
+  s->field[RAW_BEARING] = (buf[0] << 8) | buf[1];
+  s->field[RAW_PITCH] = (int8_t)buf[PITCH_Register - RAW_BURST_START];
+  s->field[RAW_ROLL] = (int8_t)buf[ROLL_Register - RAW_BURST_START];
+  for (int i = 0; i < 9; i++) {
+    const uint8_t *word = &buf[MAGNETX_Register - RAW_BURST_START + 2 * i];
+    s->field[RAW_MAGX + i] = (int16_t)((word[0] << 8) | word[1]);
+  }
+  return true;
+}
+
+//Hand a full block over to the Recorder task. If it still hasn't written the last one
+//the block is dropped, rather than ever holding up the acquisition task
+void recordHandOver() {
+  portENTER_CRITICAL(&recordMux);
+  if (recordReady < 0) {
+    recordReady = recordFilling;
+    recordFilling = 1 - recordFilling;
+  } else recordDroppedBlocks++;
+  portEXIT_CRITICAL(&recordMux);
+  recordBlockReset(&recordBlocks[recordFilling]);
+}
+
+//Add a complete sample (including the calibration byte and boat heading) to the recording
+void recordPut(const RawSample *s) {
+  RecordBlock *b = &recordBlocks[recordFilling];
+
+  if (!recordBlockAdd(b, s)) {
+    recordHandOver();
+    recordBlockAdd(&recordBlocks[recordFilling], s);
+  }
+  recordedSamples++;
+
+  //Hand over the last partial block once the Recorder task has room for it
+  if (recordStopping && recordReady < 0) {
+    recordHandOver();
+    recording = false;
+    recordStopping = false;
+  }
+}
+
+/*
+ * Recording - the file side
+ */
+
+bool recordStart() {
+  if (recording) return true;
+  recordFile = SPIFFS.open(RECORD_FILE, FILE_APPEND);
+  if (!recordFile) return false;
+  recordBlockReset(&recordBlocks[0]);
+  recordBlockReset(&recordBlocks[1]);
+  recordFilling = 0;
+  recordReady = -1;
+  recordedSamples = recordedBlocks = recordDroppedBlocks = 0;
+  recordStopping = false;
+  recording = true;
+  return true;
+}
+
+//The acquisition task finishes off the last block on its next sample
+void recordStop() {
+  if (recording) recordStopping = true;
+}
+
+void recordErase() {
+  if (!recording) SPIFFS.remove(RECORD_FILE);
+}
+
+//Periodic task - write out any finished block, close the file when the recording stops
+void recorderTask(void *pvParameters) {
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+
+  for (;;) {
+    int ready = recordReady;
+    if (ready >= 0) {
+      RecordBlock *b = &recordBlocks[ready];
+      if (b->samples > 0) {
+        int length = recordBlockClose(b);
+        if (recordFile.write(b->data, length) == length) recordedBlocks++;
+        else recordDroppedBlocks++;
+      }
+      recordReady = -1;
+    }
+    if (recordFile && !recording && recordReady < 0) {
+      recordFile.close();
+      Serial.printf("Recording stopped, %u samples in %u blocks, %u blocks dropped\n", recordedSamples, recordedBlocks, recordDroppedBlocks);
+    }
+    //Don't fill the filesystem - the configuration and web app live there too
+    if (recording && !recordStopping && SPIFFS.totalBytes() - SPIFFS.usedBytes() < RECORD_SPIFFS_RESERVE) {
+      Serial.println("SPIFFS full, stopping recording");
+      recordStop();
+    }
+    waitForNextPeriod(pvParameters, &xLastWakeTime);
+  }
+}
+
+void recordStatus(Print &out) {
+  out.printf("Recording: %s, %u samples, %u blocks written, %u dropped\n",
+             recording ? "on" : "off", recordedSamples, recordedBlocks, recordDroppedBlocks);
+  File f = SPIFFS.open(RECORD_FILE);
+  if (f) {
+    out.printf("%s: %u bytes\n", RECORD_FILE, (unsigned)f.size());
+    f.close();
+  }
+  out.printf("SPIFFS: %u of %u bytes used\n", (unsigned)SPIFFS.usedBytes(), (unsigned)SPIFFS.totalBytes());
+}
+
+/*
+ * Replay
+ */
+
+struct ReplayContext {
+  File out;
+  HDMmessage hdm;
+  HeadingFilter filter;
+  int sensor;               //the last good bearing
+  int heading;              //filtered, as sent
+  uint32_t firstMs, lastMs; //of the recording being replayed
+  uint32_t baseMs;          //length of the recordings before it
+  unsigned long started;
+};
+
+uint32_t fnv1a(uint32_t hash, const char *s) {
+  while (*s) {
+    hash ^= (uint8_t)*s++;
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+void replaySample(const RawSample *s, void *context) {
+  ReplayContext *r = (ReplayContext *)context;
+  char line[80];
+
+  //The start of the next recording. Its times start again from its own boot, and its
+  //filter from its first heading
+  uint32_t periodMs = s->ms - r->lastMs;
+  if (replayResult.samples == 0 || s->ms < r->lastMs || s->ms - r->lastMs > REPLAY_MAX_GAP_MS) {
+    if (replayResult.samples > 0) r->baseMs += r->lastMs - r->firstMs;
+    r->firstMs = s->ms;
+    r->filter = HeadingFilter();
+    periodMs = 0;
+    replayResult.recordings++;
+  }
+  r->lastMs = s->ms;
+  uint32_t ms = r->baseMs + (s->ms - r->firstMs);
+
+  //Keep to replaySpeed times real time
+  if (replaySpeed > 0) {
+    uint32_t due = ms / replaySpeed;
+    uint32_t now = millis() - r->started;
+    if (due > now) vTaskDelay(pdMS_TO_TICKS(due - now));
+  }
+
+  //The same steps as the correct, filter and encode stages (see Pipeline.h), the filter over
+  //the recorded time between samples. An out of range bearing keeps the last good one, as
+  //Cmps14::acceptBearing() does for the live heading, and like a bad live sample isn't filtered
+  bool good = (uint16_t)s->field[RAW_BEARING] < CMPS_BEARING_LIMIT;
+  if (good) r->sensor = s->field[RAW_BEARING] / 10;
+  int sensor = r->sensor;
+  int boat = correctHeading(sensor);
+  if (good) r->heading = filterHeading(&r->filter, boat, periodMs);
+  r->hdm.update(r->heading);
+
+  sprintf(line, "%u,%d,%d,%d,%s\n", ms, sensor, boat, s->field[RAW_BOAT_HEADING], r->hdm.msgString);
+  r->out.print(line);
+  replayResult.digest = fnv1a(replayResult.digest, line);
+  if (boat != s->field[RAW_BOAT_HEADING]) replayResult.mismatches++;
+  replayResult.samples++;
+}
+
+void replayRun(void *pvParameters) {
+  ReplayContext r;
+  uint8_t block[RECORD_BLOCK_SIZE];
+
+  File in = SPIFFS.open(RECORD_FILE);
+  r.out = SPIFFS.open(REPLAY_FILE, FILE_WRITE);
+  r.out.print("ms,sensor,boat,recorded,nmea\n");
+  r.started = millis();
+  r.firstMs = r.lastMs = r.baseMs = 0;
+  r.sensor = r.heading = 0;
+
+  while (in && in.read(block, RECORD_HEADER_SIZE) == RECORD_HEADER_SIZE) {
+    //Resynchronise on the next magic byte after a damaged block
+    if (block[0] != RECORD_BLOCK_MAGIC) {
+      replayResult.badBlocks++;
+      while (in.available() && in.peek() != RECORD_BLOCK_MAGIC) in.read();
+      continue;
+    }
+    int count = block[1];
+    int length = block[2] | (block[3] << 8);
+    if (length > RECORD_PAYLOAD_SIZE ||
+        in.read(block + RECORD_HEADER_SIZE, length + RECORD_TRAILER_SIZE) != length + RECORD_TRAILER_SIZE) {
+      replayResult.badBlocks++;
+      continue;
+    }
+    const uint8_t *payload = block + RECORD_HEADER_SIZE;
+    uint16_t checkSum = payload[length] | (payload[length + 1] << 8);
+    if (Fletcher16(payload, length) != checkSum || recordBlockDecode(payload, length, count, replaySample, &r) < 0)
+      replayResult.badBlocks++;
+  }
+  in.close();
+  r.out.close();
+
+  replayResult.elapsedMs = millis() - r.started;
+  replayResult.recordedMs = r.baseMs + r.lastMs - r.firstMs;
+  replayResult.running = false;
+  Serial.printf("Replay done, %u samples, %u mismatches, digest %08x\n", replayResult.samples, replayResult.mismatches, replayResult.digest);
+  replayTask = NULL;
+  vTaskDelete(NULL);
+}
+
+//Start a replay of the recording. speed 0 runs flat out, otherwise a multiple of real time
+bool replayStart(uint32_t speed) {
+  if (replayResult.running || recording || recordFile || !SPIFFS.exists(RECORD_FILE)) return false;
+  memset(&replayResult, 0, sizeof(replayResult));
+  replayResult.digest = 2166136261;
+  replayResult.running = true;
+  replaySpeed = speed;
+  if (xTaskCreatePinnedToCore(replayRun, "Replay", 6000, NULL, 1, &replayTask, NETWORK_CORE) != pdPASS) {
+    replayResult.running = false;
+    return false;
+  }
+  return true;
+}
+
+void replayStatus(Print &out) {
+  ReplayResult *r = &replayResult;
+  out.printf("Replay: %s, %u samples in %u recordings, %u mismatches, %u bad blocks\n", r->running ? "running" : "idle",
+             r->samples, r->recordings, r->mismatches, r->badBlocks);
+  if (!r->running && r->samples > 0)
+    out.printf("%u ms of recording in %u ms (%ux), output digest %08x in %s\n", r->recordedMs, r->elapsedMs,
+               r->elapsedMs > 0 ? r->recordedMs / r->elapsedMs : 0, r->digest, REPLAY_FILE);
+}
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef _SEA_STATE_H
+#define _SEA_STATE_H
+/*
+ * Sea state
+ *
+ * Wave period, heave and roll worked out from the CMPS14's accelerometer, for the crew and
+ * for tuning the heading damping (see HEADING_DAMPING_MS in Pipeline.h).
+ *
+ * The SeaSample task reads the accelerometer Y and Z registers of the main sensor at 100Hz,
+ * in one four byte burst. Z, less gravity, is the vertical acceleration, and the roll comes
+ * from the direction of gravity across the boat, as in Fusion.h - it has far finer steps
+ * than the roll register's whole degrees. Every SEA_DECIMATE readings are averaged, which
+ * keeps the swell and throws away the engine and the slamming, and go into a ring holding
+ * the last SEA_FFT_SIZE of them. That is 100 seconds at 5Hz, so a 20 second swell is five
+ * bins up the spectrum and not lost in the leakage from the mean.
+ *
+ * The sampler never waits for the bus: if another task has it, that reading is skipped.
+ * So the heading can only ever be held up by one four byte read in progress, and the
+ * priority inheritance of the bus mutex sees to it that finishes straight away.
+ *
+ * Every SEA_HOP samples (half a window, so the windows overlap by half) the SeaState task,
+ * at the lowest priority on the network core, takes a copy of the ring, applies a Hann
+ * window and runs a single precision radix-2 FFT. Both signals go through the one complex
+ * FFT - acceleration as the real part, roll as the imaginary part - and are separated
+ * afterwards by the symmetry of real signals' spectra. From the spectra, between
+ * SEA_MIN_PERIOD_S and SEA_MAX_PERIOD_S:
+ *
+ *   wave period    peak of the heave spectrum (acceleration divided by (2 pi f)^4)
+ *   zero crossing  sqrt(m0 / m2) of the heave spectrum
+ *   heave          significant height, 4 sqrt(m0) - crest to trough of the highest third
+ *   roll period    peak of the roll spectrum
+ *   roll           significant amplitude, 2 sqrt(m0) - to one side, of the highest third
+ *
+ * The peaks are interpolated between the bins with a parabola. Results are served at
+ * /getSeaState, on "seastate" at the console and in /metrics, and go out as an XDR sentence
+ * to any NMEA client whose profile asks for XDR (see NmeaProfiles.h).
+ *
+ * The analysis is held to SEA_BUDGET_PERCENT of a core, averaged over a hop. One that takes
+ * longer than its share - the CPU is slowed down at anchor, see Power.h - makes the following
+ * windows be skipped until it is paid for. The cycles taken are reported like the fusion's.
+ */
+
+#include "Cmps14.h"
+#include "Tasks.h"
+#include "Trace.h"
+
+#define SEA_SAMPLE_MS 10               //100Hz
+#define SEA_DECIMATE 20                //readings averaged into each sample, 5Hz
+#define SEA_RATE_HZ (1000.0f / (SEA_SAMPLE_MS * SEA_DECIMATE))
+#ifndef SEA_FFT_SIZE
+#define SEA_FFT_SIZE 512               //a power of 2 - 102 seconds at 5Hz
+#endif
+#define SEA_HOP (SEA_FFT_SIZE / 2)
+#define SEA_MIN_PERIOD_S 2.0f
+#define SEA_MAX_PERIOD_S 20.0f
+#define SEA_MAX_GAP_PERCENT 10         //samples with no reading before a window is thrown out
+#ifndef SEA_BUDGET_PERCENT
+#define SEA_BUDGET_PERCENT 2
+#endif
+#define SEA_HANN_POWER 0.375f          //mean square of the Hann window
+
+#define SEA_RAW_START ACCELEROY_Register
+#define SEA_RAW_BYTES 4
+
+struct SeaState {
+  bool valid;
+  uint32_t atMs;                       //millis() at the end of the window
+  float wavePeriodS;
+  float zeroCrossingPeriodS;
+  float heaveM;                        //significant
+  float accelRms;                      //m/s^2, vertical, in the wave band
+  float rollPeriodS;
+  float rollDeg;                       //significant amplitude
+};
+
+//The ring, written by the SeaSample task. NAN marks a sample that had no good reading
+float seaAccelRing[SEA_FFT_SIZE], seaRollRing[SEA_FFT_SIZE];
+unsigned seaHead = 0, seaFilled = 0, seaSinceHop = 0;
+portMUX_TYPE seaRingMux = portMUX_INITIALIZER_UNLOCKED;
+
+//The FFT, for the SeaState task
+float seaRe[SEA_FFT_SIZE], seaIm[SEA_FFT_SIZE];
+float seaCos[SEA_FFT_SIZE / 2], seaSin[SEA_FFT_SIZE / 2];
+float seaHann[SEA_FFT_SIZE];
+
+SeaState seaState = { false };
+portMUX_TYPE seaStateMux = portMUX_INITIALIZER_UNLOCKED;
+
+//Counters
+uint32_t seaReads = 0, seaBusBusy = 0, seaReadErrors = 0;
+uint32_t seaAnalyses = 0, seaGappy = 0, seaOverBudget = 0;
+uint32_t seaCyclesLast = 0, seaCyclesMax = 0;
+uint64_t seaCyclesTotal = 0;
+uint64_t seaDebtCycles = 0;
+
+//Twiddle factors and window, once at start up
+void seaStateBegin() {
+  for (int k = 0; k < SEA_FFT_SIZE / 2; k++) {
+    seaCos[k] = cosf(2 * PI * k / SEA_FFT_SIZE);
+    seaSin[k] = sinf(2 * PI * k / SEA_FFT_SIZE);
+  }
+  for (int i = 0; i < SEA_FFT_SIZE; i++) seaHann[i] = 0.5f - 0.5f * cosf(2 * PI * i / SEA_FFT_SIZE);
+}
+
+//In place forward FFT of SEA_FFT_SIZE complex points - iterative radix-2, decimation in time
+void seaFft(float *re, float *im) {
+  const int n = SEA_FFT_SIZE;
+
+  //Bit reversed order
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j |= bit;
+    if (i < j) {
+      float t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+
+  //Butterflies. The twiddle for step k of a span is e^(-2 pi i k / span), k * n / span in the table
+  for (int span = 2; span <= n; span <<= 1) {
+    int half = span >> 1, stride = n / span;
+    for (int start = 0; start < n; start += span) {
+      for (int k = 0; k < half; k++) {
+        float wr = seaCos[k * stride], wi = -seaSin[k * stride];
+        int a = start + k, b = a + half;
+        float tr = re[b] * wr - im[b] * wi;
+        float ti = re[b] * wi + im[b] * wr;
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
+
+//Peak of a spectrum between bins lo and hi, as a frequency, interpolated with a parabola
+float seaPeak(const float *spectrum, int lo, int hi) {
+  int peak = lo;
+  for (int k = lo + 1; k <= hi; k++) if (spectrum[k] > spectrum[peak]) peak = k;
+  float offset = 0;
+  if (peak > lo && peak < hi) {
+    float a = spectrum[peak - 1], b = spectrum[peak], c = spectrum[peak + 1];
+    float d = a - 2 * b + c;
+    if (d < 0) offset = 0.5f * (a - c) / d;
+  }
+  return (peak + offset) * SEA_RATE_HZ / SEA_FFT_SIZE;
+}
+
+//The statistics of one window. re holds the vertical acceleration and im the roll, oldest
+//first, with the means taken off. Both are overwritten
+void seaAnalyse(float *re, float *im, SeaState *out) {
+  const int n = SEA_FFT_SIZE;
+  const int lo = max(1, (int)ceilf(n / (SEA_MAX_PERIOD_S * SEA_RATE_HZ)));
+  const int hi = min(n / 2 - 1, (int)(n / (SEA_MIN_PERIOD_S * SEA_RATE_HZ)));
+  //Per bin variance of a one sided spectrum, allowing for the window
+  const float scale = 2.0f / ((float)n * n * SEA_HANN_POWER);
+
+  for (int i = 0; i < n; i++) {
+    re[i] *= seaHann[i];
+    im[i] *= seaHann[i];
+  }
+  seaFft(re, im);
+
+  //Separate the two spectra: X[k] = (Z[k] + conj Z[n-k]) / 2, Y[k] = (Z[k] - conj Z[n-k]) / 2i
+  //The heave spectrum goes into re[] and the roll spectrum into im[], below bin n/2
+  float m0 = 0, m2 = 0, accel0 = 0, roll0 = 0;
+  for (int k = lo; k <= hi; k++) {
+    float ar = re[k] + re[n - k], ai = im[k] - im[n - k];
+    float br = re[k] - re[n - k], bi = im[k] + im[n - k];
+    float f = k * SEA_RATE_HZ / n;
+    float w2 = 2 * PI * f * 2 * PI * f;
+    float accel = (ar * ar + ai * ai) * 0.25f * scale;
+    float roll = (br * br + bi * bi) * 0.25f * scale;
+    accel0 += accel;
+    roll0 += roll;
+    re[k] = accel / (w2 * w2);
+    im[k] = roll;
+    m0 += re[k];
+    m2 += re[k] * f * f;
+  }
+
+  out->wavePeriodS = 1 / seaPeak(re, lo, hi);
+  out->zeroCrossingPeriodS = m2 > 0 ? sqrtf(m0 / m2) : 0;
+  out->heaveM = 4 * sqrtf(m0);
+  out->accelRms = sqrtf(accel0);
+  out->rollPeriodS = 1 / seaPeak(im, lo, hi);
+  out->rollDeg = 2 * sqrtf(roll0);
+  out->atMs = millis();
+  out->valid = true;
+}
+
+//100Hz - a reading into the ring
+void seaSample(void *pvParameters) {
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+  Cmps14 *sensor = &cmpsSensors[0];
+  TaskConfig *analysis = findTask("SeaState");
+  uint8_t buf[SEA_RAW_BYTES];
+  float accelSum = 0, rollSum = 0;
+  int readings = 0, good = 0;
+
+  for (;;) {
+    waitForNextPeriod(pvParameters, &xLastWakeTime);
+
+    //Never wait for the bus - the heading comes first
+    seaReads++;
+    if (!sensor->tryLock()) seaBusBusy++;
+    else {
+      bool ok = sensor->transferRegisters(SEA_RAW_START, buf, SEA_RAW_BYTES);
+      sensor->unlock();
+      if (ok) {
+        float ay = (int16_t)((buf[0] << 8) | buf[1]);
+        float az = (int16_t)((buf[2] << 8) | buf[3]);
+        accelSum += az * accelScale;
+        rollSum += atan2f(ay, az) * RAD_TO_DEG;
+        good++;
+      } else seaReadErrors++;
+    }
+    if (++readings < SEA_DECIMATE) continue;
+
+    portENTER_CRITICAL(&seaRingMux);
+    seaAccelRing[seaHead] = good > 0 ? accelSum / good : NAN;
+    seaRollRing[seaHead] = good > 0 ? rollSum / good : NAN;
+    seaHead = (seaHead + 1) % SEA_FFT_SIZE;
+    if (seaFilled < SEA_FFT_SIZE) seaFilled++;
+    bool hop = ++seaSinceHop >= SEA_HOP && seaFilled == SEA_FFT_SIZE;
+    if (hop) seaSinceHop = 0;
+    portEXIT_CRITICAL(&seaRingMux);
+    if (hop && analysis != NULL && analysis->handle != NULL) xTaskNotifyGive(analysis->handle);
+
+    accelSum = rollSum = 0;
+    readings = good = 0;
+  }
+}
+
+//Every hop - the spectrum of the last window
+void seaStateTask(void *pvParameters) {
+  SeaState result;
+
+  for (;;) {
+    TRACE_END(TRACE_RUN);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    TRACE_BEGIN(TRACE_RUN);
+
+    //Sit this one out if the last analysis went over the budget
+    uint64_t allowance = (uint64_t)getCpuFrequencyMhz() * 1000000 * SEA_HOP / SEA_RATE_HZ * SEA_BUDGET_PERCENT / 100;
+    if (seaDebtCycles > 0) {
+      seaDebtCycles = seaDebtCycles > allowance ? seaDebtCycles - allowance : 0;
+      seaOverBudget++;
+      continue;
+    }
+
+    TRACE_SCOPE(TRACE_SEA_STATE);
+    uint32_t start = ESP.getCycleCount();
+
+    //Oldest first
+    portENTER_CRITICAL(&seaRingMux);
+    for (int i = 0, j = seaHead; i < SEA_FFT_SIZE; i++, j = (j + 1) % SEA_FFT_SIZE) {
+      seaRe[i] = seaAccelRing[j];
+      seaIm[i] = seaRollRing[j];
+    }
+    portEXIT_CRITICAL(&seaRingMux);
+
+    //Take off the means, which are gravity and the list. Gaps are filled with the mean
+    float accelMean = 0, rollMean = 0;
+    int gaps = 0;
+    for (int i = 0; i < SEA_FFT_SIZE; i++) {
+      if (isnan(seaRe[i])) gaps++;
+      else {
+        accelMean += seaRe[i];
+        rollMean += seaIm[i];
+      }
+    }
+    if (gaps * 100 > SEA_FFT_SIZE * SEA_MAX_GAP_PERCENT) {
+      seaGappy++;
+      portENTER_CRITICAL(&seaStateMux);
+      seaState.valid = false;
+      portEXIT_CRITICAL(&seaStateMux);
+      continue;
+    }
+    accelMean /= SEA_FFT_SIZE - gaps;
+    rollMean /= SEA_FFT_SIZE - gaps;
+    for (int i = 0; i < SEA_FFT_SIZE; i++) {
+      seaRe[i] = isnan(seaRe[i]) ? 0 : seaRe[i] - accelMean;
+      seaIm[i] = isnan(seaIm[i]) ? 0 : seaIm[i] - rollMean;
+    }
+
+    seaAnalyse(seaRe, seaIm, &result);
+    portENTER_CRITICAL(&seaStateMux);
+    seaState = result;
+    portEXIT_CRITICAL(&seaStateMux);
+
+    seaCyclesLast = ESP.getCycleCount() - start;
+    if (seaCyclesLast > seaCyclesMax) seaCyclesMax = seaCyclesLast;
+    seaCyclesTotal += seaCyclesLast;
+    seaAnalyses++;
+    if (seaCyclesLast > allowance) seaDebtCycles = seaCyclesLast - allowance;
+  }
+}
+
+//A copy of the latest results, for the other tasks
+SeaState seaStateGet() {
+  portENTER_CRITICAL(&seaStateMux);
+  SeaState s = seaState;
+  portEXIT_CRITICAL(&seaStateMux);
+  return s;
+}
+
+//Average share of a core used by the analysis
+float seaBudgetPercent() {
+  if (seaAnalyses == 0) return 0;
+  float cyclesPerHop = getCpuFrequencyMhz() * 1000000.0f * SEA_HOP / SEA_RATE_HZ;
+  return 100.0f * seaCyclesTotal / seaAnalyses / cyclesPerHop;
+}
+
+void seaStateStatus(Print &out) {
+  SeaState s = seaStateGet();
+  if (s.valid)
+    out.printf("Waves: period %.1fs (zero crossing %.1fs), heave %.2fm, vertical acceleration %.2fm/s2\n"
+               "Roll: period %.1fs, %.1f degrees\n",
+               s.wavePeriodS, s.zeroCrossingPeriodS, s.heaveM, s.accelRms, s.rollPeriodS, s.rollDeg);
+  else out.printf("No sea state yet - %u of %d samples in the window\n", seaFilled, SEA_FFT_SIZE);
+  out.printf("Readings: %u, bus busy %u, errors %u\n", seaReads, seaBusBusy, seaReadErrors);
+  out.printf("Windows: %u analysed, %u too gappy, %u skipped over budget\n", seaAnalyses, seaGappy, seaOverBudget);
+  out.printf("Cycles per window: last %u, max %u, %.3f%% of a core (budget %d%%)\n",
+             seaCyclesLast, seaCyclesMax, seaBudgetPercent(), SEA_BUDGET_PERCENT);
+}
+
+#endif
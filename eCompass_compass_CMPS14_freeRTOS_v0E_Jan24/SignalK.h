@@ -0,0 +1,564 @@
+#ifndef _SIGNALK_H
+#define _SIGNALK_H
+/*
+ * Signal K delta stream
+ *
+ * Chart plotters and dashboards that speak Signal K can take the heading straight from the
+ * unit rather than through an NMEA converter. Three paths are published, all in SI units:
+ * navigation.headingMagnetic (radians), navigation.rateOfTurn (radians a second) and
+ * navigation.attitude (roll, pitch and yaw in radians).
+ *
+ * Two listeners are served:
+ *   SIGNALK_TCP_PORT - the Signal K TCP stream, one JSON message per line
+ *   SIGNALK_WS_PORT  - HTTP on its own port: GET /signalk is the discovery document and
+ *                      GET /signalk/v1/stream upgrades to a WebSocket
+ * The WebSocket does not go through the HTTP server library, which builds a std::string for
+ * every message. A client gets the hello message when it connects and is then subscribed to
+ * every path with the "ideal" policy at a one second period - unless it asked for
+ * ?subscribe=none - and can change that with subscribe and unsubscribe messages. path may end
+ * in a * wildcard; period, minPeriod and policy are honoured. The context is always taken as
+ * vessels.self.
+ *
+ * Everything here belongs to the SignalK task, which does its own select() on the listeners
+ * and its clients and wakes every SIGNALK_TICK_MS to send. On each tick it takes one heading
+ * snapshot (see Heading.h) and encodes each path's value once, into a fragment that is reused
+ * for every client; the fragment's version goes up only when its text changes, which is how
+ * "instant" and "ideal" know there is something new. Each client then gets at most one delta
+ * per tick holding all of its paths that are due. Messages are built with JsonWriter into
+ * static buffers and sent without blocking - a client that can't keep up loses the delta
+ * rather than holding up the others. While the heading is bad nothing is sent, so a stale
+ * value is never passed off as current. The unit has no clock, so deltas carry no timestamp.
+ */
+
+#include <WiFi.h>
+#include <lwip/sockets.h>
+#include <mbedtls/version.h>
+#include <mbedtls/sha1.h>
+#include <mbedtls/base64.h>
+#include "SocketServer.h"
+#include "Heading.h"
+#include "JsonWriter.h"
+#include "Tasks.h"
+
+#define SIGNALK_TCP_PORT 8375
+#define SIGNALK_WS_PORT 3000
+#define SIGNALK_MAX_CLIENTS 4
+#define SIGNALK_TICK_MS 100             //fastest a value can go out
+#define SIGNALK_DEFAULT_PERIOD 1000     //ms
+#define SIGNALK_RX_BUFFER 512           //longest subscribe message or HTTP request
+#define SIGNALK_MAX_MESSAGE 384
+#define SIGNALK_VERSION "1.7.0"
+#define SIGNALK_SOURCE "ecompass.HC"
+
+enum SignalKPath {
+  SK_HEADING_MAGNETIC,
+  SK_RATE_OF_TURN,
+  SK_ATTITUDE,
+  NUM_SK_PATHS
+};
+
+const char * const signalKPathNames[NUM_SK_PATHS] = {
+  "navigation.headingMagnetic", "navigation.rateOfTurn", "navigation.attitude"
+};
+
+enum SignalKPolicy { SK_FIXED, SK_INSTANT, SK_IDEAL };
+
+struct SignalKSubscription {
+  bool active;
+  uint8_t policy;
+  uint16_t period, minPeriod;      //ms
+  uint32_t sentAt;                 //millis() when last sent
+  uint32_t sentVersion;            //version of the value last sent
+};
+
+enum SignalKState {
+  SK_CLOSED,
+  SK_TCP,                          //TCP stream
+  SK_HTTP,                         //waiting for the HTTP request on the WebSocket port
+  SK_WS                            //WebSocket open
+};
+
+struct SignalKClient {
+  SignalKState state;
+  WiFiClient client;
+  char rx[SIGNALK_RX_BUFFER + 1];  //room for a terminating NUL
+  int rxLength;
+  SignalKSubscription sub[NUM_SK_PATHS];
+};
+
+//The value of each path as it was last encoded
+struct SignalKValue {
+  char json[96];                   //{"path":...,"value":...}
+  int length;
+  uint32_t version;                //bumped when the text changes
+};
+
+SignalKClient signalKClients[SIGNALK_MAX_CLIENTS];
+SignalKValue signalKValues[NUM_SK_PATHS];
+SocketServer signalKTcpServer(SIGNALK_TCP_PORT);
+SocketServer signalKWsServer(SIGNALK_WS_PORT);
+
+//Room in front for the longest WebSocket header we send and behind for CR LF
+char signalKOut[4 + SIGNALK_MAX_MESSAGE + 2];
+
+int signalKClientCount = 0;
+uint32_t signalKDeltas = 0;       //deltas sent
+uint32_t signalKBytes = 0;
+uint32_t signalKDrops = 0;        //deltas a client had no room for
+
+void signalKClose(SignalKClient *c) {
+  c->client.stop();
+  c->state = SK_CLOSED;
+  signalKClientCount--;
+}
+
+//Send a whole message or nothing. A part sent would break the framing, so the client is dropped
+bool signalKSend(SignalKClient *c, const char *data, int length) {
+  int n = send(c->client.fd(), data, length, MSG_DONTWAIT);
+  if (n > 0) signalKBytes += n;
+  if (n == length) return true;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) signalKDrops++;
+  else signalKClose(c);
+  return false;
+}
+
+//Frame and send the message written at signalKOut + 4
+bool signalKSendMessage(SignalKClient *c, int length) {
+  char *start = signalKOut + 4;
+
+  if (c->state == SK_TCP) {
+    start[length++] = '\r';
+    start[length++] = '\n';
+  } else if (length < 126) {      //WebSocket text frame, unmasked
+    *--start = length;
+    *--start = 0x81;
+    length += 2;
+  } else {
+    *--start = length & 0xFF;
+    *--start = length >> 8;
+    *--start = 126;
+    *--start = 0x81;
+    length += 4;
+  }
+  return signalKSend(c, start, length);
+}
+
+void signalKSubscribeAll(SignalKClient *c, bool active) {
+  for (int p = 0; p < NUM_SK_PATHS; p++)
+    c->sub[p] = { active, SK_IDEAL, SIGNALK_DEFAULT_PERIOD, 0, 0, 0 };
+}
+
+void signalKHello(SignalKClient *c) {
+  JsonWriter w;
+
+  jsonBegin(&w, signalKOut + 4, SIGNALK_MAX_MESSAGE);
+  jsonObject(&w);
+  jsonKey(&w, "name");
+  jsonString(&w, "eCompass");
+  jsonKey(&w, "version");
+  jsonString(&w, SIGNALK_VERSION);
+  jsonKey(&w, "self");
+  jsonString(&w, "vessels.self");
+  jsonKey(&w, "roles");
+  jsonArray(&w);
+  jsonString(&w, "master");
+  jsonString(&w, "main");
+  jsonEndArray(&w);
+  jsonEndObject(&w);
+  signalKSendMessage(c, w.length);
+}
+
+void signalKOpen(WiFiClient newClient, SignalKState state) {
+  for (int i = 0; i < SIGNALK_MAX_CLIENTS; i++) {
+    SignalKClient *c = &signalKClients[i];
+    if (c->state != SK_CLOSED) continue;
+    c->client = newClient;
+    c->state = state;
+    c->rxLength = 0;
+    signalKClientCount++;
+    signalKSubscribeAll(c, true);
+    if (state == SK_TCP) signalKHello(c);
+    return;
+  }
+  newClient.stop();   //no room
+}
+
+/*
+ * Subscription messages are picked apart where they lie in the receive buffer. They are
+ * small and flat, so finding a key is just a search for "key": - there is no full parser.
+ */
+
+//Where the value of "key" starts, NULL if it isn't there
+const char *signalKFindKey(const char *p, const char *end, const char *key) {
+  int n = strlen(key);
+
+  for (; p + n + 2 < end; p++) {
+    if (*p != '"' || p[n + 1] != '"' || memcmp(p + 1, key, n) != 0) continue;
+    const char *v = p + n + 2;
+    while (v < end && isspace(*v)) v++;
+    if (v < end && *v == ':') {
+      for (v++; v < end && isspace(*v); v++);
+      return v;
+    }
+  }
+  return NULL;
+}
+
+//A string value - sets its length, NULL if the key is missing or not a string
+const char *signalKFindString(const char *p, const char *end, const char *key, int *length) {
+  const char *v = signalKFindKey(p, end, key), *q;
+  if (v == NULL || *v != '"') return NULL;
+  v++;
+  if ((q = (const char *)memchr(v, '"', end - v)) == NULL) return NULL;
+  *length = q - v;
+  return v;
+}
+
+long signalKFindNumber(const char *p, const char *end, const char *key, long otherwise) {
+  const char *v = signalKFindKey(p, end, key);
+  return v != NULL && isdigit(*v) ? strtol(v, NULL, 10) : otherwise;
+}
+
+bool signalKMatch(const char *pattern, int length, const char *path) {
+  if (length > 0 && pattern[length - 1] == '*') return strncmp(path, pattern, length - 1) == 0;
+  return (int)strlen(path) == length && strncmp(path, pattern, length) == 0;
+}
+
+//One {"path":...} object from a subscribe or unsubscribe list
+void signalKSubscription(SignalKClient *c, bool subscribe, const char *p, const char *end) {
+  int length, policyLength;
+  const char *pattern = signalKFindString(p, end, "path", &length);
+  const char *policy = signalKFindString(p, end, "policy", &policyLength);
+  if (pattern == NULL) return;
+
+  SignalKSubscription s = { subscribe, SK_IDEAL, SIGNALK_DEFAULT_PERIOD, 0, 0, 0 };
+  s.period = constrain(signalKFindNumber(p, end, "period", SIGNALK_DEFAULT_PERIOD), SIGNALK_TICK_MS, 60000);
+  s.minPeriod = constrain(signalKFindNumber(p, end, "minPeriod", 0), 0, 60000);
+  if (policy != NULL && strncmp(policy, "fixed", policyLength) == 0) s.policy = SK_FIXED;
+  else if (policy != NULL && strncmp(policy, "instant", policyLength) == 0) s.policy = SK_INSTANT;
+
+  for (int i = 0; i < NUM_SK_PATHS; i++)
+    if (signalKMatch(pattern, length, signalKPathNames[i])) c->sub[i] = s;
+}
+
+//A complete message from a client. Anything but a subscription is ignored
+void signalKMessage(SignalKClient *c, const char *p, int length) {
+  const char *end = p + length, *v, *close;
+  bool subscribe = false;
+
+  if ((v = signalKFindKey(p, end, "unsubscribe")) == NULL) {
+    if ((v = signalKFindKey(p, end, "subscribe")) == NULL) return;
+    subscribe = true;
+  }
+  if (*v != '[') return;
+  //Each {...} in the list - they hold no objects of their own
+  while ((v = (const char *)memchr(v, '{', end - v)) != NULL &&
+         (close = (const char *)memchr(v, '}', end - v)) != NULL) {
+    signalKSubscription(c, subscribe, v, close);
+    v = close;
+  }
+}
+
+void signalKHttpReply(SignalKClient *c, const char *status, const char *body) {
+  char buff[SIGNALK_MAX_MESSAGE + 128];
+  int n = snprintf(buff, sizeof(buff), "HTTP/1.1 %s\r\nContent-Type: application/json\r\n"
+                   "Access-Control-Allow-Origin: *\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s",
+                   status, (int)strlen(body), body);
+  signalKSend(c, buff, min(n, (int)sizeof(buff) - 1));
+  if (c->state != SK_CLOSED) signalKClose(c);
+}
+
+//Value of an HTTP header in the request, up to the end of its line. NULL if it isn't there
+const char *signalKHeader(const char *request, const char *name, int *length) {
+  int n = strlen(name);
+
+  for (const char *p = strstr(request, "\r\n"); p != NULL; p = strstr(p, "\r\n")) {
+    p += 2;
+    if (strncasecmp(p, name, n) != 0 || p[n] != ':') continue;
+    for (p += n + 1; *p == ' '; p++);
+    *length = strcspn(p, "\r\n");
+    return p;
+  }
+  return NULL;
+}
+
+//The whole HTTP request is in rx. Either upgrade to a WebSocket or answer and close
+void signalKRequest(SignalKClient *c) {
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  char buff[SIGNALK_MAX_MESSAGE];
+  unsigned char digest[20], accept[32];
+  size_t acceptLength;
+  int keyLength, hostLength;
+  const char *key = signalKHeader(c->rx, "Sec-WebSocket-Key", &keyLength);
+  const char *host = signalKHeader(c->rx, "Host", &hostLength);
+
+  if (strncmp(c->rx, "GET /signalk/v1/stream", 22) == 0 && key != NULL && keyLength < 64) {
+    memcpy(buff, key, keyLength);
+    strcpy(buff + keyLength, guid);
+#if MBEDTLS_VERSION_MAJOR < 3
+    mbedtls_sha1_ret((const unsigned char *)buff, keyLength + strlen(guid), digest);
+#else
+    mbedtls_sha1((const unsigned char *)buff, keyLength + strlen(guid), digest);
+#endif
+    mbedtls_base64_encode(accept, sizeof(accept), &acceptLength, digest, sizeof(digest));
+    int n = sprintf(buff, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: %.*s\r\n\r\n", (int)acceptLength, accept);
+    if (!signalKSend(c, buff, n)) {
+      if (c->state != SK_CLOSED) signalKClose(c);
+      return;
+    }
+    c->state = SK_WS;
+    signalKSubscribeAll(c, strstr(c->rx, "subscribe=none") == NULL);
+    signalKHello(c);
+  } else if (strncmp(c->rx, "GET /signalk ", 13) == 0 || strncmp(c->rx, "GET /signalk/ ", 14) == 0) {
+    //Endpoints are absolute, so take the address the client used to reach us
+    if (host == NULL) host = "192.168.4.1", hostLength = strlen(host);
+    int nameLength = strcspn(host, ":\r\n");
+    if (nameLength > hostLength) nameLength = hostLength;
+    snprintf(buff, sizeof(buff), "{\"endpoints\":{\"v1\":{\"version\":\"%s\","
+             "\"signalk-ws\":\"ws://%.*s:%d/signalk/v1/stream\",\"signalk-tcp\":\"tcp://%.*s:%d\"}},"
+             "\"server\":{\"id\":\"ecompass\",\"version\":\"%s\"}}",
+             SIGNALK_VERSION, nameLength, host, SIGNALK_WS_PORT, nameLength, host, SIGNALK_TCP_PORT, VERSION);
+    signalKHttpReply(c, "200 OK", buff);
+  } else signalKHttpReply(c, "404 Not Found", "{}");
+}
+
+//Complete WebSocket frames at the front of rx. Returns the bytes used, 0 if the frame isn't all here yet
+int signalKFrame(SignalKClient *c) {
+  uint8_t *b = (uint8_t *)c->rx;
+  int header = 2;
+  uint32_t length;
+
+  if (c->rxLength < 2) return 0;
+  length = b[1] & 0x7F;
+  if (length == 126) {
+    if (c->rxLength < 4) return 0;
+    length = (b[2] << 8) | b[3];
+    header = 4;
+  } else if (length == 127) length = SIGNALK_RX_BUFFER;   //far too long for us
+  if (b[1] & 0x80) header += 4;                           //clients always mask
+  if (header + length > SIGNALK_RX_BUFFER) {
+    signalKClose(c);
+    return 0;
+  }
+  if (c->rxLength < (int)(header + length)) return 0;
+
+  uint8_t *payload = b + header;
+  if (b[1] & 0x80)
+    for (uint32_t i = 0; i < length; i++) payload[i] ^= b[header - 4 + (i & 3)];
+
+  switch (b[0] & 0x0F) {
+    case 0x1:        //text
+      signalKMessage(c, (const char *)payload, length);
+      break;
+    case 0x8:        //close
+      signalKClose(c);
+      return 0;
+    case 0x9: {      //ping - answer with the same payload
+      char pong[2 + 125];
+      if (length > 125) break;
+      pong[0] = 0x8A;
+      pong[1] = length;
+      memcpy(pong + 2, payload, length);
+      signalKSend(c, pong, length + 2);
+      break;
+    }
+  }
+  return header + length;
+}
+
+//Called when select() says a client's socket is readable
+void signalKService(SignalKClient *c) {
+  int n = recv(c->client.fd(), c->rx + c->rxLength, SIGNALK_RX_BUFFER - c->rxLength, MSG_DONTWAIT);
+  if (n <= 0) {
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) signalKClose(c);
+    return;
+  }
+  c->rxLength += n;
+  c->rx[c->rxLength] = '\0';
+
+  int used = 0, length;
+  char *nl;
+  switch (c->state) {
+    case SK_TCP:
+      while ((nl = (char *)memchr(c->rx + used, '\n', c->rxLength - used)) != NULL) {
+        signalKMessage(c, c->rx + used, nl - c->rx - used);
+        used = nl + 1 - c->rx;
+      }
+      if (used == 0 && c->rxLength == SIGNALK_RX_BUFFER) used = c->rxLength;   //too long - throw it away
+      break;
+    case SK_HTTP:
+      if (strstr(c->rx, "\r\n\r\n") != NULL) {
+        signalKRequest(c);
+        c->rxLength = 0;   //clients wait for our answer before sending frames
+      } else if (c->rxLength == SIGNALK_RX_BUFFER) signalKClose(c);
+      return;
+    case SK_WS:
+      while (c->state == SK_WS && (length = signalKFrame(c)) > 0) {
+        used = length;
+        memmove(c->rx, c->rx + used, c->rxLength - used);
+        c->rxLength -= used;
+      }
+      return;
+    default:
+      return;
+  }
+  memmove(c->rx, c->rx + used, c->rxLength - used);
+  c->rxLength -= used;
+}
+
+//Encode each path's value, bumping its version if it has changed
+void signalKEncode(const HeadingSnapshot *h) {
+  char json[sizeof(signalKValues[0].json)];
+  JsonWriter w;
+
+  for (int p = 0; p < NUM_SK_PATHS; p++) {
+    SignalKValue *v = &signalKValues[p];
+    jsonBegin(&w, json, sizeof(json));
+    jsonObject(&w);
+    jsonKey(&w, "path");
+    jsonString(&w, signalKPathNames[p]);
+    jsonKey(&w, "value");
+    switch (p) {
+      case SK_HEADING_MAGNETIC:
+        jsonNumber(&w, h->heading * DEG_TO_RAD, 4);
+        break;
+      case SK_RATE_OF_TURN:
+        jsonNumber(&w, h->rateOfTurn * DEG_TO_RAD, 4);
+        break;
+      case SK_ATTITUDE:
+        jsonObject(&w);
+        jsonKey(&w, "roll");
+        jsonNumber(&w, h->roll * DEG_TO_RAD, 4);
+        jsonKey(&w, "pitch");
+        jsonNumber(&w, h->pitch * DEG_TO_RAD, 4);
+        jsonKey(&w, "yaw");
+        jsonNumber(&w, h->heading * DEG_TO_RAD, 4);
+        jsonEndObject(&w);
+        break;
+    }
+    jsonEndObject(&w);
+    if (w.overflow) continue;
+    if ((int)w.length != v->length || memcmp(json, v->json, w.length) != 0) {
+      memcpy(v->json, json, w.length);
+      v->length = w.length;
+      v->version++;
+    }
+  }
+}
+
+bool signalKDue(const SignalKSubscription *s, const SignalKValue *v, uint32_t now) {
+  uint32_t since = now - s->sentAt;
+  bool changed = v->version != s->sentVersion;
+
+  if (!s->active || v->length == 0) return false;
+  switch (s->policy) {
+    case SK_INSTANT: return changed && since >= s->minPeriod;
+    case SK_IDEAL:   return (changed && since >= s->minPeriod) || since >= s->period;
+    default:         return since >= s->period;
+  }
+}
+
+//One delta holding every path that is due for this client
+void signalKDelta(SignalKClient *c, uint32_t now) {
+  JsonWriter w;
+  bool due[NUM_SK_PATHS], any = false;
+
+  for (int p = 0; p < NUM_SK_PATHS; p++) any |= due[p] = signalKDue(&c->sub[p], &signalKValues[p], now);
+  if (!any) return;
+
+  jsonBegin(&w, signalKOut + 4, SIGNALK_MAX_MESSAGE);
+  jsonObject(&w);
+  jsonKey(&w, "context");
+  jsonString(&w, "vessels.self");
+  jsonKey(&w, "updates");
+  jsonArray(&w);
+  jsonObject(&w);
+  jsonKey(&w, "$source");
+  jsonString(&w, SIGNALK_SOURCE);
+  jsonKey(&w, "values");
+  jsonArray(&w);
+  for (int p = 0; p < NUM_SK_PATHS; p++)
+    if (due[p]) jsonFragment(&w, signalKValues[p].json, signalKValues[p].length);
+  jsonEndArray(&w);
+  jsonEndObject(&w);
+  jsonEndArray(&w);
+  jsonEndObject(&w);
+  if (w.overflow || !signalKSendMessage(c, w.length)) return;
+
+  signalKDeltas++;
+  for (int p = 0; p < NUM_SK_PATHS; p++)
+    if (due[p]) {
+      c->sub[p].sentAt = now;
+      c->sub[p].sentVersion = signalKValues[p].version;
+    }
+}
+
+void signalKTick() {
+  HeadingSnapshot h;
+
+  if (signalKClientCount == 0) return;
+  headingLatest(&h);
+  if (h.status != SAMPLE_OK) return;
+  signalKEncode(&h);
+
+  uint32_t now = millis();
+  for (int i = 0; i < SIGNALK_MAX_CLIENTS; i++) {
+    SignalKClient *c = &signalKClients[i];
+    if (c->state == SK_TCP || c->state == SK_WS) signalKDelta(c, now);
+  }
+}
+
+void signalKTask(void *pvParameters) {
+  TaskConfig *t = (TaskConfig *)pvParameters;
+  uint32_t nextTick = millis();
+  fd_set readSet;
+  struct timeval timeout;
+
+  //WiFi is up by the time the background tasks start
+  if (!signalKTcpServer.begin() || !signalKWsServer.begin()) Serial.println("Signal K: failed to open the listeners");
+
+  for (;;) {
+    long wait = (long)(nextTick - millis());
+    if (wait <= 0) {
+      TRACE_BEGIN(TRACE_SIGNALK);
+      signalKTick();
+      TRACE_END(TRACE_SIGNALK);
+      nextTick += t->periodMs;
+      if ((long)(nextTick - millis()) < 0) nextTick = millis() + t->periodMs;   //fell behind - don't try to catch up
+      continue;
+    }
+
+    FD_ZERO(&readSet);
+    int maxFd = -1;
+    SocketServer *servers[2] = { &signalKTcpServer, &signalKWsServer };
+    for (int i = 0; i < 2; i++)
+      if (servers[i]->fd() >= 0) {
+        FD_SET(servers[i]->fd(), &readSet);
+        maxFd = max(maxFd, servers[i]->fd());
+      }
+    for (int i = 0; i < SIGNALK_MAX_CLIENTS; i++)
+      if (signalKClients[i].state != SK_CLOSED) {
+        FD_SET(signalKClients[i].client.fd(), &readSet);
+        maxFd = max(maxFd, signalKClients[i].client.fd());
+      }
+    timeout.tv_sec = 0;
+    timeout.tv_usec = wait * 1000;
+    if (select(maxFd + 1, &readSet, NULL, NULL, &timeout) <= 0) continue;
+
+    if (signalKTcpServer.fd() >= 0 && FD_ISSET(signalKTcpServer.fd(), &readSet)) {
+      WiFiClient newClient = signalKTcpServer.accept();
+      if (newClient) signalKOpen(newClient, SK_TCP);
+    }
+    if (signalKWsServer.fd() >= 0 && FD_ISSET(signalKWsServer.fd(), &readSet)) {
+      WiFiClient newClient = signalKWsServer.accept();
+      if (newClient) signalKOpen(newClient, SK_HTTP);
+    }
+    for (int i = 0; i < SIGNALK_MAX_CLIENTS; i++) {
+      SignalKClient *c = &signalKClients[i];
+      if (c->state != SK_CLOSED && FD_ISSET(c->client.fd(), &readSet)) signalKService(c);
+    }
+  }
+}
+
+#endif
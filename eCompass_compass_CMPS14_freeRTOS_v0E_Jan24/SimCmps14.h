@@ -0,0 +1,171 @@
+#ifndef _SIM_CMPS14_H
+#define _SIM_CMPS14_H
+/*
+ * Simulated CMPS14
+ *
+ * Stands in for the real sensor when SIMULATE_CMPS14 is defined, so the rest of the
+ * firmware (filtering, compass card, NMEA output, web app, console) can be run and
+ * profiled on a bare ESP32 devkit without a compass attached.
+ *
+ * The simulator keeps a register file with the same layout as the chip (see Cmps14.h)
+ * and regenerates it on every read. The boat follows simScript - a list of legs, each
+ * with a duration and a rate of turn - with the boat rolling and pitching in a swell
+ * and some noise added to every reading. The script repeats when it reaches the end.
+ *
+ * Faults can be injected to exercise the I2C error handling and bus recovery in Cmps14.h:
+ * a percentage of transactions NACKed or cut short, a bus that sticks (every transaction
+ * NACKs until it is clocked out), a dead chip that never answers again, or a percentage of
+ * reads that complete but come back as all ones.
+ *
+ * Each of the CMPS_SENSORS sensors has a register file and faults of its own, all on the
+ * same boat. Two faults are there for the sensor voting in Vote.h, and look perfectly healthy
+ * on the bus: a frozen sensor keeps returning the same registers, and an offset one reads
+ * a set number of degrees out, as one mounted next to a new loudspeaker would.
+ */
+
+#define SIM_REGISTERS 32
+#define SIM_HEADING_NOISE_DEG 0.8   //peak noise on the bearing
+#define SIM_RAW_NOISE 20            //peak noise on the raw mag/accel/gyro counts
+#define SIM_SOFTWARE_VERSION 5
+#define SIM_CALIBRATION 0xFF        //fully calibrated
+
+struct SimLeg {
+  uint32_t durationMs;
+  float turnRateDps;        //positive turns to starboard
+  float rollAmplitudeDeg;
+  float rollPeriodS;
+};
+
+//Start on 000, sit still, tack through 90 degrees, bear away, then a slow 360
+SimLeg simScript[] = {
+  // duration  turn   roll  period
+  {  60000,    0.0,   1.0,  6.0 },
+  {  15000,    6.0,   3.0,  5.0 },
+  {  120000,   0.0,   8.0,  5.0 },
+  {  30000,   -3.0,   10.0, 4.0 },
+  {  120000,   0.0,   12.0, 4.0 },
+  {  180000,   2.0,   4.0,  6.0 }
+};
+#define SIM_LEGS (sizeof(simScript) / sizeof(simScript[0]))
+
+enum SimFault { SIM_FAULT_OFF, SIM_FAULT_NACK, SIM_FAULT_SHORT, SIM_FAULT_STUCK, SIM_FAULT_DEAD,
+                SIM_FAULT_FROZEN, SIM_FAULT_OFFSET, SIM_FAULT_GARBAGE, NUM_SIM_FAULTS };
+const char *simFaultNames[NUM_SIM_FAULTS] = { "off", "nack", "short", "stuck", "dead", "frozen", "offset", "garbage" };
+
+struct SimSensor {
+  uint8_t registers[SIM_REGISTERS];
+  SimFault fault;
+  int faultValue;           //percent of transactions, or degrees for an offset
+  bool busStuck;
+  uint32_t busClears;
+};
+SimSensor simSensors[CMPS_MAX_SENSORS];
+
+float simHeading = 0;
+unsigned long simLastUpdate = 0, simLegStart = 0;
+unsigned simLeg = 0;
+
+//Uniform noise in the range +-amplitude
+float simNoise(float amplitude) {
+  return amplitude * (random(-1000, 1001) / 1000.0);
+}
+
+void simPutWord(uint8_t *registers, int reg, int16_t value) {
+  registers[reg] = (uint16_t)value >> 8;
+  registers[reg + 1] = value & 0xFF;
+}
+
+//Advance the boat to the present time and regenerate the register file of one sensor
+void simUpdate(SimSensor *sensor) {
+  uint8_t *r = sensor->registers;
+  unsigned long now = millis();
+  if (simLastUpdate == 0) simLastUpdate = simLegStart = now;
+
+  while (now - simLegStart > simScript[simLeg].durationMs) {
+    simLegStart += simScript[simLeg].durationMs;
+    simLeg = (simLeg + 1) % SIM_LEGS;
+  }
+  SimLeg *leg = &simScript[simLeg];
+  simHeading += leg->turnRateDps * (now - simLastUpdate) / 1000.0;
+  simHeading = fmod(simHeading + 360.0, 360.0);
+  simLastUpdate = now;
+
+  float phase = 2 * PI * (now / 1000.0) / leg->rollPeriodS;
+  float roll = leg->rollAmplitudeDeg * sin(phase);
+  float pitch = leg->rollAmplitudeDeg * 0.3 * cos(phase);
+  float offset = sensor->fault == SIM_FAULT_OFFSET ? sensor->faultValue : 0;
+  float heading = fmod(simHeading + offset + simNoise(SIM_HEADING_NOISE_DEG) + 720.0, 360.0);
+  if (sensor->fault == SIM_FAULT_FROZEN) return;
+
+  r[CONTROL_Register] = SIM_SOFTWARE_VERSION;
+  r[1] = (uint8_t)(heading * 256 / 360);
+  simPutWord(r, BEARING_Register, (int16_t)(heading * 10));
+  r[PITCH_Register] = (int8_t)pitch;
+  r[ROLL_Register] = (int8_t)roll;
+
+  //Earth's field, horizontal component pointing north, seen from the boat's frame
+  float h = heading * DEG_TO_RAD;
+  simPutWord(r, MAGNETX_Register, 400 * cos(h) + simNoise(SIM_RAW_NOISE));
+  simPutWord(r, MAGNETY_Register, -400 * sin(h) + simNoise(SIM_RAW_NOISE));
+  simPutWord(r, MAGNETZ_Register, 700 + simNoise(SIM_RAW_NOISE));
+
+  //Gravity in mg, tipped by the roll and pitch
+  simPutWord(r, ACCELEROX_Register, 1000 * sin(pitch * DEG_TO_RAD) + simNoise(SIM_RAW_NOISE));
+  simPutWord(r, ACCELEROY_Register, -1000 * sin(roll * DEG_TO_RAD) + simNoise(SIM_RAW_NOISE));
+  simPutWord(r, ACCELEROZ_Register, 1000 * cos(roll * DEG_TO_RAD) + simNoise(SIM_RAW_NOISE));
+
+  //Gyro in 1/16 dps
+  float rollRate = leg->rollAmplitudeDeg * 2 * PI / leg->rollPeriodS * cos(phase);
+  simPutWord(r, GYROX_Register, rollRate * 16 + simNoise(SIM_RAW_NOISE));
+  simPutWord(r, GYROY_Register, simNoise(SIM_RAW_NOISE));
+  simPutWord(r, GYROZ_Register, leg->turnRateDps * 16 + simNoise(SIM_RAW_NOISE));
+
+  r[CALIBRATION_Register] = SIM_CALIBRATION;
+}
+
+//Inject a fault into a sensor from now on. value is the percent of transactions it hits,
+//or the degrees out for an offset
+void simSetFault(int sensor, SimFault fault, int value) {
+  SimSensor *s = &simSensors[sensor];
+  s->fault = fault;
+  s->faultValue = value;
+  s->busStuck = false;
+}
+
+//What this transaction runs into, if anything
+SampleStatus simTransactionFault(SimSensor *s) {
+  if (s->fault == SIM_FAULT_DEAD || s->busStuck) return SAMPLE_NACK;
+  if (s->fault < SIM_FAULT_NACK || s->fault > SIM_FAULT_STUCK || random(0, 100) >= s->faultValue) return SAMPLE_OK;
+  if (s->fault == SIM_FAULT_STUCK) s->busStuck = true;
+  return s->fault == SIM_FAULT_SHORT ? SAMPLE_SHORT_READ : SAMPLE_NACK;
+}
+
+//Clocking out the bus frees a stuck one, but doesn't bring back a dead chip
+void simBusClear(int sensor) {
+  simSensors[sensor].busClears++;
+  simSensors[sensor].busStuck = false;
+}
+
+//A read that completes, but with every bit set - as a bus held high gives
+void simGarbage(SimSensor *s, uint8_t *buf, size_t count) {
+  if (s->fault == SIM_FAULT_GARBAGE && random(0, 100) < s->faultValue) memset(buf, 0xFF, count);
+}
+
+SampleStatus simReadRegisters(int sensor, uint8_t reg, uint8_t *buf, uint8_t count) {
+  SimSensor *s = &simSensors[sensor];
+  if (reg + count > SIM_REGISTERS) return SAMPLE_NACK;
+  SampleStatus status = simTransactionFault(s);
+  if (status != SAMPLE_OK) return status;
+  simUpdate(s);
+  memcpy(buf, &s->registers[reg], count);
+  simGarbage(s, buf, count);
+  return SAMPLE_OK;
+}
+
+//Commands (calibration modes, save, erase etc.) are accepted and ignored
+SampleStatus simWriteCommand(int sensor, uint8_t command) {
+  SampleStatus status = simTransactionFault(&simSensors[sensor]);
+  return status == SAMPLE_SHORT_READ ? SAMPLE_OK : status;   //nothing to cut short
+}
+
+#endif
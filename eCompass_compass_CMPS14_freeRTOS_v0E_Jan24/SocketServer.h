@@ -0,0 +1,76 @@
+#ifndef _SOCKET_SERVER_H
+#define _SOCKET_SERVER_H
+/*
+ * Minimal TCP listener built directly on lwIP sockets
+ *
+ * WiFiServer only offers available(), which has to be polled. This class exposes the
+ * listening socket so that a task can block in select() on several listeners (and the
+ * connected clients) at once and only wake up when there is actually something to do.
+ * Accepted connections are handed back as ordinary WiFiClient objects.
+ */
+
+#include <WiFi.h>
+#include <lwip/sockets.h>
+
+class SocketServer {
+  public:
+    SocketServer(uint16_t port) : _port(port), _fd(-1) {}
+
+    bool begin() {
+      struct sockaddr_in addr;
+      int enable = 1;
+
+      _fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (_fd < 0) return false;
+      setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = INADDR_ANY;
+      addr.sin_port = htons(_port);
+      if (bind(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(_fd, 4) < 0) {
+        close(_fd);
+        _fd = -1;
+        return false;
+      }
+      fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+      return true;
+    }
+
+    //Listening socket - add this to the read set of select()
+    int fd() { return _fd; }
+
+    uint16_t port() { return _port; }
+
+    //Move the listener to a different port
+    bool restart(uint16_t port) {
+      end();
+      _port = port;
+      return begin();
+    }
+
+    //Call when select() reports the listening socket readable
+    //Returns an unconnected client if there was nothing to accept
+    WiFiClient accept() {
+      struct sockaddr_in addr;
+      socklen_t len = sizeof(addr);
+      int enable = 1;
+
+      int clientFd = lwip_accept(_fd, (struct sockaddr *)&addr, &len);
+      if (clientFd < 0) return WiFiClient();
+      setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+      setsockopt(clientFd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+      return WiFiClient(clientFd);
+    }
+
+    void end() {
+      if (_fd >= 0) close(_fd);
+      _fd = -1;
+    }
+
+  private:
+    uint16_t _port;
+    int _fd;
+};
+
+#endif
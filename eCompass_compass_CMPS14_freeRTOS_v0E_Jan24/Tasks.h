@@ -0,0 +1,132 @@
+#ifndef _TASKS_H
+#define _TASKS_H
+/*
+ * RTOS task layout
+ *
+ * The WiFi/lwIP stack runs on core 0 (PRO_CPU), so the networking and http tasks are
+ * placed there as well. Core 1 (APP_CPU) is kept for the time critical work - reading
+ * the CMPS14 and sending out the NMEA messages - at a higher priority than anything else.
+ *
+ * Every task is described by one entry in the task table (see the main sketch). The
+ * entry is passed to the task as its parameter, so a periodic task reads its period
+ * from the table rather than having it hard coded.
+ */
+
+#include "Trace.h"
+
+#ifndef ACQUISITION_CORE
+#define ACQUISITION_CORE 1
+#endif
+#ifndef NETWORK_CORE
+#define NETWORK_CORE 0
+#endif
+
+//When a task is started - see Boot.h
+enum BootStage { BOOT_FIRST, BOOT_BACKGROUND };
+
+struct TaskConfig {
+  const char *name;
+  TaskFunction_t function;
+  uint32_t stackSize;
+  UBaseType_t priority;
+  BaseType_t core;
+  uint32_t periodMs;     //0 for event driven tasks
+  BootStage stage;       //BOOT_FIRST tasks are started by setup(), the rest once the unit is up
+  TaskHandle_t handle;   //filled in by startTasks()
+  uint32_t overruns;     //number of periods where the task was still busy when it should have restarted
+};
+
+//Create the tasks in a task table that belong to one boot stage
+void startTasks(TaskConfig *table, int count, BootStage stage) {
+  for (int i = 0; i < count; i++) {
+    TaskConfig *t = &table[i];
+    if (t->stage != stage) continue;
+    if (xTaskCreatePinnedToCore(t->function, t->name, t->stackSize, t, t->priority, &t->handle, t->core) != pdPASS) {
+      Serial.print("Failed to start task ");
+      Serial.println(t->name);
+    }
+  }
+}
+
+//The task table itself is defined in the main sketch
+extern TaskConfig taskTable[];
+extern const int numTasks;
+
+TaskConfig *findTask(const char *name) {
+  for (int i = 0; i < numTasks; i++)
+    if (strcmp(taskTable[i].name, name) == 0) return &taskTable[i];
+  return NULL;
+}
+
+//Wait for the start of the next period of a periodic task
+//The period is re-read from the task table every time, so it can be changed while running
+//Counts an overrun if the task is already late (in which case it does not wait at all)
+void waitForNextPeriod(void *pvParameters, TickType_t *lastWakeTime) {
+  TaskConfig *t = (TaskConfig *)pvParameters;
+  TRACE_END(TRACE_RUN);
+  if (xTaskDelayUntil(lastWakeTime, pdMS_TO_TICKS(t->periodMs)) == pdFALSE)
+    t->overruns++;
+  TRACE_BEGIN(TRACE_RUN);
+}
+
+/*
+ * Per task and per core CPU usage
+ *
+ * Measured from the FreeRTOS run time counters. Needs configGENERATE_RUN_TIME_STATS
+ * and configUSE_TRACE_FACILITY (both set in the standard ESP32 Arduino build).
+ * Call sampleTaskStats() about once a second, the results are the CPU share of each
+ * task (as a percentage of one core) and the idle percentage of each core since the
+ * previous call.
+ */
+
+#define MAX_SYSTEM_TASKS 32
+
+struct TaskSample {
+  TaskHandle_t handle;
+  const char *name;
+  uint32_t runTime;      //run time counter at the last sample
+  float cpuPercent;
+  uint32_t stackFree;    //stack high water mark, in bytes
+};
+
+TaskSample taskSamples[MAX_SYSTEM_TASKS];
+int numTaskSamples = 0;
+float coreIdlePercent[2] = {0, 0};
+
+void sampleTaskStats() {
+#if ( configGENERATE_RUN_TIME_STATS == 1 ) && ( configUSE_TRACE_FACILITY == 1 )
+  static TaskStatus_t taskStatus[MAX_SYSTEM_TASKS];
+  static uint32_t lastTotal = 0;
+  uint32_t totalRunTime;
+
+  UBaseType_t count = uxTaskGetSystemState(taskStatus, MAX_SYSTEM_TASKS, &totalRunTime);
+  uint32_t elapsed = totalRunTime - lastTotal;
+
+  for (UBaseType_t i = 0; i < count; i++) {
+    //Find this task's previous sample, or start a new one
+    int j;
+    for (j = 0; j < numTaskSamples; j++)
+      if (taskSamples[j].handle == taskStatus[i].xHandle) break;
+    if (j == numTaskSamples) {
+      if (numTaskSamples == MAX_SYSTEM_TASKS) continue;
+      numTaskSamples++;
+      taskSamples[j].handle = taskStatus[i].xHandle;
+      taskSamples[j].runTime = taskStatus[i].ulRunTimeCounter;
+    }
+    TaskSample *s = &taskSamples[j];
+    s->name = taskStatus[i].pcTaskName;
+    s->stackFree = taskStatus[i].usStackHighWaterMark;
+    if (elapsed > 0 && lastTotal != 0)
+      s->cpuPercent = 100.0 * (taskStatus[i].ulRunTimeCounter - s->runTime) / elapsed;
+    s->runTime = taskStatus[i].ulRunTimeCounter;
+
+    for (int core = 0; core < 2; core++) {
+      if (s->handle == xTaskGetIdleTaskHandleForCPU(core))
+        coreIdlePercent[core] = s->cpuPercent;
+    }
+  }
+  lastTotal = totalRunTime;
+#endif
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+/*
+ * Tracepoints
+ *
+ * When a heading glitch shows up it helps to see how the tasks interleaved around it. Define
+ * TRACE (top of the sketch) and the tracepoints below record into a ring per core, and GET
+ * /trace returns the rings as Chrome trace event JSON, which opens in Perfetto
+ * (ui.perfetto.dev) or chrome://tracing as a timeline: one track per core and task, with
+ * every task's run from wake up to sleep, the I2C transfers and the waits for the bus, the
+ * HTTP handlers, the OLED updates and so on. Without TRACE the macros are empty and no trace
+ * code or data is built at all.
+ *
+ *   TRACE_BEGIN(id) / TRACE_END(id)   a span on the current task
+ *   TRACE_SCOPE(id)                   a span to the end of the enclosing block
+ *   TRACE_INSTANT(id, arg)            a single event with a 16 bit argument
+ *
+ * Recording an event is a read of the core's cycle counter and an atomic increment to claim
+ * a slot - no lock, so it is safe from any task. Each core writes only its own ring and an
+ * entry's seq is written last, so a reader can tell a finished entry from one being written
+ * or one left over from the previous lap. The rings are flight recorders: the oldest events
+ * are overwritten, and recording stops while /trace is being read.
+ *
+ * The cycle counters of the two cores are not in step and their rate follows the CPU clock,
+ * which the power manager changes. So traceSync() puts a sync entry - cycle count, time since
+ * boot and clock speed - in each core's ring, from that core. It is called once a second by
+ * the Power task and whenever the clock changes, and the cycle counts of the events after it
+ * are turned into microseconds from that. Events older than the oldest sync left in a ring
+ * are dropped from the dump.
+ */
+
+enum TraceEventId {
+  TRACE_SYNC,            //internal - see traceSync()
+  TRACE_RUN,             //a task awake, from its wake up to going back to sleep
+  TRACE_I2C,             //a CMPS14 transfer
+  TRACE_I2C_WAIT,        //waiting for another task to finish with the bus
+  TRACE_BAD_SAMPLE,      //arg is the SampleStatus
+  TRACE_NMEA_OUT,        //NMEA encode and fan out
+  TRACE_HTTP,            //HTTP server loop
+  TRACE_OLED,            //OLED redraw
+  TRACE_NETWORK,         //Network task handling a select() wake up
+  TRACE_SIGNALK,         //Signal K tick
+  TRACE_SEA_STATE,       //sea state spectrum of one window
+  NUM_TRACE_EVENTS
+};
+
+#ifdef TRACE
+
+#include <esp_ipc.h>
+#include <esp_timer.h>
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 1024       //events per core, 16 bytes each
+#endif
+#define TRACE_MAX_TASKS 32
+
+const char * const traceEventNames[NUM_TRACE_EVENTS] = {
+  "sync", "run", "i2c", "i2c wait", "bad sample", "nmea out", "http", "oled", "network", "signalk", "sea state"
+};
+
+struct TraceEntry {
+  uint32_t seq;                  //slot number + 1, written last
+  uint32_t cycles;               //the core's cycle counter
+  uint32_t data;                 //TaskHandle_t; low 32 bits of the time in us for a sync
+  uint16_t arg;                  //high 16 bits of the time for a sync
+  uint8_t id;                    //TraceEventId; CPU MHz for a sync
+  char phase;                    //B, E, i, or S for a sync
+};
+
+struct TraceRing {
+  uint32_t head;                 //slots claimed so far
+  TraceEntry entry[TRACE_RING_SIZE];
+};
+
+TraceRing traceRings[portNUM_PROCESSORS];
+volatile bool traceEnabled = true;
+
+inline void traceRecord(uint8_t id, char phase, uint16_t arg, uint32_t data) {
+  if (!traceEnabled) return;
+  uint32_t cycles = ESP.getCycleCount();
+  TraceRing *r = &traceRings[xPortGetCoreID()];
+  uint32_t seq = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+  TraceEntry *e = &r->entry[seq % TRACE_RING_SIZE];
+  e->seq = 0;
+  e->cycles = cycles;
+  e->data = data;
+  e->arg = arg;
+  e->id = id;
+  e->phase = phase;
+  __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+inline void traceEvent(uint8_t id, char phase, uint16_t arg) {
+  traceRecord(id, phase, arg, (uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle());
+}
+
+struct TraceScope {
+  uint8_t id;
+  TraceScope(uint8_t id) : id(id) { traceEvent(id, 'B', 0); }
+  ~TraceScope() { traceEvent(id, 'E', 0); }
+};
+
+//Runs on each core in turn
+void traceSyncHere(void *) {
+  uint64_t us = esp_timer_get_time();
+  traceRecord(getCpuFrequencyMhz(), 'S', us >> 32, (uint32_t)us);
+}
+
+void traceSync() {
+  for (int core = 0; core < portNUM_PROCESSORS; core++) esp_ipc_call_blocking(core, traceSyncHere, NULL);
+}
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_BEGIN(id) traceEvent(id, 'B', 0)
+#define TRACE_END(id) traceEvent(id, 'E', 0)
+#define TRACE_INSTANT(id, arg) traceEvent(id, 'i', arg)
+#define TRACE_SCOPE(id) TraceScope TRACE_CONCAT(traceScope, __LINE__)(id)
+#define TRACE_SYNC() traceSync()
+
+/*
+ * Chrome trace event JSON
+ */
+
+TaskStatus_t traceTaskStatus[TRACE_MAX_TASKS];
+uint32_t traceTids[TRACE_MAX_TASKS];     //task handles, in the order they were first seen
+int numTraceTids;
+
+//Chrome wants a small number for each thread
+int traceTid(uint32_t task) {
+  for (int i = 0; i < numTraceTids; i++)
+    if (traceTids[i] == task) return i + 1;
+  if (numTraceTids == TRACE_MAX_TASKS) return 0;
+  traceTids[numTraceTids++] = task;
+  return numTraceTids;
+}
+
+//Tasks that have been deleted since - the Boot task for one - can only be shown by number
+const char *traceTaskName(uint32_t task, int count) {
+  for (int i = 0; i < count; i++)
+    if ((uint32_t)(uintptr_t)traceTaskStatus[i].xHandle == task) return traceTaskStatus[i].pcTaskName;
+  return NULL;
+}
+
+void traceJson(Print &out, bool clear) {
+  char buff[160];
+  bool first = true;
+  uint32_t seen[portNUM_PROCESSORS] = {0};     //tids named on each core, as a bit mask
+
+  traceEnabled = false;
+  vTaskDelay(pdMS_TO_TICKS(2));   //let any event being recorded finish
+  int tasks = uxTaskGetSystemState(traceTaskStatus, TRACE_MAX_TASKS, NULL);
+  numTraceTids = 0;
+
+  out.print("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    TraceRing *r = &traceRings[core];
+    uint32_t head = r->head;
+    uint32_t seq = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    uint32_t syncCycles = 0, mhz = 0;
+    uint64_t syncUs = 0;
+
+    out.printf("%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"core %d\"}}",
+               first ? "" : ",", core, core);
+    first = false;
+    for (; seq != head; seq++) {
+      TraceEntry *e = &r->entry[seq % TRACE_RING_SIZE];
+      if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq + 1) continue;
+      if (e->phase == 'S') {
+        syncCycles = e->cycles;
+        syncUs = (uint64_t)e->arg << 32 | e->data;
+        mhz = e->id;
+        continue;
+      }
+      if (mhz == 0 || e->id >= NUM_TRACE_EVENTS) continue;   //no sync yet to time it by
+
+      int tid = traceTid(e->data);
+      if (tid > 0 && tid <= 32 && !(seen[core] & 1UL << (tid - 1))) {
+        const char *name = traceTaskName(e->data, tasks);
+        seen[core] |= 1UL << (tid - 1);
+        if (name != NULL) sprintf(buff, "%s", name);
+        else sprintf(buff, "task %08x", e->data);
+        out.printf(",{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                   core, tid, buff);
+      }
+      //Signed, as an event can claim its slot just after a sync that read the counter later
+      double us = syncUs + (double)(int32_t)(e->cycles - syncCycles) / mhz;
+      int n = sprintf(buff, ",{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+                      traceEventNames[e->id], e->phase, us, core, tid);
+      if (e->phase == 'i') n += sprintf(buff + n, ",\"s\":\"t\",\"args\":{\"arg\":%u}", e->arg);
+      strcpy(buff + n, "}");
+      out.print(buff);
+    }
+    if (clear) {
+      memset(r->entry, 0, sizeof(r->entry));
+      r->head = 0;
+    }
+  }
+  out.print("]}\n");
+
+  traceEnabled = true;
+  traceSync();
+}
+
+#else
+
+#define TRACE_BEGIN(id) do {} while (0)
+#define TRACE_END(id) do {} while (0)
+#define TRACE_INSTANT(id, arg) do {} while (0)
+#define TRACE_SCOPE(id) do {} while (0)
+#define TRACE_SYNC() do {} while (0)
+
+#endif //TRACE
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef _VOTE_H
+#define _VOTE_H
+/*
+ * Sensor voting
+ *
+ * With two or three CMPS14s fitted (see Cmps14.h) the correct stage hands the corrected
+ * heading of every sensor that answered to voteHeading(), which puts them together into
+ * the one boat heading.
+ *
+ * The headings are averaged on the circle (sum of the unit vectors), so 359 and 001 make 000
+ * and not 180. A sensor that has failed on the bus is simply left out. The harder failures
+ * are the silent ones - a sensor that has frozen, or has been pulled off by a bit of steel
+ * or a loudspeaker, answers perfectly well with the wrong heading. So while more than two are
+ * left, the one furthest from the mean is thrown out if it is more than VOTE_AGREE_DEG away,
+ * and the mean taken again. Two that disagree can't be told apart by the headings alone: the
+ * one nearer the last voted heading is used, as the boat can't have turned far in one sample,
+ * and the disagreement is flagged for the display and counted.
+ *
+ * How often each sensor is used, outvoted or missing, and how far it sits from the vote on
+ * average, is kept for "sensors" on the console and /metrics. A sensor that keeps being
+ * outvoted needs its compass card redone, or moving.
+ */
+
+#include "Cmps14.h"
+
+#ifndef VOTE_AGREE_DEG
+#define VOTE_AGREE_DEG 10.0      //sensors further apart than this disagree
+#endif
+
+struct SensorHealth {
+  uint32_t used;           //samples it was part of the vote
+  uint32_t outvoted;       //it answered, but disagreed with the others
+  uint32_t missing;        //it didn't answer
+  float deviation;         //from the vote on the last sample it answered, degrees
+  double absDeviationSum;  //for the mean
+};
+
+SensorHealth sensorHealth[CMPS_MAX_SENSORS];
+uint32_t voteDisagreements = 0;   //samples where the sensors that answered didn't agree
+uint32_t voteNone = 0;            //samples where none answered
+volatile bool voteDisagree = false;
+volatile uint8_t voteSensorsUsed = 0;
+int voteLast = -1;                //last voted heading
+
+//a - b, the short way round the circle, -180 to 180
+inline float voteDiff(float a, float b) {
+  float diff = fmodf(a - b, 360);
+  if (diff > 180) diff -= 360;
+  else if (diff < -180) diff += 360;
+  return diff;
+}
+
+//Circular mean of the headings with a bit set in mask
+float voteMean(const int16_t heading[], uint8_t mask) {
+  float s = 0, c = 0;
+  for (int i = 0; i < cmpsCount; i++) {
+    if (!(mask & (1 << i))) continue;
+    s += sin(heading[i] * DEG_TO_RAD);
+    c += cos(heading[i] * DEG_TO_RAD);
+  }
+  float mean = atan2(s, c) * RAD_TO_DEG;
+  return mean < 0 ? mean + 360 : mean;
+}
+
+//Put the corrected headings of the sensors together. False if none of them answered
+//Called by the Heading task for every sample
+bool voteHeading(const int16_t heading[], const SampleStatus status[], int *voted) {
+  uint8_t mask = 0;
+  int n = 0;
+  bool disagree = false;
+
+  for (int i = 0; i < cmpsCount; i++) {
+    if (status[i] == SAMPLE_OK) {
+      mask |= 1 << i;
+      n++;
+    } else sensorHealth[i].missing++;
+  }
+  voteSensorsUsed = n;
+  if (n == 0) {
+    voteNone++;
+    voteDisagree = false;
+    return false;
+  }
+
+  //Throw out the worst outlier while there is a majority to outvote it
+  float mean = voteMean(heading, mask);
+  while (n > 2) {
+    int worst = -1;
+    float worstDiff = 0;
+    for (int i = 0; i < cmpsCount; i++) {
+      if (!(mask & (1 << i))) continue;
+      float diff = fabs(voteDiff(heading[i], mean));
+      if (diff > worstDiff) {
+        worst = i;
+        worstDiff = diff;
+      }
+    }
+    if (worstDiff <= VOTE_AGREE_DEG) break;
+    mask &= ~(1 << worst);
+    n--;
+    disagree = true;
+    mean = voteMean(heading, mask);
+  }
+
+  //No majority - go with the one that is nearer where we were
+  if (n == 2) {
+    int a = -1, b = -1;
+    for (int i = 0; i < cmpsCount; i++) {
+      if (!(mask & (1 << i))) continue;
+      if (a < 0) a = i;
+      else b = i;
+    }
+    if (fabs(voteDiff(heading[a], heading[b])) > VOTE_AGREE_DEG) {
+      disagree = true;
+      if (voteLast >= 0 && fabs(voteDiff(heading[b], voteLast)) < fabs(voteDiff(heading[a], voteLast))) a = b;
+      mask = 1 << a;
+      mean = heading[a];
+    }
+  }
+  if (disagree) voteDisagreements++;
+  voteDisagree = disagree;
+
+  *voted = (int)(mean + 0.5) % 360;
+  voteLast = *voted;
+  for (int i = 0; i < cmpsCount; i++) {
+    if (status[i] != SAMPLE_OK) continue;
+    SensorHealth *h = &sensorHealth[i];
+    if (mask & (1 << i)) h->used++;
+    else h->outvoted++;
+    h->deviation = voteDiff(heading[i], mean);
+    h->absDeviationSum += fabs(h->deviation);
+  }
+  return true;
+}
+
+//"sensors" on the console
+void sensorsStatus(Print &out) {
+  out.print("Sensor  Bus Addr  Status      Used  Outvoted   Missing  Dev   Mean dev  Read us  Max us\n");
+  for (int i = 0; i < cmpsCount; i++) {
+    Cmps14 *c = &cmpsSensors[i];
+    SensorHealth *h = &sensorHealth[i];
+    uint32_t answered = h->used + h->outvoted;
+    out.printf("%-7s %d   0x%02x  %-10s %6u %9u %9u %5.1f %8.1f %8.0f %7u%s\n",
+               c->name, (int)(c->bus - cmpsBuses), c->address,
+               c->busDown ? "down" : sampleStatusNames[c->status],
+               h->used, h->outvoted, h->missing, h->deviation,
+               answered > 0 ? h->absDeviationSum / answered : 0.0,
+               c->reads > 0 ? (double)c->readUsTotal / c->reads : 0.0, c->readUsMax,
+               i == cmpsSelected ? "  *" : "");
+  }
+  out.printf("Disagreements %u, no sensor %u%s\n", voteDisagreements, voteNone,
+             voteDisagree ? " - the sensors disagree now" : "");
+  out.print("* calibration and compass card commands work on this one\n");
+}
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef _WMM_H
+#define _WMM_H
+/*
+ * Magnetic variation from the World Magnetic Model
+ *
+ * The WMM spherical harmonic coefficients (degree and order 12) are held in flash and
+ * evaluated for a position and decimal year, giving the declination (variation) in
+ * degrees, east positive. Evaluating the model takes a few hundred thousand cycles, so
+ * results are cached on a WMM_CELL_DEG grid: the variation is worked out once at the
+ * centre of a cell and after that a sample only costs a table lookup. Within a 1 degree
+ * cell the variation changes by a few tenths of a degree at most outside the polar
+ * regions - well below what the compass can resolve.
+ *
+ * The position comes from the web app (/setPosition) or the console, or from GPS sentences
+ * sent in by a client, and the date from the GPS or failing that the firmware build date.
+ * Once both are known the Encode task adds HDG (with the variation) and HDT (true heading)
+ * to the HDM sentence.
+ *
+ * The coefficients are WMM2025 (epoch 2025.0). A model is only good for the five years
+ * after its epoch - outside that the secular variation terms are extrapolating and the
+ * error grows quickly - so dates outside the window give no variation rather than a
+ * wrong one. To move to a newer model replace the table with the rows of the new WMM.COF
+ * file and change WMM_EPOCH - the layout is the same, n m g h gdot hdot.
+ *
+ * The cache is shared by every task that asks for a variation, so entries are copied in
+ * and out under wmmMux. The model itself is evaluated outside the lock; two tasks may
+ * both work out the same cell, which costs time but no harm.
+ */
+
+#define WMM_EPOCH 2025.0f
+#define WMM_LIFE_YEARS 5.0f        //the model is valid from its epoch for this long
+#define WMM_MAX_DEGREE 12
+#define WMM_CELL_DEG 1
+#define WMM_CACHE_SIZE 16          //direct mapped
+#define WMM_CACHE_YEARS 0.1f       //re-evaluate cells this much older than the date
+
+struct WmmCoefficient {
+  uint8_t n, m;
+  float g, h, gdot, hdot;          //nT and nT/year
+};
+
+const WmmCoefficient wmmCoefficients[] = {
+  { 1,  0, -29351.8,      0.0,  12.0,   0.0 },
+  { 1,  1,  -1410.8,   4545.4,   9.7, -21.5 },
+  { 2,  0,  -2556.6,      0.0, -11.6,   0.0 },
+  { 2,  1,   2951.1,  -3133.6,  -5.2, -27.7 },
+  { 2,  2,   1649.3,   -815.1,  -8.0, -12.1 },
+  { 3,  0,   1361.0,      0.0,  -1.3,   0.0 },
+  { 3,  1,  -2404.1,    -56.6,  -4.2,   4.0 },
+  { 3,  2,   1243.8,    237.5,   0.4,  -0.3 },
+  { 3,  3,    453.6,   -549.5, -15.6,  -4.1 },
+  { 4,  0,    895.0,      0.0,  -1.6,   0.0 },
+  { 4,  1,    799.5,    278.6,  -2.4,  -1.1 },
+  { 4,  2,     55.7,   -133.9,  -6.0,   4.1 },
+  { 4,  3,   -281.1,    212.0,   5.6,   1.6 },
+  { 4,  4,     12.1,   -375.6,  -7.0,  -4.4 },
+  { 5,  0,   -233.2,      0.0,   0.6,   0.0 },
+  { 5,  1,    368.9,     45.4,   1.4,  -0.5 },
+  { 5,  2,    187.2,    220.2,   0.0,   2.2 },
+  { 5,  3,   -138.7,   -122.9,   0.6,   0.4 },
+  { 5,  4,   -142.0,     43.0,   2.2,   1.7 },
+  { 5,  5,     20.9,    106.1,   0.9,   1.9 },
+  { 6,  0,     64.4,      0.0,  -0.2,   0.0 },
+  { 6,  1,     63.8,    -18.4,  -0.4,   0.3 },
+  { 6,  2,     76.9,     16.8,   0.9,  -1.6 },
+  { 6,  3,   -115.7,     48.8,   1.2,  -0.4 },
+  { 6,  4,    -40.9,    -59.8,  -0.9,   0.9 },
+  { 6,  5,     14.9,     10.9,   0.3,   0.7 },
+  { 6,  6,    -60.7,     72.7,   0.9,   0.9 },
+  { 7,  0,     79.5,      0.0,  -0.0,   0.0 },
+  { 7,  1,    -77.0,    -48.9,  -0.1,   0.6 },
+  { 7,  2,     -8.8,    -14.4,  -0.1,   0.5 },
+  { 7,  3,     59.3,     -1.0,   0.5,  -0.8 },
+  { 7,  4,     15.8,     23.4,  -0.1,   0.0 },
+  { 7,  5,      2.5,     -7.4,  -0.8,  -1.0 },
+  { 7,  6,    -11.1,    -25.1,  -0.8,   0.6 },
+  { 7,  7,     14.2,     -2.3,   0.8,  -0.2 },
+  { 8,  0,     23.2,      0.0,  -0.1,   0.0 },
+  { 8,  1,     10.8,      7.1,   0.2,  -0.2 },
+  { 8,  2,    -17.5,    -12.6,   0.0,   0.5 },
+  { 8,  3,      2.0,     11.4,   0.5,  -0.4 },
+  { 8,  4,    -21.7,     -9.7,  -0.1,   0.4 },
+  { 8,  5,     16.9,     12.7,   0.3,  -0.5 },
+  { 8,  6,     15.0,      0.7,   0.2,  -0.6 },
+  { 8,  7,    -16.8,     -5.2,  -0.0,   0.3 },
+  { 8,  8,      0.9,      3.9,   0.2,   0.2 },
+  { 9,  0,      4.6,      0.0,  -0.0,   0.0 },
+  { 9,  1,      7.8,    -24.8,  -0.1,  -0.3 },
+  { 9,  2,      3.0,     12.2,   0.1,   0.3 },
+  { 9,  3,     -0.2,      8.3,   0.3,  -0.3 },
+  { 9,  4,     -2.5,     -3.4,  -0.3,   0.3 },
+  { 9,  5,    -13.1,     -5.3,   0.0,   0.2 },
+  { 9,  6,      2.4,      7.2,   0.3,  -0.1 },
+  { 9,  7,      8.6,     -0.6,  -0.1,  -0.2 },
+  { 9,  8,     -8.7,      0.8,   0.1,   0.4 },
+  { 9,  9,    -12.9,     10.0,  -0.1,   0.1 },
+  { 10, 0,     -1.3,      0.0,   0.1,   0.0 },
+  { 10, 1,     -6.4,      3.3,   0.0,   0.0 },
+  { 10, 2,      0.2,      0.0,   0.1,  -0.0 },
+  { 10, 3,      2.0,      2.4,   0.1,  -0.2 },
+  { 10, 4,     -1.0,      5.3,  -0.0,   0.1 },
+  { 10, 5,     -0.6,     -9.1,  -0.3,  -0.1 },
+  { 10, 6,     -0.9,      0.4,   0.0,   0.1 },
+  { 10, 7,      1.5,     -4.2,  -0.1,   0.0 },
+  { 10, 8,      0.9,     -3.8,  -0.1,  -0.1 },
+  { 10, 9,     -2.7,      0.9,  -0.0,   0.2 },
+  { 10, 10,    -3.9,     -9.1,  -0.0,  -0.0 },
+  { 11, 0,      2.9,      0.0,   0.0,   0.0 },
+  { 11, 1,     -1.5,      0.0,  -0.0,  -0.0 },
+  { 11, 2,     -2.5,      2.9,   0.0,   0.1 },
+  { 11, 3,      2.4,     -0.6,   0.0,  -0.0 },
+  { 11, 4,     -0.6,      0.2,   0.0,   0.1 },
+  { 11, 5,     -0.1,      0.5,  -0.1,  -0.0 },
+  { 11, 6,     -0.6,     -0.3,   0.0,  -0.0 },
+  { 11, 7,     -0.1,     -1.2,  -0.0,   0.1 },
+  { 11, 8,      1.1,     -1.7,  -0.1,  -0.0 },
+  { 11, 9,     -1.0,     -2.9,  -0.1,   0.0 },
+  { 11, 10,    -0.2,     -1.8,  -0.1,   0.0 },
+  { 11, 11,     2.6,     -2.3,  -0.1,   0.0 },
+  { 12, 0,     -2.0,      0.0,   0.0,   0.0 },
+  { 12, 1,     -0.2,     -1.3,   0.0,  -0.0 },
+  { 12, 2,      0.3,      0.7,  -0.0,   0.0 },
+  { 12, 3,      1.2,      1.0,  -0.0,  -0.1 },
+  { 12, 4,     -1.3,     -1.4,  -0.0,   0.1 },
+  { 12, 5,      0.6,     -0.0,  -0.0,  -0.0 },
+  { 12, 6,      0.6,      0.6,   0.1,  -0.0 },
+  { 12, 7,      0.5,     -0.1,  -0.0,  -0.0 },
+  { 12, 8,     -0.1,      0.8,   0.0,   0.0 },
+  { 12, 9,     -0.4,      0.1,   0.0,  -0.0 },
+  { 12, 10,    -0.2,     -1.0,  -0.1,  -0.0 },
+  { 12, 11,    -1.3,      0.1,  -0.0,   0.0 },
+  { 12, 12,    -0.7,      0.2,  -0.1,  -0.1 }
+};
+#define WMM_COEFFICIENTS (sizeof(wmmCoefficients) / sizeof(wmmCoefficients[0]))
+
+//WGS84 ellipsoid and the model's reference radius, km
+#define WMM_A 6378.137f
+#define WMM_F (1 / 298.257223563f)
+#define WMM_RE 6371.2f
+
+struct WmmCacheEntry {
+  int16_t lat, lon;                //cell, in WMM_CELL_DEG steps
+  float year;                      //date the value was worked out for
+  float variation;
+  bool valid;
+};
+
+WmmCacheEntry wmmCache[WMM_CACHE_SIZE];
+portMUX_TYPE wmmMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t wmmEvaluations = 0, wmmCacheHits = 0;
+
+//True if the date is inside the model's life
+inline bool wmmCovers(float year) {
+  return year >= WMM_EPOCH && year < WMM_EPOCH + WMM_LIFE_YEARS;
+}
+
+//Declination in degrees (east positive) at a geodetic position, sea level
+float wmmDeclination(float latDeg, float lonDeg, float year) {
+  //Schmidt semi-normalised associated Legendre functions and their derivatives
+  float P[WMM_MAX_DEGREE + 1][WMM_MAX_DEGREE + 1], dP[WMM_MAX_DEGREE + 1][WMM_MAX_DEGREE + 1];
+  float cosmlon[WMM_MAX_DEGREE + 1], sinmlon[WMM_MAX_DEGREE + 1];
+  float dt = year - WMM_EPOCH;
+
+  //Geodetic to geocentric spherical coordinates
+  float lat = latDeg * DEG_TO_RAD, lon = lonDeg * DEG_TO_RAD;
+  float e2 = WMM_F * (2 - WMM_F);
+  float rc = WMM_A / sqrtf(1 - e2 * sinf(lat) * sinf(lat));
+  float p = rc * cosf(lat);
+  float z = rc * (1 - e2) * sinf(lat);
+  float r = sqrtf(p * p + z * z);
+  float latc = asinf(z / r);
+  float ct = sinf(latc), st = cosf(latc);    //cos and sin of the colatitude
+
+  P[0][0] = 1;
+  dP[0][0] = 0;
+  for (int n = 1; n <= WMM_MAX_DEGREE; n++) {
+    for (int m = 0; m <= n; m++) {
+      if (n == m) {
+        float k = n == 1 ? 1 : sqrtf((2.0f * n - 1) / (2.0f * n));
+        P[n][m] = k * st * P[n - 1][m - 1];
+        dP[n][m] = k * (st * dP[n - 1][m - 1] + ct * P[n - 1][m - 1]);
+      } else {
+        float k1 = (2.0f * n - 1) / sqrtf((float)(n * n - m * m));
+        float k2 = n - 1 > m ? sqrtf((float)((n - 1) * (n - 1) - m * m) / (n * n - m * m)) : 0;
+        P[n][m] = k1 * ct * P[n - 1][m] - (n - 1 > m ? k2 * P[n - 2][m] : 0);
+        dP[n][m] = k1 * (ct * dP[n - 1][m] - st * P[n - 1][m]) - (n - 1 > m ? k2 * dP[n - 2][m] : 0);
+      }
+    }
+  }
+  for (int m = 0; m <= WMM_MAX_DEGREE; m++) {
+    cosmlon[m] = cosf(m * lon);
+    sinmlon[m] = sinf(m * lon);
+  }
+
+  //Field components in the geocentric frame: north, east, down
+  float bn = 0, be = 0, bd = 0;
+  float ratio = WMM_RE / r, power = ratio * ratio;
+  int lastN = 0;
+  for (unsigned i = 0; i < WMM_COEFFICIENTS; i++) {
+    const WmmCoefficient *c = &wmmCoefficients[i];
+    if (c->n != lastN) {
+      power *= ratio;
+      lastN = c->n;
+    }
+    float g = c->g + dt * c->gdot, h = c->h + dt * c->hdot;
+    float gh = g * cosmlon[c->m] + h * sinmlon[c->m];
+    bn += power * gh * dP[c->n][c->m];
+    be += power * c->m * (g * sinmlon[c->m] - h * cosmlon[c->m]) * P[c->n][c->m];
+    bd -= power * (c->n + 1) * gh * P[c->n][c->m];
+  }
+  //East needs dividing by sin(colatitude) - declination is meaningless at the poles anyway
+  be = st > 1e-6f ? be / st : 0;
+
+  //Rotate north back into the geodetic frame - east is unchanged, and so is the
+  //declination except for the small tilt, which only mixes north and down
+  float psi = latc - lat;
+  float x = bn * cosf(psi) - bd * sinf(psi);
+  wmmEvaluations++;
+  return atan2f(be, x) * RAD_TO_DEG;
+}
+
+//Variation at a position, from the cache if the cell has been worked out recently enough
+float wmmVariation(float latDeg, float lonDeg, float year) {
+  int16_t lat = (int16_t)floorf(latDeg / WMM_CELL_DEG);
+  int16_t lon = (int16_t)floorf(lonDeg / WMM_CELL_DEG);
+  WmmCacheEntry *e = &wmmCache[(uint16_t)(lat * 31 + lon) % WMM_CACHE_SIZE], entry;
+
+  portENTER_CRITICAL(&wmmMux);
+  entry = *e;
+  bool hit = entry.valid && entry.lat == lat && entry.lon == lon && fabsf(entry.year - year) < WMM_CACHE_YEARS;
+  if (hit) wmmCacheHits++;
+  portEXIT_CRITICAL(&wmmMux);
+  if (hit) return entry.variation;
+
+  entry.lat = lat;
+  entry.lon = lon;
+  entry.year = year;
+  entry.variation = wmmDeclination((lat + 0.5f) * WMM_CELL_DEG, (lon + 0.5f) * WMM_CELL_DEG, year);
+  entry.valid = true;
+  portENTER_CRITICAL(&wmmMux);
+  *e = entry;
+  portEXIT_CRITICAL(&wmmMux);
+  return entry.variation;
+}
+
+/*
+ * Where we are and when
+ */
+
+struct Position {
+  volatile bool valid;
+  float lat, lon;                  //degrees, north and east positive
+  float year;                      //decimal year, 0 until we are told the date
+  unsigned long updatedAt;         //millis()
+};
+
+Position position = { false, 0, 0, 0, 0 };
+
+void setPosition(float lat, float lon) {
+  position.lat = lat;
+  position.lon = lon;
+  position.updatedAt = millis();
+  position.valid = true;
+}
+
+void setDate(int year, int month, int day) {
+  static const int daysBefore[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+  if (month < 1 || month > 12) return;
+  position.year = year + (daysBefore[month - 1] + day - 1) / 365.25f;
+}
+
+//Decimal year - from the GPS if we have had a date, otherwise when the firmware was built
+float currentYear() {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  static float buildYear = 0;
+
+  if (position.year > 0) return position.year;
+  if (buildYear == 0) {
+    const char *date = __DATE__;    //"Mmm dd yyyy"
+    int month = 1;
+    while (month < 12 && strncmp(months + 3 * (month - 1), date, 3) != 0) month++;
+    int day = atoi(date + 4);
+    int year = atoi(date + 7);
+    buildYear = year + (month - 1) / 12.0f + (day - 1) / 365.25f;
+  }
+  return buildYear;
+}
+
+//Variation at the current position, false if we don't know where we are or the date
+//is outside the model
+bool currentVariation(float *variation) {
+  if (!position.valid || !wmmCovers(currentYear())) return false;
+  *variation = wmmVariation(position.lat, position.lon, currentYear());
+  return true;
+}
+
+#endif
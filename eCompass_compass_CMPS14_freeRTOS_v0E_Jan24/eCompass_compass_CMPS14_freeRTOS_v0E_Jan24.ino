@@ -10,6 +10,9 @@
  * compass bearing. This is output as an NMEA "HDM" message over WiFi
  * The ESP32 provides a WiFi Access Point.
  * This has a Telnet server On port 23- the HDM messages are transmitted 5 times per second
+ * (once a second at anchor, 10 times a second when the boat is turning - see Power.h)
+ * Clients on the same port can send us RMC, GGA, VTG and HSC sentences - position, course
+ * over ground and heading to steer (see NmeaInput.h)
  * There is an http server running on port 80 - The default (root) node serves a single page web-app 
  * point your browser at 192.168.4.1/public/sensorCalibration.html to run the calibration web app
  * You need to connect to the WiFi acces point first. The default SSID is "NavSource"
@@ -26,8 +29,14 @@
  *
  *  The background tasks are run by RTOS Tasks without any
  *  direct user interaction. The RTOS scheduler is pre-emptive so any shared variables probably need to be protected by semaphores
+ *  The tasks are listed in taskTable below, which sets their core, priority, stack and period.
+ *  Sensor acquisition and NMEA output run on core 1, networking and http on core 0 (with the WiFi stack)
+ *  The heading is passed from the CMPS14 to the NMEA clients through a pipeline of tasks
+ *  (see Pipeline.h) - only the first one runs on a clock, the rest run as soon as they are fed.
  *  
- *  The foreground tasks are called from the main loop()
+ *  The network task blocks in select() until a client connects (or goes away) - nothing polls.
+ *  The foreground tasks (the config console, see Console.h) are run by the network task when
+ *  there is input from a user. loop() has nothing left to do.
  *  
  *
  * Communication between background and foreground tasks is via a set of global static
@@ -43,10 +52,28 @@
  * 
  */
 
+#define VERSION "Prototype 0.E.2"
+
+/* What goes into the firmware - BUILD_PROTOTYPE, BUILD_HEADLESS (production, no OLED) or BUILD_MINIMAL_NMEA - see BuildProfile.h */
+#define BUILD_PROFILE BUILD_PROTOTYPE
+
+/* Uncomment to run without a CMPS14 - readings come from the simulator in SimCmps14.h */
+//#define SIMULATE_CMPS14
+
+/* Uncomment to add the "bench" console command - see Bench.h */
+//#define BENCHMARKS
+
+/* Uncomment to stop with a backtrace if the sensor or output tasks allocate once running - see Memory.h */
+//#define HEAP_CHECK
+
+/* Uncomment to record tracepoints and serve them as a Chrome trace at /trace - see Trace.h */
+//#define TRACE
 
 /* Imported libraries */
 #include <SPI.h>
 #include <Wire.h>
+#include "Trace.h"
+#include "BuildProfile.h"
 #include "Cmps14.h"
 #include <Preferences.h> //Check -is this compatible with SPIFFS?
 #include <cppQueue.h>
@@ -54,39 +81,85 @@
 #include <WiFiClient.h>
 #include <WiFiAP.h>
 #include <DNSServer.h>
+#if FEATURE_OLED
 #include <Adafruit_GFX.h>
 #include <Adafruit_SH110X.h>
+#endif
 #include <SPIFFS.h>
 #include <HTTPS_Server_Generic.h>
 
 
 /* Local libs */
+#include "Configuration.h"
+#include "Tasks.h"
+#include "Memory.h"
+#include "Boot.h"
+#include "SocketServer.h"
 #include "NMEA.hpp"
+#include "NmeaInput.h"
+#include "NmeaSerial.h"
+#include "NmeaProfiles.h"
+#include "Wmm.h"
+#include "Metrics.h"
 #include "calibration.h"
+#include "Deviation.h"
+#include "Recorder.h"
+#include "Heading.h"
+#if FEATURE_HISTORY
+#include "History.h"
+#endif
+#include "Vote.h"
+#include "Pipeline.h"
+#if FEATURE_SIGNALK
+#include "SignalK.h"
+#endif
 #include "webCalibration.h"
+#include "Bench.h"
+#include "Console.h"
 
 
-#define VERSION "Prototype 0.E.2"
-#define TELNET_PORT 23       //Compass heading is output on this port
 #define CONFIG_PORT 1024
 #define WWW_PORT 80
-#define MAX_TELNET_CLIENTS 4
+#define MAX_TELNET_CLIENTS MAX_TCP_CLIENTS //Size of the client array. The number actually allowed is configurable
+
+#define CMPS14_SAMPLERATE_DELAY_MS 100 //Compass chip is sampled 10 times per second
 
+#if FEATURE_OLED
 #define DISPLAY_I2C_ADDRESS 0x3c //initialize with the I2C addr 0x3C Typically eBay OLED's
 #define SCREEN_WIDTH 128 // OLED display width, in pixels
 #define SCREEN_HEIGHT 64 // OLED display height, in pixels
 #define OLED_RESET -1   //   QT-PY / XIAO
 
-#define CMPS14_SAMPLERATE_DELAY_MS 100 //Compass chip is sampled 10 times per second
-
 Adafruit_SH1106G display = Adafruit_SH1106G(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
+#endif
 
 //Pre-Declare background task methods
-void output();
-void updateHeading();
+void output(void *);
+void updateHeading(void *);
+void processHeading(void *);
+void encodeHeading(void *);
 void turnOff();
-void handleHttp();
-void displayHeadings();
+void handleHttp(void *);
+void handleNetwork(void *);
+#if FEATURE_OLED
+void displayHeadings(void *);
+#endif
+void managePower(void *);
+void bootTask(void *);
+#if FEATURE_HISTORY
+void recordHistory(void *);
+#endif
+void receivedRMC(const NmeaRMC *, int);
+void receivedGGA(const NmeaGGA *, int);
+void receivedVTG(const NmeaVTG *, int);
+void receivedHSC(const NmeaHSC *, int);
+void receivedProfile(const NmeaSentence *, int);
+bool portReserved(uint16_t port);
+#if FEATURE_OLED
+void displayOLEDSplash();
+#endif
+void startAccessPoint();
+void removeNMEAClient(int i);
 
 
 /* Declare Global Singleton Objects */
@@ -94,120 +167,224 @@ void displayHeadings();
 // Non-volatile settings - will be restored on power-up
 Preferences settings;
 
-//Handles for the various RTOS tasks. Will be populated later
-TaskHandle_t outputTask, updateHeadingTask,  updateOLEDTask, httpServerTask;
+//The RTOS tasks. Handles will be populated by startTasks()
+TaskConfig taskTable[] = {
+  // name         function          stack  priority  core              period (ms)       started
+  { "updateHDG",  updateHeading,    4000,  5,        ACQUISITION_CORE, 100,              BOOT_FIRST },
+  { "Heading",    processHeading,   3000,  4,        ACQUISITION_CORE, 0,                BOOT_FIRST },
+  { "Encode",     encodeHeading,    4000,  4,        ACQUISITION_CORE, 0,                BOOT_FIRST },
+  { "Output",     output,           4000,  3,        ACQUISITION_CORE, 0,                BOOT_FIRST },
+#if FEATURE_OLED
+  { "updateOLED", displayHeadings,  4000,  1,        ACQUISITION_CORE, 200,              BOOT_BACKGROUND },
+#endif
+  { "Network",    handleNetwork,    4000,  3,        NETWORK_CORE,     0,                BOOT_BACKGROUND },
+  { "HandleHTTP", handleHttp,       8000,  2,        NETWORK_CORE,     100,              BOOT_BACKGROUND },
+  { "Power",      managePower,      3000,  1,        NETWORK_CORE,     1000,             BOOT_BACKGROUND },
+  { "Recorder",   recorderTask,     4000,  1,        NETWORK_CORE,     500,              BOOT_BACKGROUND },
+#if FEATURE_HISTORY
+  { "History",    recordHistory,    4000,  1,        NETWORK_CORE,     1000,             BOOT_BACKGROUND },
+#endif
+#if FEATURE_SIGNALK
+  { "SignalK",    signalKTask,      4000,  2,        NETWORK_CORE,     SIGNALK_TICK_MS,  BOOT_BACKGROUND },
+#endif
+#if FEATURE_SEA_STATE
+  { "SeaSample",  seaSample,        3000,  3,        ACQUISITION_CORE, SEA_SAMPLE_MS,    BOOT_BACKGROUND },
+  { "SeaState",   seaStateTask,     4000,  1,        NETWORK_CORE,     0,                BOOT_BACKGROUND },
+#endif
+  { "Fusion",     fusion,           4000,  5,        ACQUISITION_CORE, FUSION_PERIOD_MS, BOOT_FIRST }
+};
+const int numTasks = sizeof(taskTable) / sizeof(taskTable[0]);
 
 
 unsigned short  boatHeading = 0; //Heading seen on boat compass, calculated from sensorHeading + boatCompassOffset
 unsigned short sensorHeading = 0; //Heading read from CMPS14
 byte calibration = 0; //CMPS14 calibration level
+float rateOfTurn = 0; //Degrees per second from the gyro, positive to starboard
+volatile SampleStatus headingStatus = SAMPLE_STALE; //Status of the latest heading sample - only OK headings are sent as valid
 
-//Set up some storage for the NMEA output messages
+//Set up some storage for the NMEA messages - the output ones are in the pipeline's sentence buffers (see Pipeline.h)
 HSCmessage hsc;
-HDMmessage hdm;
+RawSample pipeRaw[PIPE_SAMPLES]; //The raw registers of each pooled sample, while recording
 
 //Create WiFi network object pointers
-const char *ssid = "NavSource";  //WiFi network name
-WiFiServer *telnetServer = NULL;
-WiFiServer configServer(CONFIG_PORT);
-WiFiServer *webServer =NULL;
-WiFiClient **telnetClients = {NULL}; //Array of WiFi Clients
-WiFiClient configClient;  //Configuration via Telnet - redundant
+//SSID, NMEA port and maximum number of NMEA clients come from the configuration (see Configuration.cpp)
+SocketServer telnetServer(0);
+struct Configuration appliedConfiguration; //The configuration the servers are currently running with
+#if FEATURE_CONFIG_TELNET
+SocketServer configServer(CONFIG_PORT);
+#endif
+WiFiClient telnetClientPool[MAX_TELNET_CLIENTS]; //Fixed pool of client objects - nothing is allocated per connection
+WiFiClient *telnetClients[MAX_TELNET_CLIENTS] = {NULL}; //The pool entries in use, NULL for a free slot
+SemaphoreHandle_t telnetClientsLock; //telnetClients is shared by the Network and Output tasks
+NmeaReceiver nmeaReceivers[MAX_TCP_CLIENTS]; //Sentences coming in from each NMEA client (see NmeaInput.h)
+struct NmeaPending {                          //The rest of a line a client's socket only took part of
+  char buf[NUM_SENTENCES * NMEA_MAX_SENTENCE];
+  int length;
+};
+NmeaPending nmeaPending[MAX_TCP_CLIENTS];
 
-extern int16_t compassCard[]; //declared in calibration.h has compass card offsets for each degree
 
 
+//Only what the heading needs is done here - the rest is left to the Boot task (see Boot.h)
 void setup() {
-  disableCalibration();  //Stop the CMPS14 from automatic recalibrating
-  Serial.begin(115200);
-  delay(1000);
-  Wire.begin();
-  // Setup filesystem
-  if (!SPIFFS.begin(true))
-    Serial.println("Mounting SPIFFS failed");
+  int64_t t;
 
+  t = esp_timer_get_time();
+  Serial.begin(115200);
+  TRACE_SYNC();
   Serial.print("Audio Compass. Version ");
   Serial.println(VERSION);
-  calibrationBegin();
+  cmpsBegin();
+  bootPhase("serial, i2c", t);
+
+  t = esp_timer_get_time();
   settings.begin("compass",false); //Open (or create) settings namespace "compass" in read-write mode
-  if ( settings.isKey("compassCard") ) {//We have an existing compassCard in NVRAM
-    Serial.println("Loading settings from flash memory");
-    settings.getBytes("compassCard",&compassCard,sizeof(compassCard));
-  } else Serial.println("No settings found in flash");
-  
-  
+  configurationPortReserved = portReserved;
+  beginConfiguration();
+  appliedConfiguration = configuration;
+  nmeaSerialBegin(configuration.NMEABaudRate); //Wired NMEA output
+  if (loadCompassCards()) Serial.println("Loaded settings from flash memory"); //We have existing compass cards in NVRAM
+  else Serial.println("No settings found in flash");
+  magCalibrationLoad();
+  bootPhase("settings", t);
+
+  t = esp_timer_get_time();
+  telnetClientsLock = xSemaphoreCreateMutex();
+  pipelineBegin();
+#if FEATURE_SEA_STATE
+  seaStateBegin();
+#endif
+#if FEATURE_HISTORY
+  historyBegin();
+#endif
+  consoleSetup();
+  cmpsReinitialise = disableCalibration; //After an I2C bus recovery the chip may have been reset
+  nmeaHandlers = { receivedRMC, receivedGGA, receivedVTG, receivedHSC, receivedProfile };
+
+  //Sample and output rates follow how lively the boat is
+  powerSetup();
+
+  //Start reading the CMPS14 and sending the heading
+  startTasks(taskTable, numTasks, BOOT_FIRST);
+  bootPhase("acquisition tasks", t);
 
+  //Everything else is done in the background
+  if (xTaskCreatePinnedToCore(bootTask, "Boot", 8000, NULL, 2, NULL, NETWORK_CORE) != pdPASS)
+    Serial.println("Failed to start task Boot");
+}
+
+//The rest of the start up, run once on the network core while the heading is already going out
+void bootTask(void * pvParameters) {
+  int64_t t;
+
+  t = esp_timer_get_time();
+  for (int i = 0; i < cmpsCount; i++) disableCalibration(&cmpsSensors[i]);  //Stop the CMPS14s from automatic recalibrating
+  calibrationBegin();
+  bootPhase("cmps14 setup", t);
+
+  // Setup filesystem
+  t = esp_timer_get_time();
+  if (!SPIFFS.begin(true))
+    Serial.println("Mounting SPIFFS failed");
+  bootPhase("spiffs", t);
+
+#if FEATURE_OLED
   //Init OLED display
+  t = esp_timer_get_time();
+  cmpsBusLock(0);
   display.begin(DISPLAY_I2C_ADDRESS, true); // Address 0x3C default
   //Display splash screen on OLED
   displayOLEDSplash();
+  cmpsBusUnlock(0);
+  bootPhase("display", t);
+#endif
 
   //Startup the Wifi access point
-  WiFi.softAP(ssid);
-  telnetClients = new WiFiClient*[4];
-  for(int i = 0; i < 4; i++)
-  {
-    telnetClients[i] = NULL;
-  }
-  //This server outputs the NMEA messages
-  telnetServer = new WiFiServer(TELNET_PORT);
-  telnetServer->begin();
+  t = esp_timer_get_time();
+  startAccessPoint();
+  bootPhase("wifi", t);
+
+  t = esp_timer_get_time();
+  //These servers output the NMEA messages - the configured port and one for each profile that has its own
+  nmeaProfilesBegin();
+  if (!telnetServer.restart(configuration.TCPPort))
+    Serial.println("Failed to start NMEA server");
 
+#if FEATURE_CONFIG_TELNET
   //This server is used for config, calibration  & debug
-  
-  configServer.begin();
+  //Configuration can also be done via Telnet (different port)
+  //But this method is now deprecated - please use a web browser
+  if (!configServer.begin())
+    Serial.println("Failed to start config server");
+#endif
 
   httpSetup(); //Setup the webserver -used for calibration
- 
+  bootPhase("servers", t);
+
+  dumpConfiguration(&configuration, Serial);
   IPAddress myAddr = WiFi.softAPIP();
   Serial.print("IP Address =");
   Serial.println(myAddr);
 
-  delay(1000);
-
   //Start the RTOS background tasks
-  xTaskCreatePinnedToCore(output, "Output", 4000, NULL, 1, &outputTask, 0);
-  xTaskCreatePinnedToCore(updateHeading, "updateHDG", 4000, NULL, 1, &updateHeadingTask, 0);
-  xTaskCreatePinnedToCore(handleHttp, "HandleHTTP", 8000, NULL, 1, &httpServerTask, 0);
-  xTaskCreatePinnedToCore(displayHeadings, "updateOLED", 4000, NULL, 1, &updateOLEDTask, 0);
-
+  startTasks(taskTable, numTasks, BOOT_BACKGROUND);
+  bootCompleteUs = esp_timer_get_time();
+  bootReport(Serial);
+  buildReport(Serial);
+  vTaskDelete(NULL);
 }
 
-unsigned loopCounter;
-long loopStart, totalLoopTime=0;
+//Start (or restart) the WiFi access point with the configured name and password
+void startAccessPoint() {
+  const char *password = strlen(configuration.AccessPointPassword) > 0 ? configuration.AccessPointPassword : NULL;
+  WiFi.softAP(configuration.AccessPointSSID, password);
+}
 
-void loop() {
-  
-  loopStart = micros();
+//The ports our other listeners have - the NMEA port can't be moved onto one of them
+bool portReserved(uint16_t port) {
+  if (port == WWW_PORT) return true;
+#if FEATURE_CONFIG_TELNET
+  if (port == CONFIG_PORT) return true;
+#endif
+#if FEATURE_SIGNALK
+  if (port == SIGNALK_TCP_PORT || port == SIGNALK_WS_PORT) return true;
+#endif
+  for (int p = 0; p < NMEA_BUILTIN_PROFILES; p++)
+    if (nmeaProfiles[p].port != 0 && port == nmeaProfiles[p].port) return true;
+  return false;
+}
 
- 
-  WiFiClient tempClient = telnetServer->available();   // listen for incoming clients
-
-  if (tempClient) {                             // if you get a client,
-    Serial.println("New NMEA client.");           // print a message out the serial port
-    for (int i=0; i<MAX_TELNET_CLIENTS; i++ ) {   //Add it to the Client array
-       if ( telnetClients[i] == NULL ) {
-          WiFiClient* client = new WiFiClient(tempClient);
-          telnetClients[i] = client;
-          break;
-       }
-    }
+//Apply any changes to the live configuration without a reboot. Run by the Network task
+//appliedConfiguration holds the settings currently in use
+void applyConfiguration() {
+  if (strcmp(appliedConfiguration.AccessPointSSID, configuration.AccessPointSSID) != 0 ||
+      strcmp(appliedConfiguration.AccessPointPassword, configuration.AccessPointPassword) != 0) {
+    Serial.println("Restarting access point");
+    startAccessPoint();
   }
-  //Configuration can also be done via Telnet (different port)
-  //But this method is now deprecated - please use a web browser
-  configClient = configServer.available();
-  if (configClient) {
-    if (configClient.connected()) {
-      Serial.println("Config Client detected.");
-      calibrationMenu();
-    }
+  if (appliedConfiguration.TCPPort != configuration.TCPPort) {
+    Serial.printf("NMEA output moved to port %d\n", configuration.TCPPort);
+    if (!telnetServer.restart(configuration.TCPPort))
+      Serial.println("Failed to start NMEA server");
   }
+  if (appliedConfiguration.NMEABaudRate != configuration.NMEABaudRate) {
+    Serial.printf("Wired NMEA output now %u baud\n", configuration.NMEABaudRate);
+    nmeaSerialBaudRate(configuration.NMEABaudRate);
+  }
+  if (appliedConfiguration.MaximumTCPClientCount != configuration.MaximumTCPClientCount) {
+    //Drop any clients over the new limit
+    for (int i = configuration.MaximumTCPClientCount; i < MAX_TELNET_CLIENTS; i++)
+      if (telnetClients[i] != NULL) removeNMEAClient(i);
+  }
+  appliedConfiguration = configuration;
+}
 
-  totalLoopTime += micros() - loopStart;
-  loopCounter++;
-
+void loop() {
+  //Everything is done by the RTOS tasks
+  vTaskDelete(NULL);
 }
 
+#if FEATURE_OLED
 void displayOLEDSplash()
 {
   display.clearDisplay();
@@ -224,86 +401,584 @@ void displayOLEDSplash()
   display.drawCircle(63, 59, 4, SH110X_WHITE);
   display.display();
 }
+#endif
 
 //Definition of background RTOS tasks
 
-//Output the heading as an NMEA message over WiFi
-void output(void * pvParameters) {
-  char buff[128];
-  TickType_t xLastWakeTime;
-  const TickType_t xPeriod = 200; //Run every 200ms
+//send() to an NMEA client without waiting, counting what went
+int writeNMEAClient(int i, const char *data, int length) {
+  int n = send(telnetClients[i]->fd(), data, length, MSG_DONTWAIT);
+  if (n > 0) {
+    nmeaClientStats[i].bytesSent += n;
+    nmeaProfiles[nmeaClientProfile[i]].bytesSent += n;
+    nmeaBytesSent += n;
+  }
+  return n;
+}
+
+//Send one line to an NMEA client without ever waiting for it. A client that isn't
+//reading (or a slow link) must not hold up the heading for everybody else, so if its
+//socket buffer is full the message is dropped and counted. If the socket only takes
+//part of a line the rest is kept and goes out ahead of the next one - a sentence cut
+//short would break the stream for the client - and new lines are dropped until it has
+void sendNMEAClient(int i, const char *line, int length) {
+  NmeaClientStats *stats = &nmeaClientStats[i];
+  NmeaProfile *profile = &nmeaProfiles[nmeaClientProfile[i]];
+  NmeaPending *pending = &nmeaPending[i];
+  unsigned long now = millis();
+  int n;
+
+  if (pending->length > 0) {
+    n = writeNMEAClient(i, pending->buf, pending->length);
+    if (n > 0) {
+      pending->length -= n;
+      memmove(pending->buf, pending->buf + n, pending->length);
+    }
+    if (pending->length > 0) {
+      if (n >= 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+        stats->drops++;
+        profile->drops++;
+      }
+      return;
+    }
+  }
+
+  n = writeNMEAClient(i, line, length);
+  if (n == length) {
+    stats->messagesSent++;
+    profile->messagesSent++;
+    if (now - stats->lastSentAt > stats->maxGapMs) stats->maxGapMs = now - stats->lastSentAt;
+    stats->lastSentAt = now;
+  } else if (n > 0) {
+    stats->partials++;
+    pending->length = length - n;
+    memcpy(pending->buf, line + n, pending->length);
+  } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    stats->drops++;
+    profile->drops++;
+  }
+  //Anything else means the connection has gone - the Network task will tidy up
+}
+
+//Acquire stage - read the CMPS14 every periodMs and hand the sample on to the Heading task
+void updateHeading(void * pvParameters) {         
+  TickType_t xLastWakeTime; //Runs every periodMs from the task table
 
   // Initialise the xLastWakeTime variable with the current time.
   xLastWakeTime = xTaskGetTickCount ();
   
   for (;;) {
-     if (Serial) {
-       sprintf(buff, "Sensor: %03d deg. Boat: %03d deg.\n", sensorHeading, boatHeading);
-       Serial.print(buff);  
+    uint32_t startUs = micros();
+
+    //Recover the I2C bus if it has gone down (see Cmps14.h)
+    cmpsService();
+
+    //Nothing free means the rest of the pipeline is stuck - the drop has been counted
+    PipeSample *s = pipeSampleGet();
+    if (s == NULL) {
+      waitForNextPeriod(pvParameters, &xLastWakeTime);
+      continue;
+    }
+    s->tickMs = pdTICKS_TO_MS(xLastWakeTime);
+
+    //get the raw CMPS14 output
+    //When recording, read all the main sensor's registers in one burst so the log holds exactly what the heading came from
+    RawSample *raw = &pipeRaw[pipeSampleIndex(s)];
+    s->recorded = recording && recordAcquire(raw);
+    if (s->recorded) {
+      Cmps14 *c = &cmpsSensors[0];
+      c->lock();
+      s->sensorStatus[0] = c->acceptBearing(raw->field[RAW_BEARING]) ? SAMPLE_OK : SAMPLE_OUT_OF_RANGE;
+      s->sensorBearing[0] = c->bearing;
+      c->unlock();
+    }
+    for (int i = s->recorded ? 1 : 0; i < cmpsCount; i++) {
+      Cmps14 *c = &cmpsSensors[i];
+      c->lock();   //so its status is the result of our read, not another task's
+      s->sensorBearing[i] = c->getBearing();
+      s->sensorStatus[i] = c->status;
+      c->unlock();
+    }
+
+    //The attitude and rate of turn come from the first sensor that answered
+    int first = 0;
+    while (first < cmpsCount - 1 && s->sensorStatus[first] != SAMPLE_OK) first++;
+    Cmps14 *c = &cmpsSensors[first];
+    s->status = s->sensorStatus[first];
+    s->sensorHeading = s->sensorBearing[0];
+    if (s->recorded) {
+      s->pitch = raw->field[RAW_PITCH];
+      s->roll = raw->field[RAW_ROLL];
+      s->yawRate = raw->field[RAW_GYROZ] * gyroScale;
+    } else {
+      s->pitch = c->pitch;
+      s->roll = c->roll;
+      s->yawRate = c->getGyroZ();
+    }
+    s->calibration = c->getCalibration();
+    s->sampledUs = micros();
+    sampleStatusCounts[s->status]++;
+    if (s->status != SAMPLE_OK) TRACE_INSTANT(TRACE_BAD_SAMPLE, s->status);
+
+    pipeStageDone(STAGE_ACQUIRE, startUs);
+    pipeSend(QUEUE_CORRECT, s);
+    waitForNextPeriod(pvParameters, &xLastWakeTime);
+  }
+}  
+
+
+//Correct and filter stages - run for each sample from updateHeading()
+void processHeading(void * pvParameters) {
+  HeadingSnapshot snap;
+  HeadingFilter filter;
+  TaskConfig *sampler = findTask("updateHDG");
+
+  for (;;) {
+    PipeSample *s = pipeReceive(QUEUE_CORRECT, portMAX_DELAY);
+
+    //Correct - the heading source, then each sensor's compass card, then the vote between them
+    uint32_t startUs = micros();
+    int corrected = boatHeading;
+    int16_t cardHeading[CMPS_MAX_SENSORS];
+    if (s->sensorStatus[0] == SAMPLE_OK) {
+      //Our own fusion, if selected, replaces the main chip's bearing once it has settled, while it keeps up
+      if (headingSource == SOURCE_FUSION && fusionUsable()) s->sensorHeading = s->sensorBearing[0] = (int)(fusionHeading + 0.5) % 360;
+      sensorHeading = s->sensorHeading;
+    }
+    for (int i = 0; i < cmpsCount; i++) cardHeading[i] = correctHeading(s->sensorBearing[i], i);
+    if (voteHeading(cardHeading, s->sensorStatus, &corrected)) {
+      rateOfTurn = s->yawRate;
+
+      //Let the power manager and the deviation learning know how much the boat is moving
+      powerSample(corrected, s->yawRate);
+      if (s->sensorStatus[0] == SAMPLE_OK) deviationSample(sensorHeading, s->yawRate);
+      bootFirstHeading();
+    }
+    if (s->recorded) {
+      RawSample *raw = &pipeRaw[pipeSampleIndex(s)];
+      raw->field[RAW_CALIBRATION] = s->calibration;
+      raw->field[RAW_BOAT_HEADING] = cardHeading[0];
+      recordPut(raw);
+    }
+    pipeStageDone(STAGE_CORRECT, startUs);
+
+    //Filter, and publish the result to everybody else
+    startUs = micros();
+    if (s->status == SAMPLE_OK) {
+      boatHeading = filterHeading(&filter, corrected, sampler->periodMs);
+      headingSampledUs = s->sampledUs;
+    }
+    s->heading = boatHeading;
+    headingStatus = s->status;
+    calibration = s->calibration;
+
+    //As a whole for the tasks on the other core
+    snap.status = s->status;
+    snap.heading = boatHeading;
+    snap.rateOfTurn = rateOfTurn;
+    snap.pitch = s->pitch;
+    snap.roll = s->roll;
+    snap.calibration = s->calibration;
+    snap.sampledUs = headingSampledUs;
+    headingPublish(&snap);
+    pipeStageDone(STAGE_FILTER, startUs);
+
+    pipeSend(QUEUE_ENCODE, s);
+  }
+}
+
+
+//Encode stage - work out which NMEA profiles are due on this sample and encode the sentences
+//they want, each once however many profiles and clients share it (see NmeaProfiles.h)
+void encodeHeading(void * pvParameters) {
+  float variation;
+  TaskConfig *sampler = findTask("updateHDG");
+
+  for (;;) {
+    //A sample should come every sample period. If none has for a few the profiles go out
+    //anyway, marked void, so the instruments can tell the compass has stopped
+    PipeSample *s = pipeReceive(QUEUE_ENCODE, pdMS_TO_TICKS(3 * sampler->periodMs));
+    uint32_t startUs = micros();
+    if (s == NULL) {
+      if ((s = pipeSampleGet()) == NULL) continue;
+      s->status = SAMPLE_STALE;
+      s->tickMs = millis();
+      s->sampledUs = micros();
+      s->sensorHeading = sensorHeading;
+      s->heading = boatHeading;
+      s->yawRate = 0;
+    }
+
+    //Which profiles are due, and so which sentences are wanted
+    xSemaphoreTake(telnetClientsLock, portMAX_DELAY);
+    uint8_t wanted = nmeaProfilesDue(s->tickMs, sampler->periodMs / 2, &s->due);
+    xSemaphoreGive(telnetClientsLock);
+
+    //Nobody wants this one - every profile in use is slower than the samples
+    if (s->due == 0 || !pipeSentencesGet(s)) {
+      pipeStageDone(STAGE_ENCODE, startUs);
+      pipeSampleFree(s);
+      continue;
+    }
+
+    PipeSentences *b = s->sentences;
+    bool haveVariation = currentVariation(&variation);
+    if (s->status == SAMPLE_OK) {
+      if (wanted & SENTENCE(SENTENCE_HDM)) {
+        b->hdm.update(s->heading);
+        b->sentence[SENTENCE_HDM] = b->hdm.msgString;
+      }
+      if (wanted & SENTENCE(SENTENCE_HDG)) {
+        b->hdg.update(s->heading, variation, haveVariation);
+        b->sentence[SENTENCE_HDG] = b->hdg.msgString;
+      }
+      //The true heading once we know where we are
+      if ((wanted & SENTENCE(SENTENCE_HDT)) && haveVariation) {
+        b->hdt.update(MOD360(s->heading + (int)lroundf(variation)));
+        b->sentence[SENTENCE_HDT] = b->hdt.msgString;
+      }
+      if (wanted & SENTENCE(SENTENCE_ROT)) {
+        b->rot.update(s->yawRate);
+        b->sentence[SENTENCE_ROT] = b->rot.msgString;
+      }
+    } else {
+      //No good heading - HDM and HDT are held back, and HDG and ROT go out marked void, so
+      //instruments can tell the compass has a fault rather than the boat pointing north
+      if (wanted & SENTENCE(SENTENCE_HDG)) {
+        b->hdg.invalid(variation, haveVariation);
+        b->sentence[SENTENCE_HDG] = b->hdg.msgString;
+      }
+      if (wanted & SENTENCE(SENTENCE_ROT)) {
+        b->rot.invalid();
+        b->sentence[SENTENCE_ROT] = b->rot.msgString;
+      }
+    }
+#if FEATURE_SEA_STATE
+    //The sea state doesn't depend on the heading, and goes out once there is one
+    if (wanted & SENTENCE(SENTENCE_XDR)) {
+      SeaState sea = seaStateGet();
+      if (sea.valid) {
+        b->xdr.update(sea.wavePeriodS, sea.heaveM, sea.rollPeriodS, sea.rollDeg);
+        b->sentence[SENTENCE_XDR] = b->xdr.msgString;
+      }
+    }
+#endif
+    for (int i = 0; i < NUM_SENTENCES; i++)
+      if (b->sentence[i] != NULL) nmeaSentencesEncoded++;
+
+    pipeStageDone(STAGE_ENCODE, startUs);
+    pipeSend(QUEUE_FANOUT, s);
+  }
+}
+
+
+//Fan out stage - send the heading as NMEA messages, wired and over WiFi. Each client gets the
+//sentences of its profile at the profile's rate (see NmeaProfiles.h)
+void output(void * pvParameters) {
+  char buff[128];
+  unsigned long lastStandard = millis();
+
+  for (;;) {
+     PipeSample *s = pipeReceive(QUEUE_FANOUT, portMAX_DELAY);
+     uint32_t startUs = micros();
+
+     //The standard profile - the wired output - goes at the output period
+     if (s->due & 1) {
+       unsigned long now = millis();
+       outputGapSample(now - lastStandard, nmeaOutputPeriodMs);
+       lastStandard = now;
+
+       //Debug text - skipped rather than wait if the serial monitor can't keep up
+       if (Serial) {
+         int n = sprintf(buff, "Sensor: %03d deg. Boat: %03d deg. %s\n", s->sensorHeading, s->heading, sampleStatusNames[s->status]);
+         if (Serial.availableForWrite() >= n) Serial.print(buff);
+       }
      }
-  
-     //Update the NMEA message with the current boat heading 
-     hdm.update(boatHeading);
+
+     TRACE_BEGIN(TRACE_NMEA_OUT);
+     xSemaphoreTake(telnetClientsLock, portMAX_DELAY);
+     nmeaProfilesBuild(s->sentences->sentence, s->due);
+
+     //Wired output first - it never waits (see NmeaSerial.h). It gets the standard profile, as often as its baud rate allows
+     NmeaProfile *standard = &nmeaProfiles[0];
+     if (standard->length > 0) nmeaSerialSend(standard->line, standard->length);
+
      //This is the main business - transmit the heading an an NMEA message over Telnet (WiFi) to anybody that is interested   
+     bool sent = false;
      for ( int i=0; i<MAX_TELNET_CLIENTS; i++ ) {
-       if ( telnetClients[i] != NULL ) 
-         telnetClients[i]->println(hdm.msgString);
+       if ( telnetClients[i] == NULL ) continue;
+       NmeaProfile *profile = &nmeaProfiles[nmeaClientProfile[i]];
+       if (profile->length > 0) {
+         sendNMEAClient(i, profile->line, profile->length);
+         sent = true;
+       }
      }
-     vTaskDelayUntil( &xLastWakeTime, xPeriod );
+     xSemaphoreGive(telnetClientsLock);
+     TRACE_END(TRACE_NMEA_OUT);
+     if (s->status == SAMPLE_OK && standard->length > 0) bootFirstOutput();
+     if (sent && s->status == SAMPLE_OK) latencySample(micros() - s->sampledUs);
+
+     pipeStageDone(STAGE_FANOUT, startUs);
+     pipeSampleFree(s);
   }
 }
 
 
-//Update the heading from the CMPS14
-void updateHeading(void * pvParameters) {         
-  TickType_t xLastWakeTime;
-  const TickType_t xPeriod = 100; //Run every 100ms
+#if FEATURE_HISTORY
+//Add a sample to the heading history (see History.h) once a second, while the heading is good
+void recordHistory(void * pvParameters) {
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+  HistorySample s;
+  HeadingSnapshot snap;
 
-  // Initialise the xLastWakeTime variable with the current time.
-  xLastWakeTime = xTaskGetTickCount ();
-  
   for (;;) {
-    //get the raw CMPS14 output
-    sensorHeading = getBearing();
-
-    //Apply compass card offset
-    boatHeading = MOD360(sensorHeading - compassCard[sensorHeading]);
-
-    calibration = getCalibration();
-
-    vTaskDelayUntil( &xLastWakeTime, xPeriod );
+    waitForNextPeriod(pvParameters, &xLastWakeTime);
+    headingLatest(&snap);
+    if (snap.status != SAMPLE_OK) continue;
+    //Wake times are exactly a period apart, so consecutive samples are a second apart even if we run late
+    s.t = pdTICKS_TO_MS(xLastWakeTime) / 1000;
+    s.field[HIST_HEADING] = snap.heading;
+    s.field[HIST_RATE] = lroundf(snap.rateOfTurn * 10);
+    s.field[HIST_PITCH] = snap.pitch;
+    s.field[HIST_ROLL] = snap.roll;
+    historyCalibration(&s, snap.calibration);
+    historyAdd(&s);
   }
-}  
+}
+#endif
 
 
 //check if there is any work for the HHTP server
 void handleHttp(void * pvParameters) {
-  TickType_t xLastWakeTime;
-  const TickType_t xPeriod = 100; //Run every 100ms
+  TickType_t xLastWakeTime; //Runs every periodMs from the task table
 
   // Initialise the xLastWakeTime variable with the current time.
   xLastWakeTime = xTaskGetTickCount ();
   
   for (;;) {
-    httpServer.loop(); 
-    vTaskDelayUntil( &xLastWakeTime, xPeriod );
+    TRACE_BEGIN(TRACE_HTTP);
+    httpServer.loop();
+    TRACE_END(TRACE_HTTP);
+    waitForNextPeriod(pvParameters, &xLastWakeTime);
   } 
 }
 
 
+//Add a newly connected NMEA client to the client array, on the profile of the port it came in on
+void addNMEAClient(WiFiClient newClient, int profile) {
+  xSemaphoreTake(telnetClientsLock, portMAX_DELAY);
+  for (int i=0; i<configuration.MaximumTCPClientCount; i++ ) {
+    if ( telnetClients[i] == NULL ) {
+      telnetClientPool[i] = newClient;
+      telnetClients[i] = &telnetClientPool[i];
+      nmeaClientStatsReset(i);
+      nmeaReceiverReset(&nmeaReceivers[i]);
+      nmeaPending[i].length = 0;
+      nmeaProfileAttach(i, profile);
+      nmeaClientCount++;
+      Serial.println("New NMEA client.");
+      break;
+    }
+  }
+  xSemaphoreGive(telnetClientsLock);
+  //If the array was full newClient goes out of scope here and the connection is closed
+}
+
+//Close an NMEA client and free its slot
+void removeNMEAClient(int i) {
+  xSemaphoreTake(telnetClientsLock, portMAX_DELAY);
+  telnetClientPool[i].stop();  //closes the socket and leaves the pool entry empty
+  telnetClients[i] = NULL;
+  nmeaClientStats[i].connectedAt = 0;
+  nmeaProfileDetach(i);
+  nmeaClientCount--;
+  xSemaphoreGive(telnetClientsLock);
+}
+
+//An NMEA client socket is readable - either it has sent us some sentences, which are read
+//straight into its receive buffer and parsed there, or it has disconnected, in which case
+//free its slot
+void serviceNMEAClient(int i) {
+  int room;
+  char *space = nmeaReceiveSpace(&nmeaReceivers[i], &room);
+  int n = recv(telnetClients[i]->fd(), space, room, MSG_DONTWAIT);
+  if (n > 0) nmeaReceived(&nmeaReceivers[i], n, i);
+  else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    Serial.println("NMEA client disconnected.");
+    removeNMEAClient(i);
+  }
+}
+
+//Handlers for the sentences NMEA clients send us. They run on the Network task
+void courseOverGround(float cog, float sog) {
+  navigation.cog = cog;
+  navigation.sog = sog;
+  navigation.cogAt = millis();
+  navigation.cogValid = true;
+  deviationFix(cog, sog);   //see Deviation.h
+}
+
+void receivedRMC(const NmeaRMC *rmc, int client) {
+  if (!rmc->valid) return;
+  if (!isnan(rmc->lat) && !isnan(rmc->lon)) setPosition(rmc->lat, rmc->lon);
+  if (rmc->year > 0) setDate(rmc->year, rmc->month, rmc->day);
+  if (!isnan(rmc->cog) && !isnan(rmc->sog)) courseOverGround(rmc->cog, rmc->sog);
+}
+
+void receivedGGA(const NmeaGGA *gga, int client) {
+  if (gga->quality > 0 && !isnan(gga->lat) && !isnan(gga->lon)) setPosition(gga->lat, gga->lon);
+}
+
+void receivedVTG(const NmeaVTG *vtg, int client) {
+  if (!isnan(vtg->cogTrue) && !isnan(vtg->sog)) courseOverGround(vtg->cogTrue, vtg->sog);
+}
+
+//Heading to steer from the autopilot or chartplotter, kept as magnetic
+void receivedHSC(const NmeaHSC *sentence, int client) {
+  float variation, steer = sentence->headingMagnetic;
+  if (isnan(steer) && !isnan(sentence->headingTrue) && currentVariation(&variation))
+    steer = sentence->headingTrue - variation;
+  if (isnan(steer)) return;
+  navigation.headingToSteer = fmodf(steer + 360, 360);
+  navigation.steerAt = millis();
+  navigation.steerValid = true;
+  hsc.update((short)lroundf(navigation.headingToSteer) % 360);
+}
+
+//A client asking to change its output profile. The answer is the profile it is on now
+void receivedProfile(const NmeaSentence *sentence, int client) {
+  PEASPmessage reply;
+
+  xSemaphoreTake(telnetClientsLock, portMAX_DELAY);
+  int profile = nmeaProfileRequest(sentence, client);
+  if (profile >= 0 && profile != nmeaClientProfile[client]) {
+    nmeaProfileAttach(client, profile);
+    Serial.printf("NMEA client %d now on profile %s\n", client, nmeaProfiles[profile].name);
+  }
+  nmeaProfileDescribe(nmeaClientProfile[client], &reply);
+  int length = strlen(reply.msgString);
+  reply.msgString[length++] = '\r';
+  reply.msgString[length++] = '\n';
+  sendNMEAClient(client, reply.msgString, length);
+  xSemaphoreGive(telnetClientsLock);
+}
+
+//Event driven connection handling. Blocks in select() on the listening sockets, the
+//connected NMEA clients and the config console sessions, so it uses next to no CPU unless
+//something happens on the network. The select() timeout is short enough to pick up console
+//input on the serial port and run the console countdowns, and is also used to sample the
+//per task CPU usage
+void handleNetwork(void * pvParameters) {
+  fd_set readSet;
+  struct timeval timeout;
+  int maxFd, fd, n;
+  unsigned long lastSample = 0, lastReport = 0;
+  uint32_t appliedGeneration = configurationGeneration;
+
+  for (;;) {
+    FD_ZERO(&readSet);
+    //The NMEA listener may be missing for a moment if its port has just been changed
+    if (telnetServer.fd() >= 0) FD_SET(telnetServer.fd(), &readSet);
+    maxFd = telnetServer.fd();
+#if FEATURE_CONFIG_TELNET
+    //and the config listener is missing if it failed to start
+    if ((fd = configServer.fd()) >= 0) {
+      FD_SET(fd, &readSet);
+      if (fd > maxFd) maxFd = fd;
+    }
+#endif
+    for (int p = 0; p < NMEA_BUILTIN_PROFILES; p++) {
+      if ((fd = nmeaProfileServers[p].fd()) >= 0) {
+        FD_SET(fd, &readSet);
+        if (fd > maxFd) maxFd = fd;
+      }
+    }
+    //Only this task adds or removes clients, so no need to lock just to read the array
+    for (int i=0; i<MAX_TELNET_CLIENTS; i++ ) {
+      if ( telnetClients[i] != NULL ) {
+        fd = telnetClients[i]->fd();
+        FD_SET(fd, &readSet);
+        if (fd > maxFd) maxFd = fd;
+      }
+    }
+#if FEATURE_CONFIG_TELNET
+    for (int i=1; i<MAX_CONSOLE_SESSIONS; i++ ) {
+      if ( consoleSessions[i].state != CONSOLE_CLOSED ) {
+        fd = consoleSessions[i].client.fd();
+        FD_SET(fd, &readSet);
+        if (fd > maxFd) maxFd = fd;
+      }
+    }
+#endif
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+
+    n = select(maxFd + 1, &readSet, NULL, NULL, &timeout);
+    TRACE_BEGIN(TRACE_NETWORK);
+    if (n > 0) {
+      if (telnetServer.fd() >= 0 && FD_ISSET(telnetServer.fd(), &readSet)) {
+        WiFiClient newClient = telnetServer.accept();
+        if (newClient) addNMEAClient(newClient, 0);
+      }
+      for (int p = 0; p < NMEA_BUILTIN_PROFILES; p++) {
+        if (nmeaProfileServers[p].fd() >= 0 && FD_ISSET(nmeaProfileServers[p].fd(), &readSet)) {
+          WiFiClient newClient = nmeaProfileServers[p].accept();
+          if (newClient) addNMEAClient(newClient, p);
+        }
+      }
+#if FEATURE_CONFIG_TELNET
+      if (configServer.fd() >= 0 && FD_ISSET(configServer.fd(), &readSet)) {
+        WiFiClient newClient = configServer.accept();
+        if (newClient) consoleOpen(newClient);
+      }
+#endif
+      for (int i=0; i<MAX_TELNET_CLIENTS; i++ ) {
+        if ( telnetClients[i] != NULL && FD_ISSET(telnetClients[i]->fd(), &readSet) )
+          serviceNMEAClient(i);
+      }
+#if FEATURE_CONFIG_TELNET
+      for (int i=1; i<MAX_CONSOLE_SESSIONS; i++ ) {
+        if ( consoleSessions[i].state != CONSOLE_CLOSED && FD_ISSET(consoleSessions[i].client.fd(), &readSet) )
+          consoleService(i);
+      }
+#endif
+    }
+    consoleTick();
+
+    //Configuration changes from the console or the web app
+    if (appliedGeneration != configurationGeneration) {
+      appliedGeneration = configurationGeneration;
+      applyConfiguration();
+    }
+    flushConfiguration(false);
+
+    if (millis() - lastSample >= 1000) {
+      sampleTaskStats();
+      lastSample = millis();
+    }
+    if (Serial && millis() - lastReport > 10000) {
+      Serial.printf("Idle: core0 %.1f%% core1 %.1f%%\n", coreIdlePercent[0], coreIdlePercent[1]);
+      lastReport = millis();
+    }
+    TRACE_END(TRACE_NETWORK);
+  }
+}
+
+
 
+#if FEATURE_OLED
 void displayHeadings(void * pvParameters)
 {
   char buff[64];
   long diff;
-  TickType_t xLastWakeTime;
-  const TickType_t xPeriod = 200; //Run every 500ms
+  TickType_t xLastWakeTime; //Runs every periodMs from the task table
 
   // Initialise the xLastWakeTime variable with the current time.
   xLastWakeTime = xTaskGetTickCount ();
   
   for (;;) {
-  
+    //Sleeps here while the display is switched off
+    oledWait();
   
     buff[0] = '\0';
   
@@ -327,17 +1002,28 @@ void displayHeadings(void * pvParameters)
 
     //Display boat heading
     display.setCursor(83,12);
-    sprintf(buff,"%03d", boatHeading);
+    if (headingStatus == SAMPLE_OK) sprintf(buff,"%03d", boatHeading);
+    else strcpy(buff, "---");
     display.print(buff);
   
-    //Sensor calibration status
+    //Sensor calibration status, or what is wrong with the sensor
     display.setCursor(3,50); 
     display.setTextSize(1);
-     sprintf(buff,"   S:%1d G:%1d A:%1d M:%1d",
+    if (headingStatus == SAMPLE_OK && voteDisagree)
+      strcpy(buff, "  Compasses disagree");
+    else if (headingStatus == SAMPLE_OK)
+      sprintf(buff,"   S:%1d G:%1d A:%1d M:%1d",
         (calibration & 0b11000000) >> 6, (calibration & 0b00110000) >> 4, (calibration & 0b00001100) >> 2, calibration & 0b00000011);
+    else sprintf(buff,"   I2C fault: %s", sampleStatusNames[headingStatus]);
     display.print(buff);
   
+    //The OLED shares bus 0 with the compass - see cmpsBusLock()
+    cmpsBusLock(0);
+    TRACE_BEGIN(TRACE_OLED);
     display.display();
-    vTaskDelayUntil( &xLastWakeTime, xPeriod );
+    TRACE_END(TRACE_OLED);
+    cmpsBusUnlock(0);
+    waitForNextPeriod(pvParameters, &xLastWakeTime);
   }
 }
+#endif
@@ -1,15 +1,16 @@
 #include "Cmps14.h"
-#define MaxHeaderLength 16    //maximum length of http header required
+#include "BuildProfile.h"
 
-extern WiFiClient configClient, webClient;
+extern WiFiClient webClient;
 extern Preferences settings;
 extern unsigned short sensorHeading, boatHeading;
+extern byte calibration;
 
-String HttpHeader = String(MaxHeaderLength);
 // We need to specify some content-type mapping, so the resources get delivered with the
 // right content type and are displayed correctly in the browser
+// const, so it stays in flash
 
-char contentTypes[][2][32] =
+const char contentTypes[][2][12] =
 {
   {".txt", "text/plain"},
   {".png",  "image/png"},
@@ -18,6 +19,12 @@ char contentTypes[][2][32] =
 };
 
 
+// Scratch space for the request handlers - file copy buffers and the like. Every handler
+// runs on the HandleHTTP task, one request at a time, so they can all share it rather than
+// each putting a buffer on the task stack or the heap
+#define HTTP_SCRATCH_SIZE 1024
+uint8_t httpScratch[HTTP_SCRATCH_SIZE];
+
 // The HTTPS Server comes in a separate namespace. For easier use, include it here.
 using namespace httpsserver;
 
@@ -30,8 +37,10 @@ HTTPServer httpServer = HTTPServer();
 // which are pointers to the request data (read request body, headers, ...) and
 // to the response data (write response, set status code, ...)
 void handleRoot(HTTPRequest * req, HTTPResponse * res);
+#if FEATURE_FILE_EDITOR
 void handleFormUpload(HTTPRequest * req, HTTPResponse * res);
 void handleFormEdit(HTTPRequest * req, HTTPResponse * res);
+#endif
 void handleFile(HTTPRequest * req, HTTPResponse * res);
 void handleDirectory(HTTPRequest * req, HTTPResponse * res);
 void handle404(HTTPRequest * req, HTTPResponse * res);
@@ -45,60 +54,69 @@ void handleResetCalibration(HTTPRequest * req, HTTPResponse * res);
 void handleGetHeading(HTTPRequest * req, HTTPResponse * res);
 void handleSaveCard(HTTPRequest * req, HTTPResponse * res);
 void handleGenerateCard(HTTPRequest * req, HTTPResponse * res);
-
-std::string htmlEncode(std::string data)
+void handleMetrics(HTTPRequest * req, HTTPResponse * res);
+void handleGetConfig(HTTPRequest * req, HTTPResponse * res);
+void handleSetConfig(HTTPRequest * req, HTTPResponse * res);
+void handleSetPosition(HTTPRequest * req, HTTPResponse * res);
+void handleGetPosition(HTTPRequest * req, HTTPResponse * res);
+void handleGetDeviation(HTTPRequest * req, HTTPResponse * res);
+void handleApplyDeviation(HTTPRequest * req, HTTPResponse * res);
+#if FEATURE_HISTORY
+void handleGetHistory(HTTPRequest * req, HTTPResponse * res);
+#endif
+#if FEATURE_SEA_STATE
+void handleGetSeaState(HTTPRequest * req, HTTPResponse * res);
+#endif
+#ifdef TRACE
+void handleTrace(HTTPRequest * req, HTTPResponse * res);
+#endif
+
+#if FEATURE_FILE_EDITOR
+// Write length characters of data to out, HTML escaped. Goes out in chunks through a small
+// buffer, so there is no string building and no allocation
+void htmlEncode(const char *data, size_t length, Print &out)
 {
   // Quick and dirty: doesn't handle control chars and such.
-  const char *p = data.c_str();
-  std::string rv = "";
+  char chunk[64];
+  size_t n = 0;
 
-  while (p && *p)
+  for (size_t i = 0; i < length; i++)
   {
-    char escapeChar = *p++;
+    const char *escape;
 
-    switch (escapeChar)
+    switch (data[i])
     {
-      case '&':
-        rv += "&amp;";
-        break;
-
-      case '<':
-        rv += "&lt;";
-        break;
-
-      case '>':
-        rv += "&gt;";
-        break;
-
-      case '"':
-        rv += "&quot;";
-        break;
-
-      case '\'':
-        rv += "&#x27;";
-        break;
-
-      case '/':
-        rv += "&#x2F;";
-        break;
+      case '&': escape = "&amp;"; break;
+      case '<': escape = "&lt;"; break;
+      case '>': escape = "&gt;"; break;
+      case '"': escape = "&quot;"; break;
+      case '\'': escape = "&#x27;"; break;
+      case '/': escape = "&#x2F;"; break;
+      default: escape = NULL; break;
+    }
 
-      default:
-        rv += escapeChar;
-        break;
+    if (n > sizeof(chunk) - 8)    // room for the longest escape
+    {
+      out.write((const uint8_t *)chunk, n);
+      n = 0;
     }
+    if (escape == NULL) chunk[n++] = data[i];
+    else while (*escape) chunk[n++] = *escape++;
   }
-
-  return rv;
+  if (n > 0) out.write((const uint8_t *)chunk, n);
 }
+#endif
 
 //Setup our webserver  
 void httpSetup() {
 // For every resource available on the server, we need to create a ResourceNode
   // The ResourceNode links URL and HTTP method to a handler function
   ResourceNode * nodeRoot = new ResourceNode("/", "GET", &handleRoot);
+#if FEATURE_FILE_EDITOR
   ResourceNode * nodeFormUpload = new ResourceNode("/upload", "POST", &handleFormUpload);
   ResourceNode * nodeFormEdit = new ResourceNode("/edit", "GET", &handleFormEdit);
   ResourceNode * nodeFormEditDone = new ResourceNode("/edit", "POST", &handleFormEdit);
+#endif
   ResourceNode * nodeDirectory = new ResourceNode("/public", "GET", &handleDirectory);
   ResourceNode * nodeFile = new ResourceNode("/public/*", "GET", &handleFile);
   ResourceNode * nodeGetCalStatus = new ResourceNode("/getCalStatus", "GET", &handleGetCalStatus);
@@ -111,15 +129,33 @@ void httpSetup() {
   ResourceNode * nodeGetHeading = new ResourceNode("/getHeading", "GET", &handleGetHeading);
   ResourceNode * nodeSaveCard = new ResourceNode("/saveCard", "GET", &handleSaveCard);
   ResourceNode * nodeGenerateCard = new ResourceNode("/generateCard", "GET", &handleGenerateCard);
+  ResourceNode * nodeMetrics = new ResourceNode("/metrics", "GET", &handleMetrics);
+  ResourceNode * nodeGetConfig = new ResourceNode("/getConfig", "GET", &handleGetConfig);
+  ResourceNode * nodeSetConfig = new ResourceNode("/setConfig", "GET", &handleSetConfig);
+  ResourceNode * nodeSetPosition = new ResourceNode("/setPosition", "GET", &handleSetPosition);
+  ResourceNode * nodeGetPosition = new ResourceNode("/getPosition", "GET", &handleGetPosition);
+  ResourceNode * nodeGetDeviation = new ResourceNode("/getDeviation", "GET", &handleGetDeviation);
+  ResourceNode * nodeApplyDeviation = new ResourceNode("/applyDeviation", "GET", &handleApplyDeviation);
+#if FEATURE_HISTORY
+  ResourceNode * nodeGetHistory = new ResourceNode("/getHistory", "GET", &handleGetHistory);
+#endif
+#if FEATURE_SEA_STATE
+  ResourceNode * nodeGetSeaState = new ResourceNode("/getSeaState", "GET", &handleGetSeaState);
+#endif
+#ifdef TRACE
+  ResourceNode * nodeTrace = new ResourceNode("/trace", "GET", &handleTrace);
+#endif
 
   // 404 node has no URL as it is used for all requests that don't match anything else
   ResourceNode * node404  = new ResourceNode("", "GET", &handle404);
 
   // Add the root nodes to the server
   httpServer.registerNode(nodeRoot);
+#if FEATURE_FILE_EDITOR
   httpServer.registerNode(nodeFormUpload);
   httpServer.registerNode(nodeFormEdit);
   httpServer.registerNode(nodeFormEditDone);
+#endif
   httpServer.registerNode(nodeDirectory);
   httpServer.registerNode(nodeFile);
   httpServer.registerNode(nodeGetCalStatus);
@@ -132,6 +168,22 @@ void httpSetup() {
   httpServer.registerNode(nodeGetHeading);
   httpServer.registerNode(nodeSaveCard);
   httpServer.registerNode(nodeGenerateCard);
+  httpServer.registerNode(nodeMetrics);
+  httpServer.registerNode(nodeGetConfig);
+  httpServer.registerNode(nodeSetConfig);
+  httpServer.registerNode(nodeSetPosition);
+  httpServer.registerNode(nodeGetPosition);
+  httpServer.registerNode(nodeGetDeviation);
+  httpServer.registerNode(nodeApplyDeviation);
+#if FEATURE_HISTORY
+  httpServer.registerNode(nodeGetHistory);
+#endif
+#if FEATURE_SEA_STATE
+  httpServer.registerNode(nodeGetSeaState);
+#endif
+#ifdef TRACE
+  httpServer.registerNode(nodeTrace);
+#endif
 
 
 
@@ -148,23 +200,6 @@ void httpSetup() {
   }
 }
 
-//This little procedure puts the CMPS14 into configuration mode
-//Note that it is up to the calling function to call endTransmission(), after it has sent the actual
-//configuration commands. This procedure just sets things up
-
-void initCMPSconfig() {
-  // Configuation bytes
-        writeToCMPS14(byte(0x98));
-        writeToCMPS14(byte(0x95));
-        writeToCMPS14(byte(0x99));
-
-        // Begin communication with CMPS14
-        Wire.beginTransmission(_i2cAddress);
-
-        // Want the Command Register
-        Wire.write(byte(0x00));
-}
-
 /*
  All of these "handle..." functions below handle all of the relevant REST API calls
  */ 
@@ -185,16 +220,19 @@ void handleRoot(HTTPRequest * req, HTTPResponse * res)
   res->println("<p>This is a very simple file server to demonstrate the use of POST forms. </p>");
   res->println("<h2>List existing files</h2>");
   res->println("<p>See <a href=\"/public\">/public</a> to list existing files and retrieve or edit them.</p>");
+#if FEATURE_FILE_EDITOR
   res->println("<h2>Upload new file</h2>");
   res->println("<p>This form allows you to upload files (text, jpg and png supported best). It demonstrates multipart/form-data.</p>");
   res->println("<form method=\"POST\" action=\"/upload\" enctype=\"multipart/form-data\">");
   res->println("file: <input type=\"file\" name=\"file\"><br>");
   res->println("<input type=\"submit\" value=\"Upload\">");
   res->println("</form>");
+#endif
   res->println("</body>");
   res->println("</html>");
 }
 
+#if FEATURE_FILE_EDITOR
 void handleFormUpload(HTTPRequest * req, HTTPResponse * res)
 {
   // First, we need to check the encoding of the form that we have received.
@@ -202,7 +240,7 @@ void handleFormUpload(HTTPRequest * req, HTTPResponse * res)
   // Then we select the body parser based on the encoding.
   // Actually we do this only for documentary purposes, we know the form is going
   // to be multipart/form-data.
-  HTTPBodyParser *parser;
+  // The parser lives on the stack for the length of the request - nothing to allocate or free
   std::string contentType = req->getHeader("Content-Type");
   size_t semicolonPos = contentType.find(";");
 
@@ -211,15 +249,13 @@ void handleFormUpload(HTTPRequest * req, HTTPResponse * res)
     contentType = contentType.substr(0, semicolonPos);
   }
 
-  if (contentType == "multipart/form-data")
-  {
-    parser = new HTTPMultipartBodyParser(req);
-  }
-  else
+  if (contentType != "multipart/form-data")
   {
     Serial.printf("Unknown POST Content-Type: %s\n", contentType.c_str());
     return;
   }
+  HTTPMultipartBodyParser multipartParser(req);
+  HTTPBodyParser *parser = &multipartParser;
 
   // We iterate over the fields. Any field with a filename is uploaded
   res->println("<html><head><title>File Upload</title></head><body><h1>File Upload</h1>");
@@ -241,21 +277,21 @@ void handleFormUpload(HTTPRequest * req, HTTPResponse * res)
     }
 
     // Should check file name validity and all that, but we skip that.
-    std::string pathname = "/public/" + filename;
-    File file = SPIFFS.open(pathname.c_str(), "w");
+    char pathname[64];
+    snprintf(pathname, sizeof(pathname), "/public/%s", filename.c_str());
+    File file = SPIFFS.open(pathname, "w");
     size_t fileLength = 0;
     didwrite = true;
 
     while (!parser->endOfField())
     {
-      byte buf[512];
-      size_t readLength = parser->read(buf, 512);
-      file.write(buf, readLength);
+      size_t readLength = parser->read(httpScratch, HTTP_SCRATCH_SIZE);
+      file.write(httpScratch, readLength);
       fileLength += readLength;
     }
 
     file.close();
-    res->printf("<p>Saved %d bytes to %s</p>", (int)fileLength, pathname.c_str());
+    res->printf("<p>Saved %d bytes to %s</p>", (int)fileLength, pathname);
   }
 
   if (!didwrite)
@@ -264,7 +300,6 @@ void handleFormUpload(HTTPRequest * req, HTTPResponse * res)
   }
 
   res->println("</body></html>");
-  delete parser;
 }
 
 void handleFormEdit(HTTPRequest * req, HTTPResponse * res)
@@ -298,11 +333,8 @@ void handleFormEdit(HTTPRequest * req, HTTPResponse * res)
 
       do
       {
-        char buffer[256];
-        length = file.read((uint8_t *)buffer, 256);
-        std::string bufferString(buffer, length);
-        bufferString = htmlEncode(bufferString);
-        res->write((uint8_t *)bufferString.c_str(), bufferString.size());
+        length = file.read(httpScratch, HTTP_SCRATCH_SIZE);
+        htmlEncode((const char *)httpScratch, length, *res);
       } while (length > 0);
 
       res->println("</textarea><br>");
@@ -344,9 +376,8 @@ void handleFormEdit(HTTPRequest * req, HTTPResponse * res)
 
         while (!parser.endOfField())
         {
-          byte buf[512];
-          size_t readLength = parser.read(buf, 512);
-          file.write(buf, readLength);
+          size_t readLength = parser.read(httpScratch, HTTP_SCRATCH_SIZE);
+          file.write(httpScratch, readLength);
           fieldLength += readLength;
         }
 
@@ -367,6 +398,7 @@ void handleFormEdit(HTTPRequest * req, HTTPResponse * res)
     res->println("</body></html>");
   }
 }
+#endif
 
 void handleDirectory(HTTPRequest * req, HTTPResponse * res)
 {
@@ -388,11 +420,13 @@ void handleDirectory(HTTPRequest * req, HTTPResponse * res)
       std::string pathname(f.name());
       res->printf("<li><a href=\"%s\">%s</a>", pathname.c_str(), pathname.c_str());
 
+#if FEATURE_FILE_EDITOR
       if (pathname.rfind(".txt") != std::string::npos)
       {
         std::string filename = pathname.substr(8); // Remove /public/
         res->printf(" <a href=\"/edit?filename=%s\">[edit]</a>", filename.c_str());
       }
+#endif
 
       res->println("</li>");
       f = d.openNextFile();
@@ -438,13 +472,12 @@ void handleFile(HTTPRequest * req, HTTPResponse * res)
   } while (strlen(contentTypes[cTypeIdx][0]) > 0);
 
   // Read the file and write it to the response
-  uint8_t buffer[256];
   size_t length = 0;
 
   do
   {
-    length = file.read(buffer, 256);
-    res->write(buffer, length);
+    length = file.read(httpScratch, HTTP_SCRATCH_SIZE);
+    res->write(httpScratch, length);
   } while (length > 0);
 
   file.close();
@@ -473,11 +506,13 @@ void handle404(HTTPRequest * req, HTTPResponse * res)
 
 void handleGetCalStatus(HTTPRequest * req, HTTPResponse * res)
 {
+  uint32_t startUs = micros();
   byte calStatus;
   char buff[128];
   Serial.println("HandleGetCalStaus() Called");
 
-  calStatus = getCalibration();
+  //The acquisition task reads this every sample - don't compete with it for the I2C bus
+  calStatus = calibration;
   byte sys = (calStatus & 0b11000000) >> 6;
   byte gyro = (calStatus & 0b00110000) >> 4;
   byte accel = (calStatus & 0b00001100) >> 2;
@@ -489,6 +524,7 @@ void handleGetCalStatus(HTTPRequest * req, HTTPResponse * res)
   // Write a JSON response
   sprintf(buff,"{\"sysStatus\":\"%d\",\"gyroStatus\":\"%d\",\"accelStatus\":\"%d\",\"magStatus\":\"%d\"}",sys,gyro,accel,mag);
   res->println(buff);
+  httpRequestDone(HTTP_GET_CAL_STATUS, startUs);
  
 }
 
@@ -508,9 +544,7 @@ void handleDisableCalibration(HTTPRequest * req, HTTPResponse * res)
 void handleEnableGyroCalib(HTTPRequest * req, HTTPResponse * res)
 {
   Serial.println("HandleEnableGyroCalib() Called");
-  initCMPSconfig();
-  Wire.write(byte(B10000100)); //enable gyro calibration
-  endTransmission();
+  configureCMPS14(byte(B10000100)); //enable gyro calibration
   // Set content type of the response
   res->setHeader("Content-Type", "application/json");
   res->setHeader("Access-Control-Allow-Origin", "*");
@@ -522,9 +556,7 @@ void handleEnableGyroCalib(HTTPRequest * req, HTTPResponse * res)
 void handleEnableAccelCalib(HTTPRequest * req, HTTPResponse * res)
 {
   Serial.println("HandleEnableAccelCalib() Called");
-  initCMPSconfig();
-  Wire.write(byte(B10000010)); //enable accelerometer calibration
-  endTransmission();
+  configureCMPS14(byte(B10000010)); //enable accelerometer calibration
   // Set content type of the response
   res->setHeader("Content-Type", "application/json");
   res->setHeader("Access-Control-Allow-Origin", "*");
@@ -536,9 +568,7 @@ void handleEnableAccelCalib(HTTPRequest * req, HTTPResponse * res)
 void handleEnableMagCalib(HTTPRequest * req, HTTPResponse * res)
 {
   Serial.println("HandleEnableMagCalib() Called");
-  initCMPSconfig();
-  Wire.write(byte(B10000001)); //enable magnetometer calibration
-  endTransmission();
+  configureCMPS14(byte(B10000001)); //enable magnetometer calibration
 
   // Set content type of the response
   res->setHeader("Content-Type", "application/json");
@@ -551,9 +581,7 @@ void handleEnableMagCalib(HTTPRequest * req, HTTPResponse * res)
 void handleResetCalibration(HTTPRequest * req, HTTPResponse * res)
 {
   Serial.println("HandleResetCalibration() Called");
-  writeToCMPS14(byte(0xE0));
-  writeToCMPS14(byte(0xE5));
-  writeToCMPS14(byte(0xE2));
+  eraseCMPSCalibration();
 
   // Set content type of the resp
   res->setHeader("Content-Type", "application/json");
@@ -566,9 +594,7 @@ void handleResetCalibration(HTTPRequest * req, HTTPResponse * res)
 void handleSaveCalibration(HTTPRequest * req, HTTPResponse * res)
 {
   Serial.println("HandleSaveCalibration() Called");
-  writeToCMPS14(byte(0xF0));
-  writeToCMPS14(byte(0xF5));
-  writeToCMPS14(byte(0xF6));    
+  saveCMPSCalibration();
 
   // Set content type of the resp
   res->setHeader("Content-Type", "application/json");
@@ -581,6 +607,7 @@ void handleSaveCalibration(HTTPRequest * req, HTTPResponse * res)
 //Returns current sensor heading
 void handleGetHeading(HTTPRequest * req, HTTPResponse * res)
 {
+  uint32_t startUs = micros();
   char buff[128];
   Serial.println("handleGetHeading() Called");
 
@@ -592,6 +619,7 @@ void handleGetHeading(HTTPRequest * req, HTTPResponse * res)
   // Write a JSON response 
   sprintf(buff,"{ \"result\":\"OK\",\"sensorHeading\":\"%03d\", \"boatHeading\":\"%03d\" }",sensorHeading,boatHeading);
   res->println(buff);
+  httpRequestDone(HTTP_GET_HEADING, startUs);
 }
 
 //Generates a compass card from the supplied parameters
@@ -636,3 +664,179 @@ void handleSaveCard(HTTPRequest * req, HTTPResponse * res)
   // Write a JSON response 
   res->println("{ \"result\":\"OK\" }");
 }
+
+//Runtime metrics in Prometheus text format - CPU, stacks, deadline misses, heap, I2C errors and NMEA output
+void handleMetrics(HTTPRequest * req, HTTPResponse * res)
+{
+  res->setHeader("Content-Type", "text/plain; version=0.0.4");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  writeMetrics(*res);
+}
+
+//Returns the current configuration (not the WiFi password)
+void handleGetConfig(HTTPRequest * req, HTTPResponse * res)
+{
+  char buff[256];
+  Serial.println("handleGetConfig() Called");
+
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+
+  sprintf(buff,"{ \"result\":\"OK\",\"ssid\":\"%s\",\"port\":%d,\"clients\":%d,\"baud\":%d }",
+          configuration.AccessPointSSID, configuration.TCPPort, configuration.MaximumTCPClientCount, configuration.NMEABaudRate);
+  res->println(buff);
+}
+
+//Changes any of the settings given as parameters e.g. /setConfig?port=10110&clients=2
+//Takes effect straight away and is saved to flash a few seconds later
+void handleSetConfig(HTTPRequest * req, HTTPResponse * res)
+{
+  const char *names[] = { "ssid", "password", "port", "clients", "baud" };
+  std::string param;
+  bool ok = true;
+
+  Serial.println("handleSetConfig() Called");
+  auto params = req->getParams();
+  for (int i = 0; i < 5; i++) {
+    if (params->getQueryParameter(names[i], param))
+      ok = setConfigurationValue(names[i], param.c_str()) && ok;
+  }
+
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  res->println(ok ? "{ \"result\":\"OK\" }" : "{ \"result\":\"Invalid setting\" }");
+}
+
+//Sets the position used for the magnetic variation, e.g. /setPosition?lat=50.8&lon=-1.3
+//An optional date=yyyy-mm-dd sets the date for the model too
+void handleSetPosition(HTTPRequest * req, HTTPResponse * res)
+{
+  std::string lat, lon, date;
+  int year, month, day;
+  bool ok = false;
+
+  Serial.println("handleSetPosition() Called");
+  auto params = req->getParams();
+  if (params->getQueryParameter("lat", lat) && params->getQueryParameter("lon", lon)) {
+    float latitude = atof(lat.c_str()), longitude = atof(lon.c_str());
+    if (latitude >= -90 && latitude <= 90 && longitude >= -180 && longitude <= 180) {
+      setPosition(latitude, longitude);
+      ok = true;
+    }
+  }
+  if (params->getQueryParameter("date", date) && sscanf(date.c_str(), "%d-%d-%d", &year, &month, &day) == 3)
+    setDate(year, month, day);
+
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  res->println(ok ? "{ \"result\":\"OK\" }" : "{ \"result\":\"Invalid position\" }");
+}
+
+void handleGetPosition(HTTPRequest * req, HTTPResponse * res)
+{
+  char buff[256];
+  float variation = 0;
+  bool known = currentVariation(&variation);
+  int n;
+
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  n = sprintf(buff,"{ \"result\":\"%s\",\"lat\":%.5f,\"lon\":%.5f,\"year\":%.2f,\"variation\":%.1f,\"trueHeading\":\"%03d\"",
+          known ? "OK" : position.valid ? "Date outside magnetic model" : "No position", position.lat, position.lon, currentYear(), variation, MOD360(boatHeading + (int)lroundf(variation)));
+  //Course and speed over ground and heading to steer, if an NMEA client has sent them
+  if (navigation.cogValid) n += sprintf(buff + n, ",\"cog\":%.1f,\"sog\":%.1f", navigation.cog, navigation.sog);
+  if (navigation.steerValid) n += sprintf(buff + n, ",\"headingToSteer\":\"%03d\"", (int)lroundf(navigation.headingToSteer) % 360);
+  strcpy(buff + n, " }");
+  res->println(buff);
+}
+
+//The compass card learnt from GPS course over ground, per sector, for the web app to show
+//against the current card before anybody applies it
+void handleGetDeviation(HTTPRequest * req, HTTPResponse * res)
+{
+  char buff[128];
+  float offset, confidence;
+
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  sprintf(buff, "{ \"result\":\"OK\",\"accepted\":%u,\"sectors\":[", deviationCounts[DEV_ACCEPTED]);
+  res->print(buff);
+  for (int i = 0; i < DEV_SECTORS; i++) {
+    int centre = i * DEV_SECTOR_DEG + DEV_SECTOR_DEG / 2;
+    int n = sprintf(buff, "%s{\"sector\":%d,\"fixes\":%u,\"card\":%.0f", i > 0 ? "," : "", i * DEV_SECTOR_DEG,
+                    deviationSectors[i].count, wrap180(compassCard[centre]));
+    if (deviationProposed(centre, &offset, &confidence))
+      sprintf(buff + n, ",\"proposed\":%.1f,\"ci95\":%.1f}", offset, confidence);
+    else strcpy(buff + n, "}");
+    res->print(buff);
+  }
+  res->println("] }");
+}
+
+//Approval - the learnt card replaces the compass card and is saved
+void handleApplyDeviation(HTTPRequest * req, HTTPResponse * res)
+{
+  char buff[64];
+
+  Serial.println("handleApplyDeviation() Called");
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  sprintf(buff, "{ \"result\":\"OK\",\"changed\":%d }", deviationApply());
+  res->println(buff);
+}
+
+#if FEATURE_HISTORY
+//Heading history as min/mean/max buckets - see History.h
+//span and end are seconds before now (default the last hour), step the bucket width in seconds
+void handleGetHistory(HTTPRequest * req, HTTPResponse * res)
+{
+  std::string param;
+  uint32_t span = 3600, end = 0, step = 60, now = historyLast.t;
+
+  auto params = req->getParams();
+  if (params->getQueryParameter("span", param)) span = atol(param.c_str());
+  if (params->getQueryParameter("end", param)) end = atol(param.c_str());
+  if (params->getQueryParameter("step", param)) step = atol(param.c_str());
+  end = min(end, now);
+  span = min(span, now - end);
+
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  historyJson(now - end - span, now - end + 1, step, *res);
+}
+#endif
+
+#if FEATURE_SEA_STATE
+// The latest sea state (see SeaState.h). Periods in seconds, heave in metres, roll in degrees
+void handleGetSeaState(HTTPRequest * req, HTTPResponse * res)
+{
+  char buff[256];
+  SeaState sea = seaStateGet();
+
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  if (!sea.valid) {
+    sprintf(buff, "{ \"result\":\"No sea state yet\",\"samples\":%u,\"window\":%d }", seaFilled, SEA_FFT_SIZE);
+  } else {
+    sprintf(buff, "{ \"result\":\"OK\",\"age\":%.1f,\"wavePeriod\":%.1f,\"zeroCrossingPeriod\":%.1f,"
+                  "\"heave\":%.2f,\"verticalAccel\":%.3f,\"rollPeriod\":%.1f,\"roll\":%.1f }",
+            (millis() - sea.atMs) / 1000.0, sea.wavePeriodS, sea.zeroCrossingPeriodS,
+            sea.heaveM, sea.accelRms, sea.rollPeriodS, sea.rollDeg);
+  }
+  res->println(buff);
+}
+#endif
+
+#ifdef TRACE
+// The tracepoint rings as a Chrome trace (see Trace.h). ?clear=1 empties them afterwards
+void handleTrace(HTTPRequest * req, HTTPResponse * res)
+{
+  std::string param;
+  bool clear = req->getParams()->getQueryParameter("clear", param) && param == "1";
+
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Content-Disposition", "attachment; filename=\"ecompass-trace.json\"");
+  res->setHeader("Access-Control-Allow-Origin", "*");
+  traceJson(*res, clear);
+}
+#endif
@@ -0,0 +1,84 @@
+#ifndef _HOST_FIRMWARE_H
+#define _HOST_FIRMWARE_H
+/*
+ * The firmware, built for the host
+ *
+ * The sketch is compiled as it is - the same .ino, the same headers - against the shims in
+ * host/include. What stands in for the hardware is here: each CMPS14 the firmware expects
+ * is a SimCmps14.h register file attached to its I2C bus at its address, so the real
+ * Cmps14.h code (the register reads, the NACK and short read handling, the bus recovery)
+ * runs over the Wire shim. SIMULATE_CMPS14 is not defined. The OLED gets a device that
+ * takes whatever it is sent.
+ *
+ * Include this in exactly one source file of an executable, and call firmwareBegin() where
+ * the Arduino core would call setup().
+ */
+
+#include "../eCompass_compass_CMPS14_freeRTOS_v0E_Jan24/eCompass_compass_CMPS14_freeRTOS_v0E_Jan24.ino"
+#include "../eCompass_compass_CMPS14_freeRTOS_v0E_Jan24/SimCmps14.h"
+
+//The chip's side of a transaction. A one byte write sets the register pointer for the read
+//that follows; anything longer is a command. Faults are drawn once per write and read pair,
+//as simReadRegisters() does
+struct SimChip {
+  int sensor;
+  uint8_t pointer;
+  bool shortPending;
+};
+
+SimChip simChips[CMPS_MAX_SENSORS];
+
+uint8_t simChipWrite(void *context, const uint8_t *data, size_t length)
+{
+  SimChip *chip = (SimChip *)context;
+  SimSensor *s = &simSensors[chip->sensor];
+
+  if (length > 1) return simWriteCommand(chip->sensor, data[1]) == SAMPLE_OK ? I2C_ERROR_OK : I2C_ERROR_ADDRESS_NACK;
+  SampleStatus status = simTransactionFault(s);
+  if (status == SAMPLE_NACK) return I2C_ERROR_ADDRESS_NACK;
+  chip->shortPending = status == SAMPLE_SHORT_READ;
+  chip->pointer = length == 1 ? data[0] : 0;
+  return I2C_ERROR_OK;
+}
+
+size_t simChipRead(void *context, uint8_t *data, size_t length)
+{
+  SimChip *chip = (SimChip *)context;
+  SimSensor *s = &simSensors[chip->sensor];
+  bool cutShort = chip->shortPending;
+
+  chip->shortPending = false;
+  if (s->fault == SIM_FAULT_DEAD || s->busStuck || chip->pointer + length > SIM_REGISTERS) return 0;
+  simUpdate(s);
+  memcpy(data, &s->registers[chip->pointer], length);
+  simGarbage(s, data, length);
+  return cutShort ? length - 1 : length;
+}
+
+void simChipBusClear(void *context)
+{
+  simBusClear(((SimChip *)context)->sensor);
+}
+
+WireDevice simChipDevices[CMPS_MAX_SENSORS];
+
+#if FEATURE_OLED
+uint8_t oledWrite(void *context, const uint8_t *data, size_t length) { return I2C_ERROR_OK; }
+size_t oledRead(void *context, uint8_t *data, size_t length) { return 0; }
+const WireDevice oledDevice = { NULL, oledWrite, oledRead, NULL };
+#endif
+
+void firmwareBegin()
+{
+  for (int i = 0; i < cmpsCount; i++) {
+    simChips[i].sensor = i;
+    simChipDevices[i] = { &simChips[i], simChipWrite, simChipRead, simChipBusClear };
+    cmpsSensors[i].bus->wire->attach(cmpsSensors[i].address, &simChipDevices[i]);
+  }
+#if FEATURE_OLED
+  Wire.attach(DISPLAY_I2C_ADDRESS, &oledDevice);
+#endif
+  setup();
+}
+
+#endif
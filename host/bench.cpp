@@ -0,0 +1,54 @@
+//
+//  bench.cpp
+//
+//  The heading hot path benchmarks of Bench.h on the host, in ns/op - the same kernels and
+//  the same table (or JSON) as the "bench" console command on the unit, where they are
+//  timed in CPU cycles. The host's cycle counter runs at the nominal CPU clock, so ns/op
+//  is the host's own time.
+//
+//    ecompass-bench [json [results.json]]
+//
+//  Only the configuration and compass card are loaded, as for a replay - no sensors, tasks
+//  or servers - so nothing else is running while the kernels are timed. With a file name
+//  the JSON goes there, away from what the firmware prints while loading.
+//
+
+#include "Firmware.h"
+
+class FilePrint : public Print {
+  public:
+    FILE *file;
+    FilePrint(FILE *f) : file(f) {}
+    size_t write(uint8_t c) { return fputc(c, file) == EOF ? 0 : 1; }
+    size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, file); }
+};
+
+int main(int argc, char **argv)
+{
+  bool json = argc >= 2 && strcmp(argv[1], "json") == 0;
+  FILE *results = NULL;
+
+  if (argc > 3 || (argc >= 2 && !json)) {
+    fprintf(stderr, "Usage: %s [json [results.json]]\n", argv[0]);
+    return 2;
+  }
+  if (argc == 3 && (results = fopen(argv[2], "w")) == NULL) {
+    fprintf(stderr, "Can't write %s\n", argv[2]);
+    return 2;
+  }
+
+  SPIFFS.begin(true);
+  settings.begin("compass", false);
+  beginConfiguration();
+  loadCompassCards();
+
+  if (results != NULL) {
+    FilePrint out(results);
+    runBenchmarks(out, json);
+    fclose(results);
+  }
+  else runBenchmarks(Serial, json);
+  Serial.flush();
+  fflush(stdout);
+  _exit(0);
+}
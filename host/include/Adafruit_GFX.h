@@ -0,0 +1,30 @@
+#ifndef _HOST_ADAFRUIT_GFX_H
+#define _HOST_ADAFRUIT_GFX_H
+/*
+ * There is no display on the host. Text and drawing go nowhere - only the bus traffic a
+ * real display would make is kept, see Adafruit_SH110X.h
+ */
+
+#include "Arduino.h"
+
+class Adafruit_GFX : public Print {
+  public:
+    Adafruit_GFX(int16_t w, int16_t h) : _width(w), _height(h) {}
+    size_t write(uint8_t) { return 1; }
+    using Print::write;
+    void setTextSize(uint8_t) {}
+    void setTextColor(uint16_t) {}
+    void setTextColor(uint16_t, uint16_t) {}
+    void setCursor(int16_t, int16_t) {}
+    void drawPixel(int16_t, int16_t, uint16_t) {}
+    void drawLine(int16_t, int16_t, int16_t, int16_t, uint16_t) {}
+    void drawCircle(int16_t, int16_t, int16_t, uint16_t) {}
+    void fillRect(int16_t, int16_t, int16_t, int16_t, uint16_t) {}
+    int16_t width() const { return _width; }
+    int16_t height() const { return _height; }
+
+  private:
+    int16_t _width, _height;
+};
+
+#endif
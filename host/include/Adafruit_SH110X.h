@@ -0,0 +1,31 @@
+#ifndef _HOST_ADAFRUIT_SH110X_H
+#define _HOST_ADAFRUIT_SH110X_H
+/*
+ * The SH1106 OLED, minus the glass. display() and the commands are real I2C transactions
+ * on the display's bus (a device in host/Firmware.h takes them and throws them away), so
+ * they hold the bus for as long as the real display would and show up in the bus locking.
+ */
+
+#include "Adafruit_GFX.h"
+#include "Wire.h"
+
+#define SH110X_BLACK 0
+#define SH110X_WHITE 1
+#define SH110X_DISPLAYOFF 0xAE
+#define SH110X_DISPLAYON 0xAF
+
+class Adafruit_SH1106G : public Adafruit_GFX {
+  public:
+    Adafruit_SH1106G(uint16_t w, uint16_t h, TwoWire *wire, int8_t resetPin = -1)
+      : Adafruit_GFX(w, h), _wire(wire) {}
+    bool begin(uint8_t address = 0x3C, bool reset = true);
+    void clearDisplay() {}
+    void display();
+    void oled_command(uint8_t command);
+
+  private:
+    TwoWire *_wire;
+    uint8_t _address = 0x3C;
+};
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+/*
+ * Arduino core for the host build
+ *
+ * Just enough of the ESP32 Arduino core for the sketch to build and run as an ordinary
+ * program on Linux (see host/README.md). Time comes from the monotonic clock, Serial is
+ * stdin and stdout, the other UARTs go nowhere (or to a file) at the speed their baud rate
+ * allows, and pins read back whatever was last written to them. The RTOS underneath is
+ * FreeRTOS.h.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int uint;
+
+#define PROGMEM
+#define IRAM_ATTR
+#define F(s) (s)
+
+#define PI 3.1415926535897932384626433832795
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+#define B10000000 0x80
+#define B10000001 0x81
+#define B10000010 0x82
+#define B10000100 0x84
+#define B10010000 0x90
+
+//Time
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+//Pins - nothing is attached, a pin reads back what was last written to it
+#define LOW 0
+#define HIGH 1
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define OUTPUT_OPEN_DRAIN 0x13
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+#define SDA 21
+#define SCL 22
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t pin);
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+//The CPU clock only scales the cycle counter here - see ESP.getCycleCount()
+bool setCpuFrequencyMhz(uint32_t mhz);
+uint32_t getCpuFrequencyMhz();
+
+class String;
+class Printable;
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *s) { return s == NULL ? 0 : write((const uint8_t *)s, strlen(s)); }
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    size_t print(const char *s) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = 10) { return printNumber(n, base); }
+    size_t print(int n, int base = 10) { return printSigned(n, base); }
+    size_t print(unsigned int n, int base = 10) { return printNumber(n, base); }
+    size_t print(long n, int base = 10) { return printSigned(n, base); }
+    size_t print(unsigned long n, int base = 10) { return printNumber(n, base); }
+    size_t print(long long n, int base = 10) { return printSigned(n, base); }
+    size_t print(unsigned long long n, int base = 10) { return printNumber(n, base); }
+    size_t print(double n, int digits = 2) { return printFloat(n, digits); }
+    size_t print(const String &s);
+    size_t print(const Printable &p);
+
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+    template <typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+
+  private:
+    size_t printNumber(unsigned long long n, int base);
+    size_t printSigned(long long n, int base);
+    size_t printFloat(double n, int digits);
+};
+
+class Printable {
+  public:
+    virtual ~Printable() {}
+    virtual size_t printTo(Print &p) const = 0;
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    void setTimeout(unsigned long ms) { _timeout = ms; }
+    size_t readBytes(char *buffer, size_t length);
+    size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+
+  protected:
+    unsigned long _timeout = 1000;
+};
+
+class String {
+  public:
+    String(const char *s = "") : _s(s == NULL ? "" : s) {}
+    String(const std::string &s) : _s(s) {}
+    explicit String(int n) : _s(std::to_string(n)) {}
+    explicit String(unsigned n) : _s(std::to_string(n)) {}
+    explicit String(long n) : _s(std::to_string(n)) {}
+    explicit String(unsigned long n) : _s(std::to_string(n)) {}
+    const char *c_str() const { return _s.c_str(); }
+    unsigned length() const { return _s.length(); }
+    String &operator+=(const String &s) { _s += s._s; return *this; }
+    String &operator+=(const char *s) { _s += s; return *this; }
+    String &operator+=(char c) { _s += c; return *this; }
+    bool operator==(const String &s) const { return _s == s._s; }
+    bool operator==(const char *s) const { return _s == s; }
+    char operator[](unsigned i) const { return i < _s.length() ? _s[i] : 0; }
+
+  private:
+    std::string _s;
+};
+
+class IPAddress : public Printable {
+  public:
+    IPAddress() : _address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+    IPAddress(uint32_t address) : _address(address) {}
+    operator uint32_t() const { return _address; }
+    uint8_t operator[](int i) const { return _address >> (8 * i); }
+    String toString() const;
+    size_t printTo(Print &p) const;
+
+  private:
+    uint32_t _address;      //network order, as lwIP keeps it
+};
+
+#include "HardwareSerial.h"
+
+class EspClass {
+  public:
+    void restart();
+    uint32_t getCycleCount();
+    uint32_t getCpuFreqMHz() { return getCpuFrequencyMhz(); }
+    uint32_t getHeapSize();
+    uint32_t getFreeHeap();
+    uint32_t getMinFreeHeap();
+    uint32_t getMaxAllocHeap();
+    uint32_t getSketchSize();
+    uint32_t getFreeSketchSpace();
+};
+
+extern EspClass ESP;
+
+#endif
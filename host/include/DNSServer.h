@@ -0,0 +1,8 @@
+#ifndef _HOST_DNS_SERVER_H
+#define _HOST_DNS_SERVER_H
+
+//Included by the sketch, not used by it
+
+#include "WiFi.h"
+
+#endif
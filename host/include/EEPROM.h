@@ -0,0 +1,30 @@
+#ifndef _HOST_EEPROM_H
+#define _HOST_EEPROM_H
+/*
+ * The emulated EEPROM - hostStoragePath("eeprom"), read into memory by begin() and written
+ * back by commit(). A missing file reads as erased flash.
+ */
+
+#include "Arduino.h"
+
+class EEPROMClass {
+  public:
+    ~EEPROMClass() { end(); }
+    bool begin(size_t size);
+    void end();
+    bool commit();
+    uint8_t read(int address) { return address >= 0 && (size_t)address < _size ? _data[address] : 0; }
+    void write(int address, uint8_t value);
+    size_t readBytes(int address, void *buffer, size_t length);
+    size_t writeBytes(int address, const void *buffer, size_t length);
+    size_t length() const { return _size; }
+
+  private:
+    uint8_t *_data = NULL;
+    size_t _size = 0;
+    bool _dirty = false;
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _HOST_FS_H
+#define _HOST_FS_H
+/*
+ * A file system in a directory of the host - see SPIFFS.h. Files and directories are as
+ * in the ESP32 core: copies of a File share it, and it is closed when the last one goes.
+ */
+
+#include <memory>
+#include "Arduino.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+namespace fs {
+
+class File : public Stream {
+  public:
+    File() {}
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    int available();
+    int read();
+    size_t read(uint8_t *buffer, size_t size);
+    int peek();
+    void flush();
+    bool seek(uint32_t position, SeekMode mode = SeekSet);
+    size_t position() const;
+    size_t size() const;
+    void close();
+    operator bool() const;
+    const char *name() const;
+    const char *path() const { return name(); }
+    bool isDirectory() const;
+    File openNextFile(const char *mode = FILE_READ);
+    void rewindDirectory();
+
+  private:
+    friend class FS;
+    struct Impl;
+    std::shared_ptr<Impl> _impl;
+};
+
+class FS {
+  public:
+    FS(const char *kind) : _kind(kind) {}
+    File open(const char *path, const char *mode = FILE_READ, bool create = false);
+    File open(const String &path, const char *mode = FILE_READ, bool create = false) { return open(path.c_str(), mode, create); }
+    bool exists(const char *path);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool remove(const char *path);
+    bool rename(const char *from, const char *to);
+    bool mkdir(const char *path);
+    bool rmdir(const char *path);
+
+  protected:
+    std::string hostPath(const char *path);
+    const char *_kind;
+    bool _mounted = false;
+};
+
+}
+
+using fs::File;
+using fs::FS;
+
+#endif
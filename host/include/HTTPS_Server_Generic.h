@@ -0,0 +1,193 @@
+#ifndef _HOST_HTTPS_SERVER_GENERIC_H
+#define _HOST_HTTPS_SERVER_GENERIC_H
+/*
+ * The esp32_https_server API for the host build - plain HTTP/1.1 over POSIX sockets
+ *
+ * loop() takes whatever connections are waiting and answers one request on each, then
+ * closes it: the request is read (headers and body), handed to the node registered for its
+ * method and path, and the response the handler wrote is sent with a Content-Length. Nodes
+ * match exactly, or by prefix when they end in "/*"; anything else goes to the default node.
+ * WebSocket nodes are accepted and never matched - nothing in the firmware serves one from
+ * this server.
+ */
+
+#include <string>
+#include <vector>
+#include <utility>
+#include "Arduino.h"
+#include "lwip/sockets.h"
+
+namespace httpsserver {
+
+std::string intToString(int value);
+
+class ResourceParameters {
+  public:
+    bool isQueryParameterSet(const std::string &name);
+    bool getQueryParameter(const std::string &name, std::string &value);
+    size_t getQueryParameterCount(bool unique = false) { return _query.size(); }
+
+  private:
+    friend class HTTPServer;
+    std::vector<std::pair<std::string, std::string> > _query;
+};
+
+class HTTPRequest {
+  public:
+    std::string getHeader(const std::string &name);
+    std::string getMethod() { return _method; }
+    std::string getRequestString() { return _requestString; }
+    ResourceParameters *getParams() { return &_params; }
+    size_t getContentLength() { return _body.size(); }
+    size_t readChars(char *buffer, size_t length);
+    size_t readBytes(byte *buffer, size_t length) { return readChars((char *)buffer, length); }
+    bool requestComplete() { return _bodyRead == _body.size(); }
+    void discardRequestBody() { _bodyRead = _body.size(); }
+
+  private:
+    friend class HTTPServer;
+    std::string _method, _requestString;
+    std::vector<std::pair<std::string, std::string> > _headers;
+    ResourceParameters _params;
+    std::string _body;
+    size_t _bodyRead = 0;
+};
+
+class HTTPResponse : public Print {
+  public:
+    void setStatusCode(uint16_t statusCode) { _statusCode = statusCode; }
+    void setStatusText(const std::string &statusText) { _statusText = statusText; }
+    uint16_t getStatusCode() { return _statusCode; }
+    void setHeader(const std::string &name, const std::string &value);
+    bool isHeaderWritten() { return false; }
+    size_t write(uint8_t c) { _body += (char)c; return 1; }
+    size_t write(const uint8_t *buffer, size_t size) { _body.append((const char *)buffer, size); return size; }
+    using Print::write;
+
+  private:
+    friend class HTTPServer;
+    uint16_t _statusCode = 200;
+    std::string _statusText = "OK";
+    std::vector<std::pair<std::string, std::string> > _headers;
+    std::string _body;
+};
+
+typedef void (HTTPSCallbackFunction)(HTTPRequest *req, HTTPResponse *res);
+
+enum HTTPNodeType { HANDLER_CALLBACK, WEBSOCKET };
+
+class HTTPNode {
+  public:
+    HTTPNode(const std::string &path, HTTPNodeType type, const std::string &tag)
+      : _path(path), _nodeType(type), _tag(tag) {}
+    virtual ~HTTPNode() {}
+    const std::string _path;
+    const HTTPNodeType _nodeType;
+    const std::string _tag;
+};
+
+class ResourceNode : public HTTPNode {
+  public:
+    ResourceNode(const std::string &path, const std::string &method, HTTPSCallbackFunction *callback, const std::string &tag = "")
+      : HTTPNode(path, HANDLER_CALLBACK, tag), _method(method), _callback(callback) {}
+    const std::string _method;
+    HTTPSCallbackFunction *_callback;
+};
+
+class WebsocketHandler {
+  public:
+    static const int SEND_TYPE_BINARY = 0x02;
+    static const int SEND_TYPE_TEXT = 0x01;
+    virtual ~WebsocketHandler() {}
+    virtual void onMessage(void *input) {}
+    virtual void onClose() {}
+    void send(std::string data, uint8_t sendType = SEND_TYPE_TEXT) {}
+    void send(uint8_t *data, uint16_t length, uint8_t sendType = SEND_TYPE_BINARY) {}
+    void close(uint16_t status = 1000, std::string message = "") {}
+    bool closed() { return true; }
+};
+
+typedef WebsocketHandler *(WebsocketHandlerCreator)();
+
+class WebsocketNode : public HTTPNode {
+  public:
+    WebsocketNode(const std::string &path, WebsocketHandlerCreator *creator, const std::string &tag = "")
+      : HTTPNode(path, WEBSOCKET, tag), _creator(creator) {}
+    WebsocketHandlerCreator *_creator;
+};
+
+class HTTPServer {
+  public:
+    HTTPServer(const uint16_t port = 80, const uint8_t maxConnections = 4, const in_addr_t bindAddress = 0)
+      : _port(port) {}
+    ~HTTPServer() { stop(); }
+    void registerNode(HTTPNode *node) { _nodes.push_back(node); }
+    void unregisterNode(HTTPNode *node);
+    void setDefaultNode(HTTPNode *node) { _defaultNode = node; }
+    void setDefaultHeader(const std::string &name, const std::string &value);
+    uint8_t start();
+    void stop();
+    bool isRunning() { return _fd >= 0; }
+    void loop();
+
+    //Requests answered, for the tests
+    uint32_t requests() const { return _requests; }
+
+  private:
+    void serve(int fd);
+    ResourceNode *findNode(const std::string &method, const std::string &path);
+
+    uint16_t _port;
+    int _fd = -1;
+    std::vector<HTTPNode *> _nodes;
+    HTTPNode *_defaultNode = NULL;
+    std::vector<std::pair<std::string, std::string> > _defaultHeaders;
+    uint32_t _requests = 0;
+};
+
+//Request bodies. The whole body has been read by the time the handler runs
+class HTTPBodyParser {
+  public:
+    HTTPBodyParser(HTTPRequest *req) : _request(req) {}
+    virtual ~HTTPBodyParser() {}
+    virtual bool nextField() = 0;
+    virtual std::string getFieldName() { return _name; }
+    virtual std::string getFieldFilename() { return _filename; }
+    virtual std::string getFieldMimeType() { return _mimeType; }
+    virtual size_t read(byte *buffer, size_t bufferSize);
+    virtual bool endOfField() { return _fieldRead == _field.size(); }
+
+  protected:
+    std::string body();
+    void setField(const std::string &name, const std::string &filename, const std::string &mimeType, const std::string &value);
+
+    HTTPRequest *_request;
+    std::string _name, _filename, _mimeType, _field;
+    size_t _fieldRead = 0;
+};
+
+class HTTPURLEncodedBodyParser : public HTTPBodyParser {
+  public:
+    HTTPURLEncodedBodyParser(HTTPRequest *req) : HTTPBodyParser(req) {}
+    bool nextField();
+
+  private:
+    std::string _body;
+    size_t _position = 0;
+    bool _started = false;
+};
+
+class HTTPMultipartBodyParser : public HTTPBodyParser {
+  public:
+    HTTPMultipartBodyParser(HTTPRequest *req) : HTTPBodyParser(req) {}
+    bool nextField();
+
+  private:
+    std::string _body, _boundary;
+    size_t _position = 0;
+    bool _started = false;
+};
+
+}
+
+#endif
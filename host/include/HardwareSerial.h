@@ -0,0 +1,59 @@
+#ifndef _HOST_HARDWARE_SERIAL_H
+#define _HOST_HARDWARE_SERIAL_H
+/*
+ * UARTs for the host build
+ *
+ * UART 0 (Serial, the serial monitor) is stdout, and reads come from stdin when it is a
+ * terminal or a pipe. The others go nowhere, or to the file named by ECOMPASS_UART<n> (so
+ * ECOMPASS_UART2=/dev/stdout shows the wired NMEA output). Every UART drains its TX ring at
+ * what its baud rate carries - ten bits a character - so availableForWrite() and a full
+ * ring behave as they do on the chip.
+ */
+
+#include "Arduino.h"
+
+#define SERIAL_8N1 0x800001c
+
+class HardwareSerial : public Stream {
+  public:
+    HardwareSerial(int uart);
+
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rxPin = -1, int8_t txPin = -1);
+    void end();
+    void updateBaudRate(unsigned long baud);
+    size_t setTxBufferSize(size_t size);
+    size_t setRxBufferSize(size_t size);
+    operator bool() const { return true; }
+
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    int availableForWrite();
+    void flush();
+
+    //Bytes that have gone out on the line, for the tests
+    uint64_t bytesWritten() const { return _written; }
+
+  private:
+    void drain();
+
+    int _uart;
+    unsigned long _baud = 115200;
+    size_t _txBufferSize = 128;
+    size_t _queued = 0;          //bytes in the TX ring
+    uint64_t _drainedUs = 0;     //when the ring was last worked out
+    uint64_t _written = 0;
+    int _fd = -1;                //where the bytes go, -1 for nowhere
+    int _peeked = -1;
+    pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t _writeLock = PTHREAD_MUTEX_INITIALIZER;   //one write at a time, start to finish
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+
+#endif
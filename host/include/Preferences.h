@@ -0,0 +1,50 @@
+#ifndef _HOST_PREFERENCES_H
+#define _HOST_PREFERENCES_H
+/*
+ * NVS for the host build - a directory per namespace and a file per key, under
+ * hostStoragePath("nvs"). A value is written to a new file and renamed over the old one, so
+ * like NVS a key holds either the old value or the new one whatever happens.
+ */
+
+#include "Arduino.h"
+
+class Preferences {
+  public:
+    bool begin(const char *name, bool readOnly = false);
+    void end();
+    bool clear();
+    bool remove(const char *key);
+    bool isKey(const char *key);
+
+    size_t putBytes(const char *key, const void *value, size_t length);
+    size_t getBytes(const char *key, void *buffer, size_t maxLength);
+    size_t getBytesLength(const char *key);
+    size_t putUChar(const char *key, uint8_t value) { return putBytes(key, &value, sizeof(value)); }
+    uint8_t getUChar(const char *key, uint8_t defaultValue = 0) { return getValue(key, defaultValue); }
+    size_t putUShort(const char *key, uint16_t value) { return putBytes(key, &value, sizeof(value)); }
+    uint16_t getUShort(const char *key, uint16_t defaultValue = 0) { return getValue(key, defaultValue); }
+    size_t putUInt(const char *key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+    uint32_t getUInt(const char *key, uint32_t defaultValue = 0) { return getValue(key, defaultValue); }
+    size_t putInt(const char *key, int32_t value) { return putBytes(key, &value, sizeof(value)); }
+    int32_t getInt(const char *key, int32_t defaultValue = 0) { return getValue(key, defaultValue); }
+    size_t putFloat(const char *key, float value) { return putBytes(key, &value, sizeof(value)); }
+    float getFloat(const char *key, float defaultValue = NAN) { return getValue(key, defaultValue); }
+    size_t putBool(const char *key, bool value) { return putUChar(key, value); }
+    bool getBool(const char *key, bool defaultValue = false) { return getUChar(key, defaultValue); }
+
+  private:
+    template <typename T> T getValue(const char *key, T defaultValue) {
+      T value;
+      return getBytesLength(key) == sizeof(T) && getBytes(key, &value, sizeof(T)) == sizeof(T) ? value : defaultValue;
+    }
+    std::string path(const char *key);
+
+    std::string _namespace;
+    bool _started = false, _readOnly = false;
+};
+
+//Where the host build keeps a kind of storage - under ECOMPASS_STORAGE, or ecompass-storage
+//in the working directory
+std::string hostStoragePath(const char *kind);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_PRINT_H
+#define _HOST_PRINT_H
+
+#include "Arduino.h"
+
+#endif
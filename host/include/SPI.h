@@ -0,0 +1,8 @@
+#ifndef _HOST_SPI_H
+#define _HOST_SPI_H
+
+//Nothing on SPI in this design
+
+#include "Arduino.h"
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _HOST_SPIFFS_H
+#define _HOST_SPIFFS_H
+/*
+ * SPIFFS for the host build - the directory hostStoragePath("spiffs"), with the size of the
+ * partition on a 4MB ESP32 with the default partition table. SPIFFS has no directories, so
+ * "/public/index.html" is a file in a subdirectory here and listing "/public" works the same.
+ */
+
+#include "FS.h"
+
+#define HOST_SPIFFS_BYTES 1378241
+
+class SPIFFSFS : public fs::FS {
+  public:
+    SPIFFSFS() : fs::FS("spiffs") {}
+    bool begin(bool formatOnFail = false, const char *basePath = "/spiffs", uint8_t maxOpenFiles = 10, const char *label = NULL);
+    void end() { _mounted = false; }
+    bool format();
+    size_t totalBytes() { return HOST_SPIFFS_BYTES; }
+    size_t usedBytes();
+};
+
+extern SPIFFSFS SPIFFS;
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _HOST_WIFI_H
+#define _HOST_WIFI_H
+/*
+ * WiFi for the host build
+ *
+ * The access point is the machine's own network: softAP() only notes the SSID, and the
+ * unit's address is the loopback address. Servers listen on every interface of the host.
+ *
+ * Every port the firmware listens on is moved up by ECOMPASS_PORT_OFFSET, if it is set - the
+ * NMEA port 23 and the web server on 80 need root otherwise, and tests run side by side each
+ * use an offset of their own. hostPort() gives where a firmware port really is.
+ */
+
+#include "Arduino.h"
+#include "WiFiClient.h"
+
+#define WIFI_AP 2
+
+class WiFiClass {
+  public:
+    bool softAP(const char *ssid, const char *password = NULL, int channel = 1, int hidden = 0, int maxConnections = 4);
+    bool softAPdisconnect(bool wifiOff = false);
+    IPAddress softAPIP() { return IPAddress(127, 0, 0, 1); }
+    uint8_t softAPgetStationNum() { return 0; }
+    bool mode(int mode) { return true; }
+    bool setSleep(bool enable) { return true; }
+    const char *softAPSSID() const { return _ssid; }
+
+  private:
+    char _ssid[33] = "";
+};
+
+extern WiFiClass WiFi;
+
+class WiFiServer {
+  public:
+    WiFiServer(uint16_t port = 80, uint8_t maxClients = 4) : _port(port) {}
+    ~WiFiServer() { end(); }
+    void begin(uint16_t port = 0);
+    void end();
+    WiFiClient available();
+    WiFiClient accept() { return available(); }
+    bool hasClient();
+    void setNoDelay(bool noDelay) { _noDelay = noDelay; }
+    operator bool() { return _fd >= 0; }
+    int fd() const { return _fd; }
+
+  private:
+    uint16_t _port;
+    int _fd = -1;
+    bool _noDelay = false;
+};
+
+//The host port a firmware port is listening on - see ECOMPASS_PORT_OFFSET
+uint16_t hostPort(uint16_t port);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_WIFI_AP_H
+#define _HOST_WIFI_AP_H
+
+#include "WiFi.h"
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _HOST_WIFI_CLIENT_H
+#define _HOST_WIFI_CLIENT_H
+/*
+ * A TCP connection. As in the ESP32 core, copies of a WiFiClient share the socket, and it is
+ * closed when stop() is called or the last copy goes away.
+ */
+
+#include <memory>
+#include "Arduino.h"
+#include "lwip/sockets.h"
+
+class WiFiClient : public Stream {
+  public:
+    WiFiClient() {}
+    explicit WiFiClient(int fd);
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    int available();
+    int read();
+    int read(uint8_t *buffer, size_t size);
+    int peek();
+    void flush() {}
+    void stop();
+    uint8_t connected();
+    operator bool() { return connected(); }
+    bool operator==(const WiFiClient &other) const { return _socket == other._socket; }
+    int fd() const;
+    int setNoDelay(bool noDelay);
+    IPAddress remoteIP() const;
+    uint16_t remotePort() const;
+
+  private:
+    struct Socket {
+      int fd;
+      Socket(int fd) : fd(fd) {}
+      Socket(const Socket &) = delete;
+      ~Socket();
+    };
+    std::shared_ptr<Socket> _socket;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _HOST_WIRE_H
+#define _HOST_WIRE_H
+/*
+ * I2C for the host build
+ *
+ * Each TwoWire is a bus with devices attached to it by address (see wireAttach()). A
+ * transaction goes to the device at its address, or is NACKed if there is none, and takes
+ * as long as it would at the bus clock - nine bit times a byte plus the start and stop - so
+ * code that holds a bus lock across a transaction holds it for the right length of time.
+ *
+ * The simulated CMPS14s are attached in host/Firmware.h.
+ */
+
+#include "Arduino.h"
+
+#define I2C_BUFFER_LENGTH 128
+
+//Error codes from endTransmission(), as in the ESP32 core
+#define I2C_ERROR_OK 0
+#define I2C_ERROR_ADDRESS_NACK 2
+#define I2C_ERROR_DATA_NACK 3
+
+//A device on a bus. Each call is one transaction with it
+struct WireDevice {
+  void *context;
+  //A write of length bytes. Returns an I2C_ERROR_ code
+  uint8_t (*write)(void *context, const uint8_t *data, size_t length);
+  //A read of up to length bytes. Returns how many the device sent before it stopped - 0 is a NACK
+  size_t (*read)(void *context, uint8_t *data, size_t length);
+  //The bus has been clocked out and Wire started again - see TwoWire::end()
+  void (*busClear)(void *context);
+};
+
+class TwoWire : public Stream {
+  public:
+    TwoWire(uint8_t busNumber);
+
+    bool begin(int sda = -1, int scl = -1, uint32_t frequency = 0);
+    bool end();
+    bool setClock(uint32_t frequency);
+    uint32_t getClock() { return _clock; }
+    void setTimeOut(uint16_t timeoutMs) {}
+
+    void beginTransmission(uint16_t address);
+    void beginTransmission(int address) { beginTransmission((uint16_t)address); }
+    uint8_t endTransmission(bool sendStop = true);
+    size_t requestFrom(uint16_t address, size_t size, bool sendStop = true);
+    uint8_t requestFrom(int address, int size) { return requestFrom((uint16_t)address, (size_t)size); }
+    uint8_t requestFrom(uint8_t address, uint8_t size) { return requestFrom((uint16_t)address, (size_t)size); }
+
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *data, size_t length);
+    using Print::write;
+    int available() { return _rxLength - _rxIndex; }
+    int read() { return _rxIndex < _rxLength ? _rxBuffer[_rxIndex++] : -1; }
+    int peek() { return _rxIndex < _rxLength ? _rxBuffer[_rxIndex] : -1; }
+
+    //Attach a device at an address, or detach it with NULL
+    void attach(uint8_t address, const WireDevice *device);
+
+    //Transactions, and the ones nobody answered
+    uint32_t transactions() const { return _transactions; }
+    uint32_t nacks() const { return _nacks; }
+
+  private:
+    void busTime(size_t bytes);
+
+    uint8_t _busNumber;
+    bool _started = false;
+    uint32_t _clock = 100000;
+    const WireDevice *_devices[128] = {};
+    uint16_t _txAddress = 0;
+    uint8_t _txBuffer[I2C_BUFFER_LENGTH];
+    size_t _txLength = 0;
+    uint8_t _rxBuffer[I2C_BUFFER_LENGTH];
+    size_t _rxLength = 0, _rxIndex = 0;
+    uint32_t _transactions = 0, _nacks = 0;
+};
+
+extern TwoWire Wire;
+extern TwoWire Wire1;
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _HOST_CPPQUEUE_H
+#define _HOST_CPPQUEUE_H
+
+//Included by the sketch, not used by it
+
+#include "Arduino.h"
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _HOST_ESP_HEAP_CAPS_H
+#define _HOST_ESP_HEAP_CAPS_H
+/*
+ * The heap, as far as the C library will say - see mallinfo2(). The "size" of the heap is
+ * HOST_HEAP_BYTES, the internal RAM a WROOM-32 leaves the application, so the free figures
+ * mean much the same as on the chip.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HOST_HEAP_BYTES (320 * 1024)
+
+#define MALLOC_CAP_EXEC (1 << 0)
+#define MALLOC_CAP_32BIT (1 << 1)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+typedef struct {
+  size_t total_free_bytes;
+  size_t total_allocated_bytes;
+  size_t largest_free_block;
+  size_t minimum_free_bytes;
+  size_t allocated_blocks;
+  size_t free_blocks;
+  size_t total_blocks;
+} multi_heap_info_t;
+
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps);
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+extern "C" int ets_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
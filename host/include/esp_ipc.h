@@ -0,0 +1,16 @@
+#ifndef _HOST_ESP_IPC_H
+#define _HOST_ESP_IPC_H
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_ARG 0x102
+
+typedef void (*esp_ipc_func_t)(void *arg);
+
+//There is no other core to run it on - it is run straight away by the caller
+esp_err_t esp_ipc_call_blocking(uint32_t cpu, esp_ipc_func_t function, void *arg);
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef _HOST_FREERTOS_H
+#define _HOST_FREERTOS_H
+/*
+ * FreeRTOS for the host build
+ *
+ * The parts of the FreeRTOS API the sketch uses, on POSIX threads. Every task is a thread
+ * and the kernel objects are mutexes and condition variables, so blocking, timeouts and
+ * notifications behave as they do on the ESP32. A tick is a millisecond, as in the Arduino
+ * core.
+ *
+ * What can't be had from an ordinary process is left out: priorities and core affinity
+ * are recorded but Linux schedules the threads as it likes, and a critical section is a
+ * lock (held by one task at a time) rather than interrupts off. The run time counters in
+ * uxTaskGetSystemState() are each thread's CPU time; the two idle tasks get whatever is
+ * left of their core once the tasks pinned to it are counted.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void (*TaskFunction_t)(void *);
+
+typedef struct HostTask *TaskHandle_t;
+typedef struct HostSemaphore *SemaphoreHandle_t;
+typedef struct HostQueue *QueueHandle_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+#define errQUEUE_EMPTY pdFALSE
+#define errQUEUE_FULL pdFALSE
+
+#define configTICK_RATE_HZ 1000
+#define configGENERATE_RUN_TIME_STATS 1
+#define configUSE_TRACE_FACILITY 1
+#define configMAX_TASK_NAME_LEN 16
+#define portNUM_PROCESSORS 2
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY (TickType_t)0xffffffffUL
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define pdTICKS_TO_MS(ticks) ((uint32_t)(((uint64_t)(ticks) * 1000) / configTICK_RATE_HZ))
+
+/*
+ * Tasks
+ */
+
+typedef enum { eRunning, eReady, eBlocked, eSuspended, eDeleted, eInvalid } eTaskState;
+typedef enum { eNoAction, eSetBits, eIncrement, eSetValueWithOverwrite, eSetValueWithoutOverwrite } eNotifyAction;
+
+typedef struct {
+  TaskHandle_t xHandle;
+  const char *pcTaskName;
+  UBaseType_t xTaskNumber;
+  eTaskState eCurrentState;
+  UBaseType_t uxCurrentPriority;
+  UBaseType_t uxBasePriority;
+  uint32_t ulRunTimeCounter;      //microseconds
+  void *pxStackBase;
+  uint32_t usStackHighWaterMark;  //bytes
+  BaseType_t xCoreID;
+} TaskStatus_t;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth,
+                                   void *parameters, UBaseType_t priority, TaskHandle_t *created, BaseType_t core);
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stackDepth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *created);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+BaseType_t xTaskDelayUntil(TickType_t *previousWakeTime, TickType_t period);
+#define vTaskDelayUntil(previousWakeTime, period) ((void)xTaskDelayUntil(previousWakeTime, period))
+TickType_t xTaskGetTickCount();
+TaskHandle_t xTaskGetCurrentTaskHandle();
+TaskHandle_t xTaskGetIdleTaskHandleForCPU(UBaseType_t cpu);
+const char *pcTaskGetName(TaskHandle_t task);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+UBaseType_t uxTaskGetNumberOfTasks();
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *status, UBaseType_t size, uint32_t *totalRunTime);
+BaseType_t xPortGetCoreID();
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+BaseType_t xTaskNotifyWait(uint32_t clearOnEntry, uint32_t clearOnExit, uint32_t *value, TickType_t wait);
+#define xTaskNotifyGive(task) xTaskNotify((task), 0, eIncrement)
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t wait);
+
+/*
+ * Semaphores and mutexes
+ */
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t wait);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex);
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t semaphore);
+
+/*
+ * Queues - items are copied in and out, as in FreeRTOS
+ */
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+void vQueueDelete(QueueHandle_t queue);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait);
+#define xQueueSendToBack xQueueSend
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t wait);
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait);
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
+BaseType_t xQueueReset(QueueHandle_t queue);
+
+/*
+ * Critical sections - a lock each, taken recursively like the ESP32's spinlocks
+ */
+
+typedef struct {
+  pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+
+inline void portENTER_CRITICAL(portMUX_TYPE *mux) { pthread_mutex_lock(&mux->mutex); }
+inline void portEXIT_CRITICAL(portMUX_TYPE *mux) { pthread_mutex_unlock(&mux->mutex); }
+#define portENTER_CRITICAL_ISR portENTER_CRITICAL
+#define portEXIT_CRITICAL_ISR portEXIT_CRITICAL
+#define taskENTER_CRITICAL portENTER_CRITICAL
+#define taskEXIT_CRITICAL portEXIT_CRITICAL
+
+void vTaskSuspendAll();
+BaseType_t xTaskResumeAll();
+
+#endif
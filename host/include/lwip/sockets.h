@@ -0,0 +1,33 @@
+#ifndef _HOST_LWIP_SOCKETS_H
+#define _HOST_LWIP_SOCKETS_H
+/*
+ * The lwIP socket API is the BSD one, which the host has. bind() is wrapped to apply
+ * ECOMPASS_PORT_OFFSET (see WiFi.h), and a send() on a connection the other end has closed
+ * gets EPIPE, as on lwIP, rather than a SIGPIPE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define lwip_socket ::socket
+#define lwip_bind ::bind
+#define lwip_listen ::listen
+#define lwip_accept ::accept
+#define lwip_connect ::connect
+#define lwip_send ::send
+#define lwip_recv ::recv
+#define lwip_close ::close
+#define lwip_select ::select
+#define lwip_setsockopt ::setsockopt
+#define lwip_getsockopt ::getsockopt
+#define lwip_fcntl ::fcntl
+
+#endif
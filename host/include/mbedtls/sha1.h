@@ -0,0 +1,11 @@
+#ifndef _HOST_MBEDTLS_SHA1_H
+#define _HOST_MBEDTLS_SHA1_H
+
+//SHA-1 for the WebSocket handshake - see host/src/mbedtls.cpp
+
+#include <stddef.h>
+
+int mbedtls_sha1_ret(const unsigned char *input, size_t length, unsigned char output[20]);
+int mbedtls_sha1(const unsigned char *input, size_t length, unsigned char output[20]);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _HOST_MBEDTLS_VERSION_H
+#define _HOST_MBEDTLS_VERSION_H
+
+//The mbedTLS 2 API, as in the ESP32 Arduino core 2.x
+
+#define MBEDTLS_VERSION_MAJOR 2
+#define MBEDTLS_VERSION_MINOR 28
+
+#endif
@@ -0,0 +1,50 @@
+//
+//  load.cpp
+//
+//  Several chartplotters and a phone at once, against a unit or a host build - see
+//  tests/LoadGenerator.h.
+//
+//    ecompass-load [-c consumers] [-p pollers] [-s slow readers] [-t seconds]
+//                  [-i poll interval ms] [-n NMEA port] [-w web port] [unit address]
+//
+//  The exit status is 1 if a client couldn't connect or was closed, saw a bad checksum or
+//  had a request fail. The unit takes 4 NMEA clients unless set otherwise ("set clients").
+//
+
+#include "tests/LoadGenerator.h"
+#include <getopt.h>
+
+int main(int argc, char **argv)
+{
+  LoadOptions options;
+  LoadReport report;
+  int option;
+
+  while ((option = getopt(argc, argv, "c:p:s:t:i:n:w:")) != -1) {
+    switch (option) {
+      case 'c': options.consumers = atoi(optarg); break;
+      case 'p': options.pollers = atoi(optarg); break;
+      case 's': options.slowReaders = atoi(optarg); break;
+      case 't': options.seconds = atof(optarg); break;
+      case 'i': options.pollIntervalMs = atoi(optarg); break;
+      case 'n': options.nmeaPort = atoi(optarg); break;
+      case 'w': options.httpPort = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-c consumers] [-p pollers] [-s slow readers] [-t seconds] [-i poll interval ms]\n"
+                        "       [-n NMEA port] [-w web port] [unit address]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (optind < argc) options.host = argv[optind];
+
+  printf("%d consumers, %d pollers and %d slow readers on %s for %.0fs\n", options.consumers, options.pollers,
+         options.slowReaders, options.host, options.seconds);
+  runLoad(options, report);
+  printLoadReport(stdout, options, report);
+
+  bool ok = true;
+  for (auto &c : report.consumers) ok &= c.connected && !c.closed && c.badChecksums == 0;
+  for (auto &p : report.pollers) ok &= p.failures == 0;
+  for (auto &s : report.slowReaders) ok &= s.connected && s.badChecksums == 0;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+//
+//  main.cpp
+//
+//  The firmware as a host program. Listens where the unit would (moved up by
+//  ECOMPASS_PORT_OFFSET), keeps its settings and files under ECOMPASS_STORAGE, and talks to
+//  the console on stdin and stdout.
+//
+
+#include "Firmware.h"
+
+int main()
+{
+  firmwareBegin();
+  for (;;) loop();
+}
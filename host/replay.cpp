@@ -0,0 +1,98 @@
+//
+//  replay.cpp
+//
+//  Replays a recording (record.bin, downloaded from /public on the unit) through this
+//  firmware's compass card correction, filter and NMEA encoding, as fast as the host goes -
+//  see Recorder.h. The output is the unit's replay.csv.
+//
+//    ecompass-replay record.bin [replay.csv [baseline.csv]]
+//
+//  The compass cards come from ECOMPASS_STORAGE, so point it at a copy of the unit's
+//  settings to get the unit's corrections. Given the replay.csv from another firmware
+//  version (or the unit's own), the output is compared with it line by line and the
+//  exit status is 1 if they differ.
+//
+
+#include "Firmware.h"
+#include <fstream>
+
+#define REPLAY_DIFFS_SHOWN 10
+
+//Into the host's SPIFFS, where the replay looks for it
+static bool importRecording(const char *from)
+{
+  std::ifstream in(from, std::ios::binary);
+  std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  File out = SPIFFS.open(RECORD_FILE, FILE_WRITE);
+  return in.is_open() && out && out.write((const uint8_t *)contents.data(), contents.size()) == contents.size();
+}
+
+static bool copyFile(const std::string &from, const std::string &to)
+{
+  std::ifstream in(from, std::ios::binary);
+  std::ofstream out(to, std::ios::binary);
+  out << in.rdbuf();
+  return in.is_open() && out.good();
+}
+
+//Line by line, from the first line after the header
+static int compareOutput(const char *path, const char *baselinePath)
+{
+  std::ifstream output(path), baseline(baselinePath);
+  std::string a, b;
+  int line = 0, differences = 0;
+
+  if (!baseline) {
+    fprintf(stderr, "Can't read %s\n", baselinePath);
+    return -1;
+  }
+  for (;;) {
+    bool haveA = (bool)std::getline(output, a), haveB = (bool)std::getline(baseline, b);
+    if (!haveA && !haveB) break;
+    line++;
+    if (haveA && haveB && a == b) continue;
+    if (differences++ < REPLAY_DIFFS_SHOWN)
+      printf("%d\n< %s\n> %s\n", line, haveA ? a.c_str() : "(end)", haveB ? b.c_str() : "(end)");
+  }
+  return differences;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc > 4) {
+    fprintf(stderr, "Usage: %s record.bin [replay.csv [baseline.csv]]\n", argv[0]);
+    return 2;
+  }
+
+  //What setup() does for the correction, and no more - no sensors, tasks or servers
+  SPIFFS.begin(true);
+  settings.begin("compass", false);
+  beginConfiguration();
+  loadCompassCards();
+  if (!importRecording(argv[1])) {
+    fprintf(stderr, "Can't read %s\n", argv[1]);
+    return 2;
+  }
+
+  if (!replayStart(0)) {
+    fprintf(stderr, "Replay didn't start\n");
+    return 2;
+  }
+  while (replayTask != NULL) delay(10);   //done, and finished printing
+  replayStatus(Serial);
+
+  std::string output = hostStoragePath("spiffs") + REPLAY_FILE;
+  if (argc >= 3 && !copyFile(output, argv[2])) {
+    fprintf(stderr, "Can't write %s\n", argv[2]);
+    return 2;
+  }
+  if (argc == 4) {
+    int differences = compareOutput(output.c_str(), argv[3]);
+    if (differences < 0) return 2;
+    printf("%d lines differ from %s\n", differences, argv[3]);
+    fflush(stdout);
+    _exit(differences == 0 ? 0 : 1);
+  }
+  fflush(stdout);
+  _exit(replayResult.badBlocks == 0 ? 0 : 1);
+}
@@ -0,0 +1,529 @@
+//
+//  Arduino.cpp
+//
+//  The Arduino core and the bits of ESP-IDF under it, for the host build - time, pins,
+//  Print, the UARTs and the ESP object. See host/include/Arduino.h.
+//
+
+#include <Arduino.h>
+#include <esp_ipc.h>
+#include <malloc.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+
+//Everything counts from when the program started, as it does from boot on the chip
+static uint64_t monotonicNs()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static uint64_t startNs = monotonicNs();
+static size_t heapBase;       //what the C++ runtime had allocated before the firmware started
+static size_t heapMinFree = HOST_HEAP_BYTES;
+
+//The rest of the start up - runs before any of the firmware's constructors that might want it
+__attribute__((constructor(101))) static void hostStart()
+{
+  startNs = monotonicNs();
+  heapBase = mallinfo2().uordblks;
+  //A send() to a client that has gone is an error, as on lwIP, not the end of the program
+  signal(SIGPIPE, SIG_IGN);
+}
+
+int64_t esp_timer_get_time()
+{
+  return (monotonicNs() - startNs) / 1000;
+}
+
+unsigned long millis()
+{
+  return (monotonicNs() - startNs) / 1000000;
+}
+
+unsigned long micros()
+{
+  return (monotonicNs() - startNs) / 1000;
+}
+
+void delay(uint32_t ms)
+{
+  vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  struct timespec t = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+  nanosleep(&t, NULL);
+}
+
+void yield()
+{
+  sched_yield();
+}
+
+//
+// Pins. Only what was last written is remembered - an open drain pin reads high unless
+// driven low, as with the pull ups on the I2C lines
+//
+
+static uint8_t pinModes[40], pinLevels[40];
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if (pin >= sizeof(pinModes)) return;
+  pinModes[pin] = mode;
+  if (mode == INPUT_PULLUP || mode == OUTPUT_OPEN_DRAIN) pinLevels[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if (pin < sizeof(pinLevels)) pinLevels[pin] = value ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin)
+{
+  return pin < sizeof(pinLevels) ? pinLevels[pin] : LOW;
+}
+
+//Nothing ever presses the button
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode) {}
+void detachInterrupt(uint8_t pin) {}
+
+//
+// random() - xorshift, shared by all the tasks
+//
+
+static uint64_t randomState = 0x9E3779B97F4A7C15ULL;
+static pthread_mutex_t randomLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t randomNext()
+{
+  pthread_mutex_lock(&randomLock);
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 7;
+  randomState ^= randomState << 17;
+  uint32_t value = randomState >> 32;
+  pthread_mutex_unlock(&randomLock);
+  return value;
+}
+
+void randomSeed(unsigned long seed)
+{
+  pthread_mutex_lock(&randomLock);
+  randomState = seed != 0 ? seed : 0x9E3779B97F4A7C15ULL;
+  pthread_mutex_unlock(&randomLock);
+}
+
+long random(long howbig)
+{
+  return howbig <= 0 ? 0 : randomNext() % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+  return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+//
+// The CPU clock. It only sets how fast ESP.getCycleCount() counts
+//
+
+static uint32_t cpuMHz = 240;
+
+bool setCpuFrequencyMhz(uint32_t mhz)
+{
+  if (mhz != 240 && mhz != 160 && mhz != 80 && mhz != 40 && mhz != 20 && mhz != 10) return false;
+  cpuMHz = mhz;
+  return true;
+}
+
+uint32_t getCpuFrequencyMhz()
+{
+  return cpuMHz;
+}
+
+//
+// Print
+//
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (size-- > 0 && write(*buffer++)) n++;
+  return n;
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char buffer[256], *p = buffer;
+  va_list args;
+
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length < 0) return 0;
+  if ((size_t)length >= sizeof(buffer)) {
+    p = (char *)malloc(length + 1);
+    if (p == NULL) return 0;
+    va_start(args, format);
+    vsnprintf(p, length + 1, format, args);
+    va_end(args);
+  }
+  size_t n = write((const uint8_t *)p, length);
+  if (p != buffer) free(p);
+  return n;
+}
+
+size_t Print::print(const String &s)
+{
+  return write(s.c_str(), s.length());
+}
+
+size_t Print::print(const Printable &p)
+{
+  return p.printTo(*this);
+}
+
+size_t Print::printNumber(unsigned long long n, int base)
+{
+  char buffer[8 * sizeof(n) + 1], *p = &buffer[sizeof(buffer) - 1];
+
+  if (base < 2) base = 10;
+  *p = '\0';
+  do {
+    int digit = n % base;
+    n /= base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+  } while (n != 0);
+  return write(p);
+}
+
+size_t Print::printSigned(long long n, int base)
+{
+  //Only base 10 is signed, as in the Arduino core
+  if (base == 10 && n < 0) return print('-') + printNumber(-(unsigned long long)n, 10);
+  return printNumber((unsigned long long)n, base);
+}
+
+size_t Print::printFloat(double number, int digits)
+{
+  size_t n = 0;
+
+  if (isnan(number)) return print("nan");
+  if (isinf(number)) return print("inf");
+  if (number > 4294967040.0 || number < -4294967040.0) return print("ovf");
+  if (number < 0.0) {
+    n += print('-');
+    number = -number;
+  }
+
+  double rounding = 0.5;
+  for (int i = 0; i < digits; i++) rounding /= 10.0;
+  number += rounding;
+
+  unsigned long whole = (unsigned long)number;
+  double remainder = number - (double)whole;
+  n += printNumber(whole, 10);
+  if (digits > 0) n += print('.');
+  while (digits-- > 0) {
+    remainder *= 10.0;
+    unsigned digit = (unsigned)remainder;
+    n += print((char)('0' + digit));
+    remainder -= digit;
+  }
+  return n;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+  size_t count = 0;
+  unsigned long start = millis();
+
+  while (count < length) {
+    int c = read();
+    if (c < 0) {
+      if (millis() - start >= _timeout) break;
+      delay(1);
+      continue;
+    }
+    buffer[count++] = (char)c;
+  }
+  return count;
+}
+
+String IPAddress::toString() const
+{
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+  return String(buffer);
+}
+
+size_t IPAddress::printTo(Print &p) const
+{
+  return p.print(toString());
+}
+
+//
+// UARTs
+//
+
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+HardwareSerial Serial2(2);
+
+static bool stdinOpen = true;
+static std::string stdinBuffer;
+
+HardwareSerial::HardwareSerial(int uart) : _uart(uart)
+{
+  if (uart == 0) _fd = STDOUT_FILENO;
+}
+
+void HardwareSerial::begin(unsigned long baud, uint32_t config, int8_t rxPin, int8_t txPin)
+{
+  char name[32];
+
+  pthread_mutex_lock(&_lock);
+  _baud = baud;
+  _queued = 0;
+  if (_uart != 0 && _fd < 0) {
+    snprintf(name, sizeof(name), "ECOMPASS_UART%d", _uart);
+    const char *path = getenv(name);
+    if (path != NULL) _fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void HardwareSerial::end()
+{
+  flush();
+}
+
+void HardwareSerial::updateBaudRate(unsigned long baud)
+{
+  pthread_mutex_lock(&_lock);
+  drain();
+  _baud = baud;
+  pthread_mutex_unlock(&_lock);
+}
+
+size_t HardwareSerial::setTxBufferSize(size_t size)
+{
+  _txBufferSize = max(size, (size_t)128);   //the hardware FIFO, at least
+  return _txBufferSize;
+}
+
+size_t HardwareSerial::setRxBufferSize(size_t size)
+{
+  return size;
+}
+
+//Take out of the ring what the line has sent since last time - ten bits a character
+void HardwareSerial::drain()
+{
+  uint64_t now = micros();
+  if (_queued == 0) {
+    _drainedUs = now;
+    return;
+  }
+  uint64_t sent = (now - _drainedUs) * _baud / 10000000;
+  if (sent == 0) return;
+  _queued -= min((uint64_t)_queued, sent);
+  _drainedUs = _queued == 0 ? now : _drainedUs + sent * 10000000 / _baud;
+}
+
+//Waits for room in the ring, as the ESP32 driver does, and like it keeps other writers out
+//until the whole buffer has gone in
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  size_t written = 0;
+
+  pthread_mutex_lock(&_writeLock);
+  pthread_mutex_lock(&_lock);
+  while (written < size) {
+    drain();
+    size_t room = _txBufferSize - _queued;
+    if (room == 0) {
+      pthread_mutex_unlock(&_lock);
+      delayMicroseconds(10000000 / _baud + 1);
+      pthread_mutex_lock(&_lock);
+      continue;
+    }
+    size_t n = min(room, size - written);
+    if (_fd >= 0 && ::write(_fd, buffer + written, n) < 0) _fd = -1;
+    _queued += n;
+    _written += n;
+    written += n;
+  }
+  pthread_mutex_unlock(&_lock);
+  pthread_mutex_unlock(&_writeLock);
+  return written;
+}
+
+int HardwareSerial::availableForWrite()
+{
+  pthread_mutex_lock(&_lock);
+  drain();
+  int room = _txBufferSize - _queued;
+  pthread_mutex_unlock(&_lock);
+  return room;
+}
+
+void HardwareSerial::flush()
+{
+  for (;;) {
+    pthread_mutex_lock(&_lock);
+    drain();
+    size_t queued = _queued;
+    pthread_mutex_unlock(&_lock);
+    if (queued == 0) return;
+    delay(1);
+  }
+}
+
+//Only UART 0 has anything coming in - stdin, without ever waiting for it
+int HardwareSerial::available()
+{
+  if (_uart != 0) return 0;
+  pthread_mutex_lock(&_lock);
+  struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+  while (stdinOpen && poll(&p, 1, 0) > 0) {
+    char buffer[256];
+    ssize_t n = ::read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (n <= 0) stdinOpen = false;
+    else stdinBuffer.append(buffer, n);
+  }
+  int n = stdinBuffer.size();
+  pthread_mutex_unlock(&_lock);
+  return n;
+}
+
+int HardwareSerial::read()
+{
+  if (available() == 0) return -1;
+  pthread_mutex_lock(&_lock);
+  int c = (uint8_t)stdinBuffer[0];
+  stdinBuffer.erase(0, 1);
+  pthread_mutex_unlock(&_lock);
+  return c;
+}
+
+int HardwareSerial::peek()
+{
+  return available() == 0 ? -1 : (uint8_t)stdinBuffer[0];
+}
+
+//
+// ESP
+//
+
+EspClass ESP;
+
+//Starts the program again, as a reboot would
+void EspClass::restart()
+{
+  char arguments[4096], *argv[64];
+  int fd = open("/proc/self/cmdline", O_RDONLY), argc = 0;
+  ssize_t length = fd >= 0 ? ::read(fd, arguments, sizeof(arguments) - 1) : -1;
+
+  Serial.flush();
+  if (length > 0) {
+    arguments[length] = '\0';
+    for (char *p = arguments; p < arguments + length && argc < 63; p += strlen(p) + 1) argv[argc++] = p;
+    argv[argc] = NULL;
+    execv("/proc/self/exe", argv);
+  }
+  exit(0);
+}
+
+uint32_t EspClass::getCycleCount()
+{
+  return (uint32_t)((monotonicNs() - startNs) * cpuMHz / 1000);
+}
+
+uint32_t EspClass::getHeapSize()
+{
+  return HOST_HEAP_BYTES;
+}
+
+uint32_t EspClass::getFreeHeap()
+{
+  return heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+}
+
+uint32_t EspClass::getMinFreeHeap()
+{
+  return heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+}
+
+uint32_t EspClass::getMaxAllocHeap()
+{
+  return heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+}
+
+//The code and initialised data, as in a flash image (the file has debug information too),
+//and what would be left of the default 1.25MB app partition
+extern "C" char __executable_start, _edata;
+
+uint32_t EspClass::getSketchSize()
+{
+  return &_edata - &__executable_start;
+}
+
+uint32_t EspClass::getFreeSketchSpace()
+{
+  uint32_t partition = 0x140000, size = getSketchSize();
+  return size < partition ? partition - size : 0;
+}
+
+//
+// Heap - what the firmware has allocated since it started, out of HOST_HEAP_BYTES
+//
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+  size_t used = mallinfo2().uordblks, allocated = used > heapBase ? used - heapBase : 0;
+  size_t left = allocated < HOST_HEAP_BYTES ? HOST_HEAP_BYTES - allocated : 0;
+  if (left < heapMinFree) heapMinFree = left;
+  return left;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+  heap_caps_get_free_size(caps);
+  return heapMinFree;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+  return heap_caps_get_free_size(caps);
+}
+
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps)
+{
+  memset(info, 0, sizeof(*info));
+  info->total_free_bytes = heap_caps_get_free_size(caps);
+  info->total_allocated_bytes = HOST_HEAP_BYTES - info->total_free_bytes;
+  info->largest_free_block = info->total_free_bytes;
+  info->minimum_free_bytes = heapMinFree;
+}
+
+extern "C" int ets_printf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int n = vfprintf(stderr, format, args);
+  va_end(args);
+  return n;
+}
+
+esp_err_t esp_ipc_call_blocking(uint32_t cpu, esp_ipc_func_t function, void *arg)
+{
+  if (cpu >= portNUM_PROCESSORS) return ESP_ERR_INVALID_ARG;
+  function(arg);
+  return ESP_OK;
+}
@@ -0,0 +1,607 @@
+//
+//  FreeRTOS.cpp
+//
+//  FreeRTOS on POSIX threads for the host build - see host/include/freertos/FreeRTOS.h.
+//
+//  Every kernel object has a mutex and a condition variable on the monotonic clock, and
+//  a blocking call is a wait on the condition with the timeout worked out from the ticks.
+//  A task's stack is allocated here and painted, as FreeRTOS does, so the high water mark
+//  is how much of it the task has really used - on the host.
+//
+
+#include <Arduino.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <vector>
+
+#define HOST_STACK_BYTES (512 * 1024)    //host code needs more stack than the Xtensa build
+#define STACK_PAINT 0xA5
+
+struct HostTask {
+  char name[configMAX_TASK_NAME_LEN];
+  TaskFunction_t function;
+  void *parameters;
+  UBaseType_t priority, number;
+  BaseType_t core;
+  uint32_t stackDepth;          //what the firmware asked for, in bytes
+  uint8_t *stack;               //NULL for the main thread and the idle tasks
+  pthread_t thread;
+  clockid_t cpuClock;
+  bool hasClock, idle, deleted;
+  uint32_t runTime;             //the last reading of the CPU clock, microseconds
+  //Notifications
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notifyValue;
+  bool notifyPending;
+};
+
+enum SemaphoreType { SEMAPHORE_MUTEX, SEMAPHORE_RECURSIVE, SEMAPHORE_COUNTING };
+
+struct HostSemaphore {
+  SemaphoreType type;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  UBaseType_t count, maxCount;
+  HostTask *holder;             //mutexes only
+  UBaseType_t recursion;
+};
+
+struct HostQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty, notFull;
+  UBaseType_t length, itemSize, head, count;
+  uint8_t *items;
+};
+
+static pthread_mutex_t tasksLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<HostTask *> tasks;
+static HostTask *idleTasks[portNUM_PROCESSORS];
+static UBaseType_t nextTaskNumber = 1;
+static thread_local HostTask *currentTask = NULL;
+static pthread_mutex_t schedulerLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/*
+ * Time
+ */
+
+static void initCondition(pthread_cond_t *cond)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static struct timespec deadline(TickType_t ticks)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  uint64_t ns = (uint64_t)pdTICKS_TO_MS(ticks) * 1000000 + t.tv_nsec;
+  t.tv_sec += ns / 1000000000;
+  t.tv_nsec = ns % 1000000000;
+  return t;
+}
+
+//Wait on a condition until woken or the ticks have gone. False on a timeout
+static bool waitFor(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, const struct timespec *until)
+{
+  if (ticks == 0) return false;
+  if (ticks == portMAX_DELAY) return pthread_cond_wait(cond, lock) == 0;
+  return pthread_cond_timedwait(cond, lock, until) == 0;
+}
+
+TickType_t xTaskGetTickCount()
+{
+  return (TickType_t)pdMS_TO_TICKS(millis());
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  if (ticks == 0) {
+    sched_yield();
+    return;
+  }
+  struct timespec t = { (time_t)(pdTICKS_TO_MS(ticks) / 1000), (long)(pdTICKS_TO_MS(ticks) % 1000) * 1000000 };
+  while (nanosleep(&t, &t) != 0 && errno == EINTR);
+}
+
+//As in FreeRTOS, the wake time always moves on a period, and there is no wait if it has
+//already gone by
+BaseType_t xTaskDelayUntil(TickType_t *previousWakeTime, TickType_t period)
+{
+  TickType_t now = xTaskGetTickCount();
+  TickType_t wakeTime = *previousWakeTime + period;
+  bool shouldDelay = (int32_t)(wakeTime - now) > 0;
+
+  *previousWakeTime = wakeTime;
+  if (shouldDelay) vTaskDelay(wakeTime - now);
+  return shouldDelay ? pdTRUE : pdFALSE;
+}
+
+/*
+ * Tasks
+ */
+
+static HostTask *newTask(const char *name, uint32_t stackDepth, UBaseType_t priority, BaseType_t core)
+{
+  HostTask *task = (HostTask *)calloc(1, sizeof(HostTask));
+  strncpy(task->name, name, sizeof(task->name) - 1);
+  task->stackDepth = stackDepth;
+  task->priority = priority;
+  task->core = core;
+  pthread_mutex_init(&task->lock, NULL);
+  initCondition(&task->cond);
+  pthread_mutex_lock(&tasksLock);
+  task->number = nextTaskNumber++;
+  tasks.push_back(task);
+  pthread_mutex_unlock(&tasksLock);
+  return task;
+}
+
+//The thread the program started on is a task too - loopTask, as in the Arduino core
+static HostTask *thisTask()
+{
+  if (currentTask == NULL) {
+    currentTask = newTask("loopTask", 8192, 1, 1);
+    currentTask->thread = pthread_self();
+    currentTask->hasClock = pthread_getcpuclockid(pthread_self(), &currentTask->cpuClock) == 0;
+  }
+  return currentTask;
+}
+
+static void *taskStart(void *arg)
+{
+  HostTask *task = (HostTask *)arg;
+
+  currentTask = task;
+  pthread_setname_np(pthread_self(), task->name);
+  task->function(task->parameters);
+  //FreeRTOS can't return from a task either
+  fprintf(stderr, "Task %s returned from its function\n", task->name);
+  abort();
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth,
+                                   void *parameters, UBaseType_t priority, TaskHandle_t *created, BaseType_t core)
+{
+  pthread_attr_t attr;
+  HostTask *task = newTask(name, stackDepth, priority, core);
+
+  task->function = function;
+  task->parameters = parameters;
+  task->stack = (uint8_t *)mmap(NULL, HOST_STACK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (task->stack == MAP_FAILED) return pdFAIL;
+  memset(task->stack, STACK_PAINT, HOST_STACK_BYTES);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, task->stack, HOST_STACK_BYTES);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  //Fill in the handle before the task runs - it may well look itself up
+  if (created != NULL) *created = task;
+  int error = pthread_create(&task->thread, &attr, taskStart, task);
+  pthread_attr_destroy(&attr);
+  if (error != 0) {
+    if (created != NULL) *created = NULL;
+    task->deleted = true;
+    return pdFAIL;
+  }
+  task->hasClock = pthread_getcpuclockid(task->thread, &task->cpuClock) == 0;
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stackDepth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *created)
+{
+  return xTaskCreatePinnedToCore(function, name, stackDepth, parameters, priority, created, tskNO_AFFINITY);
+}
+
+//Another task can only be cancelled where it waits, so it goes at its next wait
+void vTaskDelete(TaskHandle_t task)
+{
+  HostTask *self = thisTask();
+  if (task == NULL) task = self;
+  pthread_mutex_lock(&tasksLock);
+  task->deleted = true;
+  task->hasClock = false;
+  pthread_mutex_unlock(&tasksLock);
+  if (task == self) pthread_exit(NULL);
+  pthread_cancel(task->thread);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  return thisTask();
+}
+
+const char *pcTaskGetName(TaskHandle_t task)
+{
+  return (task != NULL ? task : thisTask())->name;
+}
+
+BaseType_t xPortGetCoreID()
+{
+  BaseType_t core = thisTask()->core;
+  return core >= 0 && core < portNUM_PROCESSORS ? core : 0;
+}
+
+//Stand ins for the idle tasks, so the per core idle time can be reported
+TaskHandle_t xTaskGetIdleTaskHandleForCPU(UBaseType_t cpu)
+{
+  if (cpu >= portNUM_PROCESSORS) return NULL;
+  pthread_mutex_lock(&tasksLock);
+  if (idleTasks[cpu] == NULL) {
+    pthread_mutex_unlock(&tasksLock);
+    char name[8];
+    snprintf(name, sizeof(name), "IDLE%u", cpu);
+    HostTask *idle = newTask(name, 1536, 0, cpu);
+    idle->idle = true;
+    pthread_mutex_lock(&tasksLock);
+    if (idleTasks[cpu] == NULL) idleTasks[cpu] = idle;
+  }
+  HostTask *idle = idleTasks[cpu];
+  pthread_mutex_unlock(&tasksLock);
+  return idle;
+}
+
+//The untouched part of the stack, less what the host needs over what the firmware asked for
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+  if (task == NULL) task = thisTask();
+  if (task->stack == NULL) return task->stackDepth;
+  size_t untouched = 0;
+  while (untouched < HOST_STACK_BYTES && task->stack[untouched] == STACK_PAINT) untouched++;
+  size_t used = HOST_STACK_BYTES - untouched;
+  return used < task->stackDepth ? task->stackDepth - used : 0;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks()
+{
+  UBaseType_t count = 0;
+  pthread_mutex_lock(&tasksLock);
+  for (HostTask *task : tasks) count += !task->deleted;
+  pthread_mutex_unlock(&tasksLock);
+  return count;
+}
+
+//Run times are the threads' CPU time. The idle tasks get what is left of their core
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *status, UBaseType_t size, uint32_t *totalRunTime)
+{
+  uint64_t elapsed = esp_timer_get_time();
+  uint64_t busy[portNUM_PROCESSORS] = { 0 };
+  UBaseType_t count = 0;
+
+  xTaskGetIdleTaskHandleForCPU(0);
+  xTaskGetIdleTaskHandleForCPU(1);
+  pthread_mutex_lock(&tasksLock);
+  for (HostTask *task : tasks) {
+    struct timespec t;
+    if (task->hasClock && clock_gettime(task->cpuClock, &t) == 0)
+      task->runTime = (uint32_t)((uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000);
+    if (!task->deleted && !task->idle && task->core >= 0 && task->core < portNUM_PROCESSORS)
+      busy[task->core] += task->runTime;
+  }
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+    idleTasks[core]->runTime = (uint32_t)(busy[core] < elapsed ? elapsed - busy[core] : 0);
+  for (HostTask *task : tasks) {
+    if (task->deleted || count == size) continue;
+    TaskStatus_t *s = &status[count++];
+    s->xHandle = task;
+    s->pcTaskName = task->name;
+    s->xTaskNumber = task->number;
+    s->eCurrentState = task == currentTask ? eRunning : eBlocked;
+    s->uxCurrentPriority = s->uxBasePriority = task->priority;
+    s->ulRunTimeCounter = task->runTime;
+    s->pxStackBase = task->stack;
+    s->xCoreID = task->core;
+    s->usStackHighWaterMark = 0;
+  }
+  pthread_mutex_unlock(&tasksLock);
+  for (UBaseType_t i = 0; i < count; i++) status[i].usStackHighWaterMark = uxTaskGetStackHighWaterMark(status[i].xHandle);
+  if (totalRunTime != NULL) *totalRunTime = (uint32_t)elapsed;
+  return count;
+}
+
+void vTaskSuspendAll()
+{
+  pthread_mutex_lock(&schedulerLock);
+}
+
+BaseType_t xTaskResumeAll()
+{
+  pthread_mutex_unlock(&schedulerLock);
+  return pdFALSE;
+}
+
+/*
+ * Notifications
+ */
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+  BaseType_t result = pdPASS;
+
+  pthread_mutex_lock(&task->lock);
+  switch (action) {
+    case eNoAction: break;
+    case eSetBits: task->notifyValue |= value; break;
+    case eIncrement: task->notifyValue++; break;
+    case eSetValueWithOverwrite: task->notifyValue = value; break;
+    case eSetValueWithoutOverwrite:
+      if (task->notifyPending) result = pdFAIL;
+      else task->notifyValue = value;
+      break;
+  }
+  task->notifyPending = true;
+  pthread_cond_broadcast(&task->cond);
+  pthread_mutex_unlock(&task->lock);
+  return result;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t wait)
+{
+  HostTask *task = thisTask();
+  struct timespec until = deadline(wait);
+
+  pthread_mutex_lock(&task->lock);
+  while (task->notifyValue == 0 && waitFor(&task->cond, &task->lock, wait, &until));
+  uint32_t value = task->notifyValue;
+  if (value != 0) task->notifyValue = clearOnExit ? 0 : value - 1;
+  task->notifyPending = false;
+  pthread_mutex_unlock(&task->lock);
+  return value;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clearOnEntry, uint32_t clearOnExit, uint32_t *value, TickType_t wait)
+{
+  HostTask *task = thisTask();
+  struct timespec until = deadline(wait);
+
+  pthread_mutex_lock(&task->lock);
+  if (!task->notifyPending) task->notifyValue &= ~clearOnEntry;
+  while (!task->notifyPending && waitFor(&task->cond, &task->lock, wait, &until));
+  BaseType_t received = task->notifyPending ? pdTRUE : pdFALSE;
+  if (value != NULL) *value = task->notifyValue;
+  if (received) task->notifyValue &= ~clearOnExit;
+  task->notifyPending = false;
+  pthread_mutex_unlock(&task->lock);
+  return received;
+}
+
+/*
+ * Semaphores
+ */
+
+static SemaphoreHandle_t newSemaphore(SemaphoreType type, UBaseType_t maxCount, UBaseType_t count)
+{
+  HostSemaphore *s = (HostSemaphore *)calloc(1, sizeof(HostSemaphore));
+  s->type = type;
+  s->maxCount = maxCount;
+  s->count = count;
+  pthread_mutex_init(&s->lock, NULL);
+  initCondition(&s->cond);
+  return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  return newSemaphore(SEMAPHORE_MUTEX, 1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex()
+{
+  return newSemaphore(SEMAPHORE_RECURSIVE, 1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+  return newSemaphore(SEMAPHORE_COUNTING, 1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount)
+{
+  return newSemaphore(SEMAPHORE_COUNTING, maxCount, initialCount);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t s)
+{
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->cond);
+  free(s);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait)
+{
+  struct timespec until = deadline(wait);
+
+  pthread_mutex_lock(&s->lock);
+  while (s->count == 0 && waitFor(&s->cond, &s->lock, wait, &until));
+  bool taken = s->count > 0;
+  if (taken) {
+    s->count--;
+    if (s->type != SEMAPHORE_COUNTING) {
+      s->holder = thisTask();
+      s->recursion = 1;
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return taken ? pdTRUE : pdFALSE;
+}
+
+//A mutex can only be given back by the task holding it
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+  BaseType_t result = pdTRUE;
+
+  pthread_mutex_lock(&s->lock);
+  if (s->type != SEMAPHORE_COUNTING && s->holder != thisTask()) result = pdFALSE;
+  else if (s->count == s->maxCount) result = pdFALSE;
+  else {
+    s->count++;
+    s->holder = NULL;
+    s->recursion = 0;
+    pthread_cond_signal(&s->cond);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return result;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t s, TickType_t wait)
+{
+  HostTask *self = thisTask();
+
+  pthread_mutex_lock(&s->lock);
+  if (s->count == 0 && s->holder == self) {
+    s->recursion++;
+    pthread_mutex_unlock(&s->lock);
+    return pdTRUE;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return xSemaphoreTake(s, wait);
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t s)
+{
+  pthread_mutex_lock(&s->lock);
+  if (s->holder != thisTask() || s->recursion == 0) {
+    pthread_mutex_unlock(&s->lock);
+    return pdFALSE;
+  }
+  if (--s->recursion == 0) {
+    s->holder = NULL;
+    s->count = 1;
+    pthread_cond_signal(&s->cond);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return pdTRUE;
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t s)
+{
+  pthread_mutex_lock(&s->lock);
+  UBaseType_t count = s->count;
+  pthread_mutex_unlock(&s->lock);
+  return count;
+}
+
+/*
+ * Queues
+ */
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+  HostQueue *q = (HostQueue *)calloc(1, sizeof(HostQueue));
+  q->length = length;
+  q->itemSize = itemSize;
+  q->items = (uint8_t *)calloc(length, itemSize);
+  pthread_mutex_init(&q->lock, NULL);
+  initCondition(&q->notEmpty);
+  initCondition(&q->notFull);
+  return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->notEmpty);
+  pthread_cond_destroy(&q->notFull);
+  free(q->items);
+  free(q);
+}
+
+static BaseType_t queueSend(QueueHandle_t q, const void *item, TickType_t wait, bool front)
+{
+  struct timespec until = deadline(wait);
+
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->length && waitFor(&q->notFull, &q->lock, wait, &until));
+  if (q->count == q->length) {
+    pthread_mutex_unlock(&q->lock);
+    return errQUEUE_FULL;
+  }
+  UBaseType_t slot;
+  if (front) slot = q->head = (q->head + q->length - 1) % q->length;
+  else slot = (q->head + q->count) % q->length;
+  memcpy(q->items + slot * q->itemSize, item, q->itemSize);
+  q->count++;
+  pthread_cond_signal(&q->notEmpty);
+  pthread_mutex_unlock(&q->lock);
+  return pdPASS;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait)
+{
+  return queueSend(q, item, wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t wait)
+{
+  return queueSend(q, item, wait, true);
+}
+
+//For queues of one item
+BaseType_t xQueueOverwrite(QueueHandle_t q, const void *item)
+{
+  pthread_mutex_lock(&q->lock);
+  memcpy(q->items + q->head * q->itemSize, item, q->itemSize);
+  q->count = 1;
+  pthread_cond_signal(&q->notEmpty);
+  pthread_mutex_unlock(&q->lock);
+  return pdPASS;
+}
+
+static BaseType_t queueReceive(QueueHandle_t q, void *item, TickType_t wait, bool remove)
+{
+  struct timespec until = deadline(wait);
+
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && waitFor(&q->notEmpty, &q->lock, wait, &until));
+  if (q->count == 0) {
+    pthread_mutex_unlock(&q->lock);
+    return errQUEUE_EMPTY;
+  }
+  memcpy(item, q->items + q->head * q->itemSize, q->itemSize);
+  if (remove) {
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    pthread_cond_signal(&q->notFull);
+  } else pthread_cond_signal(&q->notEmpty);   //let the next reader see it too
+  pthread_mutex_unlock(&q->lock);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait)
+{
+  return queueReceive(q, item, wait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t wait)
+{
+  return queueReceive(q, item, wait, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+  pthread_mutex_lock(&q->lock);
+  UBaseType_t count = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q)
+{
+  pthread_mutex_lock(&q->lock);
+  UBaseType_t spaces = q->length - q->count;
+  pthread_mutex_unlock(&q->lock);
+  return spaces;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+  pthread_mutex_lock(&q->lock);
+  q->head = q->count = 0;
+  pthread_cond_broadcast(&q->notFull);
+  pthread_mutex_unlock(&q->lock);
+  return pdPASS;
+}
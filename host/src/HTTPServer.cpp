@@ -0,0 +1,355 @@
+//
+//  HTTPServer.cpp
+//
+//  The web server for the host build - see host/include/HTTPS_Server_Generic.h.
+//
+
+#include <HTTPS_Server_Generic.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/time.h>
+
+#define HTTP_HEADER_LIMIT 8192
+#define HTTP_TIMEOUT_S 2
+
+namespace httpsserver {
+
+std::string intToString(int value)
+{
+  return std::to_string(value);
+}
+
+static int hexDigit(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static std::string urlDecode(const std::string &s)
+{
+  std::string decoded;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '+') decoded += ' ';
+    else if (s[i] == '%' && i + 2 < s.size() && hexDigit(s[i + 1]) >= 0 && hexDigit(s[i + 2]) >= 0) {
+      decoded += (char)(hexDigit(s[i + 1]) * 16 + hexDigit(s[i + 2]));
+      i += 2;
+    } else decoded += s[i];
+  }
+  return decoded;
+}
+
+//name=value pairs separated by &
+static void parsePairs(const std::string &s, std::vector<std::pair<std::string, std::string> > &pairs)
+{
+  size_t start = 0;
+  while (start < s.size()) {
+    size_t end = s.find('&', start);
+    if (end == std::string::npos) end = s.size();
+    std::string pair = s.substr(start, end - start);
+    size_t equals = pair.find('=');
+    if (!pair.empty()) {
+      if (equals == std::string::npos) pairs.push_back(std::make_pair(urlDecode(pair), std::string()));
+      else pairs.push_back(std::make_pair(urlDecode(pair.substr(0, equals)), urlDecode(pair.substr(equals + 1))));
+    }
+    start = end + 1;
+  }
+}
+
+bool ResourceParameters::isQueryParameterSet(const std::string &name)
+{
+  for (auto &p : _query) if (p.first == name) return true;
+  return false;
+}
+
+bool ResourceParameters::getQueryParameter(const std::string &name, std::string &value)
+{
+  for (auto &p : _query) {
+    if (p.first == name) {
+      value = p.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string HTTPRequest::getHeader(const std::string &name)
+{
+  for (auto &h : _headers) if (strcasecmp(h.first.c_str(), name.c_str()) == 0) return h.second;
+  return "";
+}
+
+size_t HTTPRequest::readChars(char *buffer, size_t length)
+{
+  size_t n = min(length, _body.size() - _bodyRead);
+  memcpy(buffer, _body.data() + _bodyRead, n);
+  _bodyRead += n;
+  return n;
+}
+
+void HTTPResponse::setHeader(const std::string &name, const std::string &value)
+{
+  for (auto &h : _headers) {
+    if (strcasecmp(h.first.c_str(), name.c_str()) == 0) {
+      h.second = value;
+      return;
+    }
+  }
+  _headers.push_back(std::make_pair(name, value));
+}
+
+/*
+ * The server
+ */
+
+void HTTPServer::unregisterNode(HTTPNode *node)
+{
+  for (auto i = _nodes.begin(); i != _nodes.end(); i++) {
+    if (*i == node) {
+      _nodes.erase(i);
+      return;
+    }
+  }
+}
+
+void HTTPServer::setDefaultHeader(const std::string &name, const std::string &value)
+{
+  _defaultHeaders.push_back(std::make_pair(name, value));
+}
+
+uint8_t HTTPServer::start()
+{
+  struct sockaddr_in address = {};
+  int enable = 1;
+
+  if (_fd >= 0) return 1;
+  _fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_fd < 0) return 0;
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(_port);
+  address.sin_addr.s_addr = INADDR_ANY;
+  if (bind(_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(_fd, 4) < 0) {
+    stop();
+    return 0;
+  }
+  fcntl(_fd, F_SETFL, O_NONBLOCK);
+  return 1;
+}
+
+void HTTPServer::stop()
+{
+  if (_fd >= 0) close(_fd);
+  _fd = -1;
+}
+
+void HTTPServer::loop()
+{
+  int fd;
+  while (_fd >= 0 && (fd = accept(_fd, NULL, NULL)) >= 0) {
+    serve(fd);
+    close(fd);
+  }
+}
+
+ResourceNode *HTTPServer::findNode(const std::string &method, const std::string &path)
+{
+  for (HTTPNode *node : _nodes) {
+    if (node->_nodeType != HANDLER_CALLBACK) continue;
+    ResourceNode *resource = (ResourceNode *)node;
+    if (resource->_method != method) continue;
+    const std::string &p = node->_path;
+    if (p == path) return resource;
+    if (p.size() >= 2 && p.compare(p.size() - 2, 2, "/*") == 0 && path.compare(0, p.size() - 1, p, 0, p.size() - 1) == 0)
+      return resource;
+  }
+  return _defaultNode != NULL && _defaultNode->_nodeType == HANDLER_CALLBACK ? (ResourceNode *)_defaultNode : NULL;
+}
+
+static bool sendAll(int fd, const std::string &data)
+{
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0 && errno != EINTR) return false;
+    if (n > 0) sent += n;
+  }
+  return true;
+}
+
+//One request, one response, and the connection is closed
+void HTTPServer::serve(int fd)
+{
+  struct timeval timeout = { HTTP_TIMEOUT_S, 0 };
+  std::string received;
+  char buffer[2048];
+  size_t headerEnd;
+  HTTPRequest request;
+  HTTPResponse response;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  while ((headerEnd = received.find("\r\n\r\n")) == std::string::npos) {
+    if (received.size() > HTTP_HEADER_LIMIT) return;
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) return;
+    received.append(buffer, n);
+  }
+
+  //The request line and the headers
+  size_t lineEnd = received.find("\r\n");
+  std::string requestLine = received.substr(0, lineEnd);
+  size_t space1 = requestLine.find(' '), space2 = requestLine.rfind(' ');
+  if (space1 == std::string::npos || space2 <= space1) return;
+  request._method = requestLine.substr(0, space1);
+  std::string target = requestLine.substr(space1 + 1, space2 - space1 - 1);
+  for (size_t start = lineEnd + 2; start < headerEnd;) {
+    size_t end = received.find("\r\n", start);
+    std::string line = received.substr(start, end - start);
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) {
+      size_t value = line.find_first_not_of(' ', colon + 1);
+      request._headers.push_back(std::make_pair(line.substr(0, colon), value == std::string::npos ? "" : line.substr(value)));
+    }
+    start = end + 2;
+  }
+
+  //The body
+  size_t contentLength = strtoul(request.getHeader("Content-Length").c_str(), NULL, 10);
+  request._body = received.substr(headerEnd + 4);
+  while (request._body.size() < contentLength) {
+    ssize_t n = recv(fd, buffer, min(sizeof(buffer), contentLength - request._body.size()), 0);
+    if (n <= 0) return;
+    request._body.append(buffer, n);
+  }
+  request._body.resize(contentLength);
+
+  //The path and query
+  size_t question = target.find('?');
+  std::string path = urlDecode(target.substr(0, question));
+  if (question != std::string::npos) parsePairs(target.substr(question + 1), request._params._query);
+  request._requestString = path;
+
+  for (auto &h : _defaultHeaders) response.setHeader(h.first, h.second);
+  ResourceNode *node = findNode(request._method, path);
+  if (node != NULL) node->_callback(&request, &response);
+  else {
+    response.setStatusCode(404);
+    response.setStatusText("Not Found");
+    response.print("Not Found");
+  }
+  _requests++;
+
+  std::string reply = "HTTP/1.1 " + std::to_string(response._statusCode) + " " + response._statusText + "\r\n";
+  response.setHeader("Content-Length", std::to_string(response._body.size()));
+  response.setHeader("Connection", "close");
+  for (auto &h : response._headers) reply += h.first + ": " + h.second + "\r\n";
+  reply += "\r\n";
+  if (request._method != "HEAD") reply += response._body;
+  sendAll(fd, reply);
+}
+
+/*
+ * Body parsers
+ */
+
+std::string HTTPBodyParser::body()
+{
+  std::string all(_request->getContentLength(), '\0');
+  size_t n = _request->readChars(&all[0], all.size());
+  all.resize(n);
+  return all;
+}
+
+void HTTPBodyParser::setField(const std::string &name, const std::string &filename, const std::string &mimeType, const std::string &value)
+{
+  _name = name;
+  _filename = filename;
+  _mimeType = mimeType;
+  _field = value;
+  _fieldRead = 0;
+}
+
+size_t HTTPBodyParser::read(byte *buffer, size_t bufferSize)
+{
+  size_t n = min(bufferSize, _field.size() - _fieldRead);
+  memcpy(buffer, _field.data() + _fieldRead, n);
+  _fieldRead += n;
+  return n;
+}
+
+bool HTTPURLEncodedBodyParser::nextField()
+{
+  if (!_started) {
+    _body = body();
+    _started = true;
+  }
+  while (_position < _body.size()) {
+    size_t end = _body.find('&', _position);
+    if (end == std::string::npos) end = _body.size();
+    std::vector<std::pair<std::string, std::string> > pair;
+    parsePairs(_body.substr(_position, end - _position), pair);
+    _position = end + 1;
+    if (!pair.empty()) {
+      setField(pair[0].first, "", "text/plain", pair[0].second);
+      return true;
+    }
+  }
+  return false;
+}
+
+//The value of a parameter in a header, as in name="file" or boundary=xyz
+static std::string headerParameter(const std::string &header, const std::string &name)
+{
+  size_t at = header.find(name + "=");
+  while (at != std::string::npos && at > 0 && header[at - 1] != ' ' && header[at - 1] != ';') at = header.find(name + "=", at + 1);
+  if (at == std::string::npos) return "";
+  at += name.size() + 1;
+  if (at < header.size() && header[at] == '"') {
+    size_t end = header.find('"', at + 1);
+    return header.substr(at + 1, end == std::string::npos ? std::string::npos : end - at - 1);
+  }
+  size_t end = header.find(';', at);
+  return header.substr(at, end == std::string::npos ? std::string::npos : end - at);
+}
+
+bool HTTPMultipartBodyParser::nextField()
+{
+  if (!_started) {
+    _started = true;
+    _boundary = "--" + headerParameter(_request->getHeader("Content-Type"), "boundary");
+    _body = body();
+    _position = _body.find(_boundary);
+    if (_boundary.size() == 2 || _position == std::string::npos) _position = _body.size();
+  }
+  //At a boundary - the last one has "--" after it
+  _position += _boundary.size();
+  if (_position + 2 > _body.size() || _body.compare(_position, 2, "--") == 0) {
+    _position = _body.size();
+    return false;
+  }
+  size_t headersStart = _body.find("\r\n", _position);
+  size_t headersEnd = _body.find("\r\n\r\n", _position);
+  if (headersStart == std::string::npos || headersEnd == std::string::npos) {
+    _position = _body.size();
+    return false;
+  }
+  std::string disposition, mimeType = "text/plain";
+  for (size_t start = headersStart + 2; start < headersEnd;) {
+    size_t end = _body.find("\r\n", start);
+    std::string line = _body.substr(start, end - start);
+    if (strncasecmp(line.c_str(), "Content-Disposition:", 20) == 0) disposition = line;
+    else if (strncasecmp(line.c_str(), "Content-Type:", 13) == 0) mimeType = line.substr(line.find_first_not_of(' ', 13));
+    start = end + 2;
+  }
+  size_t valueStart = headersEnd + 4;
+  size_t valueEnd = _body.find("\r\n" + _boundary, valueStart);
+  if (valueEnd == std::string::npos) valueEnd = _body.size();
+  setField(headerParameter(disposition, "name"), headerParameter(disposition, "filename"), mimeType,
+           _body.substr(valueStart, valueEnd - valueStart));
+  _position = valueEnd + 2 < _body.size() ? valueEnd + 2 : _body.size();
+  return true;
+}
+
+}
@@ -0,0 +1,398 @@
+//
+//  Storage.cpp
+//
+//  NVS, the emulated EEPROM and SPIFFS for the host build, all kept in files under
+//  hostStoragePath() - see host/include/Preferences.h, EEPROM.h and SPIFFS.h.
+//
+
+#include <Preferences.h>
+#include <EEPROM.h>
+#include <SPIFFS.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <vector>
+
+EEPROMClass EEPROM;
+SPIFFSFS SPIFFS;
+
+static bool makeDirectories(const std::string &path)
+{
+  for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+    std::string part = path.substr(0, slash);
+    if (mkdir(part.c_str(), 0755) < 0 && errno != EEXIST) return false;
+    if (slash == std::string::npos) return true;
+  }
+}
+
+std::string hostStoragePath(const char *kind)
+{
+  const char *base = getenv("ECOMPASS_STORAGE");
+  std::string path = std::string(base != NULL && *base ? base : "ecompass-storage") + "/" + kind;
+  makeDirectories(path);
+  return path;
+}
+
+//The whole of a file, or false if there isn't one
+static bool readFile(const std::string &path, std::string &contents)
+{
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == NULL) return false;
+  char buffer[4096];
+  size_t n;
+  contents.clear();
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) contents.append(buffer, n);
+  fclose(f);
+  return true;
+}
+
+//Written to one side and renamed over the old file, so it is never half written
+static bool writeFile(const std::string &path, const void *data, size_t length)
+{
+  std::string temporary = path + ".tmp";
+  FILE *f = fopen(temporary.c_str(), "wb");
+  if (f == NULL) return false;
+  bool written = fwrite(data, 1, length, f) == length;
+  written = fflush(f) == 0 && written;
+  fclose(f);
+  return written && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+/*
+ * Preferences
+ */
+
+//NVS keys and namespaces are 15 characters at most
+bool Preferences::begin(const char *name, bool readOnly)
+{
+  if (_started || name == NULL || strlen(name) > 15) return false;
+  _namespace = hostStoragePath("nvs") + "/" + name;
+  if (!readOnly && !makeDirectories(_namespace)) return false;
+  _readOnly = readOnly;
+  _started = true;
+  return true;
+}
+
+void Preferences::end()
+{
+  _started = false;
+}
+
+std::string Preferences::path(const char *key)
+{
+  return _namespace + "/" + key;
+}
+
+bool Preferences::clear()
+{
+  if (!_started || _readOnly) return false;
+  DIR *d = opendir(_namespace.c_str());
+  if (d == NULL) return true;
+  for (struct dirent *e; (e = readdir(d)) != NULL;)
+    if (e->d_name[0] != '.') unlink((_namespace + "/" + e->d_name).c_str());
+  closedir(d);
+  return true;
+}
+
+bool Preferences::remove(const char *key)
+{
+  return _started && !_readOnly && unlink(path(key).c_str()) == 0;
+}
+
+bool Preferences::isKey(const char *key)
+{
+  struct stat s;
+  return _started && stat(path(key).c_str(), &s) == 0;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t length)
+{
+  if (!_started || _readOnly || key == NULL || strlen(key) > 15) return 0;
+  return writeFile(path(key), value, length) ? length : 0;
+}
+
+//Nothing is copied if the value won't fit, as in the ESP32 core
+size_t Preferences::getBytes(const char *key, void *buffer, size_t maxLength)
+{
+  std::string value;
+  if (!_started || !readFile(path(key), value) || value.size() > maxLength) return 0;
+  memcpy(buffer, value.data(), value.size());
+  return value.size();
+}
+
+size_t Preferences::getBytesLength(const char *key)
+{
+  struct stat s;
+  return _started && stat(path(key).c_str(), &s) == 0 ? s.st_size : 0;
+}
+
+/*
+ * EEPROM
+ */
+
+bool EEPROMClass::begin(size_t size)
+{
+  std::string contents;
+  end();
+  _data = (uint8_t *)malloc(size);
+  if (_data == NULL) return false;
+  _size = size;
+  memset(_data, 0xFF, size);
+  if (readFile(hostStoragePath("eeprom") + "/eeprom.bin", contents)) memcpy(_data, contents.data(), min(size, contents.size()));
+  return true;
+}
+
+void EEPROMClass::end()
+{
+  if (_data == NULL) return;
+  if (_dirty) commit();
+  free(_data);
+  _data = NULL;
+  _size = 0;
+}
+
+bool EEPROMClass::commit()
+{
+  if (_data == NULL) return false;
+  _dirty = false;
+  return writeFile(hostStoragePath("eeprom") + "/eeprom.bin", _data, _size);
+}
+
+void EEPROMClass::write(int address, uint8_t value)
+{
+  if (address < 0 || (size_t)address >= _size) return;
+  _dirty |= _data[address] != value;
+  _data[address] = value;
+}
+
+size_t EEPROMClass::readBytes(int address, void *buffer, size_t length)
+{
+  if (address < 0 || (size_t)address + length > _size) return 0;
+  memcpy(buffer, _data + address, length);
+  return length;
+}
+
+size_t EEPROMClass::writeBytes(int address, const void *buffer, size_t length)
+{
+  if (address < 0 || (size_t)address + length > _size) return 0;
+  for (size_t i = 0; i < length; i++) write(address + i, ((const uint8_t *)buffer)[i]);
+  return length;
+}
+
+/*
+ * Files
+ */
+
+namespace fs {
+
+struct File::Impl {
+  std::string name;                   //the path on the file system, "/public/index.html"
+  std::string hostPath;
+  FILE *file = NULL;
+  std::vector<std::string> entries;   //a directory's files, by name
+  size_t nextEntry = 0;
+  bool directory = false;
+  std::string mode;
+  ~Impl() { if (file != NULL) fclose(file); }
+};
+
+//SPIFFS is flat - a directory lists every file under it, however deep
+static void listFiles(const std::string &hostPath, const std::string &name, std::vector<std::string> &entries)
+{
+  DIR *d = opendir(hostPath.c_str());
+  if (d == NULL) return;
+  for (struct dirent *e; (e = readdir(d)) != NULL;) {
+    if (e->d_name[0] == '.') continue;
+    std::string child = name == "/" ? name + e->d_name : name + "/" + e->d_name;
+    struct stat s;
+    if (stat((hostPath + "/" + e->d_name).c_str(), &s) < 0) continue;
+    if (S_ISDIR(s.st_mode)) listFiles(hostPath + "/" + e->d_name, child, entries);
+    else entries.push_back(child);
+  }
+  closedir(d);
+}
+
+size_t File::write(const uint8_t *buffer, size_t size)
+{
+  if (!_impl || _impl->file == NULL || _impl->mode == FILE_READ) return 0;
+  return fwrite(buffer, 1, size, _impl->file);
+}
+
+int File::available()
+{
+  if (!_impl || _impl->file == NULL) return 0;
+  return (int)(size() - position());
+}
+
+int File::read()
+{
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read(uint8_t *buffer, size_t size)
+{
+  if (!_impl || _impl->file == NULL) return 0;
+  return fread(buffer, 1, size, _impl->file);
+}
+
+int File::peek()
+{
+  if (!_impl || _impl->file == NULL) return -1;
+  int c = fgetc(_impl->file);
+  if (c != EOF) ungetc(c, _impl->file);
+  return c == EOF ? -1 : c;
+}
+
+void File::flush()
+{
+  if (_impl && _impl->file != NULL) fflush(_impl->file);
+}
+
+bool File::seek(uint32_t position, SeekMode mode)
+{
+  static const int whence[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+  return _impl && _impl->file != NULL && fseek(_impl->file, position, whence[mode]) == 0;
+}
+
+size_t File::position() const
+{
+  return _impl && _impl->file != NULL ? ftell(_impl->file) : 0;
+}
+
+size_t File::size() const
+{
+  struct stat s;
+  if (!_impl || _impl->file == NULL) return 0;
+  fflush(_impl->file);
+  return fstat(fileno(_impl->file), &s) == 0 ? s.st_size : 0;
+}
+
+void File::close()
+{
+  _impl.reset();
+}
+
+File::operator bool() const
+{
+  return (bool)_impl;
+}
+
+//The full path, as the 1.x core gives it
+const char *File::name() const
+{
+  return _impl ? _impl->name.c_str() : NULL;
+}
+
+bool File::isDirectory() const
+{
+  return _impl && _impl->directory;
+}
+
+File File::openNextFile(const char *mode)
+{
+  File next;
+  if (!_impl || !_impl->directory || _impl->nextEntry == _impl->entries.size()) return next;
+  std::string name = _impl->entries[_impl->nextEntry++];
+  next._impl = std::make_shared<Impl>();
+  next._impl->name = name;
+  next._impl->hostPath = _impl->hostPath + name.substr(_impl->name == "/" ? 0 : _impl->name.size());
+  next._impl->mode = mode;
+  next._impl->file = fopen(next._impl->hostPath.c_str(), "rb");
+  if (next._impl->file == NULL) next._impl.reset();
+  return next;
+}
+
+void File::rewindDirectory()
+{
+  if (_impl) _impl->nextEntry = 0;
+}
+
+std::string FS::hostPath(const char *path)
+{
+  std::string base = hostStoragePath(_kind);
+  return path[0] == '/' ? base + path : base + "/" + path;
+}
+
+//Writing makes any directories on the way, since SPIFFS doesn't have them
+File FS::open(const char *path, const char *mode, bool create)
+{
+  File f;
+  struct stat s;
+  if (!_mounted || path == NULL || path[0] != '/') return f;
+  std::string host = hostPath(path);
+  bool exists = stat(host.c_str(), &s) == 0;
+
+  f._impl = std::make_shared<File::Impl>();
+  f._impl->name = path;
+  f._impl->hostPath = host;
+  f._impl->mode = mode;
+  if (strcmp(mode, FILE_READ) == 0 && exists && S_ISDIR(s.st_mode)) {
+    f._impl->directory = true;
+    listFiles(host, path, f._impl->entries);
+    return f;
+  }
+  if (strcmp(mode, FILE_READ) != 0) makeDirectories(host.substr(0, host.rfind('/')));
+  f._impl->file = fopen(host.c_str(), strcmp(mode, FILE_READ) == 0 ? "rb" : strcmp(mode, FILE_APPEND) == 0 ? "ab" : "wb");
+  if (f._impl->file == NULL) f._impl.reset();
+  return f;
+}
+
+bool FS::exists(const char *path)
+{
+  struct stat s;
+  return _mounted && path != NULL && stat(hostPath(path).c_str(), &s) == 0;
+}
+
+bool FS::remove(const char *path)
+{
+  return _mounted && unlink(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char *from, const char *to)
+{
+  return _mounted && ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+bool FS::mkdir(const char *path)
+{
+  return _mounted && makeDirectories(hostPath(path));
+}
+
+bool FS::rmdir(const char *path)
+{
+  return _mounted && ::rmdir(hostPath(path).c_str()) == 0;
+}
+
+}
+
+/*
+ * SPIFFS
+ */
+
+bool SPIFFSFS::begin(bool formatOnFail, const char *basePath, uint8_t maxOpenFiles, const char *label)
+{
+  _mounted = makeDirectories(hostStoragePath(_kind));
+  return _mounted;
+}
+
+bool SPIFFSFS::format()
+{
+  std::vector<std::string> files;
+  std::string base = hostStoragePath(_kind);
+  fs::listFiles(base, "/", files);
+  for (const std::string &file : files) unlink((base + file).c_str());
+  return true;
+}
+
+size_t SPIFFSFS::usedBytes()
+{
+  std::vector<std::string> files;
+  std::string base = hostStoragePath(_kind);
+  size_t used = 0;
+  struct stat s;
+  fs::listFiles(base, "/", files);
+  for (const std::string &file : files)
+    if (stat((base + file).c_str(), &s) == 0) used += s.st_size;
+  return used;
+}
@@ -0,0 +1,218 @@
+//
+//  WiFi.cpp
+//
+//  WiFi, TCP connections and servers for the host build - see host/include/WiFi.h.
+//
+
+#include <WiFi.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+
+WiFiClass WiFi;
+
+uint16_t hostPort(uint16_t port)
+{
+  static int offset = -1;
+  if (offset < 0) {
+    const char *env = getenv("ECOMPASS_PORT_OFFSET");
+    offset = env != NULL ? atoi(env) : 0;
+  }
+  return (uint16_t)(port + offset);
+}
+
+//Every listener in the firmware - WiFiServer, SocketServer, the web server - comes through here
+extern "C" int bind(int fd, const struct sockaddr *address, socklen_t length) __THROW
+{
+  typedef int (*BindFunction)(int, const struct sockaddr *, socklen_t);
+  static BindFunction realBind = (BindFunction)dlsym(RTLD_NEXT, "bind");
+
+  if (address != NULL && address->sa_family == AF_INET && length >= sizeof(struct sockaddr_in)) {
+    struct sockaddr_in moved = *(const struct sockaddr_in *)address;
+    if (moved.sin_port != 0) moved.sin_port = htons(hostPort(ntohs(moved.sin_port)));
+    return realBind(fd, (const struct sockaddr *)&moved, sizeof(moved));
+  }
+  return realBind(fd, address, length);
+}
+
+bool WiFiClass::softAP(const char *ssid, const char *password, int channel, int hidden, int maxConnections)
+{
+  strncpy(_ssid, ssid, sizeof(_ssid) - 1);
+  ets_printf("Access point %s is the host's own network\n", _ssid);
+  return true;
+}
+
+bool WiFiClass::softAPdisconnect(bool wifiOff)
+{
+  _ssid[0] = '\0';
+  return true;
+}
+
+/*
+ * WiFiClient
+ */
+
+WiFiClient::Socket::~Socket()
+{
+  close(fd);
+}
+
+WiFiClient::WiFiClient(int fd) : _socket(std::make_shared<Socket>(fd)) {}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+  struct sockaddr_in address = {};
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (fd < 0) return 0;
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(((uint32_t)ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3]);
+  if (::connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    close(fd);
+    return 0;
+  }
+  _socket = std::make_shared<Socket>(fd);
+  return 1;
+}
+
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+  struct hostent *entry = gethostbyname(host);
+  if (entry == NULL || entry->h_addrtype != AF_INET) return 0;
+  const uint8_t *a = (const uint8_t *)entry->h_addr_list[0];
+  return connect(IPAddress(a[0], a[1], a[2], a[3]), port);
+}
+
+int WiFiClient::fd() const
+{
+  return _socket ? _socket->fd : -1;
+}
+
+//Blocks while the socket buffer is full, as the core's write() does
+size_t WiFiClient::write(const uint8_t *buffer, size_t size)
+{
+  size_t sent = 0;
+
+  while (_socket && sent < size) {
+    ssize_t n = send(_socket->fd, buffer + sent, size - sent, MSG_NOSIGNAL);
+    if (n > 0) sent += n;
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      struct pollfd p = { _socket->fd, POLLOUT, 0 };
+      poll(&p, 1, 100);
+    } else break;
+  }
+  return sent;
+}
+
+int WiFiClient::available()
+{
+  int bytes = 0;
+  if (!_socket || ioctl(_socket->fd, FIONREAD, &bytes) < 0) return 0;
+  return bytes;
+}
+
+int WiFiClient::read()
+{
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t *buffer, size_t size)
+{
+  if (!_socket) return -1;
+  ssize_t n = recv(_socket->fd, buffer, size, MSG_DONTWAIT);
+  return n > 0 ? (int)n : -1;
+}
+
+int WiFiClient::peek()
+{
+  uint8_t c;
+  if (!_socket || recv(_socket->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) != 1) return -1;
+  return c;
+}
+
+void WiFiClient::stop()
+{
+  _socket.reset();
+}
+
+//Connected until the other end closes - there may still be data to read
+uint8_t WiFiClient::connected()
+{
+  if (!_socket) return 0;
+  uint8_t c;
+  ssize_t n = recv(_socket->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+  if (n > 0) return 1;
+  if (n == 0) return 0;
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+int WiFiClient::setNoDelay(bool noDelay)
+{
+  int enable = noDelay;
+  return _socket ? setsockopt(_socket->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) : -1;
+}
+
+IPAddress WiFiClient::remoteIP() const
+{
+  struct sockaddr_in address = {};
+  socklen_t length = sizeof(address);
+  if (!_socket || getpeername(_socket->fd, (struct sockaddr *)&address, &length) < 0) return IPAddress();
+  uint32_t a = ntohl(address.sin_addr.s_addr);
+  return IPAddress(a >> 24, a >> 16, a >> 8, a);
+}
+
+uint16_t WiFiClient::remotePort() const
+{
+  struct sockaddr_in address = {};
+  socklen_t length = sizeof(address);
+  if (!_socket || getpeername(_socket->fd, (struct sockaddr *)&address, &length) < 0) return 0;
+  return ntohs(address.sin_port);
+}
+
+/*
+ * WiFiServer
+ */
+
+void WiFiServer::begin(uint16_t port)
+{
+  struct sockaddr_in address = {};
+  int enable = 1;
+
+  end();
+  if (port != 0) _port = port;
+  _fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_fd < 0) return;
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(_port);
+  address.sin_addr.s_addr = INADDR_ANY;
+  if (bind(_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(_fd, 4) < 0) {
+    end();
+    return;
+  }
+  fcntl(_fd, F_SETFL, O_NONBLOCK);
+}
+
+void WiFiServer::end()
+{
+  if (_fd >= 0) close(_fd);
+  _fd = -1;
+}
+
+WiFiClient WiFiServer::available()
+{
+  if (_fd < 0) return WiFiClient();
+  int fd = ::accept(_fd, NULL, NULL);
+  if (fd < 0) return WiFiClient();
+  WiFiClient client(fd);
+  if (_noDelay) client.setNoDelay(true);
+  return client;
+}
+
+bool WiFiServer::hasClient()
+{
+  struct pollfd p = { _fd, POLLIN, 0 };
+  return _fd >= 0 && poll(&p, 1, 0) == 1;
+}
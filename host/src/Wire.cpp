@@ -0,0 +1,151 @@
+//
+//  Wire.cpp
+//
+//  I2C buses for the host build - see host/include/Wire.h - and the SH1106 OLED that
+//  sits on one of them.
+//
+
+#include <Wire.h>
+#include <Adafruit_SH110X.h>
+
+#define SH1106_PAGES 8
+#define SH1106_COLUMNS 132          //the controller's RAM is wider than the glass
+#define SH1106_CHUNK 31             //data bytes per transaction, after the control byte
+#define SH1106_CLOCK 400000         //the Adafruit library speeds the bus up for a refresh
+
+TwoWire Wire(0);
+TwoWire Wire1(1);
+
+TwoWire::TwoWire(uint8_t busNumber) : _busNumber(busNumber) {}
+
+//As in the ESP32 core, starting a bus that is already going changes nothing
+bool TwoWire::begin(int sda, int scl, uint32_t frequency)
+{
+  if (_started) return true;
+  _clock = frequency != 0 ? frequency : 100000;
+  _started = true;
+  return true;
+}
+
+//The firmware only ends a bus to clock it out, so that is what the devices are told
+bool TwoWire::end()
+{
+  _started = false;
+  for (int address = 0; address < 128; address++)
+    if (_devices[address] != NULL && _devices[address]->busClear != NULL) _devices[address]->busClear(_devices[address]->context);
+  return true;
+}
+
+bool TwoWire::setClock(uint32_t frequency)
+{
+  _clock = frequency;
+  return true;
+}
+
+//Nine bit times a byte, and one each for the start and the stop
+void TwoWire::busTime(size_t bytes)
+{
+  uint32_t bits = bytes * 9 + 2;
+  delayMicroseconds((uint32_t)((uint64_t)bits * 1000000 / _clock));
+}
+
+void TwoWire::beginTransmission(uint16_t address)
+{
+  _txAddress = address;
+  _txLength = 0;
+}
+
+size_t TwoWire::write(uint8_t c)
+{
+  if (_txLength == I2C_BUFFER_LENGTH) return 0;
+  _txBuffer[_txLength++] = c;
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t *data, size_t length)
+{
+  size_t written = 0;
+  while (written < length && write(data[written])) written++;
+  return written;
+}
+
+uint8_t TwoWire::endTransmission(bool sendStop)
+{
+  const WireDevice *device = _txAddress < 128 ? _devices[_txAddress] : NULL;
+
+  _transactions++;
+  if (!_started || device == NULL) {
+    busTime(1);
+    _nacks++;
+    return I2C_ERROR_ADDRESS_NACK;
+  }
+  uint8_t error = device->write(device->context, _txBuffer, _txLength);
+  busTime(error == I2C_ERROR_ADDRESS_NACK ? 1 : 1 + _txLength);
+  if (error != I2C_ERROR_OK) _nacks++;
+  return error;
+}
+
+size_t TwoWire::requestFrom(uint16_t address, size_t size, bool sendStop)
+{
+  const WireDevice *device = address < 128 ? _devices[address] : NULL;
+
+  _transactions++;
+  _rxIndex = _rxLength = 0;
+  if (size > I2C_BUFFER_LENGTH) size = I2C_BUFFER_LENGTH;
+  if (_started && device != NULL) _rxLength = device->read(device->context, _rxBuffer, size);
+  busTime(1 + _rxLength);
+  if (_rxLength == 0) _nacks++;
+  return _rxLength;
+}
+
+void TwoWire::attach(uint8_t address, const WireDevice *device)
+{
+  if (address < 128) _devices[address] = device;
+}
+
+/*
+ * SH1106 - the transactions the Adafruit library makes, with nothing to show for them
+ */
+
+bool Adafruit_SH1106G::begin(uint8_t address, bool reset)
+{
+  static const uint8_t init[] = { 0x00, SH110X_DISPLAYOFF, 0xD5, 0x80, 0xA8, 0x3F, 0xD3, 0x00, 0x40, 0xAD, 0x8B,
+                                  0xA1, 0xC8, 0xDA, 0x12, 0x81, 0xFF, 0xD9, 0x1F, 0xDB, 0x40, 0x33, 0xA6, 0x20, 0x10, 0xA4 };
+  _address = address;
+  _wire->begin();
+  _wire->beginTransmission(_address);
+  _wire->write(init, sizeof(init));
+  bool found = _wire->endTransmission() == I2C_ERROR_OK;
+  delay(100);
+  oled_command(SH110X_DISPLAYON);
+  return found;
+}
+
+void Adafruit_SH1106G::oled_command(uint8_t command)
+{
+  _wire->beginTransmission(_address);
+  _wire->write((uint8_t)0x00);
+  _wire->write(command);
+  _wire->endTransmission();
+}
+
+void Adafruit_SH1106G::display()
+{
+  static uint8_t data[SH1106_CHUNK + 1] = { 0x40 };
+  uint32_t clock = _wire->getClock();
+
+  _wire->setClock(SH1106_CLOCK);
+  for (int page = 0; page < SH1106_PAGES; page++) {
+    const uint8_t address[] = { 0x00, (uint8_t)(0xB0 + page), 0x10, 0x00 };
+    _wire->beginTransmission(_address);
+    _wire->write(address, sizeof(address));
+    _wire->endTransmission();
+    for (int column = 0; column < SH1106_COLUMNS; column += SH1106_CHUNK) {
+      int bytes = min(SH1106_CHUNK, SH1106_COLUMNS - column);
+      _wire->beginTransmission(_address);
+      _wire->write(data, bytes + 1);
+      _wire->endTransmission();
+    }
+  }
+  _wire->setClock(clock);
+}
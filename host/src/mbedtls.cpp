@@ -0,0 +1,90 @@
+//
+//  mbedtls.cpp
+//
+//  The two mbedTLS functions the WebSocket handshake in SignalK.h needs, for the host build.
+//  SHA-1 as in FIPS 180-4, base64 as in RFC 4648.
+//
+
+#include <mbedtls/sha1.h>
+#include <mbedtls/base64.h>
+#include <stdint.h>
+#include <string.h>
+
+static uint32_t rotate(uint32_t x, int n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+static void sha1Block(uint32_t h[5], const unsigned char *block)
+{
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  for (int i = 16; i < 80; i++) w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+    else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+    else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+    else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+    uint32_t t = rotate(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotate(b, 30);
+    b = a;
+    a = t;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+int mbedtls_sha1_ret(const unsigned char *input, size_t length, unsigned char output[20])
+{
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  unsigned char last[128] = { 0 };
+  size_t whole = length & ~(size_t)63, rest = length - whole;
+  uint64_t bits = (uint64_t)length * 8;
+
+  for (size_t i = 0; i < whole; i += 64) sha1Block(h, input + i);
+  memcpy(last, input + whole, rest);
+  last[rest] = 0x80;
+  size_t padded = rest < 56 ? 64 : 128;
+  for (int i = 0; i < 8; i++) last[padded - 1 - i] = (unsigned char)(bits >> (8 * i));
+  for (size_t i = 0; i < padded; i += 64) sha1Block(h, last + i);
+  for (int i = 0; i < 20; i++) output[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+  return 0;
+}
+
+int mbedtls_sha1(const unsigned char *input, size_t length, unsigned char output[20])
+{
+  return mbedtls_sha1_ret(input, length, output);
+}
+
+int mbedtls_base64_encode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t needed = (slen + 2) / 3 * 4 + 1;
+
+  if (dst == NULL || dlen < needed) {
+    *olen = needed;
+    return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < slen; i += 3) {
+    uint32_t v = (uint32_t)src[i] << 16;
+    if (i + 1 < slen) v |= (uint32_t)src[i + 1] << 8;
+    if (i + 2 < slen) v |= src[i + 2];
+    dst[n++] = alphabet[(v >> 18) & 63];
+    dst[n++] = alphabet[(v >> 12) & 63];
+    dst[n++] = i + 1 < slen ? alphabet[(v >> 6) & 63] : '=';
+    dst[n++] = i + 2 < slen ? alphabet[v & 63] : '=';
+  }
+  dst[n] = '\0';
+  *olen = n;
+  return 0;
+}
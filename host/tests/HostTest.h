@@ -0,0 +1,143 @@
+#ifndef _HOST_TEST_H
+#define _HOST_TEST_H
+/*
+ * What the host tests share: a fresh storage directory and port offset for each test, so
+ * they can run side by side, connecting to the firmware's listeners, and checking NMEA.
+ *
+ * A test is a main() that ends with testExit(), which fails it if any CHECK did. ctest runs
+ * each one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+int testFailures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+      testFailures++; \
+      fprintf(stderr, "FAIL %s:%d: %s - ", __FILE__, __LINE__, #condition); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+    } \
+  } while (0)
+
+//Settings and files in a directory of their own, and every port moved up by offset
+void testEnvironment(const char *name, int portOffset)
+{
+  char storage[64];
+  snprintf(storage, sizeof(storage), "/tmp/ecompass-%s-XXXXXX", name);
+  if (mkdtemp(storage) == NULL) {
+    perror("mkdtemp");
+    exit(2);
+  }
+  setenv("ECOMPASS_STORAGE", storage, 1);
+  char offset[16];
+  snprintf(offset, sizeof(offset), "%d", portOffset);
+  setenv("ECOMPASS_PORT_OFFSET", offset, 1);
+}
+
+double testSeconds()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//A connection to a host port, trying for a while - the listeners come up in the Boot task
+int testConnect(uint16_t port, double timeoutS = 5)
+{
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (double start = testSeconds(); testSeconds() - start < timeoutS; usleep(50000)) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+//Reads lines from a connection, waiting up to timeoutS for each one
+class LineReader {
+  public:
+    LineReader(int fd) : _fd(fd) {}
+
+    bool readLine(std::string &line, double timeoutS = 2)
+    {
+      double start = testSeconds();
+      size_t end;
+      while ((end = _buffer.find('\n')) == std::string::npos) {
+        double left = timeoutS - (testSeconds() - start);
+        struct pollfd p = { _fd, POLLIN, 0 };
+        if (left <= 0 || poll(&p, 1, (int)(left * 1000) + 1) <= 0) return false;
+        char chunk[1024];
+        ssize_t n = recv(_fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) return false;
+        _buffer.append(chunk, n);
+      }
+      line = _buffer.substr(0, end);
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      _buffer.erase(0, end + 1);
+      return true;
+    }
+
+  private:
+    int _fd;
+    std::string _buffer;
+};
+
+//$...*hh with the right checksum
+bool nmeaChecksumOk(const std::string &sentence)
+{
+  size_t star = sentence.rfind('*');
+  if (sentence.size() < 4 || (sentence[0] != '$' && sentence[0] != '!') || star == std::string::npos || star + 3 != sentence.size())
+    return false;
+  uint8_t sum = 0;
+  for (size_t i = 1; i < star; i++) sum ^= (uint8_t)sentence[i];
+  return strtoul(sentence.substr(star + 1).c_str(), NULL, 16) == sum;
+}
+
+//The nth comma separated field of a sentence, without the checksum
+std::string nmeaField(const std::string &sentence, int n)
+{
+  std::string body = sentence.substr(0, sentence.rfind('*'));
+  size_t start = 0;
+  for (int i = 0; i < n; i++) {
+    start = body.find(',', start);
+    if (start == std::string::npos) return "";
+    start++;
+  }
+  return body.substr(start, body.find(',', start) - start);
+}
+
+//Degrees between two headings, the short way round
+double headingError(double a, double b)
+{
+  double d = fmod(a - b + 540.0, 360.0) - 180.0;
+  return fabs(d);
+}
+
+//Ends the test there and then - the firmware's tasks are still running, and the static
+//destructors would take things out from under them
+void testExit(const char *name)
+{
+  if (testFailures == 0) printf("%s: passed\n", name);
+  else printf("%s: %d checks failed\n", name, testFailures);
+  fflush(stdout);
+  fflush(stderr);
+  _exit(testFailures == 0 ? 0 : 1);
+}
+
+#endif
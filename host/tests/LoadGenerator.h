@@ -0,0 +1,288 @@
+#ifndef _LOAD_GENERATOR_H
+#define _LOAD_GENERATOR_H
+/*
+ * A load generator for the NMEA port and the web app, to see how the unit copes with
+ * several chartplotters and a phone at once
+ *
+ * Each client is a thread of its own, for the length of the run:
+ *  - consumers read the NMEA port as a chartplotter would, check every checksum and time
+ *    the gaps between HDM sentences
+ *  - pollers fetch /getHeading and /getCalStatus in turn, as the calibration page does
+ *  - slow readers connect to the NMEA port with a small receive buffer and then stop
+ *    reading, until the end of the run when what they were sent is read and checked
+ *
+ * Nothing here knows about the firmware, so it runs against a unit (ecompass-load) as well
+ * as against the host build in the same process (tests/load.cpp). After the run /metrics
+ * is read for the unit's own view: the messages it dropped and the heading latency from
+ * the CMPS14 read to the network.
+ *
+ * A consumer can also watch for a heading. Whoever turns the compass to it sets
+ * LoadOptions::watchFrom, and each consumer notes when it first sees it - the end to end
+ * latency.
+ */
+
+#include "tests/HostTest.h"
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <netdb.h>
+#include <sys/time.h>
+
+//Multiples of the median gap, as in the unit's own histogram (Metrics.h)
+#define LOAD_GAP_BUCKETS 6
+const double loadGapLimits[LOAD_GAP_BUCKETS - 1] = { 0.9, 1.1, 1.5, 2.0, 4.0 };
+
+#define LOAD_SLOW_RCVBUF 1024     //bytes - the smallest Linux will take is about twice this
+#define LOAD_WATCH_DEGREES 2      //a watched heading is seen when a sentence is this close
+
+struct LoadOptions {
+  const char *host = "127.0.0.1";
+  uint16_t nmeaPort = 23;
+  uint16_t httpPort = 80;
+  int consumers = 4;
+  int pollers = 2;
+  int slowReaders = 1;
+  double seconds = 10;
+  int pollIntervalMs = 200;
+  double watchHeading = -1;                //none
+  std::atomic<double> watchFrom { 0 };     //testSeconds() when the compass was turned to it
+};
+
+struct ConsumerResult {
+  bool connected = false;
+  bool closed = false;                     //by the unit before the end - it has a client limit
+  uint32_t bytes = 0, sentences = 0, hdm = 0, badChecksums = 0;
+  std::vector<double> gapsMs;              //between HDM sentences
+  double watchSeenAt = 0;
+};
+
+struct PollerResult {
+  bool connected = false;
+  uint32_t requests = 0, failures = 0;
+  double totalMs = 0, maxMs = 0;
+};
+
+struct SlowReaderResult {
+  bool connected = false;
+  bool stillOpen = false;                  //when the reading started again
+  uint32_t bytes = 0, sentences = 0, badChecksums = 0;
+};
+
+struct LoadReport {
+  double seconds = 0;
+  std::vector<ConsumerResult> consumers;
+  std::vector<PollerResult> pollers;
+  std::vector<SlowReaderResult> slowReaders;
+  bool metricsRead = false;
+  double unitDrops = 0, unitLatencySum = 0, unitLatencyCount = 0, unitLatencyMax = 0;
+};
+
+int loadConnect(const LoadOptions &options, uint16_t port, int rcvbuf = 0)
+{
+  struct addrinfo hints = {}, *found;
+  char service[8];
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(options.host, service, &hints, &found) != 0) return -1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (connect(fd, found->ai_addr, found->ai_addrlen) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(found);
+  return fd;
+}
+
+//One GET on a connection of its own, as the unit closes it after every response
+bool loadHttpGet(const LoadOptions &options, const char *path, std::string &body)
+{
+  int fd = loadConnect(options, options.httpPort);
+  if (fd < 0) return false;
+  struct timeval timeout = { 2, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: " + options.host + "\r\nConnection: close\r\n\r\n";
+  std::string reply;
+  bool sent = send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+  char chunk[2048];
+  for (ssize_t n; sent && (n = recv(fd, chunk, sizeof(chunk), 0)) > 0;) reply.append(chunk, n);
+  close(fd);
+  size_t headerEnd = reply.find("\r\n\r\n");
+  if (reply.compare(0, 12, "HTTP/1.1 200") != 0 || headerEnd == std::string::npos) return false;
+  body = reply.substr(headerEnd + 4);
+  return true;
+}
+
+void loadConsumer(LoadOptions *options, ConsumerResult *result, double end)
+{
+  int fd = loadConnect(*options, options->nmeaPort);
+  if (fd < 0) return;
+  result->connected = true;
+
+  LineReader reader(fd);
+  std::string line;
+  double lastHdm = 0;
+  while (testSeconds() < end) {
+    if (!reader.readLine(line, end - testSeconds())) {
+      char probe;
+      result->closed = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+      break;
+    }
+    double now = testSeconds();
+    result->bytes += line.size() + 2;
+    result->sentences++;
+    if (!nmeaChecksumOk(line)) {
+      result->badChecksums++;
+      continue;
+    }
+    if (line.size() < 6 || line.compare(3, 3, "HDM") != 0) continue;
+    result->hdm++;
+    if (lastHdm > 0) result->gapsMs.push_back((now - lastHdm) * 1000);
+    lastHdm = now;
+    double from = options->watchFrom;
+    if (options->watchHeading >= 0 && from > 0 && result->watchSeenAt == 0 &&
+        headingError(atof(nmeaField(line, 1).c_str()), options->watchHeading) <= LOAD_WATCH_DEGREES)
+      result->watchSeenAt = now;
+  }
+  close(fd);
+}
+
+void loadPoller(LoadOptions *options, PollerResult *result, double end)
+{
+  static const char * const paths[] = { "/getHeading", "/getCalStatus" };
+  std::string body;
+
+  for (int i = 0; testSeconds() < end; i++) {
+    double start = testSeconds();
+    bool ok = loadHttpGet(*options, paths[i % 2], body) && body.compare(0, 1, "{") == 0;
+    double ms = (testSeconds() - start) * 1000;
+    result->connected |= ok;
+    result->requests++;
+    if (!ok) result->failures++;
+    result->totalMs += ms;
+    result->maxMs = std::max(result->maxMs, ms);
+    double wait = options->pollIntervalMs - ms;
+    if (wait > 0) usleep((useconds_t)(wait * 1000));
+  }
+}
+
+void loadSlowReader(LoadOptions *options, SlowReaderResult *result, double end)
+{
+  int fd = loadConnect(*options, options->nmeaPort, LOAD_SLOW_RCVBUF);
+  if (fd < 0) return;
+  result->connected = true;
+  while (testSeconds() < end) usleep(50000);
+
+  //Everything that arrived must still be whole sentences
+  LineReader reader(fd);
+  std::string line;
+  char probe;
+  result->stillOpen = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) != 0;
+  for (double drainEnd = testSeconds() + 1; testSeconds() < drainEnd && reader.readLine(line, 0.5);) {
+    result->bytes += line.size() + 2;
+    result->sentences++;
+    if (!nmeaChecksumOk(line)) result->badChecksums++;
+  }
+  close(fd);
+}
+
+//The sum of the values of a metric, over all its labels
+double loadMetric(const std::string &metrics, const std::string &name, const char *label = NULL)
+{
+  double sum = 0;
+  for (size_t start = 0; start < metrics.size();) {
+    size_t end = metrics.find('\n', start);
+    if (end == std::string::npos) end = metrics.size();
+    std::string line = metrics.substr(start, end - start);
+    start = end + 1;
+    if (line.compare(0, name.size(), name) != 0 || (line[name.size()] != ' ' && line[name.size()] != '{')) continue;
+    if (label != NULL && line.find(label) == std::string::npos) continue;
+    sum += atof(line.c_str() + line.rfind(' ') + 1);
+  }
+  return sum;
+}
+
+void runLoad(LoadOptions &options, LoadReport &report)
+{
+  std::vector<std::thread> threads;
+  double end = testSeconds() + options.seconds;
+
+  report.seconds = options.seconds;
+  report.consumers.resize(options.consumers);
+  report.pollers.resize(options.pollers);
+  report.slowReaders.resize(options.slowReaders);
+  for (auto &r : report.slowReaders) threads.emplace_back(loadSlowReader, &options, &r, end);
+  for (auto &r : report.consumers) threads.emplace_back(loadConsumer, &options, &r, end);
+  for (auto &r : report.pollers) threads.emplace_back(loadPoller, &options, &r, end);
+  for (auto &t : threads) t.join();
+
+  std::string metrics;
+  report.metricsRead = loadHttpGet(options, "/metrics", metrics);
+  report.unitDrops = loadMetric(metrics, "ecompass_nmea_client_messages_total", "result=\"dropped\"");
+  report.unitLatencySum = loadMetric(metrics, "ecompass_heading_latency_seconds_sum");
+  report.unitLatencyCount = loadMetric(metrics, "ecompass_heading_latency_seconds_count");
+  report.unitLatencyMax = loadMetric(metrics, "ecompass_heading_latency_max_seconds");
+}
+
+double loadPercentile(std::vector<double> values, double p)
+{
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  return values[std::min(values.size() - 1, (size_t)(p / 100 * values.size()))];
+}
+
+//HDM sentences missing from a consumer's stream, going by its usual gap
+uint32_t loadMissing(const ConsumerResult &c)
+{
+  double median = loadPercentile(c.gapsMs, 50);
+  uint32_t missing = 0;
+  for (double gap : c.gapsMs)
+    if (median > 0 && gap > 1.5 * median) missing += (uint32_t)(gap / median + 0.5) - 1;
+  return missing;
+}
+
+void printLoadReport(FILE *out, const LoadOptions &options, const LoadReport &report)
+{
+  fprintf(out, "consumer  bytes/s  HDM/s  bad   p50ms   p99ms   maxms  missing  gaps by multiple of p50:");
+  for (int b = 0; b < LOAD_GAP_BUCKETS - 1; b++) fprintf(out, " <=%.1f", loadGapLimits[b]);
+  fprintf(out, " more\n");
+  for (size_t i = 0; i < report.consumers.size(); i++) {
+    const ConsumerResult &c = report.consumers[i];
+    if (!c.connected || (c.closed && c.sentences == 0)) {
+      fprintf(out, "%8zu  %s\n", i, c.connected ? "closed by the unit" : "not connected");
+      continue;
+    }
+    double median = loadPercentile(c.gapsMs, 50);
+    uint32_t buckets[LOAD_GAP_BUCKETS] = { 0 };
+    for (double gap : c.gapsMs) {
+      int b = 0;
+      while (b < LOAD_GAP_BUCKETS - 1 && median > 0 && gap / median > loadGapLimits[b]) b++;
+      buckets[b]++;
+    }
+    fprintf(out, "%8zu %8.0f %6.1f %4u %7.1f %7.1f %7.1f %8u ", i, c.bytes / report.seconds, c.hdm / report.seconds,
+            c.badChecksums, median, loadPercentile(c.gapsMs, 99), loadPercentile(c.gapsMs, 100), loadMissing(c));
+    for (int b = 0; b < LOAD_GAP_BUCKETS; b++) fprintf(out, " %5u", buckets[b]);
+    if (c.closed) fprintf(out, "  closed by the unit");
+    if (options.watchHeading >= 0)
+      fprintf(out, c.watchSeenAt > 0 ? "  heading %.0f after %.0fms" : "  heading %.0f not seen",
+              options.watchHeading, (c.watchSeenAt - options.watchFrom) * 1000);
+    fprintf(out, "\n");
+  }
+
+  for (size_t i = 0; i < report.pollers.size(); i++) {
+    const PollerResult &p = report.pollers[i];
+    fprintf(out, "poller %zu: %u requests, %u failed, %.1fms average, %.1fms max\n", i, p.requests, p.failures,
+            p.requests > 0 ? p.totalMs / p.requests : 0.0, p.maxMs);
+  }
+  for (size_t i = 0; i < report.slowReaders.size(); i++) {
+    const SlowReaderResult &s = report.slowReaders[i];
+    fprintf(out, "slow reader %zu: %s, %u bytes waiting in %u sentences, %u bad\n", i,
+            !s.connected ? "not connected" : s.stillOpen ? "still connected" : "disconnected", s.bytes, s.sentences, s.badChecksums);
+  }
+  if (!report.metricsRead) fprintf(out, "unit: /metrics not read\n");
+  else fprintf(out, "unit: %.0f messages dropped, heading latency %.1fms average, %.1fms max\n", report.unitDrops,
+               report.unitLatencyCount > 0 ? report.unitLatencySum / report.unitLatencyCount * 1000 : 0.0, report.unitLatencyMax * 1000);
+}
+
+#endif
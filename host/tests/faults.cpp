@@ -0,0 +1,145 @@
+//
+//  faults.cpp
+//
+//  Faults injected into the simulated CMPS14 behind the Wire shim (SimCmps14.h), through
+//  the real register reads and bus recovery in Cmps14.h: NACKs and short reads are counted
+//  and never go out as a heading, a chip that stops answering takes the bus down, HDM stops
+//  and HDG goes void, the recovery backs off while it stays dead and brings it back when it
+//  answers again, a stuck bus is clocked out, and a read of all ones is kept out of the heading.
+//
+
+#include "Firmware.h"
+#include "tests/HostTest.h"
+
+#define SIM_HEADING 123
+#define PHASE_S 3.0
+
+struct Output {
+  int hdm, wrongHdm, hdg, voidHdg, badChecksums;
+};
+
+//What the NMEA port sends over a few seconds
+static Output readOutput(LineReader &reader, double seconds)
+{
+  Output out = {};
+  std::string line;
+  for (double start = testSeconds(); testSeconds() - start < seconds && reader.readLine(line, 0.5);) {
+    if (!nmeaChecksumOk(line)) {
+      out.badChecksums++;
+      continue;
+    }
+    if (line.compare(3, 3, "HDM") == 0) {
+      out.hdm++;
+      if (headingError(atof(nmeaField(line, 1).c_str()), SIM_HEADING) > 2) {
+        out.wrongHdm++;
+        fprintf(stderr, "%s, simulated %d\n", line.c_str(), SIM_HEADING);
+      }
+    }
+    else if (line.compare(3, 3, "HDG") == 0) {
+      out.hdg++;
+      if (nmeaField(line, 1).empty()) out.voidHdg++;
+    }
+  }
+  return out;
+}
+
+//Wait up to seconds for a condition, reading the port meanwhile
+template <typename Condition> static bool waitFor(LineReader &reader, double seconds, Condition condition)
+{
+  for (double start = testSeconds(); testSeconds() - start < seconds; readOutput(reader, 0.1))
+    if (condition()) return true;
+  return condition();
+}
+
+int main()
+{
+  testEnvironment("faults", 12800);
+  simHeading = SIM_HEADING;
+  firmwareBegin();
+  Cmps14 *sensor = &cmpsSensors[0];
+
+  int fd = testConnect(hostPort(23));
+  CHECK(fd >= 0, "no NMEA listener on port %u", hostPort(23));
+  if (fd < 0) testExit("faults");
+  LineReader reader(fd);
+
+  //Healthy
+  Output out = readOutput(reader, 1);
+  CHECK(out.hdm > 0 && out.wrongHdm == 0 && out.voidHdg == 0, "healthy: %d HDM, %d wrong, %d void HDG",
+        out.hdm, out.wrongHdm, out.voidHdg);
+
+  //Some transactions NACKed, then some cut short. Counted, and never sent as a heading
+  uint32_t nacks = sensor->nackErrors, nackSamples = sampleStatusCounts[SAMPLE_NACK];
+  simSetFault(0, SIM_FAULT_NACK, 30);
+  out = readOutput(reader, PHASE_S);
+  CHECK(sensor->nackErrors > nacks, "no NACKs counted");
+  CHECK(sampleStatusCounts[SAMPLE_NACK] > nackSamples, "no samples marked nack");
+  CHECK(out.hdm > 0 && out.wrongHdm == 0 && out.badChecksums == 0, "NACKs: %d HDM, %d wrong, %d bad",
+        out.hdm, out.wrongHdm, out.badChecksums);
+
+  uint32_t shorts = sensor->shortReads;
+  simSetFault(0, SIM_FAULT_SHORT, 30);
+  out = readOutput(reader, PHASE_S);
+  CHECK(sensor->shortReads > shorts, "no short reads counted");
+  CHECK(out.hdm > 0 && out.wrongHdm == 0 && out.badChecksums == 0, "short reads: %d HDM, %d wrong, %d bad",
+        out.hdm, out.wrongHdm, out.badChecksums);
+
+  //The chip stops answering. The bus goes down, reads are stale, HDM stops and HDG is void
+  simSetFault(0, SIM_FAULT_OFF, 0);
+  CHECK(waitFor(reader, 2, [&] { return !sensor->busDown; }), "still down after the faults stopped");
+  uint32_t attempts = sensor->recoveryAttempts, recoveries = sensor->recoveries, clears = simSensors[0].busClears;
+  uint32_t stale = sensor->staleReads;
+  simSetFault(0, SIM_FAULT_DEAD, 0);
+  CHECK(waitFor(reader, 2, [&] { return (bool)sensor->busDown; }), "the bus didn't go down for a dead chip");
+  readOutput(reader, 0.5);     //what was already on its way
+  double deadStart = testSeconds();
+  out = readOutput(reader, PHASE_S);
+  double deadS = testSeconds() - deadStart;
+  CHECK(sensor->staleReads > stale, "no stale reads while the bus was down");
+  CHECK(out.hdm == 0, "%d HDM sent with the chip dead", out.hdm);
+  CHECK(out.hdg > 0 && out.voidHdg == out.hdg, "%d of %d HDG void with the chip dead", out.voidHdg, out.hdg);
+
+  //Backing off: 100ms, 200ms, 400ms... so a handful of attempts, not one a sample
+  uint32_t tries = sensor->recoveryAttempts - attempts;
+  int flat = (int)(deadS * 1000 / CMPS_BACKOFF_MIN_MS);
+  CHECK(tries >= 2 && tries <= 8, "%u recovery attempts in %.1fs (%d without a backoff)", tries, deadS, flat);
+  CHECK(simSensors[0].busClears - clears >= tries, "%u bus clears for %u attempts", simSensors[0].busClears - clears, tries);
+  CHECK(sensor->recoveries == recoveries, "recovered a dead chip");
+
+  //It answers again - the next attempt brings it back, whenever the backoff allows
+  simSetFault(0, SIM_FAULT_OFF, 0);
+  CHECK(waitFor(reader, CMPS_BACKOFF_MAX_MS / 1000.0, [&] { return !sensor->busDown; }), "not recovered");
+  CHECK(sensor->recoveries == recoveries + 1, "%u recoveries", sensor->recoveries - recoveries);
+  readOutput(reader, 0.5);
+  out = readOutput(reader, 1);
+  CHECK(out.hdm > 0 && out.wrongHdm == 0 && out.voidHdg == 0, "after recovery: %d HDM, %d wrong, %d void HDG",
+        out.hdm, out.wrongHdm, out.voidHdg);
+
+  //A bus that sticks now and then is clocked out and carries on
+  recoveries = sensor->recoveries;
+  clears = simSensors[0].busClears;
+  simSetFault(0, SIM_FAULT_STUCK, 10);
+  out = readOutput(reader, PHASE_S);
+  simSetFault(0, SIM_FAULT_OFF, 0);
+  CHECK(simSensors[0].busClears > clears, "a stuck bus wasn't clocked out");
+  CHECK(sensor->recoveries > recoveries, "no recoveries from a stuck bus");
+  CHECK(out.hdm > 0 && out.wrongHdm == 0 && out.badChecksums == 0, "stuck bus: %d HDM, %d wrong, %d bad",
+        out.hdm, out.wrongHdm, out.badChecksums);
+
+  //Reads that complete but come back as all ones - 6553 degrees - are bad samples, not headings
+  uint32_t outOfRange = sensor->outOfRange, outOfRangeSamples = sampleStatusCounts[SAMPLE_OUT_OF_RANGE];
+  simSetFault(0, SIM_FAULT_GARBAGE, 20);
+  out = readOutput(reader, PHASE_S);
+  simSetFault(0, SIM_FAULT_OFF, 0);
+  CHECK(sensor->outOfRange > outOfRange, "no out of range bearings counted");
+  CHECK(sampleStatusCounts[SAMPLE_OUT_OF_RANGE] > outOfRangeSamples, "no samples marked out_of_range");
+  CHECK(sensor->bearing < 360, "bearing %d kept", sensor->bearing);
+  CHECK(out.hdm > 0 && out.wrongHdm == 0 && out.badChecksums == 0, "garbage reads: %d HDM, %d wrong, %d bad",
+        out.hdm, out.wrongHdm, out.badChecksums);
+  CHECK(correctHeading(6553) == correctHeading(6553 % 360), "correctHeading(6553) %d", correctHeading(6553));
+
+  close(fd);
+  printf("%u NACKs, %u short reads, %u stale reads, %u out of range, %u recoveries in %u attempts\n", sensor->nackErrors,
+         sensor->shortReads, sensor->staleReads, sensor->outOfRange, sensor->recoveries, sensor->recoveryAttempts);
+  testExit("faults");
+}
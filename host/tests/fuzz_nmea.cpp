@@ -0,0 +1,238 @@
+//
+//  fuzz_nmea.cpp
+//
+//  A fuzz target for the NMEA input parser (NmeaInput.h) - the one place the firmware takes
+//  bytes from anyone on the network and parses them in place. It is built on its own with
+//  the address and undefined behaviour sanitizers, without the rest of the firmware.
+//
+//  Each input is fed through a receive buffer the way the Network task does it: recv()s of
+//  whatever size into nmeaReceiveSpace(), then nmeaReceived(). As well as not crashing, the
+//  parser must keep the buffer in bounds, only hand out fields that lie inside it, and give
+//  the same sentences however the bytes were split into reads.
+//
+//  With clang, -DLIBFUZZER and -fsanitize=fuzzer gives a libFuzzer target. Otherwise main()
+//  runs the files named on the command line, or mutates some sentences itself for a while.
+//
+//    fuzz_nmea [iterations | file...]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include "NmeaInput.h"
+
+#define FUZZ_ITERATIONS 200000
+#define FUZZ_MAX_INPUT 1024
+
+//What the handlers were given, folded together so two runs can be compared
+static uint32_t fuzzDigest;
+static const NmeaReceiver *fuzzRx;
+
+static void fuzzFold(const void *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++) fuzzDigest = (fuzzDigest ^ ((const uint8_t *)data)[i]) * 16777619;
+}
+
+static void fuzzFloat(float f)
+{
+  if (isnan(f)) f = NAN;    //either sign
+  fuzzFold(&f, sizeof(f));
+}
+
+static void fuzzRmc(const NmeaRMC *rmc, int client)
+{
+  fuzzFold("R", 1);
+  fuzzFold(&rmc->valid, sizeof(rmc->valid));
+  fuzzFloat(rmc->lat);
+  fuzzFloat(rmc->lon);
+  fuzzFloat(rmc->sog);
+  fuzzFloat(rmc->cog);
+  fuzzFold(&rmc->year, sizeof(int) * 3);
+  fuzzFloat(rmc->variation);
+}
+
+static void fuzzGga(const NmeaGGA *gga, int client)
+{
+  fuzzFold("G", 1);
+  fuzzFold(&gga->quality, sizeof(gga->quality));
+  fuzzFloat(gga->lat);
+  fuzzFloat(gga->lon);
+  fuzzFold(&gga->satellites, sizeof(gga->satellites));
+  fuzzFloat(gga->hdop);
+  fuzzFloat(gga->altitude);
+}
+
+static void fuzzVtg(const NmeaVTG *vtg, int client)
+{
+  fuzzFold("V", 1);
+  fuzzFloat(vtg->cogTrue);
+  fuzzFloat(vtg->cogMagnetic);
+  fuzzFloat(vtg->sog);
+}
+
+static void fuzzHsc(const NmeaHSC *hsc, int client)
+{
+  fuzzFold("H", 1);
+  fuzzFloat(hsc->headingTrue);
+  fuzzFloat(hsc->headingMagnetic);
+}
+
+//Every field must be inside the receive buffer - the profile handler reads them directly
+static void fuzzProfile(const NmeaSentence *s, int client)
+{
+  fuzzFold("P", 1);
+  for (int i = 0; i < NMEA_MAX_FIELDS; i++) {
+    const NmeaField &f = s->field[i];
+    if (f.p < fuzzRx->buf || f.p + f.length > fuzzRx->buf + NMEA_RX_BUFFER) abort();
+    fuzzFold(f.p, f.length);
+  }
+}
+
+//The input through a receiver in reads of the sizes in splits (repeated), and what came of it
+static uint32_t fuzzFeed(const uint8_t *data, size_t size, const std::vector<int> &splits)
+{
+  //Alone in an allocation of its own, so the sanitizer sees anything past the end
+  NmeaReceiver *rx = (NmeaReceiver *)malloc(sizeof(NmeaReceiver));
+  uint32_t countsBefore[NUM_NMEA_RX_COUNTS];
+
+  memcpy(countsBefore, nmeaRxCounts, sizeof(countsBefore));
+  nmeaReceiverReset(rx);
+  fuzzRx = rx;
+  fuzzDigest = 2166136261;
+  for (size_t done = 0, n = 0; done < size; n++) {
+    int room;
+    char *space = nmeaReceiveSpace(rx, &room);
+    if (room <= 0 || space != rx->buf + rx->length) abort();
+    int length = splits[n % splits.size()];
+    if (length > room) length = room;
+    if ((size_t)length > size - done) length = size - done;
+    memcpy(space, data + done, length);
+    nmeaReceived(rx, length, 0);
+    if (rx->length < 0 || rx->length >= NMEA_RX_BUFFER) abort();
+    done += length;
+  }
+  for (int i = 0; i < NUM_NMEA_RX_COUNTS; i++) {
+    uint32_t count = nmeaRxCounts[i] - countsBefore[i];
+    fuzzFold(&count, sizeof(count));
+  }
+  free(rx);
+  return fuzzDigest;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  nmeaHandlers = { fuzzRmc, fuzzGga, fuzzVtg, fuzzHsc, fuzzProfile };
+
+  //All at once as far as the buffer allows, then in reads of the sizes the first bytes give
+  uint32_t whole = fuzzFeed(data, size, { NMEA_RX_BUFFER });
+  std::vector<int> splits;
+  for (size_t i = 0; i < 8 && i < size; i++) splits.push_back(1 + data[i] % 97);
+  if (splits.empty()) splits.push_back(1);
+  if (fuzzFeed(data, size, splits) != whole) abort();
+  return 0;
+}
+
+#ifndef LIBFUZZER
+
+//Sentences of every kind the parser decodes, and some it doesn't
+static const char * const fuzzSeeds[] = {
+  "$GPRMC,123519,A,5049.123,N,00117.456,W,5.2,231.4,180324,1.1,W*7C\r\n",
+  "$GPGGA,123519,5049.123,N,00117.456,W,1,08,0.9,12.4,M,47.0,M,,*60\r\n",
+  "$GPVTG,231.4,T,232.5,M,5.2,N,9.6,K*44\r\n",
+  "$APHSC,229.0,T,230.1,M*59\r\n",
+  "$PEASP,autopilot*00\r\n",
+  "$PEASP,HDG+ROT,10*00\r\n",
+  "$GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1*39\r\n",
+  "!AIVDM,1,1,,A,15M67FC000G?ufbE`FepT@3n00Sa,0*5C\r\n",
+};
+
+static uint32_t fuzzRandomState = 12345;
+
+static uint32_t fuzzRandom(uint32_t n)
+{
+  fuzzRandomState ^= fuzzRandomState << 13;
+  fuzzRandomState ^= fuzzRandomState >> 17;
+  fuzzRandomState ^= fuzzRandomState << 5;
+  return fuzzRandomState % n;
+}
+
+//Put a right checksum on every sentence, so the mutations reach the decoders
+static void fuzzFixChecksums(std::string &s)
+{
+  for (size_t start = s.find_first_of("$!"); start != std::string::npos; start = s.find_first_of("$!", start + 1)) {
+    size_t star = s.find('*', start);
+    if (star == std::string::npos || star + 3 > s.size()) return;
+    uint8_t sum = 0;
+    for (size_t i = start + 1; i < star; i++) sum ^= (uint8_t)s[i];
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02X", sum);
+    s[star + 1] = hex[0];
+    s[star + 2] = hex[1];
+  }
+}
+
+//A few seeds run together and then damaged
+static std::string fuzzMutate()
+{
+  static const char alphabet[] = "$!*,.\r\n-+0123456789ABCDEFNSEWTMAVK";
+  std::string s;
+  for (int n = 1 + fuzzRandom(4); n > 0; n--) s += fuzzSeeds[fuzzRandom(sizeof(fuzzSeeds) / sizeof(fuzzSeeds[0]))];
+  for (int n = fuzzRandom(8); n > 0 && !s.empty(); n--) {
+    size_t at = fuzzRandom(s.size());
+    switch (fuzzRandom(6)) {
+      case 0: s[at] ^= 1 << fuzzRandom(8); break;
+      case 1: s.insert(at, 1, alphabet[fuzzRandom(sizeof(alphabet) - 1)]); break;
+      case 2: s.insert(at, 1, (char)fuzzRandom(256)); break;
+      case 3: s.erase(at, 1 + fuzzRandom(8)); break;
+      case 4: s.insert(at, s.substr(fuzzRandom(s.size()), 1 + fuzzRandom(150))); break;    //long lines too
+      case 5: s.insert(at, std::string(1 + fuzzRandom(40), ',')); break;
+    }
+  }
+  if (fuzzRandom(2) == 0) fuzzFixChecksums(s);
+  if (s.size() > FUZZ_MAX_INPUT) s.resize(FUZZ_MAX_INPUT);
+  return s;
+}
+
+int main(int argc, char **argv)
+{
+  long iterations = argc == 2 && atol(argv[1]) > 0 ? atol(argv[1]) : FUZZ_ITERATIONS;
+
+  //Files, as libFuzzer would run a corpus
+  if (argc >= 2 && atol(argv[1]) <= 0) {
+    for (int i = 1; i < argc; i++) {
+      FILE *f = fopen(argv[i], "rb");
+      if (f == NULL) {
+        fprintf(stderr, "Can't read %s\n", argv[i]);
+        return 2;
+      }
+      std::vector<uint8_t> data(FUZZ_MAX_INPUT * 64);
+      data.resize(fread(data.data(), 1, data.size(), f));
+      fclose(f);
+      LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    printf("%d inputs\n", argc - 1);
+    return 0;
+  }
+
+  for (long i = 0; i < iterations; i++) {
+    std::string input = fuzzMutate();
+    LLVMFuzzerTestOneInput((const uint8_t *)input.data(), input.size());
+  }
+
+  //The decoders must have been reached, not just the checksum test
+  printf("%ld inputs:", iterations);
+  for (int i = 0; i < NUM_NMEA_RX_COUNTS; i++) printf(" %s %u", nmeaRxCountNames[i], nmeaRxCounts[i]);
+  printf("\n");
+  for (int i = NMEA_RX_RMC; i <= NMEA_RX_OTHER; i++) {
+    if (nmeaRxCounts[i] > 0) continue;
+    fprintf(stderr, "FAIL: no %s sentences got through\n", nmeaRxCountNames[i]);
+    return 1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,77 @@
+//
+//  load.cpp
+//
+//  Four chartplotters, two phones on the calibration page and two clients that stop
+//  reading, all at once (see LoadGenerator.h). Every consumer must get every heading on
+//  time and intact, the web app must keep answering, a slow reader must only ever be sent
+//  whole sentences, and a turn of the compass must reach everyone quickly.
+//
+
+#include "Firmware.h"
+#include "tests/LoadGenerator.h"
+
+#define FIRST_HEADING 100
+#define TURNED_HEADING 250
+#define RUN_S 8
+#define TURN_AT_S 4
+#define MAX_GAP_MS 1000
+#define MAX_LATENCY_MS 1000
+
+int main()
+{
+  testEnvironment("load", 12400);
+  simHeading = FIRST_HEADING;
+  firmwareBegin();
+
+  int fd = testConnect(hostPort(23));
+  CHECK(fd >= 0, "no NMEA listener on port %u", hostPort(23));
+  if (fd < 0) testExit("load");
+  close(fd);
+  configuration.MaximumTCPClientCount = MAX_TCP_CLIENTS;   //four isn't enough for this
+
+  LoadOptions options;
+  LoadReport report;
+  options.nmeaPort = hostPort(23);
+  options.httpPort = hostPort(80);
+  options.consumers = 4;
+  options.pollers = 2;
+  options.slowReaders = 2;
+  options.seconds = RUN_S;
+  options.pollIntervalMs = 100;
+  options.watchHeading = TURNED_HEADING;
+  std::thread turn([&options] {
+    usleep(TURN_AT_S * 1000000);
+    options.watchFrom = testSeconds();
+    simHeading = TURNED_HEADING;
+  });
+  runLoad(options, report);
+  turn.join();
+  printLoadReport(stdout, options, report);
+
+  double expected = RUN_S * 1000.0 / powerProfiles[powerMode].outputPeriodMs;
+  for (size_t i = 0; i < report.consumers.size(); i++) {
+    ConsumerResult &c = report.consumers[i];
+    CHECK(c.connected && !c.closed, "consumer %zu didn't connect, or was closed", i);
+    CHECK(c.hdm >= expected * 0.8, "consumer %zu: %u HDM in %ds, expected %.0f", i, c.hdm, RUN_S, expected);
+    CHECK(c.badChecksums == 0, "consumer %zu: %u bad checksums", i, c.badChecksums);
+    CHECK(loadPercentile(c.gapsMs, 100) < MAX_GAP_MS, "consumer %zu: %.0fms without a heading", i, loadPercentile(c.gapsMs, 100));
+    CHECK(c.watchSeenAt > 0, "consumer %zu never saw the heading turn to %d", i, TURNED_HEADING);
+    CHECK(c.watchSeenAt == 0 || (c.watchSeenAt - options.watchFrom) * 1000 < MAX_LATENCY_MS,
+          "consumer %zu saw the turn after %.0fms", i, (c.watchSeenAt - options.watchFrom) * 1000);
+  }
+  for (size_t i = 0; i < report.pollers.size(); i++) {
+    PollerResult &p = report.pollers[i];
+    CHECK(p.requests >= RUN_S * 1000 / options.pollIntervalMs / 2, "poller %zu made %u requests", i, p.requests);
+    CHECK(p.failures == 0, "poller %zu: %u of %u requests failed", i, p.failures, p.requests);
+  }
+  for (size_t i = 0; i < report.slowReaders.size(); i++) {
+    SlowReaderResult &s = report.slowReaders[i];
+    CHECK(s.connected, "slow reader %zu didn't connect", i);
+    CHECK(s.sentences > 0, "slow reader %zu was sent nothing", i);
+    CHECK(s.badChecksums == 0, "slow reader %zu: %u broken sentences", i, s.badChecksums);
+  }
+  CHECK(report.metricsRead, "/metrics not read");
+  CHECK(report.unitLatencyCount > 0, "no heading latency in /metrics");
+
+  testExit("load");
+}
@@ -0,0 +1,114 @@
+//
+//  pipeline.cpp
+//
+//  A heading through the whole firmware: the simulated CMPS14 is set to 123 degrees, and
+//  what comes out of the NMEA port and the wired output (UART2, into a file) must be
+//  well formed HDM sentences that say so, at the rate the power mode sets. The wired output
+//  must keep within NMEA_SERIAL_LOAD_PERCENT of what its baud rate carries, and at a baud
+//  rate too slow for the batches, skip and drop them whole rather than fall behind.
+//
+
+#include <sys/stat.h>
+#include "Firmware.h"
+#include "tests/HostTest.h"
+
+#define SIM_HEADING 123
+#define RUN_S 3.0
+#define SLOW_BAUD 1200             //below the lowest the configuration allows - too slow for HDM, HDG and HDT
+#define SLOW_RUN_S 2.0
+#define BATCH_SLACK_BYTES 128      //the last batch, which goes as soon as it is due
+
+static long fileBytes(const std::string &path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+//Bytes a UART may carry in seconds at the heading output's share of the line
+static double serialBudget(uint32_t baud, double seconds)
+{
+  return baud / 10.0 * NMEA_SERIAL_LOAD_PERCENT / 100 * seconds + BATCH_SLACK_BYTES;
+}
+
+int main()
+{
+  testEnvironment("pipeline", 12000);
+  std::string uartFile = std::string(getenv("ECOMPASS_STORAGE")) + "/uart2.nmea";
+  setenv("ECOMPASS_UART2", uartFile.c_str(), 1);
+
+  simHeading = SIM_HEADING;
+  double begun = testSeconds();
+  firmwareBegin();
+
+  int fd = testConnect(hostPort(23));
+  CHECK(fd >= 0, "no NMEA listener on port %u", hostPort(23));
+  if (fd < 0) testExit("pipeline");
+
+  LineReader reader(fd);
+  std::string line;
+  int sentences = 0, headings = 0, badChecksums = 0, wrongHeadings = 0;
+  double start = testSeconds();
+  while (testSeconds() - start < RUN_S && reader.readLine(line)) {
+    sentences++;
+    if (!nmeaChecksumOk(line)) {
+      badChecksums++;
+      fprintf(stderr, "bad sentence: %s\n", line.c_str());
+      continue;
+    }
+    if (line.compare(3, 3, "HDM") != 0) continue;
+    headings++;
+    double heading = atof(nmeaField(line, 1).c_str());
+    if (headingError(heading, SIM_HEADING) > 2) {
+      wrongHeadings++;
+      fprintf(stderr, "heading %s, simulated %d\n", line.c_str(), SIM_HEADING);
+    }
+  }
+  close(fd);
+
+  //One HDM each output period of the power mode - 5Hz when cruising
+  double expected = RUN_S * 1000 / powerProfiles[powerMode].outputPeriodMs;
+  CHECK(headings >= expected * 0.8, "%d HDM sentences in %.0fs, expected %.0f", headings, RUN_S, expected);
+  CHECK(badChecksums == 0, "%d of %d sentences with a bad checksum", badChecksums, sentences);
+  CHECK(wrongHeadings == 0, "%d of %d headings away from %d", wrongHeadings, headings, SIM_HEADING);
+
+  //The wired output goes at 4800 baud, so carries fewer, and no more than its share of the line
+  long wiredBytes = fileBytes(uartFile);
+  double wiredS = testSeconds() - begun;
+  uint32_t baud = nmeaSerialBaud;
+  CHECK(wiredBytes <= serialBudget(baud, wiredS), "%ld bytes on UART2 in %.1fs at %u baud, budget %.0f",
+        wiredBytes, wiredS, baud, serialBudget(baud, wiredS));
+  CHECK(nmeaSerialBytes >= (uint32_t)wiredBytes, "%ld bytes on UART2, %u counted", wiredBytes, nmeaSerialBytes);
+  FILE *f = fopen(uartFile.c_str(), "r");
+  CHECK(f != NULL, "nothing written to UART2");
+  int wired = 0, wiredBad = 0;
+  char buffer[128];
+  while (f != NULL && fgets(buffer, sizeof(buffer), f) != NULL) {
+    std::string wiredLine(buffer);
+    while (!wiredLine.empty() && (wiredLine.back() == '\n' || wiredLine.back() == '\r')) wiredLine.pop_back();
+    if (!nmeaChecksumOk(wiredLine)) wiredBad++;
+    else if (wiredLine.compare(3, 3, "HDM") == 0 && headingError(atof(nmeaField(wiredLine, 1).c_str()), SIM_HEADING) <= 2) wired++;
+  }
+  if (f != NULL) fclose(f);
+  CHECK(wired > 0, "no HDM sentences on UART2");
+  CHECK(wiredBad == 0, "%d bad sentences on UART2", wiredBad);
+
+  //Too slow a line for the standard batch: batches are skipped to keep within the share, and
+  //sentences that don't fit the ring are dropped, and the bytes still keep within the budget
+  uint32_t skipped = nmeaSerialSkipped, dropped = nmeaSerialDropped;
+  nmeaSerialBaudRate(SLOW_BAUD);     //as the Network task does for a new NMEABaudRate
+  long slowStart = fileBytes(uartFile);
+  double slowBegun = testSeconds();
+  usleep(SLOW_RUN_S * 1e6);
+  long slowBytes = fileBytes(uartFile) - slowStart;
+  double slowS = testSeconds() - slowBegun;
+  CHECK(nmeaSerialSkipped > skipped, "no batches skipped at %d baud", SLOW_BAUD);
+  CHECK(nmeaSerialDropped > dropped, "no sentences dropped at %d baud", SLOW_BAUD);
+  CHECK(slowBytes > 0 && slowBytes <= serialBudget(SLOW_BAUD, slowS), "%ld bytes on UART2 in %.1fs at %d baud, budget %.0f",
+        slowBytes, slowS, SLOW_BAUD, serialBudget(SLOW_BAUD, slowS));
+
+  printf("%d sentences, %d HDM over TCP, %d HDM wired in %.0fs (%ld bytes, %.0f%% of %u baud); at %d baud %ld bytes in %.0fs, "
+         "%u batches skipped, %u sentences dropped\n", sentences, headings, wired, RUN_S, wiredBytes,
+         wiredBytes * 10 * 100 / (wiredS * baud), baud, SLOW_BAUD, slowBytes, SLOW_RUN_S,
+         nmeaSerialSkipped - skipped, nmeaSerialDropped - dropped);
+  testExit("pipeline");
+}
@@ -0,0 +1,98 @@
+//
+//  replay.cpp
+//
+//  Record the simulated sensor for a few seconds, then replay the recording (see
+//  Recorder.h): every sample comes back, this firmware agrees with the one that recorded
+//  it, a replay is much faster than real time and gives the same output each time, a
+//  recording made after a reboot follows on from the one before it, and a damaged block
+//  only loses its own samples.
+//
+
+#include <fstream>
+#include "Firmware.h"
+#include "tests/HostTest.h"
+
+#define RECORD_S 5
+#define REPLAY_SPEED 50
+
+//Replay (flat out by default) and wait for the task to finish, which is after it has said so
+static void replay(uint32_t speed = 0)
+{
+  CHECK(replayStart(speed), "replay didn't start");
+  for (double start = testSeconds(); replayTask != NULL && testSeconds() - start < 10;) delay(10);
+  CHECK(replayTask == NULL, "replay still running after 10s");
+}
+
+int main()
+{
+  testEnvironment("replay", 12200);
+  simHeading = 40;
+  firmwareBegin();
+  delay(500);   //for the Boot task to start the Recorder task
+
+  CHECK(recordStart(), "recording didn't start");
+  delay(RECORD_S * 1000);
+  recordStop();
+  for (double start = testSeconds(); (recording || recordFile) && testSeconds() - start < 5;) delay(50);
+  CHECK(!recording && !recordFile, "recording didn't stop");
+  printf("Recorded %u samples in %u blocks, %u dropped\n", recordedSamples, recordedBlocks, recordDroppedBlocks);
+  CHECK(recordedBlocks >= 2, "%u blocks - too few to damage one", recordedBlocks);
+  CHECK(recordDroppedBlocks == 0, "%u blocks dropped", recordDroppedBlocks);
+
+  //Everything back, and in agreement with the live pipeline
+  replay();
+  ReplayResult first = replayResult;
+  CHECK(first.samples == recordedSamples, "%u samples replayed of %u", first.samples, recordedSamples);
+  CHECK(first.mismatches == 0, "%u samples disagree with the recording", first.mismatches);
+  CHECK(first.badBlocks == 0, "%u bad blocks", first.badBlocks);
+  CHECK(first.recordedMs >= (RECORD_S - 1) * 1000, "the recording spans %ums", first.recordedMs);
+  CHECK(first.elapsedMs * 10 < first.recordedMs, "%ums of recording took %ums to replay", first.recordedMs, first.elapsedMs);
+
+  //The same firmware gives the same output
+  replay();
+  CHECK(replayResult.digest == first.digest, "digest %08x then %08x", first.digest, replayResult.digest);
+
+  //The recording again on the end, as a second one made after a reboot would be - its times
+  //start again. At REPLAY_SPEED times real time the two play one after the other
+  std::string path = hostStoragePath("spiffs") + RECORD_FILE;
+  std::string recorded;
+  {
+    std::ifstream in(path, std::ios::binary);
+    recorded.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    std::ofstream out(path, std::ios::binary | std::ios::app);
+    out << recorded;
+  }
+  replay(REPLAY_SPEED);
+  CHECK(replayResult.recordings == 2, "%u recordings in the file", replayResult.recordings);
+  CHECK(replayResult.samples == 2 * recordedSamples, "%u samples replayed of %u", replayResult.samples, 2 * recordedSamples);
+  CHECK(replayResult.recordedMs >= 2 * first.recordedMs && replayResult.recordedMs <= 2 * first.recordedMs + REPLAY_MAX_GAP_MS,
+        "two recordings of %ums span %ums", first.recordedMs, replayResult.recordedMs);
+  CHECK(replayResult.mismatches == 0, "%u samples disagree with the recordings", replayResult.mismatches);
+  std::ifstream csv(hostStoragePath("spiffs") + REPLAY_FILE);
+  std::string line;
+  long lastMs = -1, backwards = 0, lines = 0;
+  for (std::getline(csv, line); std::getline(csv, line); lastMs = atol(line.c_str()), lines++)
+    if (atol(line.c_str()) < lastMs) backwards++;
+  CHECK(lines == replayResult.samples && backwards == 0, "the replay's time went back %ld times in %ld lines", backwards, lines);
+  std::ofstream(path, std::ios::binary) << recorded;
+
+  //Damage a byte of the first block's payload. Its samples go, the rest survive
+  FILE *f = fopen(path.c_str(), "r+b");
+  uint8_t header[RECORD_HEADER_SIZE];
+  CHECK(f != NULL && fread(header, 1, sizeof(header), f) == sizeof(header), "can't read %s", path.c_str());
+  if (f != NULL) {
+    fseek(f, RECORD_HEADER_SIZE + 5, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, RECORD_HEADER_SIZE + 5, SEEK_SET);
+    fputc(c ^ 0x5A, f);
+    fclose(f);
+  }
+  replay();
+  CHECK(replayResult.badBlocks == 1, "%u bad blocks after damaging one", replayResult.badBlocks);
+  CHECK(replayResult.samples == recordedSamples - header[1], "%u samples replayed, expected %u",
+        replayResult.samples, recordedSamples - header[1]);
+  CHECK(replayResult.mismatches == 0, "%u samples disagree with the recording", replayResult.mismatches);
+
+  printf("%u samples, %ums of recording replayed in %ums, digest %08x\n", first.samples, first.recordedMs, first.elapsedMs, first.digest);
+  testExit("replay");
+}
@@ -0,0 +1,113 @@
+//
+//  seastate.cpp
+//
+//  The sea state analysis (SeaState.h) on the host: the FFT against a plain DFT, the
+//  statistics of a made up swell and roll against what went in, and how long the FFT and
+//  the whole analysis of a window take in ns/op, beside the SEA_BUDGET_PERCENT of the time
+//  between windows the SeaState task is allowed.
+//
+
+#include "Firmware.h"
+#include "tests/HostTest.h"
+
+#define WAVE_PERIOD_S 8.0f
+#define WAVE_AMPLITUDE_M 0.5f      //heave, to one side
+#define ROLL_PERIOD_S 5.0f
+#define ROLL_AMPLITUDE_DEG 6.0f
+#define PERIOD_TOLERANCE 0.05      //of the period
+#define AMPLITUDE_TOLERANCE 0.10   //of the amplitude
+
+#define TIMING_ITERATIONS 200
+#define TIMING_REPEATS 5
+
+static float re[SEA_FFT_SIZE], im[SEA_FFT_SIZE];
+static float accel[SEA_FFT_SIZE], roll[SEA_FFT_SIZE];
+
+//Noise of +-amplitude, the same every run
+static float noise(float amplitude)
+{
+  static uint32_t state = 1;
+  state = state * 1664525 + 1013904223;
+  return amplitude * ((state >> 8) / 8388608.0f - 1);
+}
+
+//Fastest of TIMING_REPEATS runs, in ns per call
+template <typename Kernel> static double timeKernel(Kernel kernel)
+{
+  double best = 1e30;
+  for (int r = 0; r < TIMING_REPEATS; r++) {
+    double start = testSeconds();
+    for (int i = 0; i < TIMING_ITERATIONS; i++) kernel();
+    best = min(best, (testSeconds() - start) * 1e9 / TIMING_ITERATIONS);
+  }
+  return best;
+}
+
+int main()
+{
+  seaStateBegin();    //the twiddles and the window - nothing else of the firmware is started
+  const int n = SEA_FFT_SIZE;
+
+  //The FFT against the definition
+  for (int i = 0; i < n; i++) {
+    re[i] = noise(1);
+    im[i] = noise(1);
+  }
+  memcpy(accel, re, sizeof(accel));
+  memcpy(roll, im, sizeof(roll));
+  seaFft(re, im);
+  double worst = 0, largest = 0;
+  for (int k = 0; k < n; k++) {
+    double sr = 0, si = 0;
+    for (int t = 0; t < n; t++) {
+      double a = -2 * M_PI * ((long)k * t % n) / n;
+      sr += accel[t] * cos(a) - roll[t] * sin(a);
+      si += accel[t] * sin(a) + roll[t] * cos(a);
+    }
+    worst = max(worst, hypot(re[k] - sr, im[k] - si));
+    largest = max(largest, hypot(sr, si));
+  }
+  CHECK(worst < largest * 1e-5, "FFT out by %.2e on bins up to %.2e", worst, largest);
+
+  //An 8 second swell and a 5 second roll, with a little noise, and the means already off
+  for (int i = 0; i < n; i++) {
+    float t = i / SEA_RATE_HZ, w = 2 * PI / WAVE_PERIOD_S;
+    accel[i] = -WAVE_AMPLITUDE_M * w * w * sinf(w * t) + noise(0.02f);
+    roll[i] = ROLL_AMPLITUDE_DEG * sinf(2 * PI * t / ROLL_PERIOD_S) + noise(0.2f);
+  }
+  SeaState s;
+  memcpy(re, accel, sizeof(re));
+  memcpy(im, roll, sizeof(im));
+  seaAnalyse(re, im, &s);
+  //A sine of amplitude A has a variance of A^2 / 2, so significant heights come out as
+  //4 sqrt(A^2 / 2) crest to trough, and a significant roll as 2 sqrt(A^2 / 2)
+  float heave = 4 * sqrtf(WAVE_AMPLITUDE_M * WAVE_AMPLITUDE_M / 2), rolled = 2 * sqrtf(ROLL_AMPLITUDE_DEG * ROLL_AMPLITUDE_DEG / 2);
+  CHECK(s.valid, "no result");
+  CHECK(fabs(s.wavePeriodS - WAVE_PERIOD_S) < WAVE_PERIOD_S * PERIOD_TOLERANCE, "wave period %.2fs, made %.1fs", s.wavePeriodS, WAVE_PERIOD_S);
+  CHECK(fabs(s.zeroCrossingPeriodS - WAVE_PERIOD_S) < WAVE_PERIOD_S * PERIOD_TOLERANCE, "zero crossing period %.2fs, made %.1fs",
+        s.zeroCrossingPeriodS, WAVE_PERIOD_S);
+  CHECK(fabs(s.heaveM - heave) < heave * AMPLITUDE_TOLERANCE, "heave %.2fm, made %.2fm", s.heaveM, heave);
+  CHECK(fabs(s.rollPeriodS - ROLL_PERIOD_S) < ROLL_PERIOD_S * PERIOD_TOLERANCE, "roll period %.2fs, made %.1fs", s.rollPeriodS, ROLL_PERIOD_S);
+  CHECK(fabs(s.rollDeg - rolled) < rolled * AMPLITUDE_TOLERANCE, "roll %.2f degrees, made %.2f", s.rollDeg, rolled);
+  printf("Waves %.2fs (zero crossing %.2fs), heave %.2fm; roll %.2fs, %.2f degrees\n", s.wavePeriodS,
+         s.zeroCrossingPeriodS, s.heaveM, s.rollPeriodS, s.rollDeg);
+
+  //The input is copied in each time, or repeated transforms would overflow
+  double fftNs = timeKernel([] {
+    memcpy(re, accel, sizeof(re));
+    memcpy(im, roll, sizeof(im));
+    seaFft(re, im);
+  });
+  double analyseNs = timeKernel([&s] {
+    memcpy(re, accel, sizeof(re));
+    memcpy(im, roll, sizeof(im));
+    seaAnalyse(re, im, &s);
+  });
+  double hopNs = SEA_HOP / SEA_RATE_HZ * 1e9;
+  printf("sea_fft      %d points %10.0f ns/op %8.1f MFLOP/s\n", n, fftNs, 5.0 * n * log2(n) / fftNs * 1000);
+  printf("sea_analyse  %d points %10.0f ns/op, budget %.0fms a window (%d%% of a core every %.0fs)\n", n, analyseNs,
+         hopNs * SEA_BUDGET_PERCENT / 100 / 1e6, SEA_BUDGET_PERCENT, hopNs / 1e9);
+  CHECK(analyseNs < hopNs * SEA_BUDGET_PERCENT / 100, "%.0f ns a window is over the budget", analyseNs);
+
+  testExit("seastate");
+}
@@ -0,0 +1,112 @@
+//
+//  wmm.cpp
+//
+//  The variation model in Wmm.h against the test values published with WMM2025, the dates
+//  it covers, the cell cache, and the variation reaching the HDG and HDT sentences.
+//
+
+#include "Firmware.h"
+#include "tests/HostTest.h"
+
+//The values are published to two decimal places, and the model is worked in float
+#define REFERENCE_TOLERANCE 0.015
+//How far a cached cell centre may be from the position itself, away from the poles
+#define CELL_TOLERANCE 0.5
+
+#define SIM_HEADING 100
+#define RUN_S 2.0
+
+//WMM2025 test values at sea level (WMM2025_TEST_VALUES.txt), declination in degrees east
+struct WmmReference {
+  float year, lat, lon, declination;
+};
+
+const WmmReference wmmReferences[] = {
+  { 2025.0,  80,   0,   1.28 },
+  { 2025.0,   0, 120,  -0.16 },
+  { 2025.0, -80, 240,  68.78 },
+  { 2027.5,  80,   0,   2.59 },
+  { 2027.5,   0, 120,  -0.24 },
+  { 2027.5, -80, 240,  68.49 },
+};
+
+int main()
+{
+  testEnvironment("wmm", 12600);
+
+  for (const WmmReference &r : wmmReferences) {
+    float d = wmmDeclination(r.lat, r.lon, r.year);
+    CHECK(fabs(d - r.declination) <= REFERENCE_TOLERANCE, "%.1f %g,%g: %.3f, reference %.2f",
+          r.year, r.lat, r.lon, d, r.declination);
+  }
+
+  //Five years from the epoch and no further
+  CHECK(!wmmCovers(WMM_EPOCH - 0.01f), "covers %.2f", WMM_EPOCH - 0.01f);
+  CHECK(wmmCovers(WMM_EPOCH), "doesn't cover %.2f", WMM_EPOCH);
+  CHECK(wmmCovers(WMM_EPOCH + WMM_LIFE_YEARS - 0.01f), "doesn't cover %.2f", WMM_EPOCH + WMM_LIFE_YEARS - 0.01f);
+  CHECK(!wmmCovers(WMM_EPOCH + WMM_LIFE_YEARS), "covers %.2f", WMM_EPOCH + WMM_LIFE_YEARS);
+
+  //The first lookup in a cell works it out at the centre, the next is a hit
+  uint32_t evaluations = wmmEvaluations, hits = wmmCacheHits;
+  float first = wmmVariation(51.5, -0.13, 2026.0);
+  float second = wmmVariation(51.9, -0.9, 2026.02);
+  CHECK(wmmEvaluations == evaluations + 1 && wmmCacheHits == hits + 1, "%u evaluations and %u hits for two lookups in a cell",
+        wmmEvaluations - evaluations, wmmCacheHits - hits);
+  CHECK(first == second, "%.3f then %.3f in the same cell", first, second);
+  CHECK(fabs(first - wmmDeclination(51.5, -0.5, 2026.0)) < 1e-4, "cell value %.3f isn't the centre's", first);
+  CHECK(fabs(first - wmmDeclination(51.5, -0.13, 2026.0)) < CELL_TOLERANCE, "cell value %.3f, at the position %.3f",
+        first, wmmDeclination(51.5, -0.13, 2026.0));
+  //A date further on than the cache allows is worked out again
+  evaluations = wmmEvaluations;
+  wmmVariation(51.5, -0.13, 2026.0 + 2 * WMM_CACHE_YEARS);
+  CHECK(wmmEvaluations == evaluations + 1, "a cell wasn't re-evaluated for a later date");
+
+  //No position, no variation - then Sydney, in the middle of the model's life
+  float variation;
+  CHECK(!currentVariation(&variation), "a variation before the position was known");
+  setPosition(-33.87, 151.21);
+  setDate(2027, 7, 1);
+  CHECK(currentVariation(&variation), "no variation once the position and date were set");
+  CHECK(fabs(variation - wmmDeclination(-33.5, 151.5, 2027.5)) < 0.05, "variation %.2f at Sydney", variation);
+  setDate(2031, 1, 1);
+  CHECK(!currentVariation(&variation), "a variation for a date after the model's life");
+  setDate(2027, 7, 1);
+
+  //...which goes out in HDG, and turns HDM into HDT
+  simHeading = SIM_HEADING;
+  firmwareBegin();
+  int fd = testConnect(hostPort(23));
+  CHECK(fd >= 0, "no NMEA listener on port %u", hostPort(23));
+  if (fd < 0) testExit("wmm");
+
+  LineReader reader(fd);
+  std::string line;
+  char expected[16];
+  snprintf(expected, sizeof(expected), "%.1f", fabs(variation));
+  int hdg = 0, hdt = 0, wrongHdg = 0, wrongHdt = 0;
+  double trueHeading = SIM_HEADING + lroundf(variation);
+  for (double start = testSeconds(); testSeconds() - start < RUN_S && reader.readLine(line);) {
+    if (!nmeaChecksumOk(line)) continue;
+    if (line.compare(3, 3, "HDG") == 0) {
+      hdg++;
+      if (nmeaField(line, 4) != expected || nmeaField(line, 5) != (variation < 0 ? "W" : "E")) {
+        wrongHdg++;
+        fprintf(stderr, "%s, variation %.2f\n", line.c_str(), variation);
+      }
+    }
+    else if (line.compare(3, 3, "HDT") == 0) {
+      hdt++;
+      if (headingError(atof(nmeaField(line, 1).c_str()), trueHeading) > 2) {
+        wrongHdt++;
+        fprintf(stderr, "%s, expected %.0f\n", line.c_str(), trueHeading);
+      }
+    }
+  }
+  close(fd);
+  CHECK(hdg > 0 && hdt > 0, "%d HDG and %d HDT sentences in %.0fs", hdg, hdt, RUN_S);
+  CHECK(wrongHdg == 0, "%d of %d HDG without variation %s%s", wrongHdg, hdg, expected, variation < 0 ? "W" : "E");
+  CHECK(wrongHdt == 0, "%d of %d HDT away from %.0f", wrongHdt, hdt, trueHeading);
+
+  printf("%d HDG and %d HDT with variation %.2f\n", hdg, hdt, variation);
+  testExit("wmm");
+}